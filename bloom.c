@@ -0,0 +1,336 @@
+/* Copyright 2015-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+
+/* Bloom filters for pruning tree walks.
+ *
+ * When the bloom_bits_per_file option is set, each dir can hold a Bloom
+ * filter over the files anywhere below it, each of which is filed under
+ * its name and under every suffix that the suffix term could match it
+ * by, all folded to lower case.  A query whose expression can only match
+ * files with one of a known set of names or suffixes then skips the
+ * subtrees whose filters hold none of them.
+ *
+ * Filters are built when a query first asks for them, and new file nodes
+ * are added to the filters of the dirs above them as they are created.
+ * Nothing can be taken out of a filter, so aged out nodes are only
+ * counted; a filter that has outgrown its size or that holds too many
+ * aged out nodes is thrown away, to be built again when next wanted.
+ *
+ * A filter can have false positives but never false negatives, so every
+ * file node that exists in the tree must be in the filters of all the
+ * dirs above it that have one, whether or not filters are enabled. */
+
+W_METRIC_COUNTER(bloom_checks, "bloom_checks_total",
+    "Number of subtrees whose Bloom filter was consulted");
+W_METRIC_COUNTER(bloom_skips, "bloom_skips_total",
+    "Number of subtrees skipped because their Bloom filter ruled them out");
+W_METRIC_COUNTER(bloom_false_positives, "bloom_false_positives_total",
+    "Number of walked subtrees that their Bloom filter wrongly let through");
+W_METRIC_COUNTER(bloom_builds, "bloom_builds_total",
+    "Number of per-dir Bloom filters built");
+W_METRIC_GAUGE(bloom_bytes, "bloom_bytes",
+    "Memory used by per-dir Bloom filters");
+
+#define KEY_NAME    1
+#define KEY_SUFFIX  2
+
+struct w_bloom {
+  // the number of bits, which is a power of two, less one
+  uint32_t mask;
+  uint32_t num_hashes;
+  // the bloom_bits_per_file setting that it was sized with
+  uint32_t bits_per_file;
+  // how many file nodes it has room for, how many were added, and how
+  // many of those have since been aged out
+  uint32_t capacity;
+  uint32_t num_files;
+  uint32_t num_stale;
+  // set while it is being filled in
+  bool building;
+  uint64_t bits[1];
+};
+
+static void make_key(struct w_bloom_key *key, uint8_t kind,
+    const char *buf, uint32_t len)
+{
+  // FNV-1a over the lower case bytes, starting with the kind of key
+  uint64_t h = 14695981039346656037ULL;
+  uint32_t i;
+
+  h ^= kind;
+  h *= 1099511628211ULL;
+  for (i = 0; i < len; i++) {
+    h ^= (uint8_t)tolower((uint8_t)buf[i]);
+    h *= 1099511628211ULL;
+  }
+  key->h1 = (uint32_t)h;
+  // odd, so that the probes are spread over the whole filter
+  key->h2 = (uint32_t)(h >> 32) | 1;
+}
+
+void w_bloom_key_name(struct w_bloom_key *key, const char *buf,
+    uint32_t len)
+{
+  make_key(key, KEY_NAME, buf, len);
+}
+
+void w_bloom_key_suffix(struct w_bloom_key *key, const char *buf,
+    uint32_t len)
+{
+  make_key(key, KEY_SUFFIX, buf, len);
+}
+
+// Computes the keys that a file named name is filed under
+static uint32_t name_keys(w_string_t *name, struct w_bloom_key *keys)
+{
+  uint32_t n = 0, i;
+
+  w_bloom_key_name(&keys[n++], name->buf, name->len);
+  for (i = name->len; i > 0 && n < W_BLOOM_MAX_NAME_KEYS; i--) {
+    if (name->buf[i - 1] == '.') {
+      w_bloom_key_suffix(&keys[n++], name->buf + i, name->len - i);
+    }
+  }
+  return n;
+}
+
+static uint32_t bloom_size(const struct w_bloom *bloom)
+{
+  return (uint32_t)(sizeof(*bloom) +
+      (((uint64_t)bloom->mask + 1) / 64 - 1) * sizeof(uint64_t));
+}
+
+static struct w_bloom *bloom_new(uint32_t num_files, uint32_t bits_per_file)
+{
+  struct w_bloom *bloom;
+  uint64_t want;
+  uint32_t num_bits = 64, capacity;
+
+  // Leave room for the subtree to grow before it needs a rebuild
+  capacity = num_files + num_files / 2 + 16;
+  want = (uint64_t)capacity * bits_per_file;
+  while (num_bits < want && num_bits < (1u << 31)) {
+    num_bits <<= 1;
+  }
+
+  bloom = calloc(1, sizeof(*bloom) + (num_bits / 64 - 1) * sizeof(uint64_t));
+  if (!bloom) {
+    return NULL;
+  }
+  bloom->mask = num_bits - 1;
+  // A file has a name and usually a suffix, so there are about two
+  // keys per file; k = ln(2) * bits per key
+  bloom->num_hashes = MAX(1, MIN(8, (bits_per_file * 35 + 50) / 100));
+  bloom->bits_per_file = bits_per_file;
+  bloom->capacity = capacity;
+  w_metric_add(&bloom_bytes, bloom_size(bloom));
+  return bloom;
+}
+
+void w_bloom_free(struct w_bloom *bloom)
+{
+  if (!bloom) {
+    return;
+  }
+  w_metric_add(&bloom_bytes, -(int64_t)bloom_size(bloom));
+  free(bloom);
+}
+
+static void bloom_add(struct w_bloom *bloom, const struct w_bloom_key *key)
+{
+  uint32_t i, h = key->h1;
+
+  for (i = 0; i < bloom->num_hashes; i++) {
+    bloom->bits[(h & bloom->mask) / 64] |= 1ULL << (h & 63);
+    h += key->h2;
+  }
+}
+
+static bool bloom_test(const struct w_bloom *bloom,
+    const struct w_bloom_key *key)
+{
+  uint32_t i, h = key->h1;
+
+  for (i = 0; i < bloom->num_hashes; i++) {
+    if (!(bloom->bits[(h & bloom->mask) / 64] & (1ULL << (h & 63)))) {
+      return false;
+    }
+    h += key->h2;
+  }
+  return true;
+}
+
+static void drop_filter(struct watchman_dir *dir)
+{
+  w_bloom_free(dir->bloom);
+  dir->bloom = NULL;
+}
+
+// Adds a newly created file node to the filters of the dirs above it
+void w_bloom_note_file(struct watchman_file *file)
+{
+  struct w_bloom_key keys[W_BLOOM_MAX_NAME_KEYS];
+  uint32_t num_keys = 0, i;
+  struct watchman_dir *dir;
+
+  for (dir = file->parent; dir; dir = dir->parent) {
+    if (!dir->bloom) {
+      continue;
+    }
+    if (!num_keys) {
+      num_keys = name_keys(file->name, keys);
+    }
+    if (++dir->bloom->num_files > dir->bloom->capacity) {
+      drop_filter(dir);
+      continue;
+    }
+    for (i = 0; i < num_keys; i++) {
+      bloom_add(dir->bloom, &keys[i]);
+    }
+  }
+}
+
+// Notes that a file node is being aged out of the tree
+void w_bloom_forget_file(struct watchman_file *file)
+{
+  struct watchman_dir *dir;
+
+  for (dir = file->parent; dir; dir = dir->parent) {
+    if (dir->bloom && ++dir->bloom->num_stale > dir->bloom->capacity / 2) {
+      drop_filter(dir);
+    }
+  }
+}
+
+/* Allocates filters for dir and the dirs below it that don't have a
+ * usable one, sized for the file nodes below each.  Returns the number
+ * of file nodes below dir */
+static uint32_t alloc_filters(struct watchman_dir *dir,
+    uint32_t bits_per_file)
+{
+  uint32_t num_files = dir->files ? w_ht_size(dir->files) : 0;
+  w_ht_iter_t i;
+
+  if (w_ht_first(dir->dirs, &i)) do {
+    struct watchman_dir *child = w_ht_val_ptr(i.value);
+
+    num_files += alloc_filters(child, bits_per_file);
+  } while (w_ht_next(dir->dirs, &i));
+
+  if (dir->bloom && dir->bloom->bits_per_file != bits_per_file) {
+    drop_filter(dir);
+  }
+  if (!dir->bloom) {
+    dir->bloom = bloom_new(num_files, bits_per_file);
+    if (dir->bloom) {
+      dir->bloom->building = true;
+      w_metric_inc(&bloom_builds);
+    }
+  }
+  return num_files;
+}
+
+// The filters that are being filled in for the dirs above a dir
+struct fill_frame {
+  struct w_bloom *bloom;
+  struct fill_frame *up;
+};
+
+/* Adds the files below dir to the filters being built for it and the
+ * dirs above it, so that a whole subtree is built in a single walk */
+static void fill_filters(struct watchman_dir *dir, struct fill_frame *up)
+{
+  struct fill_frame frame, *f;
+  struct w_bloom_key keys[W_BLOOM_MAX_NAME_KEYS];
+  uint32_t num_keys, k;
+  w_ht_iter_t i;
+
+  if (dir->bloom && dir->bloom->building) {
+    frame.bloom = dir->bloom;
+    frame.up = up;
+    up = &frame;
+  }
+
+  if (up && w_ht_first(dir->files, &i)) do {
+    struct watchman_file *file = w_ht_val_ptr(i.value);
+
+    num_keys = name_keys(file->name, keys);
+    for (f = up; f; f = f->up) {
+      f->bloom->num_files++;
+      for (k = 0; k < num_keys; k++) {
+        bloom_add(f->bloom, &keys[k]);
+      }
+    }
+  } while (w_ht_next(dir->files, &i));
+
+  if (up && w_ht_first(dir->dirs, &i)) do {
+    struct watchman_dir *child = w_ht_val_ptr(i.value);
+
+    fill_filters(child, up);
+  } while (w_ht_next(dir->dirs, &i));
+
+  if (dir->bloom) {
+    dir->bloom->building = false;
+  }
+}
+
+/* Whether there may be a file below dir that has one of keys, building
+ * its filter if need be */
+bool w_bloom_dir_may_contain(w_root_t *root, struct watchman_dir *dir,
+    const struct w_bloom_key *keys, uint32_t num_keys)
+{
+  uint32_t bits_per_file = root->config.bloom_bits_per_file;
+  uint32_t i;
+
+  if (!bits_per_file) {
+    return true;
+  }
+  if (!dir->bloom || dir->bloom->bits_per_file != bits_per_file) {
+    alloc_filters(dir, bits_per_file);
+    fill_filters(dir, NULL);
+    if (!dir->bloom) {
+      return true;
+    }
+  }
+
+  w_metric_inc(&bloom_checks);
+  for (i = 0; i < num_keys; i++) {
+    if (bloom_test(dir->bloom, &keys[i])) {
+      return true;
+    }
+  }
+  w_metric_inc(&bloom_skips);
+  return false;
+}
+
+/* Called after walking a dir whose filter let it through, if the walk
+ * also consulted the filters of all of its child dirs and none of them
+ * did.  Unless one of its own files has one of keys, that was a false
+ * positive */
+void w_bloom_dir_walked(struct watchman_dir *dir,
+    const struct w_bloom_key *keys, uint32_t num_keys)
+{
+  struct w_bloom_key file_keys[W_BLOOM_MAX_NAME_KEYS];
+  uint32_t num_file_keys, j, k;
+  w_ht_iter_t i;
+
+  if (w_ht_first(dir->files, &i)) do {
+    struct watchman_file *file = w_ht_val_ptr(i.value);
+
+    num_file_keys = name_keys(file->name, file_keys);
+    for (j = 0; j < num_file_keys; j++) {
+      for (k = 0; k < num_keys; k++) {
+        if (file_keys[j].h1 == keys[k].h1 && file_keys[j].h2 == keys[k].h2) {
+          return;
+        }
+      }
+    }
+  } while (w_ht_next(dir->files, &i));
+
+  w_metric_inc(&bloom_false_positives);
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -72,19 +72,23 @@ void cfg_set_global(const char *name, json_t *val)
   pthread_rwlock_unlock(&cfg_lock);
 }
 
-static json_t *cfg_get_raw(const char *name, json_t **optr)
+/* Replaces the .watchmanconfig of root with config, returning the old
+ * one for the caller to release.  Values that cfg_get_json handed out
+ * from the old config stay valid until the caller releases the root
+ * lock, which it must hold */
+json_t *cfg_swap_root_config(w_root_t *root, json_t *config)
 {
-  json_t *val = NULL;
+  json_t *old;
 
-  pthread_rwlock_rdlock(&cfg_lock);
-  if (*optr) {
-    val = json_object_get(*optr, name);
-  }
+  pthread_rwlock_wrlock(&cfg_lock);
+  old = root->config_file;
+  root->config_file = config;
   pthread_rwlock_unlock(&cfg_lock);
-  return val;
+  return old;
 }
 
-json_t *cfg_get_json(w_root_t *root, const char *name)
+// Must be called with cfg_lock held
+static json_t *cfg_lookup(w_root_t *root, const char *name)
 {
   json_t *val = NULL;
 
@@ -93,16 +97,30 @@ json_t *cfg_get_json(w_root_t *root, const char *name)
     val = json_object_get(root->config_file, name);
   }
   // then: command line arguments
-  if (!val) {
-    val = cfg_get_raw(name, &arg_cfg);
+  if (!val && arg_cfg) {
+    val = json_object_get(arg_cfg, name);
   }
   // then: global config options
-  if (!val) {
-    val = cfg_get_raw(name, &global_cfg);
+  if (!val && global_cfg) {
+    val = json_object_get(global_cfg, name);
   }
   return val;
 }
 
+/* The result is borrowed from the config that holds it; a root's
+ * .watchmanconfig may be reloaded at any time, so callers that pass a
+ * root must hold its lock for as long as they use the result.  The
+ * scalar getters below copy their values out and need no lock */
+json_t *cfg_get_json(w_root_t *root, const char *name)
+{
+  json_t *val;
+
+  pthread_rwlock_rdlock(&cfg_lock);
+  val = cfg_lookup(root, name);
+  pthread_rwlock_unlock(&cfg_lock);
+  return val;
+}
+
 const char *cfg_get_string(w_root_t *root, const char *name,
     const char *defval)
 {
@@ -221,41 +239,50 @@ json_t *cfg_compute_root_files(bool *enforcing) {
 json_int_t cfg_get_int(w_root_t *root, const char *name,
     json_int_t defval)
 {
-  json_t *val = cfg_get_json(root, name);
+  json_t *val;
 
+  pthread_rwlock_rdlock(&cfg_lock);
+  val = cfg_lookup(root, name);
   if (val) {
     if (!json_is_integer(val)) {
       w_log(W_LOG_FATAL, "Expected config value %s to be an integer\n", name);
     }
-    return json_integer_value(val);
+    defval = json_integer_value(val);
   }
+  pthread_rwlock_unlock(&cfg_lock);
 
   return defval;
 }
 
 bool cfg_get_bool(w_root_t *root, const char *name, bool defval)
 {
-  json_t *val = cfg_get_json(root, name);
+  json_t *val;
 
+  pthread_rwlock_rdlock(&cfg_lock);
+  val = cfg_lookup(root, name);
   if (val) {
     if (!json_is_boolean(val)) {
       w_log(W_LOG_FATAL, "Expected config value %s to be a boolean\n", name);
     }
-    return json_is_true(val);
+    defval = json_is_true(val);
   }
+  pthread_rwlock_unlock(&cfg_lock);
 
   return defval;
 }
 
 double cfg_get_double(w_root_t *root, const char *name, double defval) {
-  json_t *val = cfg_get_json(root, name);
+  json_t *val;
 
+  pthread_rwlock_rdlock(&cfg_lock);
+  val = cfg_lookup(root, name);
   if (val) {
     if (!json_is_number(val)) {
       w_log(W_LOG_FATAL, "Expected config value %s to be a number\n", name);
     }
-    return json_real_value(val);
+    defval = json_number_value(val);
   }
+  pthread_rwlock_unlock(&cfg_lock);
 
   return defval;
 }
@@ -128,5 +128,171 @@ static void cmd_debug_poison(struct watchman_client *client, json_t *args)
 }
 W_CMD_REG("debug-poison", cmd_debug_poison, CMD_DAEMON, w_cmd_realpath_root)
 
+static void cmd_debug_metrics(struct watchman_client *client, json_t *args)
+{
+  json_t *resp;
+
+  if (json_array_size(args) != 1) {
+    send_error_response(client,
+                        "wrong number of arguments for 'debug-metrics'");
+    return;
+  }
+
+  resp = make_response();
+  set_prop(resp, "metrics", w_metrics_to_json());
+  send_and_dispose_response(client, resp);
+}
+W_CMD_REG("debug-metrics", cmd_debug_metrics, CMD_DAEMON, NULL)
+
+/* debug-trace start
+ * debug-trace stop
+ * debug-trace dump [PATH]
+ * Controls span tracing.  dump returns the spans in the Chrome
+ * trace-event format, or writes them to PATH if it is given */
+static void cmd_debug_trace(struct watchman_client *client, json_t *args)
+{
+  const char *action;
+  const char *path = NULL;
+  json_t *resp;
+  size_t nargs = json_array_size(args);
+
+  if (nargs < 2 || nargs > 3) {
+    send_error_response(client,
+                        "wrong number of arguments for 'debug-trace'");
+    return;
+  }
+
+  action = json_string_value(json_array_get(args, 1));
+  if (!action) {
+    send_error_response(client, "expected 'debug-trace' action to be a string");
+    return;
+  }
+  if (nargs == 3) {
+    path = json_string_value(json_array_get(args, 2));
+    if (!path || strcmp(action, "dump")) {
+      send_error_response(client,
+          "only 'debug-trace dump' accepts a path argument");
+      return;
+    }
+  }
+
+  resp = make_response();
+
+  if (!strcmp(action, "start")) {
+    w_trace_start();
+  } else if (!strcmp(action, "stop")) {
+    w_trace_stop();
+  } else if (!strcmp(action, "dump")) {
+    json_t *trace = w_trace_to_json();
+
+    if (path) {
+      if (json_dump_file(trace, path, JSON_COMPACT)) {
+        send_error_response(client, "failed to write trace to %s: %s",
+            path, strerror(errno));
+        json_decref(trace);
+        json_decref(resp);
+        return;
+      }
+      set_prop(resp, "path", json_string_nocheck(path));
+      set_prop(resp, "num_events", json_integer(
+            json_array_size(json_object_get(trace, "traceEvents"))));
+      json_decref(trace);
+    } else {
+      json_object_update(resp, trace);
+      json_decref(trace);
+    }
+  } else {
+    send_error_response(client, "unknown 'debug-trace' action %s", action);
+    json_decref(resp);
+    return;
+  }
+
+  set_prop(resp, "tracing", json_boolean(w_trace_enabled));
+  send_and_dispose_response(client, resp);
+}
+W_CMD_REG("debug-trace", cmd_debug_trace, CMD_DAEMON, NULL)
+
+/* debug-lock-profile [start|stop]
+ * Controls lock contention profiling and reports the per-lock wait and
+ * hold histograms, along with the call sites that held locks longest */
+static void cmd_debug_lock_profile(struct watchman_client *client,
+    json_t *args)
+{
+  const char *action = NULL;
+  json_t *resp, *prof;
+
+  if (json_array_size(args) > 2) {
+    send_error_response(client,
+                        "wrong number of arguments for 'debug-lock-profile'");
+    return;
+  }
+  if (json_array_size(args) == 2) {
+    action = json_string_value(json_array_get(args, 1));
+    if (!action) {
+      send_error_response(client,
+          "expected 'debug-lock-profile' action to be a string");
+      return;
+    }
+  }
+
+  if (!action) {
+    // just report
+  } else if (!strcmp(action, "start")) {
+    w_lockprof_start();
+  } else if (!strcmp(action, "stop")) {
+    w_lockprof_stop();
+  } else {
+    send_error_response(client, "unknown 'debug-lock-profile' action %s",
+        action);
+    return;
+  }
+
+  resp = make_response();
+  prof = w_lockprof_to_json(20);
+  json_object_update(resp, prof);
+  json_decref(prof);
+  send_and_dispose_response(client, resp);
+}
+W_CMD_REG("debug-lock-profile", cmd_debug_lock_profile, CMD_DAEMON, NULL)
+
+/* debug-evict /root
+ * Spills the tree of the root to disk regardless of the memory budget */
+static void cmd_debug_evict(struct watchman_client *client, json_t *args)
+{
+  w_root_t *root;
+  json_t *resp;
+  char *errmsg = NULL;
+  uint64_t bytes;
+
+  if (json_array_size(args) != 2) {
+    send_error_response(client,
+                        "wrong number of arguments for 'debug-evict'");
+    return;
+  }
+
+  root = resolve_root_or_err(client, args, 1, false);
+  if (!root) {
+    return;
+  }
+
+  w_root_lock(root);
+  bytes = w_root_estimate_bytes(root);
+  if (!w_root_evict(root, &errmsg)) {
+    w_root_unlock(root);
+    send_error_response(client, "unable to evict: %s", errmsg);
+    free(errmsg);
+    w_root_delref(root);
+    return;
+  }
+  w_root_unlock(root);
+
+  resp = make_response();
+  set_prop(resp, "evicted", json_true());
+  set_prop(resp, "estimated_bytes", json_integer((json_int_t)bytes));
+  send_and_dispose_response(client, resp);
+  w_root_delref(root);
+}
+W_CMD_REG("debug-evict", cmd_debug_evict, CMD_DAEMON, w_cmd_realpath_root)
+
 /* vim:ts=2:sw=2:et:
  */
@@ -0,0 +1,147 @@
+/* Copyright 2015-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+
+static json_t *summary_to_json(w_root_t *root, struct watchman_dir *dir)
+{
+  json_t *obj;
+  char clockbuf[128];
+  uint32_t name_start = root->root_path->len + 1;
+
+  obj = json_object();
+  if (dir->path->len > root->root_path->len) {
+    w_string_t *rel = w_string_slice(dir->path, name_start,
+        dir->path->len - name_start);
+
+    set_prop(obj, "name", w_string_to_json(rel));
+    w_string_delref(rel);
+  } else {
+    set_prop(obj, "name", json_string_nocheck(""));
+  }
+  set_prop(obj, "files", json_integer(dir->summary.num_files));
+  set_prop(obj, "dirs", json_integer(dir->summary.num_dirs));
+  set_prop(obj, "bytes", json_integer((json_int_t)dir->summary.num_bytes));
+  if (dir->summary.max_ticks &&
+      clock_id_string(root->number, dir->summary.max_ticks, clockbuf,
+        sizeof(clockbuf))) {
+    set_prop(obj, "last_change", json_string_nocheck(clockbuf));
+  }
+  return obj;
+}
+
+static int compare_bytes_desc(const void *a, const void *b)
+{
+  const struct watchman_dir *x = *(struct watchman_dir *const *)a;
+  const struct watchman_dir *y = *(struct watchman_dir *const *)b;
+
+  if (x->summary.num_bytes != y->summary.num_bytes) {
+    return x->summary.num_bytes > y->summary.num_bytes ? -1 : 1;
+  }
+  return w_string_compare(x->path, y->path);
+}
+
+// Whether the node for child in dir exists and is still a dir
+static bool child_exists(struct watchman_dir *dir, struct watchman_dir *child)
+{
+  struct watchman_file *file;
+  w_string_t *name;
+
+  if (!dir->files) {
+    return false;
+  }
+  name = w_string_basename(child->path);
+  file = w_ht_val_ptr(w_ht_get(dir->files, w_ht_ptr_val(name)));
+  w_string_delref(name);
+  return file && file->exists && S_ISDIR(file->stat.mode);
+}
+
+/* du /root [path]
+ * Reports how many files and dirs exist below path, which is relative
+ * to the root, how many bytes the files hold, and when something there
+ * last changed; likewise for each of its subdirs.  This comes from the
+ * totals that are kept for each dir, so it doesn't walk the tree */
+static void cmd_du(struct watchman_client *client, json_t *args)
+{
+  w_root_t *root;
+  w_string_t *dir_name;
+  struct watchman_dir *dir, **children = NULL;
+  uint32_t num_children = 0, i;
+  const char *rel = NULL;
+  char *errmsg = NULL;
+  json_t *resp, *arr;
+  w_ht_iter_t iter;
+
+  if (json_array_size(args) > 3) {
+    send_error_response(client, "wrong number of arguments to 'du'");
+    return;
+  }
+  if (json_array_size(args) == 3) {
+    rel = json_string_value(json_array_get(args, 2));
+    if (!rel) {
+      send_error_response(client, "expected argument 2 to be a path");
+      return;
+    }
+  }
+
+  root = resolve_root_or_err(client, args, 1, false);
+  if (!root) {
+    return;
+  }
+
+  if (rel && rel[0] && strcmp(rel, ".")) {
+    dir_name = w_string_path_cat_cstr(root->root_path, rel);
+  } else {
+    dir_name = root->root_path;
+    w_string_addref(dir_name);
+  }
+
+  w_root_lock(root);
+  if (root->evicted && !w_root_rehydrate(root, &errmsg)) {
+    w_root_unlock(root);
+    send_error_response(client, "unable to load the tree: %s", errmsg);
+    free(errmsg);
+    w_string_delref(dir_name);
+    w_root_delref(root);
+    return;
+  }
+
+  dir = w_root_resolve_dir(root, dir_name, false);
+  w_string_delref(dir_name);
+  if (!dir) {
+    w_root_unlock(root);
+    send_error_response(client, "%s is not a known dir", rel);
+    w_root_delref(root);
+    return;
+  }
+
+  if (dir->dirs) {
+    children = malloc(MAX(w_ht_size(dir->dirs), 1) * sizeof(*children));
+  }
+  if (children && w_ht_first(dir->dirs, &iter)) do {
+    struct watchman_dir *child = w_ht_val_ptr(iter.value);
+
+    if (child_exists(dir, child)) {
+      children[num_children++] = child;
+    }
+  } while (w_ht_next(dir->dirs, &iter));
+  qsort(children, num_children, sizeof(*children), compare_bytes_desc);
+
+  resp = make_response();
+  annotate_with_clock(root, resp);
+  set_prop(resp, "summary", summary_to_json(root, dir));
+  arr = json_array_of_size(num_children);
+  for (i = 0; i < num_children; i++) {
+    json_array_append_new(arr, summary_to_json(root, children[i]));
+  }
+  set_prop(resp, "children", arr);
+  w_root_unlock(root);
+  free(children);
+
+  send_and_dispose_response(client, resp);
+  w_root_delref(root);
+}
+W_CMD_REG("du", cmd_du, CMD_DAEMON, w_cmd_realpath_root)
+
+/* vim:ts=2:sw=2:et:
+ */
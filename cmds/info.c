@@ -153,7 +153,6 @@ static void cmd_get_config(struct watchman_client *client, json_t *args)
     config = json_object();
   }
 
-  json_incref(root->config_file);
   set_prop(resp, "config", config);
   send_and_dispose_response(client, resp);
   w_root_delref(root);
@@ -0,0 +1,354 @@
+/* Copyright 2015-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+
+W_METRIC_COUNTER(lstat_batch_paths, "lstat_batch_paths_total",
+    "Number of paths looked up by lstat-batch");
+
+/* The paths of a batch are either an array of strings or a single
+ * string holding one path per line */
+struct path_iter {
+  json_t *list;
+  size_t index;
+  const char *packed, *packed_end;
+};
+
+static bool next_path(struct path_iter *it, const char **path, uint32_t *len)
+{
+  const char *end;
+
+  if (it->list) {
+    json_t *ele = json_array_get(it->list, it->index);
+
+    if (!ele) {
+      return false;
+    }
+    it->index++;
+    *path = json_string_value(ele);
+    *len = u32_strlen(*path);
+    return true;
+  }
+
+  if (it->packed >= it->packed_end) {
+    return false;
+  }
+  end = memchr(it->packed, '\n', it->packed_end - it->packed);
+  if (!end) {
+    end = it->packed_end;
+  }
+  *path = it->packed;
+  *len = (uint32_t)(end - it->packed);
+  it->packed = end + 1;
+  return true;
+}
+
+static bool parse_paths(json_t *spec, struct path_iter *it, uint32_t *num,
+    char **errmsg)
+{
+  json_t *paths = json_object_get(spec, "paths");
+  const char *path;
+  uint32_t len;
+  size_t i;
+
+  memset(it, 0, sizeof(*it));
+  if (json_is_array(paths)) {
+    for (i = 0; i < json_array_size(paths); i++) {
+      if (!json_is_string(json_array_get(paths, i))) {
+        *errmsg = strdup("paths must be an array of strings");
+        return false;
+      }
+    }
+    it->list = paths;
+  } else if (json_is_string(paths)) {
+    it->packed = json_string_value(paths);
+    it->packed_end = it->packed + strlen(it->packed);
+  } else {
+    *errmsg = strdup(
+        "paths must be an array of strings or a newline separated string");
+    return false;
+  }
+
+  *num = 0;
+  while (next_path(it, &path, &len)) {
+    (*num)++;
+  }
+  it->index = 0;
+  if (!it->list) {
+    it->packed = json_string_value(paths);
+  }
+  return true;
+}
+
+/* Composes in buf the full path of rel, which is len bytes long and is
+ * either relative to the root or an absolute path below it.  Empty and
+ * "." components are dropped and ".." is resolved against the path
+ * composed so far, as the other commands that take paths do not follow
+ * symlinks either.  Returns false, with errmsg set, if the path lies
+ * outside of the root or we run out of memory */
+static bool compose_path(w_root_t *root, char **buf, uint32_t *alloc,
+    const char *rel, uint32_t len, uint32_t *full_len, char **errmsg)
+{
+  uint32_t root_len = root->root_path->len, pos, end, start;
+  w_string_t prefix;
+
+  if (len > 0 && rel[0] == WATCHMAN_DIR_SEP) {
+    // An absolute path must lie below the root
+    w_string_init_borrowed(&prefix, rel, MIN(len, root_len));
+    if (len < root_len ||
+        !(root->case_sensitive ? w_string_equal(&prefix, root->root_path) :
+          w_string_equal_caseless(&prefix, root->root_path)) ||
+        (len > root_len && rel[root_len] != WATCHMAN_DIR_SEP)) {
+      ignore_result(asprintf(errmsg, "path %.*s is outside of the root",
+          (int)len, rel));
+      return false;
+    }
+    rel += root_len;
+    len -= root_len;
+  }
+
+  if (root_len + 1 + len > *alloc) {
+    char *grown = realloc(*buf, root_len + 1 + len);
+
+    if (!grown) {
+      *errmsg = strdup("out of memory");
+      return false;
+    }
+    *buf = grown;
+    *alloc = root_len + 1 + len;
+  }
+  memcpy(*buf, root->root_path->buf, root_len);
+  pos = root_len;
+
+  for (start = 0; start < len; start = end + 1) {
+    for (end = start; end < len && rel[end] != WATCHMAN_DIR_SEP; end++) {
+      ;
+    }
+    if (end == start || (end - start == 1 && rel[start] == '.')) {
+      continue;
+    }
+    if (end - start == 2 && rel[start] == '.' && rel[start + 1] == '.') {
+      if (pos == root_len) {
+        ignore_result(asprintf(errmsg, "path %.*s is outside of the root",
+            (int)len, rel));
+        return false;
+      }
+      while ((*buf)[--pos] != WATCHMAN_DIR_SEP) {
+        ;
+      }
+      continue;
+    }
+    (*buf)[pos++] = WATCHMAN_DIR_SEP;
+    memcpy(*buf + pos, rel + start, end - start);
+    pos += end - start;
+  }
+
+  *full_len = pos;
+  return true;
+}
+
+/* Finds the dir whose full path is the first len bytes of path, which
+ * may differ in case from the name that we have for it */
+static struct watchman_dir *lookup_dir_caseless(w_root_t *root,
+    const char *path, uint32_t len)
+{
+  struct watchman_dir *dir;
+  w_string_t want;
+  w_ht_iter_t i;
+  uint32_t end;
+
+  dir = w_ht_val_ptr(w_ht_get(root->dirname_to_dir,
+        w_ht_ptr_val(root->root_path)));
+  for (end = root->root_path->len; dir && end < len; ) {
+    struct watchman_dir *next = NULL;
+
+    for (end++; end < len && path[end] != WATCHMAN_DIR_SEP; end++) {
+      ;
+    }
+    w_string_init_borrowed(&want, path, end);
+    if (dir->dirs && w_ht_first(dir->dirs, &i)) do {
+      struct watchman_dir *child = w_ht_val_ptr(i.value);
+
+      if (w_string_equal_caseless(child->path, &want)) {
+        next = child;
+        break;
+      }
+    } while (w_ht_next(dir->dirs, &i));
+    dir = next;
+  }
+  return dir;
+}
+
+/* Finds the node for the full path composed in buf, which is full_len
+ * bytes long.  Returns NULL if watchman has never seen it, setting
+ * ignored if that is because it is ignored */
+static struct watchman_file *lookup_file(w_root_t *root, char *buf,
+    uint32_t full_len, bool *ignored)
+{
+  uint32_t base;
+  struct watchman_dir *dir;
+  struct watchman_file *file = NULL;
+  w_string_t dir_name, file_name;
+
+  *ignored = false;
+  for (base = full_len; buf[base - 1] != WATCHMAN_DIR_SEP; base--) {
+    ;
+  }
+
+  // The dir is keyed by its full path, without the trailing slash
+  w_string_init_borrowed(&dir_name, buf, base - 1);
+  w_string_init_borrowed(&file_name, buf + base, full_len - base);
+  dir = w_ht_val_ptr(w_ht_get(root->dirname_to_dir, w_ht_ptr_val(&dir_name)));
+  if (!dir && !root->case_sensitive) {
+    dir = lookup_dir_caseless(root, buf, base - 1);
+  }
+  if (dir && dir->files) {
+    file = w_ht_val_ptr(w_ht_get(dir->files, w_ht_ptr_val(&file_name)));
+  }
+  if (!file && dir && dir->lc_files) {
+    w_string_t *lc_name = w_string_dup_lower(&file_name);
+
+    file = w_ht_val_ptr(w_ht_get(dir->lc_files, w_ht_ptr_val(lc_name)));
+    w_string_delref(lc_name);
+  }
+  if (file) {
+    return file;
+  }
+
+  *ignored = w_ignore_check(&root->ignore, root->root_path, buf,
+      full_len) == W_IGNORE_SELF;
+  return NULL;
+}
+
+/* lstat-batch /root {"paths": [...]}
+ * Reports what watchman knows of the metadata of each of a batch of
+ * paths relative to the root, so that tools that would otherwise lstat
+ * every one of them can ask for them all at once.  The root is synced
+ * once for the whole batch.
+ *
+ * The results are columns with one entry per path, in the order given:
+ * mode, size, mtime_ns and ino.  A path that doesn't exist has a mode
+ * of 0; paths that watchman doesn't track, because they are ignored or
+ * name the root itself, are listed by index in untracked, and must be
+ * looked at by the caller.  A path outside of the root fails the whole
+ * batch */
+static void cmd_lstat_batch(struct watchman_client *client, json_t *args)
+{
+  w_root_t *root;
+  json_t *spec, *resp, *modes, *sizes, *mtimes, *inos, *untracked;
+  struct path_iter it;
+  const char *path;
+  uint32_t len, full_len, num, i, alloc = 0;
+  char *errmsg = NULL, *buf = NULL;
+  int sync_timeout = 60000;
+
+  if (json_array_size(args) != 3) {
+    send_error_response(client, "wrong number of arguments to 'lstat-batch'");
+    return;
+  }
+  spec = json_array_get(args, 2);
+  if (!json_is_object(spec)) {
+    send_error_response(client, "expected argument 2 to be an object");
+    return;
+  }
+  if (json_unpack(spec, "{s?:i*}", "sync_timeout", &sync_timeout) != 0 ||
+      sync_timeout < 0) {
+    send_error_response(client, "sync_timeout must be an integer value >= 0");
+    return;
+  }
+  if (!parse_paths(spec, &it, &num, &errmsg)) {
+    send_error_response(client, "%s", errmsg);
+    free(errmsg);
+    return;
+  }
+
+  root = resolve_root_or_err(client, args, 1, false);
+  if (!root) {
+    return;
+  }
+
+  if (sync_timeout && !w_root_sync_to_now(root, sync_timeout)) {
+    send_error_response(client, "synchronization failed: %s",
+        strerror(errno));
+    w_root_delref(root);
+    return;
+  }
+
+  w_root_lock(root);
+  if (root->evicted && !w_root_rehydrate(root, &errmsg)) {
+    w_root_unlock(root);
+    send_error_response(client, "unable to load the tree: %s", errmsg);
+    free(errmsg);
+    w_root_delref(root);
+    return;
+  }
+
+  modes = json_array_of_size(num);
+  sizes = json_array_of_size(num);
+  mtimes = json_array_of_size(num);
+  inos = json_array_of_size(num);
+  untracked = json_array();
+
+  for (i = 0; next_path(&it, &path, &len); i++) {
+    struct watchman_file *file = NULL;
+    bool ignored = false;
+
+    if (!compose_path(root, &buf, &alloc, path, len, &full_len, &errmsg)) {
+      break;
+    }
+    if (full_len == root->root_path->len) {
+      // We have no node for the root itself
+      ignored = true;
+    } else {
+      file = lookup_file(root, buf, full_len, &ignored);
+    }
+    if (ignored) {
+      json_array_append_new(untracked, json_integer(i));
+    }
+    if (!file || !file->exists) {
+      json_array_append_new(modes, json_integer(0));
+      json_array_append_new(sizes, json_integer(0));
+      json_array_append_new(mtimes, json_integer(0));
+      json_array_append_new(inos, json_integer(0));
+      continue;
+    }
+    json_array_append_new(modes, json_integer(file->stat.mode));
+    json_array_append_new(sizes, json_integer(file->stat.size));
+    json_array_append_new(mtimes, json_integer(
+          (json_int_t)file->stat.mtime.tv_sec * WATCHMAN_NSEC_IN_SEC +
+          file->stat.mtime.tv_nsec));
+    json_array_append_new(inos, json_integer(file->stat.ino));
+  }
+  if (errmsg) {
+    w_root_unlock(root);
+    free(buf);
+    json_decref(modes);
+    json_decref(sizes);
+    json_decref(mtimes);
+    json_decref(inos);
+    json_decref(untracked);
+    send_error_response(client, "%s", errmsg);
+    free(errmsg);
+    w_root_delref(root);
+    return;
+  }
+  w_metric_add(&lstat_batch_paths, num);
+
+  resp = make_response();
+  annotate_with_clock(root, resp);
+  w_root_unlock(root);
+  free(buf);
+
+  set_prop(resp, "mode", modes);
+  set_prop(resp, "size", sizes);
+  set_prop(resp, "mtime_ns", mtimes);
+  set_prop(resp, "ino", inos);
+  set_prop(resp, "untracked", untracked);
+
+  send_and_dispose_response(client, resp);
+  w_root_delref(root);
+}
+W_CMD_REG("lstat-batch", cmd_lstat_batch, CMD_DAEMON, w_cmd_realpath_root)
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -3,6 +3,26 @@
 
 #include "watchman.h"
 
+// Adds the clock, fresh instance flag and files from res to response
+static void add_query_results(json_t *response, w_root_t *root,
+    w_query_res *res, struct w_query_field_list *field_list)
+{
+  char clockbuf[128];
+
+  if (clock_id_string(res->root_number, res->ticks,
+        clockbuf, sizeof(clockbuf))) {
+    set_prop(response, "clock", json_string_nocheck(clockbuf));
+  }
+  set_prop(response, "is_fresh_instance",
+           json_pack("b", res->is_fresh_instance));
+  if (res->partial_sync) {
+    set_prop(response, "partial_sync", json_true());
+  }
+  set_prop(response, "files", w_query_results_to_json(field_list,
+        res->num_results, res->results));
+  add_root_warnings_to_response(response, root);
+}
+
 /* query /root {query} */
 static void cmd_query(struct watchman_client *client, json_t *args)
 {
@@ -12,8 +32,7 @@ static void cmd_query(struct watchman_client *client, json_t *args)
   char *errmsg = NULL;
   w_query_res res;
   json_t *response;
-  json_t *file_list, *jfield_list;
-  char clockbuf[128];
+  json_t *jfield_list;
   struct w_query_field_list field_list;
 
   if (json_array_size(args) != 3) {
@@ -36,7 +55,14 @@ static void cmd_query(struct watchman_client *client, json_t *args)
     return;
   }
 
-  query = w_query_parse(root, query_spec, &errmsg);
+  if (!parse_result_format(query_spec, &field_list, &errmsg)) {
+    send_error_response(client, "invalid result_format: %s", errmsg);
+    free(errmsg);
+    w_root_delref(root);
+    return;
+  }
+
+  query = w_query_parse_cached(root, query_spec, &errmsg);
   if (!query) {
     send_error_response(client, "failed to parse query: %s", errmsg);
     free(errmsg);
@@ -58,23 +84,292 @@ static void cmd_query(struct watchman_client *client, json_t *args)
 
   w_query_delref(query);
 
-  file_list = w_query_results_to_json(&field_list,
-                res.num_results, res.results);
-  w_query_result_free(&res);
-
   response = make_response();
-  if (clock_id_string(res.root_number, res.ticks, clockbuf, sizeof(clockbuf))) {
-    set_prop(response, "clock", json_string_nocheck(clockbuf));
-  }
-  set_prop(response, "is_fresh_instance",
-           json_pack("b", res.is_fresh_instance));
-  set_prop(response, "files", file_list);
-  add_root_warnings_to_response(response, root);
+  add_query_results(response, root, &res, &field_list);
+  w_query_result_free(&res);
 
   send_and_dispose_response(client, response);
   w_root_delref(root);
 }
 W_CMD_REG("query", cmd_query, CMD_DAEMON|CMD_CLIENT, w_cmd_realpath_root)
 
+// Tracks the completion of the per-root parts of a multi-query
+struct multi_query {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint32_t outstanding;
+};
+
+struct multi_query_item {
+  const char *name;
+  w_root_t *root;
+  w_query *query;
+  struct w_query_field_list field_list;
+  struct watchman_sync sync;
+  bool syncing;
+  struct timespec deadline;
+  // the per-root response, or an object holding an error
+  json_t *result;
+  struct multi_query *mq;
+  struct w_pool_job *job;
+};
+
+static void multi_query_item_error(struct multi_query_item *item,
+    const char *fmt, ...)
+{
+  char *errmsg = NULL;
+  va_list ap;
+
+  va_start(ap, fmt);
+  ignore_result(vasprintf(&errmsg, fmt, ap));
+  va_end(ap);
+
+  if (item->result) {
+    json_decref(item->result);
+  }
+  item->result = json_pack("{s:s}", "error", errmsg ? errmsg : "");
+  free(errmsg);
+}
+
+// Resolves the root and parses the query for one entry of the root map
+static void multi_query_item_init(struct multi_query_item *item,
+    json_t *shared_spec, json_t *overrides)
+{
+  json_t *query_spec;
+  char *errmsg = NULL;
+
+  if (json_is_string(overrides)) {
+    // shorthand for a per-root "since" clock
+    query_spec = json_deep_copy(shared_spec);
+    set_prop(query_spec, "since", json_incref(overrides));
+  } else if (json_is_object(overrides)) {
+    query_spec = json_deep_copy(shared_spec);
+    json_object_update(query_spec, overrides);
+  } else if (json_is_null(overrides)) {
+    query_spec = json_incref(shared_spec);
+  } else {
+    multi_query_item_error(item, "expected a clock, an object or null "
+        "for root %s", item->name);
+    return;
+  }
+
+  item->root = w_root_resolve(item->name, false, &errmsg);
+  if (!item->root) {
+    multi_query_item_error(item, "unable to resolve root %s: %s",
+        item->name, errmsg);
+    goto done;
+  }
+
+  if (!parse_field_list(json_object_get(query_spec, "fields"),
+        &item->field_list, &errmsg)) {
+    multi_query_item_error(item, "invalid field list: %s", errmsg);
+    goto done;
+  }
+
+  if (!parse_result_format(query_spec, &item->field_list, &errmsg)) {
+    multi_query_item_error(item, "invalid result_format: %s", errmsg);
+    goto done;
+  }
+
+  item->query = w_query_parse_cached(item->root, query_spec, &errmsg);
+  if (!item->query) {
+    multi_query_item_error(item, "failed to parse query: %s", errmsg);
+  }
+
+done:
+  free(errmsg);
+  json_decref(query_spec);
+}
+
+/* Runs one root's query on the pool.  The sync cookie was already
+ * observed by the client thread, so this never blocks waiting for the
+ * root's notifications, which are also serviced by the pool */
+static bool multi_query_item_run(void *arg, bool kicked)
+{
+  struct multi_query_item *item = arg;
+  w_query_res res;
+  unused_parameter(kicked);
+
+  if (!w_query_execute(item->query, item->root, &res, NULL, NULL)) {
+    multi_query_item_error(item, "query failed: %s", res.errmsg);
+  } else {
+    res.partial_sync = item->syncing && item->sync.partial;
+    item->result = json_object();
+    add_query_results(item->result, item->root, &res, &item->field_list);
+  }
+  w_query_result_free(&res);
+  return false;
+}
+
+static void multi_query_item_done(void *arg)
+{
+  struct multi_query_item *item = arg;
+  struct multi_query *mq = item->mq;
+
+  w_pool_job_free(item->job);
+  item->job = NULL;
+
+  pthread_mutex_lock(&mq->lock);
+  if (--mq->outstanding == 0) {
+    pthread_cond_signal(&mq->cond);
+  }
+  pthread_mutex_unlock(&mq->lock);
+}
+
+static bool multi_query_realpath_roots(json_t *args, char **errmsg)
+{
+  json_t *roots, *resolved;
+  const char *name;
+  json_t *val;
+
+  if (json_array_size(args) != 3) {
+    ignore_result(asprintf(errmsg,
+          "wrong number of arguments for 'multi-query'"));
+    return false;
+  }
+  roots = json_array_get(args, 1);
+  if (!json_is_object(roots)) {
+    ignore_result(asprintf(errmsg,
+          "second argument must be an object keyed by root"));
+    return false;
+  }
+
+  resolved = json_object();
+  json_object_foreach(roots, name, val) {
+    char *path = w_realpath(name);
+
+    set_prop(resolved, path ? path : name, json_incref(val));
+    free(path);
+  }
+  json_array_set_new(args, 1, resolved);
+  return true;
+}
+
+/* multi-query {"/root1": clock, "/root2": {overrides}, ...} {query}
+ * Runs the query against each of the roots in parallel on the shared
+ * pool.  Each entry of the root map may supply a "since" clock, an
+ * object whose properties override those of the query for that root,
+ * or null to use the query as-is.  The results are keyed by root; a
+ * root that fails has an "error" property rather than failing the
+ * whole command */
+static void cmd_multi_query(struct watchman_client *client, json_t *args)
+{
+  json_t *roots, *query_spec, *val, *results, *response;
+  struct multi_query_item *items;
+  struct multi_query mq;
+  const char *name;
+  uint32_t i, n = 0;
+
+  if (json_array_size(args) != 3) {
+    send_error_response(client, "wrong number of arguments for 'multi-query'");
+    return;
+  }
+  roots = json_array_get(args, 1);
+  query_spec = json_array_get(args, 2);
+  if (!json_is_object(roots) || json_object_size(roots) == 0) {
+    send_error_response(client, "multi-query: expected a non-empty object "
+        "keyed by root as the second argument");
+    return;
+  }
+  if (!json_is_object(query_spec)) {
+    send_error_response(client, "multi-query: expected a query object "
+        "as the third argument");
+    return;
+  }
+
+  items = calloc(json_object_size(roots), sizeof(*items));
+  if (!items) {
+    send_error_response(client, "out of memory");
+    return;
+  }
+  pthread_mutex_init(&mq.lock, NULL);
+  pthread_cond_init(&mq.cond, NULL);
+  mq.outstanding = 0;
+
+  json_object_foreach(roots, name, val) {
+    struct multi_query_item *item = &items[n++];
+
+    item->name = name;
+    item->mq = &mq;
+    multi_query_item_init(item, query_spec, val);
+  }
+
+  // Issue all of the sync cookies before waiting for any of them, so
+  // that the roots settle concurrently
+  for (i = 0; i < n; i++) {
+    struct multi_query_item *item = &items[i];
+
+    if (!item->query || !item->query->sync_timeout) {
+      continue;
+    }
+    if (!w_root_sync_begin(item->root, &item->sync)) {
+      multi_query_item_error(item, "synchronization failed: %s",
+          strerror(errno));
+      continue;
+    }
+    w_timeoutms_to_abs_timespec(item->query->sync_timeout, &item->deadline);
+    item->syncing = true;
+  }
+  for (i = 0; i < n; i++) {
+    struct multi_query_item *item = &items[i];
+
+    if (!item->syncing) {
+      continue;
+    }
+    if (!w_root_sync_wait(item->root, &item->sync, &item->deadline)) {
+      multi_query_item_error(item, "synchronization failed: %s",
+          strerror(errno));
+    }
+    item->query->sync_timeout = 0;
+  }
+
+  // Fan the queries out across the pool
+  for (i = 0; i < n; i++) {
+    struct multi_query_item *item = &items[i];
+
+    if (!item->query || item->result) {
+      continue;
+    }
+    item->job = w_pool_job_new("multi-query", multi_query_item_run,
+        multi_query_item_done, item);
+    if (!item->job) {
+      multi_query_item_run(item, true);
+      continue;
+    }
+    pthread_mutex_lock(&mq.lock);
+    mq.outstanding++;
+    pthread_mutex_unlock(&mq.lock);
+    w_pool_job_kick(item->job);
+  }
+
+  pthread_mutex_lock(&mq.lock);
+  while (mq.outstanding > 0) {
+    pthread_cond_wait(&mq.cond, &mq.lock);
+  }
+  pthread_mutex_unlock(&mq.lock);
+
+  results = json_object();
+  for (i = 0; i < n; i++) {
+    struct multi_query_item *item = &items[i];
+
+    set_prop(results, item->name, item->result);
+    if (item->query) {
+      w_query_delref(item->query);
+    }
+    if (item->root) {
+      w_root_delref(item->root);
+    }
+  }
+  free(items);
+  pthread_mutex_destroy(&mq.lock);
+  pthread_cond_destroy(&mq.cond);
+
+  response = make_response();
+  set_prop(response, "results", results);
+  send_and_dispose_response(client, response);
+}
+W_CMD_REG("multi-query", cmd_multi_query, CMD_DAEMON,
+    multi_query_realpath_roots)
+
 /* vim:ts=2:sw=2:et:
  */
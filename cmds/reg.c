@@ -131,10 +131,15 @@ void preprocess_command(json_t *args, enum w_pdu_type output_pdu)
   }
 }
 
+W_METRIC_COUNTER(commands, "commands_total", "Number of commands dispatched");
+W_METRIC_HISTOGRAM(command_duration, "command_duration_usec",
+    "Time taken to dispatch and run commands", "usec");
+
 bool dispatch_command(struct watchman_client *client, json_t *args, int mode)
 {
   struct watchman_command_handler_def *def;
   char *errmsg = NULL;
+  uint64_t start;
 
   def = lookup(args, &errmsg, mode);
 
@@ -149,7 +154,10 @@ bool dispatch_command(struct watchman_client *client, json_t *args, int mode)
     return false;
   }
 
+  w_metric_inc(&commands);
+  start = w_metric_now_usec();
   def->func(client, args);
+  w_metric_observe_since(&command_duration, start);
   return true;
 }
 
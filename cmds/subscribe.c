@@ -15,6 +15,11 @@ static bool subscription_generator(
   w_log(W_LOG_DBG, "running subscription %s %p\n",
       sub->name->buf, sub);
 
+  if (!ctx->since.is_timestamp && query->relative_root) {
+    return w_query_process_relative_root_changes(query, root, ctx,
+        ctx->since.clock.ticks + 1);
+  }
+
   // Walk back in time until we hit the boundary
   for (f = root->latest_file; f; f = f->next) {
     if (ctx->since.is_timestamp &&
@@ -40,7 +45,7 @@ static bool subscription_generator(
 
 static json_t *build_subscription_results(
     struct watchman_client_subscription *sub,
-    w_root_t *root)
+    w_root_t *root, uint32_t *ticks)
 {
   w_query_res res;
   json_t *response;
@@ -97,6 +102,7 @@ static json_t *build_subscription_results(
     since_spec = NULL;
   }
   sub->query->since_spec = w_clockspec_new_clock(res.root_number, res.ticks);
+  *ticks = res.ticks;
 
   set_prop(response, "is_fresh_instance", json_boolean(res.is_fresh_instance));
   set_prop(response, "files", file_list);
@@ -106,13 +112,29 @@ static json_t *build_subscription_results(
   return response;
 }
 
+/* Queues the results of a subscription; its cursor, if any, moves
+ * once they have been delivered.
+ * must be called with the client locked */
+static bool enqueue_subscription_response(
+    struct watchman_client *client,
+    struct watchman_client_subscription *sub,
+    w_root_t *root, json_t *response, uint32_t ticks)
+{
+  if (sub->cursor) {
+    return enqueue_cursor_response(client, response, root, sub->cursor,
+        ticks);
+  }
+  return enqueue_response(client, response, true);
+}
+
 /* must be called with root and client locked */
 void w_run_subscription_rules(
     struct watchman_client *client,
     struct watchman_client_subscription *sub,
     w_root_t *root)
 {
-  json_t *response = build_subscription_results(sub, root);
+  uint32_t ticks = 0;
+  json_t *response = build_subscription_results(sub, root, &ticks);
 
   if (!response) {
     return;
@@ -120,7 +142,7 @@ void w_run_subscription_rules(
 
   add_root_warnings_to_response(response, root);
 
-  if (!enqueue_response(client, response, true)) {
+  if (!enqueue_subscription_response(client, sub, root, response, ticks)) {
     w_log(W_LOG_DBG, "failed to queue sub response\n");
     json_decref(response);
   }
@@ -151,9 +173,9 @@ static void cmd_unsubscribe(struct watchman_client *client, json_t *args)
 
   sname = w_string_new(name);
 
-  pthread_mutex_lock(&w_client_lock);
+  w_clients_lock();
   deleted = w_ht_del(client->subscriptions, w_ht_ptr_val(sname));
-  pthread_mutex_unlock(&w_client_lock);
+  w_clients_unlock();
 
   w_string_delref(sname);
 
@@ -180,6 +202,7 @@ static void cmd_subscribe(struct watchman_client *client, json_t *args)
   struct w_query_field_list field_list;
   char *errmsg;
   int defer = true; /* can't use bool because json_unpack requires int */
+  uint32_t ticks = 0;
 
   if (json_array_size(args) != 4) {
     send_error_response(client, "wrong number of arguments for subscribe");
@@ -207,6 +230,12 @@ static void cmd_subscribe(struct watchman_client *client, json_t *args)
     goto done;
   }
 
+  if (!parse_result_format(query_spec, &field_list, &errmsg)) {
+    send_error_response(client, "invalid result_format: %s", errmsg);
+    free(errmsg);
+    goto done;
+  }
+
   query = w_query_parse(root, query_spec, &errmsg);
   if (!query) {
     send_error_response(client, "failed to parse query: %s", errmsg);
@@ -222,6 +251,12 @@ static void cmd_subscribe(struct watchman_client *client, json_t *args)
 
   sub->name = w_string_new(name);
   sub->query = query;
+  if (query->since_spec && query->since_spec->tag == w_cs_named_cursor) {
+    sub->cursor = query->since_spec->named_cursor.cursor;
+    w_string_addref(sub->cursor);
+    // The cursor moves when the results are sent, not when they are built
+    query->hold_cursor = true;
+  }
 
   json_unpack(query_spec, "{s?:b}", "defer_vcs", &defer);
   sub->vcs_defer = defer;
@@ -229,10 +264,10 @@ static void cmd_subscribe(struct watchman_client *client, json_t *args)
   memcpy(&sub->field_list, &field_list, sizeof(field_list));
   sub->root = root;
 
-  pthread_mutex_lock(&w_client_lock);
+  w_clients_lock();
   w_ht_replace(client->subscriptions, w_ht_ptr_val(sub->name),
       w_ht_ptr_val(sub));
-  pthread_mutex_unlock(&w_client_lock);
+  w_clients_unlock();
 
   resp = make_response();
   annotate_with_clock(root, resp);
@@ -240,9 +275,13 @@ static void cmd_subscribe(struct watchman_client *client, json_t *args)
   add_root_warnings_to_response(resp, root);
   send_and_dispose_response(client, resp);
 
-  resp = build_subscription_results(sub, root);
+  resp = build_subscription_results(sub, root, &ticks);
   if (resp) {
-    send_and_dispose_response(client, resp);
+    w_clients_lock();
+    if (!enqueue_subscription_response(client, sub, root, resp, ticks)) {
+      json_decref(resp);
+    }
+    w_clients_unlock();
   }
 done:
   w_root_delref(root);
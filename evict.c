@@ -0,0 +1,308 @@
+/* Copyright 2015-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+
+/* Daemon-wide memory budget.
+ *
+ * When the global memory_budget_mb option is set and the estimated
+ * size of all of the in-memory trees exceeds it, the trees of the
+ * least recently used roots are spilled to a snapshot on disk and
+ * freed.  The watches keep running while a root is evicted: its io job
+ * still observes sync cookies, and holds on to all other changes in
+ * root->evicted_pending.  The next query against the root rehydrates
+ * the tree from the snapshot and then processes the deferred changes,
+ * which is far cheaper than a recrawl.
+ *
+ * Roots with triggers or subscriptions are never evicted, since those
+ * need the tree whenever anything changes. */
+
+// Rough cost of each node, including its name and hash table entries
+#define FILE_NODE_COST (sizeof(struct watchman_file) + 64)
+#define DIR_NODE_COST (sizeof(struct watchman_dir) + 192)
+
+W_METRIC_GAUGE(roots_evicted, "roots_evicted",
+    "Number of roots whose tree is currently evicted to disk");
+W_METRIC_COUNTER(evictions, "evictions_total",
+    "Number of times a tree was evicted to stay within the memory budget");
+W_METRIC_COUNTER(rehydrations, "rehydrations_total",
+    "Number of times an evicted tree was reloaded from its snapshot");
+W_METRIC_HISTOGRAM(rehydrate_duration, "rehydrate_duration_usec",
+    "Time taken to reload an evicted tree", "usec");
+
+static pthread_once_t evict_once = PTHREAD_ONCE_INIT;
+static struct w_pool_job *evict_job = NULL;
+
+static uint64_t memory_budget(void)
+{
+  json_int_t mb = cfg_get_int(NULL, "memory_budget_mb", 0);
+
+  return mb > 0 ? (uint64_t)mb * 1024 * 1024 : 0;
+}
+
+static uint64_t estimate_bytes(uint64_t files, uint64_t dirs)
+{
+  return (files * FILE_NODE_COST) + (dirs * DIR_NODE_COST);
+}
+
+// Estimated memory held by the trees of all roots
+uint64_t w_evict_estimate_total(void)
+{
+  uint64_t files, dirs;
+
+  w_root_count_nodes(&files, &dirs);
+  return estimate_bytes(files, dirs);
+}
+
+/* Estimated memory held by the tree of root.
+ * Must be called with the root locked */
+uint64_t w_root_estimate_bytes(w_root_t *root)
+{
+  if (root->evicted || !root->dirname_to_dir) {
+    return 0;
+  }
+  return estimate_bytes(root->num_files, w_ht_size(root->dirname_to_dir));
+}
+
+static w_string_t *snapshot_path(w_root_t *root)
+{
+  return w_string_make_printf("%s.%" PRIu32 ".snapshot",
+      watchman_state_file, root->number);
+}
+
+/* Spills the tree of root to disk and frees it.
+ * Must be called with the root locked */
+bool w_root_evict(w_root_t *root, char **errmsg)
+{
+  const struct watchman_ops *ops = w_root_watcher_ops(root);
+  uint64_t bytes;
+
+  if (!(ops->flags & WATCHER_TREE_EVICTABLE)) {
+    ignore_result(asprintf(errmsg, "the %s watcher does not support "
+          "evicting trees", ops->name));
+    return false;
+  }
+  if (root->evicted) {
+    ignore_result(asprintf(errmsg, "already evicted"));
+    return false;
+  }
+  if (!root->done_initial || root->should_recrawl || root->cancelled) {
+    ignore_result(asprintf(errmsg, "root is not settled"));
+    return false;
+  }
+  if ((root->commands && w_ht_size(root->commands) > 0) ||
+      w_root_has_subscriptions(root)) {
+    ignore_result(asprintf(errmsg, "root has triggers or subscriptions"));
+    return false;
+  }
+
+  bytes = w_root_estimate_bytes(root);
+  // The journal reads the tree, so must be brought up to date first
+  w_journal_flush(root);
+  if (!root->snapshot_path) {
+    root->snapshot_path = snapshot_path(root);
+  }
+  if (!w_root_snapshot_write(root, root->snapshot_path->buf, errmsg)) {
+    return false;
+  }
+
+  w_root_reset_tree(root);
+  root->evicted = true;
+  w_metric_inc(&roots_evicted);
+  w_metric_inc(&evictions);
+
+  w_log(W_LOG_ERR, "evicted tree of %.*s (about %" PRIu64 " bytes) to %s\n",
+      root->root_path->len, root->root_path->buf, bytes,
+      root->snapshot_path->buf);
+  return true;
+}
+
+/* Reloads an evicted tree and processes the changes that were observed
+ * while it was evicted.  If the snapshot cannot be used, a recrawl is
+ * scheduled and false is returned.
+ * Must be called with the root locked */
+bool w_root_rehydrate(w_root_t *root, char **errmsg)
+{
+  struct w_snapshot_info info;
+  uint64_t start = w_metric_now_usec();
+  uint64_t span = w_trace_begin();
+  char *why = NULL;
+
+  if (!root->evicted) {
+    return true;
+  }
+
+  if (!w_root_snapshot_load(root, root->snapshot_path->buf, &info, &why)) {
+    goto fail;
+  }
+  // The snapshot must be of this incarnation of the root, and no
+  // change can have been given a tick since it was taken
+  if (info.root_number != root->number || info.ticks > root->ticks) {
+    ignore_result(asprintf(&why, "snapshot %s is stale",
+          root->snapshot_path->buf));
+    goto fail;
+  }
+
+  root->evicted = false;
+  w_metric_dec(&roots_evicted);
+  unlink(root->snapshot_path->buf);
+
+  // Catch up with what happened while we were on disk
+  if (w_pending_coll_size(&root->evicted_pending) > 0) {
+    root->ticks++;
+    while (w_root_process_pending(root, &root->evicted_pending, false)) {
+      ;
+    }
+  }
+
+  w_metric_inc(&rehydrations);
+  w_metric_observe_since(&rehydrate_duration, start);
+  w_trace_end("root", "rehydrate", span, root->root_path->buf);
+  w_log(W_LOG_ERR, "rehydrated tree of %.*s: %" PRIu32 " files\n",
+      root->root_path->len, root->root_path->buf, info.num_files);
+  return true;
+
+fail:
+  w_log(W_LOG_ERR, "unable to rehydrate %.*s: %s\n",
+      root->root_path->len, root->root_path->buf, why);
+  ignore_result(asprintf(errmsg, "unable to rehydrate evicted tree: %s; "
+        "the root will be recrawled", why));
+  free(why);
+  w_root_reset_tree(root);
+  w_root_schedule_recrawl(root, "evicted tree could not be rehydrated");
+  return false;
+}
+
+/* Forgets any snapshot of the tree, as when the root is torn down.
+ * Must be called with the root locked, or when it is no longer shared */
+void w_root_discard_snapshot(w_root_t *root)
+{
+  if (root->evicted) {
+    root->evicted = false;
+    w_metric_dec(&roots_evicted);
+  }
+  w_pending_coll_drain(&root->evicted_pending);
+  if (root->snapshot_path) {
+    unlink(root->snapshot_path->buf);
+    w_string_delref(root->snapshot_path);
+    root->snapshot_path = NULL;
+  }
+}
+
+/* Called by the io job with pending changes for root.  If the tree is
+ * evicted, the sync cookies among them are processed and the rest are
+ * set aside for rehydration, and true is returned.  Roots that have
+ * gained a trigger since they were evicted are rehydrated instead.
+ * Must be called with the root locked */
+bool w_root_defer_pending(w_root_t *root,
+    struct watchman_pending_collection *coll)
+{
+  struct watchman_pending_fs *p, *pending;
+  char *errmsg = NULL;
+
+  if (!root->evicted) {
+    return false;
+  }
+  if (root->commands && w_ht_size(root->commands) > 0) {
+    if (!w_root_rehydrate(root, &errmsg)) {
+      w_pending_coll_drain(coll);
+      free(errmsg);
+      return true;
+    }
+    return false;
+  }
+
+  pending = coll->pending;
+  coll->pending = NULL;
+  w_ht_free_entries(coll->pending_uniq);
+
+  while (pending) {
+    p = pending;
+    pending = p->next;
+
+    if (w_string_startswith(p->path, root->query_cookie_prefix)) {
+      w_root_process_path(root, coll, p->path, p->now, p->flags, NULL);
+    } else {
+      w_pending_coll_add(&root->evicted_pending, p->path, p->now, p->flags);
+    }
+    w_pending_fs_free(p);
+  }
+  return true;
+}
+
+static int compare_last_cmd(const void *a, const void *b)
+{
+  const w_root_t *ra = *(w_root_t**)a;
+  const w_root_t *rb = *(w_root_t**)b;
+
+  if (ra->last_cmd_timestamp != rb->last_cmd_timestamp) {
+    return ra->last_cmd_timestamp < rb->last_cmd_timestamp ? -1 : 1;
+  }
+  return 0;
+}
+
+// Evicts the least recently used roots until we're within the budget
+static bool evict_job_run(void *arg, bool kicked)
+{
+  uint64_t budget = memory_budget();
+  w_root_t **roots;
+  uint32_t i, n;
+  unused_parameter(arg);
+  unused_parameter(kicked);
+
+  if (budget == 0 || w_evict_estimate_total() <= budget) {
+    return true;
+  }
+
+  roots = w_root_list_watched(&n);
+  if (!roots) {
+    return true;
+  }
+  qsort(roots, n, sizeof(*roots), compare_last_cmd);
+
+  for (i = 0; i < n; i++) {
+    char *errmsg = NULL;
+
+    // The most recently used root is kept resident no matter what, so
+    // that a single large root isn't evicted after every change
+    if (i + 1 < n && w_evict_estimate_total() > budget) {
+      w_root_lock(roots[i]);
+      if (!roots[i]->evicted && !w_root_evict(roots[i], &errmsg)) {
+        w_log(W_LOG_DBG, "not evicting %.*s: %s\n",
+            roots[i]->root_path->len, roots[i]->root_path->buf, errmsg);
+      }
+      w_root_unlock(roots[i]);
+      free(errmsg);
+    }
+    w_root_delref(roots[i]);
+  }
+  free(roots);
+
+  if (w_evict_estimate_total() > budget) {
+    w_log(W_LOG_DBG, "still over the memory budget after evicting "
+        "all eligible roots\n");
+  }
+  return true;
+}
+
+static void start_evict_job(void)
+{
+  evict_job = w_pool_job_new("evict", evict_job_run, NULL, NULL);
+}
+
+// Kicks the evictor if we are over the memory budget
+void w_evict_check(void)
+{
+  uint64_t budget = memory_budget();
+
+  if (budget == 0 || w_evict_estimate_total() <= budget) {
+    return;
+  }
+  pthread_once(&evict_once, start_evict_job);
+  if (evict_job) {
+    w_pool_job_kick(evict_job);
+  }
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -0,0 +1,389 @@
+/* Copyright 2015-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+#include "thirdparty/wildmatch/wildmatch.h"
+
+/* Ignore rules.
+ *
+ * The ignore_dirs and ignore_vcs options are compiled into a trie keyed
+ * by path component, relative to the root, so that checking a path
+ * against the literal rules costs a binary search per component however
+ * many rules there are.
+ *
+ * Entries of ignore_dirs that contain an unescaped `*`, `?` or `[` are
+ * globs.  A glob hangs off the trie node of its leading literal dirs and
+ * is only tried for paths below that node.  There it is matched with
+ * wildmatch against the part of the path below the node, and as `*`
+ * doesn't match across a `/`, only against the ancestor with as many
+ * components as the pattern; a pattern containing `**` is tried against
+ * each of them.  Escaping the glob characters with `\` makes an entry
+ * literal.
+ *
+ * A dir named by ignore_dirs is ignored along with everything below
+ * it.  A dir named by ignore_vcs is tracked, as are its direct
+ * children, but nothing further down. */
+
+#define IGNORE_FULL 1
+#define IGNORE_VCS 2
+
+struct watchman_ignore_glob {
+  char *pattern;
+  // the number of components the pattern matches, or -1 if any
+  int depth;
+};
+
+struct watchman_ignore_node {
+  char *name;
+  uint32_t len;
+  int flags;
+  // sorted by name
+  struct watchman_ignore_node **children;
+  uint32_t num_children;
+  uint32_t alloc_children;
+  // globs relative to this node
+  struct watchman_ignore_glob *globs;
+  uint32_t num_globs;
+};
+
+static int compare_name(const struct watchman_ignore_node *node,
+    const char *name, uint32_t len)
+{
+  int res = memcmp(node->name, name, MIN(node->len, len));
+
+  if (res != 0) {
+    return res;
+  }
+  return node->len < len ? -1 : node->len > len ? 1 : 0;
+}
+
+/* Returns the index of the child with this name, or the index at which
+ * it would be inserted */
+static uint32_t find_child(const struct watchman_ignore_node *node,
+    const char *name, uint32_t len, bool *found)
+{
+  uint32_t lo = 0, hi = node->num_children;
+
+  *found = false;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    int res = compare_name(node->children[mid], name, len);
+
+    if (res == 0) {
+      *found = true;
+      return mid;
+    }
+    if (res < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+static struct watchman_ignore_node *make_child(
+    struct watchman_ignore_node *node, const char *name, uint32_t len)
+{
+  struct watchman_ignore_node *child;
+  uint32_t pos;
+  bool found;
+
+  pos = find_child(node, name, len, &found);
+  if (found) {
+    return node->children[pos];
+  }
+
+  if (node->num_children == node->alloc_children) {
+    uint32_t alloc = node->alloc_children ? node->alloc_children * 2 : 4;
+    struct watchman_ignore_node **children = realloc(node->children,
+        alloc * sizeof(*children));
+
+    if (!children) {
+      return NULL;
+    }
+    node->children = children;
+    node->alloc_children = alloc;
+  }
+
+  child = calloc(1, sizeof(*child));
+  if (!child) {
+    return NULL;
+  }
+  child->name = malloc(len);
+  if (!child->name) {
+    free(child);
+    return NULL;
+  }
+  memcpy(child->name, name, len);
+  child->len = len;
+
+  memmove(node->children + pos + 1, node->children + pos,
+      (node->num_children - pos) * sizeof(*node->children));
+  node->children[pos] = child;
+  node->num_children++;
+  return child;
+}
+
+static void free_node(struct watchman_ignore_node *node)
+{
+  uint32_t i;
+
+  for (i = 0; i < node->num_children; i++) {
+    free_node(node->children[i]);
+  }
+  for (i = 0; i < node->num_globs; i++) {
+    free(node->globs[i].pattern);
+  }
+  free(node->globs);
+  free(node->children);
+  free(node->name);
+  free(node);
+}
+
+bool w_ignore_init(struct watchman_ignore *ign)
+{
+  memset(ign, 0, sizeof(*ign));
+  ign->tree = calloc(1, sizeof(*ign->tree));
+  return ign->tree != NULL;
+}
+
+void w_ignore_destroy(struct watchman_ignore *ign)
+{
+  if (ign->tree) {
+    free_node(ign->tree);
+    ign->tree = NULL;
+  }
+}
+
+/* Returns true if rel contains a glob character that isn't escaped
+ * with a backslash */
+bool w_ignore_is_glob(const char *rel)
+{
+  for (; *rel; rel++) {
+    if (*rel == '\\' && rel[1]) {
+      rel++;
+    } else if (*rel == '*' || *rel == '?' || *rel == '[') {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool is_literal(const char *name, uint32_t len)
+{
+  uint32_t i;
+
+  for (i = 0; i < len; i++) {
+    if (strchr("*?[\\", name[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Follows or creates the child for each component of rel
+static struct watchman_ignore_node *make_path(
+    struct watchman_ignore_node *node, const char *rel)
+{
+  const char *end;
+
+  while (*rel) {
+    end = strchr(rel, WATCHMAN_DIR_SEP);
+    if (!end) {
+      end = rel + strlen(rel);
+    }
+    if (end > rel) {
+      node = make_child(node, rel, (uint32_t)(end - rel));
+      if (!node) {
+        return NULL;
+      }
+    }
+    rel = *end ? end + 1 : end;
+  }
+  return node;
+}
+
+static bool add_glob(struct watchman_ignore *ign, const char *pattern)
+{
+  struct watchman_ignore_node *node = ign->tree;
+  struct watchman_ignore_glob *globs;
+  const char *end, *p;
+  char *dup;
+  int depth = 1;
+
+  // Anchor the glob below its leading literal dirs
+  for (;;) {
+    end = strchr(pattern, WATCHMAN_DIR_SEP);
+    if (!end) {
+      break;
+    }
+    if (end > pattern) {
+      if (!is_literal(pattern, (uint32_t)(end - pattern))) {
+        break;
+      }
+      node = make_child(node, pattern, (uint32_t)(end - pattern));
+      if (!node) {
+        return false;
+      }
+    }
+    pattern = end + 1;
+  }
+
+  for (p = pattern; *p; p++) {
+    if (*p == WATCHMAN_DIR_SEP) {
+      depth++;
+    }
+  }
+  if (strstr(pattern, "**")) {
+    depth = -1;
+  }
+
+  dup = strdup(pattern);
+  if (!dup) {
+    return false;
+  }
+  globs = realloc(node->globs, (node->num_globs + 1) * sizeof(*globs));
+  if (!globs) {
+    free(dup);
+    return false;
+  }
+  globs[node->num_globs].pattern = dup;
+  globs[node->num_globs].depth = depth;
+  node->globs = globs;
+  node->num_globs++;
+  return true;
+}
+
+/* Adds a rule for rel, a path relative to the root.  If vcs is true
+ * this is an ignore_vcs entry, otherwise an ignore_dirs entry, which
+ * may be a glob */
+bool w_ignore_add(struct watchman_ignore *ign, const char *rel, bool vcs)
+{
+  struct watchman_ignore_node *node;
+  char buf[WATCHMAN_NAME_MAX];
+  uint32_t i, len = 0;
+
+  if (!vcs) {
+    if (w_ignore_is_glob(rel)) {
+      return add_glob(ign, rel);
+    }
+    // Drop the escapes of literal glob characters
+    for (i = 0; rel[i]; i++) {
+      if (rel[i] == '\\' && rel[i + 1] && strchr("*?[]", rel[i + 1])) {
+        i++;
+      }
+      if (len + 1 >= sizeof(buf)) {
+        return false;
+      }
+      buf[len++] = rel[i];
+    }
+    buf[len] = '\0';
+    rel = buf;
+  }
+
+  node = make_path(ign->tree, rel);
+  if (!node) {
+    return false;
+  }
+  if (node == ign->tree) {
+    // Ignoring the root itself makes no sense
+    return false;
+  }
+  node->flags |= vcs ? IGNORE_VCS : IGNORE_FULL;
+  return true;
+}
+
+/* Matches the globs of node against each ancestor of rel, and rel
+ * itself, that has as many components as the glob */
+static bool match_globs(const struct watchman_ignore_node *node,
+    const char *rel, const char *stop)
+{
+  char buf[WATCHMAN_NAME_MAX];
+  uint32_t len = (uint32_t)(stop - rel);
+  uint32_t end, i;
+  int depth = 0;
+  char c;
+
+  if (len == 0 || len >= sizeof(buf)) {
+    return false;
+  }
+  memcpy(buf, rel, len);
+  buf[len] = '\0';
+
+  for (end = 1; end <= len; end++) {
+    if (end < len && buf[end] != WATCHMAN_DIR_SEP) {
+      continue;
+    }
+    depth++;
+    c = buf[end];
+    buf[end] = '\0';
+    for (i = 0; i < node->num_globs; i++) {
+      const struct watchman_ignore_glob *glob = &node->globs[i];
+
+      if ((glob->depth < 0 || glob->depth == depth) &&
+          wildmatch(glob->pattern, buf, WM_PATHNAME, 0) == WM_MATCH) {
+        return true;
+      }
+    }
+    buf[end] = c;
+  }
+  return false;
+}
+
+/* Classifies path, a full path below root_path.  Returns W_IGNORE_SELF
+ * if the path is ignored, W_IGNORE_CONTENTS if the path is tracked but
+ * nothing below it is, or W_IGNORE_NONE */
+enum w_ignore_result w_ignore_check(const struct watchman_ignore *ign,
+    w_string_t *root_path, const char *path, uint32_t len)
+{
+  const struct watchman_ignore_node *node = ign->tree;
+  const char *rel, *comp, *end, *stop;
+  // number of components after an ignore_vcs dir, or -1 if none
+  int below_vcs = -1;
+
+  if (len <= root_path->len + 1 ||
+      path[root_path->len] != WATCHMAN_DIR_SEP ||
+      memcmp(path, root_path->buf, root_path->len)) {
+    return W_IGNORE_NONE;
+  }
+  rel = path + root_path->len + 1;
+  stop = path + len;
+
+  if (node->num_globs && match_globs(node, rel, stop)) {
+    return W_IGNORE_SELF;
+  }
+
+  for (comp = rel; comp < stop && (node || below_vcs >= 0); comp = end + 1) {
+    end = memchr(comp, WATCHMAN_DIR_SEP, stop - comp);
+    if (!end) {
+      end = stop;
+    }
+
+    if (below_vcs >= 0 && ++below_vcs >= 2) {
+      return W_IGNORE_SELF;
+    }
+    if (node) {
+      uint32_t pos;
+      bool found;
+
+      pos = find_child(node, comp, (uint32_t)(end - comp), &found);
+      node = found ? node->children[pos] : NULL;
+      if (node && (node->flags & IGNORE_FULL)) {
+        return W_IGNORE_SELF;
+      }
+      if (node && (node->flags & IGNORE_VCS) && below_vcs < 0) {
+        below_vcs = 0;
+      }
+      if (node && node->num_globs && end < stop &&
+          match_globs(node, end + 1, stop)) {
+        return W_IGNORE_SELF;
+      }
+    }
+  }
+
+  return below_vcs == 1 ? W_IGNORE_CONTENTS : W_IGNORE_NONE;
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -0,0 +1,149 @@
+/* Copyright 2015-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+
+/* Ordered indexes over the file nodes of a root.
+ *
+ * The only order that a root keeps its files in is that of when they
+ * were last observed to change.  When the ordered_indexes option lists
+ * them, the root also keeps file nodes ordered by size, by mtime (in
+ * seconds) and by the tick at which they were created, so that a query
+ * whose expression implies a range of one of those (see
+ * w_query_parse) visits just the files in the range instead of all of
+ * them.
+ *
+ * An index is built from the whole tree when a query first wants it,
+ * and is kept up to date from then on.  Whoever changes one of the
+ * indexed fields of a file node must take the node out of that index
+ * first and put it back afterwards; nodes must likewise be taken out of
+ * all of them before they are freed */
+
+W_METRIC_COUNTER(index_builds, "index_builds_total",
+    "Number of ordered file indexes built");
+W_METRIC_GAUGE(index_entries, "index_entries",
+    "Number of file nodes held in ordered indexes across all roots");
+
+static const char *field_names[W_INDEX_MAX] = {
+  "size",
+  "mtime",
+  "cclock",
+};
+
+static int64_t file_key(struct watchman_file *file, enum w_index_field field)
+{
+  switch (field) {
+    case W_INDEX_SIZE:
+      return file->stat.size;
+    case W_INDEX_MTIME:
+      return file->stat.mtime.tv_sec;
+    case W_INDEX_CCLOCK:
+    default:
+      return file->ctime.ticks;
+  }
+}
+
+/* Evaluates the ordered_indexes option: an array naming some of size,
+ * mtime and cclock */
+unsigned w_root_parse_index_fields(w_root_t *root)
+{
+  json_t *names = cfg_get_json(root, "ordered_indexes");
+  unsigned fields = 0;
+  uint32_t i, f;
+
+  if (!names) {
+    return 0;
+  }
+  if (!json_is_array(names)) {
+    w_log(W_LOG_ERR, "ordered_indexes must be an array of strings\n");
+    return 0;
+  }
+  for (i = 0; i < json_array_size(names); i++) {
+    const char *name = json_string_value(json_array_get(names, i));
+
+    for (f = 0; name && f < W_INDEX_MAX; f++) {
+      if (!strcmp(name, field_names[f])) {
+        fields |= W_INDEX_BIT(f);
+        break;
+      }
+    }
+    if (!name || f == W_INDEX_MAX) {
+      w_log(W_LOG_ERR, "ordered_indexes: can't index on %s\n",
+          name ? name : "a non-string");
+    }
+  }
+  return fields;
+}
+
+void w_root_index_file(w_root_t *root, struct watchman_file *file,
+    unsigned fields)
+{
+  int f;
+
+  for (f = 0; f < W_INDEX_MAX; f++) {
+    if ((fields & W_INDEX_BIT(f)) && root->indexes[f] &&
+        w_skiplist_insert(root->indexes[f], file_key(file, f), file)) {
+      w_metric_inc(&index_entries);
+    }
+  }
+}
+
+void w_root_unindex_file(w_root_t *root, struct watchman_file *file,
+    unsigned fields)
+{
+  int f;
+
+  for (f = 0; f < W_INDEX_MAX; f++) {
+    if ((fields & W_INDEX_BIT(f)) && root->indexes[f] &&
+        w_skiplist_remove(root->indexes[f], file_key(file, f), file)) {
+      w_metric_dec(&index_entries);
+    }
+  }
+}
+
+void w_root_free_indexes(w_root_t *root, unsigned fields)
+{
+  int f;
+
+  for (f = 0; f < W_INDEX_MAX; f++) {
+    if ((fields & W_INDEX_BIT(f)) && root->indexes[f]) {
+      w_metric_add(&index_entries,
+          -(int64_t)w_skiplist_size(root->indexes[f]));
+      w_skiplist_free(root->indexes[f]);
+      root->indexes[f] = NULL;
+    }
+  }
+}
+
+/* Returns the index on field, building it if need be, or NULL if the
+ * root doesn't keep one.  Must be called with the root locked */
+w_skiplist_t *w_root_get_index(w_root_t *root, enum w_index_field field)
+{
+  struct watchman_file *file;
+  w_skiplist_t *index;
+
+  if (!(root->config.index_fields & W_INDEX_BIT(field))) {
+    return NULL;
+  }
+  if (root->indexes[field]) {
+    return root->indexes[field];
+  }
+
+  index = w_skiplist_new();
+  if (!index) {
+    return NULL;
+  }
+  for (file = root->latest_file; file; file = file->next) {
+    if (!w_skiplist_insert(index, file_key(file, field), file)) {
+      w_skiplist_free(index);
+      return NULL;
+    }
+  }
+  root->indexes[field] = index;
+  w_metric_add(&index_entries, w_skiplist_size(index));
+  w_metric_inc(&index_builds);
+  return index;
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -0,0 +1,579 @@
+/* Copyright 2015-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+
+/* Persistent change journal.
+ *
+ * When the persistent_journal option is set, each root keeps two files
+ * next to the state file: a tree checkpoint, in the snapshot format of
+ * snapshot.c, and an append-only journal that holds a record for every
+ * file node that has changed since the checkpoint was taken.  Between
+ * them they describe the tree, including the tick at which each file
+ * was last observed.
+ *
+ * When the daemon restarts, the tree is rebuilt from the checkpoint and
+ * journal before the initial crawl.  The crawl compares every node with
+ * the filesystem, so anything that changed while we were not running is
+ * given a new tick; the tick counter itself carries on from where the
+ * previous daemon left it.  Clocks issued by earlier incarnations of the
+ * daemon for this root therefore keep producing incremental results.
+ * If the files are missing, inconsistent or were written with different
+ * ignore settings, we start afresh and those clocks are reported as a
+ * fresh instance, as they always were.
+ *
+ * Named cursors are journaled too, each time one moves.  Because the
+ * ticks carry on, a restored cursor means exactly what it did before
+ * the restart; if the journal can't be restored, neither can the
+ * cursors, and they are reported as a fresh instance.
+ *
+ * A checkpoint is taken at the end of the initial crawl and whenever
+ * the journal grows larger than the tree; it rewrites both files. */
+
+#define JOURNAL_MAGIC "WMJRNL01"
+// Number of daemon incarnations whose clocks we honor
+#define JOURNAL_MAX_INCARNATIONS 8
+// Compact only once the journal holds at least this many records
+#define JOURNAL_MIN_COMPACT 10000
+// Ticks are reserved in blocks of this size; see w_journal_reserve_ticks
+#define JOURNAL_TICK_RESERVE 1024
+
+// Journal entry types
+#define JOURNAL_FILE 1
+#define JOURNAL_TICKS 2
+#define JOURNAL_CURSOR 3
+
+struct journal_incarnation {
+  uint64_t start_time;
+  int32_t pid;
+  uint32_t root_number;
+};
+
+/* The header is followed by the root path and the ignore fingerprint,
+ * and then by the entries, each a type byte and its payload */
+struct journal_header {
+  char magic[8];
+  uint32_t base_ticks;
+  uint32_t reserved_ticks;
+  uint32_t last_age_out_tick;
+  uint32_t path_len;
+  uint32_t fingerprint_len;
+  uint32_t num_incarnations;
+  struct journal_incarnation incarnations[JOURNAL_MAX_INCARNATIONS];
+};
+
+struct w_journal {
+  w_string_t *tree_path;
+  w_string_t *journal_path;
+  // open for append once a checkpoint has been taken
+  FILE *f;
+  // every node with a later tick is yet to be written
+  uint32_t flushed_ticks;
+  // a restarted daemon will resume ticking after this value
+  uint32_t reserved_ticks;
+  uint32_t records;
+  // the earlier incarnations whose clocks we honor
+  uint32_t num_prior;
+  struct journal_incarnation prior[JOURNAL_MAX_INCARNATIONS];
+};
+
+W_METRIC_COUNTER(journal_records, "journal_records_total",
+    "Number of file changes appended to root journals");
+W_METRIC_COUNTER(journal_restores, "journal_restores_total",
+    "Number of roots whose tree and clocks were restored at startup");
+W_METRIC_HISTOGRAM(checkpoint_duration, "journal_checkpoint_usec",
+    "Time taken to checkpoint a tree and start a new journal", "usec");
+
+static bool journal_enabled(w_root_t *root)
+{
+  return (w_root_watcher_ops(root)->flags & WATCHER_TREE_EVICTABLE) &&
+    cfg_get_bool(root, "persistent_journal", false);
+}
+
+static struct w_journal *journal_new(w_root_t *root)
+{
+  struct w_journal *j;
+  uint32_t hash;
+
+  j = calloc(1, sizeof(*j));
+  if (!j) {
+    return NULL;
+  }
+  hash = w_hash_bytes(root->root_path->buf, root->root_path->len, 0);
+  j->tree_path = w_string_make_printf("%s.%08" PRIx32 ".tree",
+      watchman_state_file, hash);
+  j->journal_path = w_string_make_printf("%s.%08" PRIx32 ".journal",
+      watchman_state_file, hash);
+  return j;
+}
+
+static void journal_close_file(struct w_journal *j)
+{
+  if (j->f) {
+    fclose(j->f);
+    j->f = NULL;
+  }
+}
+
+/* Describes the settings that decide which paths are in the tree; a
+ * tree recorded under different settings can't be trusted */
+static w_string_t *ignore_fingerprint(w_root_t *root)
+{
+  json_t *fp = json_object();
+  json_t *val;
+  w_string_t *res;
+  char *str;
+
+  val = cfg_get_json(root, "ignore_dirs");
+  if (val) {
+    json_object_set(fp, "ignore_dirs", val);
+  }
+  val = cfg_get_json(root, "ignore_vcs");
+  if (val) {
+    json_object_set(fp, "ignore_vcs", val);
+  }
+  set_prop(fp, "case_sensitive", json_boolean(root->case_sensitive));
+
+  str = json_dumps(fp, JSON_COMPACT | JSON_SORT_KEYS);
+  json_decref(fp);
+  res = w_string_new(str ? str : "");
+  free(str);
+  return res;
+}
+
+static bool write_cursor(FILE *f, w_string_t *name, uint32_t ticks)
+{
+  uint8_t type = JOURNAL_CURSOR;
+  uint32_t len = name->len;
+
+  return fwrite(&type, sizeof(type), 1, f) == 1 &&
+    fwrite(&len, sizeof(len), 1, f) == 1 &&
+    fwrite(name->buf, len, 1, f) == 1 &&
+    fwrite(&ticks, sizeof(ticks), 1, f) == 1;
+}
+
+// Writes the position of every named cursor of root
+static bool write_cursors(w_root_t *root, FILE *f)
+{
+  w_ht_iter_t i;
+
+  if (w_ht_first(root->cursors, &i)) do {
+    if (!write_cursor(f, w_ht_val_ptr(i.key), (uint32_t)i.value)) {
+      return false;
+    }
+  } while (w_ht_next(root->cursors, &i));
+  return true;
+}
+
+static bool read_cursor(w_root_t *root, FILE *f, uint32_t *ticks)
+{
+  char buf[WATCHMAN_NAME_MAX];
+  w_string_t *name;
+  uint32_t len;
+
+  if (fread(&len, sizeof(len), 1, f) != 1 || len == 0 || len >= sizeof(buf) ||
+      fread(buf, len, 1, f) != 1 || fread(ticks, sizeof(*ticks), 1, f) != 1) {
+    return false;
+  }
+  buf[len] = '\0';
+  name = w_string_new(buf);
+  w_ht_replace(root->cursors, w_ht_ptr_val(name), *ticks);
+  w_string_delref(name);
+  return true;
+}
+
+static bool read_header(w_root_t *root, FILE *f, struct journal_header *hdr,
+    char **errmsg)
+{
+  w_string_t *fp = ignore_fingerprint(root);
+  char buf[WATCHMAN_NAME_MAX];
+  bool ok = false;
+
+  if (fread(hdr, sizeof(*hdr), 1, f) != 1 ||
+      memcmp(hdr->magic, JOURNAL_MAGIC, sizeof(hdr->magic)) ||
+      hdr->num_incarnations > JOURNAL_MAX_INCARNATIONS) {
+    ignore_result(asprintf(errmsg, "not a compatible journal"));
+    goto out;
+  }
+  if (hdr->path_len != root->root_path->len ||
+      hdr->path_len >= sizeof(buf) ||
+      fread(buf, hdr->path_len, 1, f) != 1 ||
+      memcmp(buf, root->root_path->buf, hdr->path_len)) {
+    ignore_result(asprintf(errmsg, "journal is for a different root"));
+    goto out;
+  }
+  if (hdr->fingerprint_len != fp->len ||
+      hdr->fingerprint_len >= sizeof(buf) ||
+      (fp->len && fread(buf, fp->len, 1, f) != 1) ||
+      memcmp(buf, fp->buf, fp->len)) {
+    ignore_result(asprintf(errmsg, "the ignore configuration has changed"));
+    goto out;
+  }
+  ok = true;
+
+out:
+  w_string_delref(fp);
+  return ok;
+}
+
+/* Rebuilds the tree of a newly watched root from its checkpoint and
+ * journal, so that the initial crawl only has to verify it.  Returns
+ * true if the tree was restored; otherwise the tree is left empty.
+ * Must be called with the root locked, before the initial crawl */
+bool w_journal_restore(w_root_t *root)
+{
+  struct w_snapshot_info info;
+  struct journal_header hdr;
+  struct watchman_file *file;
+  struct w_journal *j;
+  uint32_t max_ticks, records = 0;
+  uint64_t start = w_metric_now_usec();
+  char *why = NULL;
+  FILE *f = NULL;
+  uint8_t type;
+
+  if (!journal_enabled(root) || root->journal) {
+    return false;
+  }
+  j = journal_new(root);
+  if (!j) {
+    return false;
+  }
+  root->journal = j;
+
+  if (!w_path_exists(j->tree_path->buf)) {
+    return false;
+  }
+
+  if (!w_root_snapshot_load(root, j->tree_path->buf, &info, &why)) {
+    goto fail;
+  }
+  f = fopen(j->journal_path->buf, "rb");
+  if (!f) {
+    ignore_result(asprintf(&why, "unable to open %s: %s",
+          j->journal_path->buf, strerror(errno)));
+    goto fail;
+  }
+  if (!read_header(root, f, &hdr, &why)) {
+    goto fail;
+  }
+  // The journal must pick up exactly where the checkpoint left off
+  if (hdr.base_ticks != info.ticks) {
+    ignore_result(asprintf(&why, "the journal does not follow the tree"));
+    goto fail;
+  }
+
+  max_ticks = MAX(info.ticks, hdr.reserved_ticks);
+  // A torn entry at the end is the expected result of a crash; we have
+  // everything before it, and the crawl will notice what it described
+  while (fread(&type, sizeof(type), 1, f) == 1) {
+    uint32_t ticks;
+
+    if (type == JOURNAL_FILE) {
+      file = w_snapshot_read_file(root, f);
+      if (!file) {
+        break;
+      }
+      max_ticks = MAX(max_ticks, file->otime.ticks);
+      records++;
+    } else if (type == JOURNAL_TICKS &&
+        fread(&ticks, sizeof(ticks), 1, f) == 1) {
+      max_ticks = MAX(max_ticks, ticks);
+    } else if (type == JOURNAL_CURSOR && read_cursor(root, f, &ticks)) {
+      max_ticks = MAX(max_ticks, ticks);
+    } else {
+      break;
+    }
+  }
+  fclose(f);
+
+  // Everything observed from here on is newer than any clock that the
+  // previous daemon could have handed out
+  root->ticks = max_ticks + 1;
+  root->last_age_out_tick = hdr.last_age_out_tick;
+  j->reserved_ticks = max_ticks;
+  j->num_prior = hdr.num_incarnations;
+  memcpy(j->prior, hdr.incarnations, sizeof(j->prior));
+
+  w_metric_inc(&journal_restores);
+  w_log(W_LOG_ERR, "restored tree of %.*s from its journal: %" PRIu32
+      " files, %" PRIu32 " journal records in %" PRIu64 "us\n",
+      root->root_path->len, root->root_path->buf, info.num_files, records,
+      w_metric_now_usec() - start);
+  return true;
+
+fail:
+  w_log(W_LOG_ERR, "not restoring %.*s from its journal: %s\n",
+      root->root_path->len, root->root_path->buf, why);
+  free(why);
+  if (f) {
+    fclose(f);
+  }
+  w_root_reset_tree(root);
+  return false;
+}
+
+/* Writes the whole tree and starts a new, empty journal after it.
+ * Must be called with the root locked */
+void w_journal_checkpoint(w_root_t *root)
+{
+  struct journal_header hdr;
+  struct w_journal *j = root->journal;
+  uint64_t start = w_metric_now_usec();
+  uint64_t start_time;
+  w_string_t *fp;
+  char *errmsg = NULL;
+  char *tmp = NULL;
+  FILE *f = NULL;
+  int pid, fd;
+  uint32_t n;
+
+  if (!root->done_initial || root->evicted || root->cancelled) {
+    return;
+  }
+  if (!j) {
+    if (!journal_enabled(root)) {
+      return;
+    }
+    j = root->journal = journal_new(root);
+    if (!j) {
+      return;
+    }
+  }
+
+  fp = ignore_fingerprint(root);
+  if (!w_root_snapshot_write(root, j->tree_path->buf, &errmsg)) {
+    w_log(W_LOG_ERR, "journal: %s\n", errmsg);
+    free(errmsg);
+    goto out;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic));
+  hdr.base_ticks = root->ticks;
+  hdr.reserved_ticks = j->reserved_ticks;
+  hdr.last_age_out_tick = root->last_age_out_tick;
+  hdr.path_len = root->root_path->len;
+
+  // Our own clocks will be honored by our successor, along with those
+  // of the most recent of the incarnations that we honor
+  n = MIN(j->num_prior, JOURNAL_MAX_INCARNATIONS - 1);
+  memcpy(hdr.incarnations, j->prior + (j->num_prior - n),
+      n * sizeof(hdr.incarnations[0]));
+  w_clock_get_identity(&start_time, &pid);
+  hdr.incarnations[n].start_time = start_time;
+  hdr.incarnations[n].pid = pid;
+  hdr.incarnations[n].root_number = root->number;
+  hdr.num_incarnations = n + 1;
+  hdr.fingerprint_len = fp->len;
+
+  ignore_result(asprintf(&tmp, "%s.XXXXXX", j->journal_path->buf));
+  fd = tmp ? mkstemp(tmp) : -1;
+  if (fd == -1 || (f = fdopen(fd, "wb")) == NULL) {
+    w_log(W_LOG_ERR, "journal: unable to create %s: %s\n",
+        tmp ? tmp : j->journal_path->buf, strerror(errno));
+    if (fd != -1) {
+      close(fd);
+      unlink(tmp);
+    }
+    goto out;
+  }
+  w_set_cloexec(fd);
+
+  if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+      fwrite(root->root_path->buf, root->root_path->len, 1, f) != 1 ||
+      (fp->len && fwrite(fp->buf, fp->len, 1, f) != 1) ||
+      !write_cursors(root, f) ||
+      fflush(f) != 0 ||
+      rename(tmp, j->journal_path->buf) != 0) {
+    w_log(W_LOG_ERR, "journal: failed to write %s: %s\n",
+        tmp, strerror(errno));
+    fclose(f);
+    unlink(tmp);
+    f = NULL;
+    goto out;
+  }
+
+  journal_close_file(j);
+  j->f = f;
+  j->records = 0;
+  j->flushed_ticks = root->ticks;
+  // Anything that changes from now on must sort after the checkpoint
+  root->ticks++;
+
+  w_metric_observe_since(&checkpoint_duration, start);
+  w_log(W_LOG_DBG, "checkpointed %.*s at tick %" PRIu32 "\n",
+      root->root_path->len, root->root_path->buf, hdr.base_ticks);
+
+out:
+  if (!f) {
+    // Without a journal that follows the current tree, a restart must
+    // not trust what is on disk
+    journal_close_file(j);
+    unlink(j->journal_path->buf);
+  }
+  w_string_delref(fp);
+  free(tmp);
+}
+
+// Stops journaling after a failed write, so that no gap can be replayed
+static void journal_abandon(w_root_t *root, struct w_journal *j)
+{
+  w_log(W_LOG_ERR, "journal: failed to append to %s: %s; journaling "
+      "for %.*s is disabled until the next recrawl\n",
+      j->journal_path->buf, strerror(errno),
+      root->root_path->len, root->root_path->buf);
+  journal_close_file(j);
+  unlink(j->journal_path->buf);
+}
+
+/* Appends the nodes that have changed since the last flush.
+ * Must be called with the root locked */
+void w_journal_flush(w_root_t *root)
+{
+  struct w_journal *j = root->journal;
+  struct watchman_file *file, *oldest = NULL;
+  uint8_t type = JOURNAL_FILE;
+  uint32_t n = 0;
+
+  if (!j || !j->f || root->evicted) {
+    return;
+  }
+
+  // The file list is ordered by tick, newest first
+  for (file = root->latest_file;
+       file && file->otime.ticks > j->flushed_ticks;
+       file = file->next) {
+    oldest = file;
+  }
+  for (file = oldest; file; file = file->prev) {
+    if (fwrite(&type, sizeof(type), 1, j->f) != 1 ||
+        !w_snapshot_write_file(root, j->f, file)) {
+      journal_abandon(root, j);
+      return;
+    }
+    n++;
+  }
+  if (n == 0) {
+    return;
+  }
+  if (fflush(j->f) != 0) {
+    journal_abandon(root, j);
+    return;
+  }
+
+  // Every change is made after the tick is advanced, so nothing more
+  // can be observed at the current tick
+  j->flushed_ticks = root->ticks;
+  j->records += n;
+  w_metric_add(&journal_records, n);
+
+  if (j->records > MAX(JOURNAL_MIN_COMPACT, root->num_files)) {
+    w_journal_checkpoint(root);
+  }
+}
+
+/* Called before the current tick is handed out in a clock.  A restored
+ * root resumes ticking after the highest reservation, so that it never
+ * reuses a tick that a client may be holding.
+ * Must be called with the root locked */
+void w_journal_reserve_ticks(w_root_t *root)
+{
+  struct w_journal *j = root->journal;
+  uint8_t type = JOURNAL_TICKS;
+  uint32_t reserve;
+
+  if (!j || !j->f || root->ticks <= j->reserved_ticks) {
+    return;
+  }
+
+  reserve = root->ticks + JOURNAL_TICK_RESERVE;
+  if (fwrite(&type, sizeof(type), 1, j->f) != 1 ||
+      fwrite(&reserve, sizeof(reserve), 1, j->f) != 1 ||
+      fflush(j->f) != 0) {
+    journal_abandon(root, j);
+    return;
+  }
+  j->reserved_ticks = reserve;
+}
+
+/* Records the new position of a named cursor.
+ * Must be called with the root locked */
+void w_journal_record_cursor(w_root_t *root, w_string_t *cursor,
+    uint32_t ticks)
+{
+  struct w_journal *j = root->journal;
+
+  if (!j || !j->f) {
+    return;
+  }
+  if (!write_cursor(j->f, cursor, ticks) || fflush(j->f) != 0) {
+    journal_abandon(root, j);
+    return;
+  }
+  j->records++;
+  w_metric_inc(&journal_records);
+}
+
+/* Returns true if a clock with this identity was issued for this root
+ * by an earlier daemon whose tree we restored.
+ * Must be called with the root locked */
+bool w_journal_owns_clock(w_root_t *root, uint64_t start_time, int pid,
+    uint32_t root_number)
+{
+  struct w_journal *j = root->journal;
+  uint32_t i;
+
+  if (!j) {
+    return false;
+  }
+  for (i = 0; i < j->num_prior; i++) {
+    if (j->prior[i].start_time == start_time &&
+        j->prior[i].pid == pid &&
+        j->prior[i].root_number == root_number) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Releases the journal but leaves the files for our successor, as when
+ * the daemon shuts down or the root is recrawled */
+void w_journal_close(w_root_t *root)
+{
+  struct w_journal *j = root->journal;
+
+  if (!j) {
+    return;
+  }
+  journal_close_file(j);
+  w_string_delref(j->tree_path);
+  w_string_delref(j->journal_path);
+  free(j);
+  root->journal = NULL;
+}
+
+/* Removes the files along with the journal, as when the root is no
+ * longer watched.
+ * Must be called with the root locked */
+void w_journal_discard(w_root_t *root)
+{
+  struct w_journal *j = root->journal;
+
+  if (!j) {
+    // We may not have taken a checkpoint yet, but an earlier daemon may
+    if (!journal_enabled(root)) {
+      return;
+    }
+    j = root->journal = journal_new(root);
+    if (!j) {
+      return;
+    }
+  }
+  unlink(j->journal_path->buf);
+  unlink(j->tree_path->buf);
+  w_journal_close(root);
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -12,6 +12,7 @@
 /* This needs to be recursive safe because we may log to clients
  * while we are dispatching subscriptions to clients */
 pthread_mutex_t w_client_lock;
+static struct w_lock_hold client_lock_hold;
 w_ht_t *clients = NULL;
 static int listener_fd;
 static pthread_t reaper_thread;
@@ -48,6 +49,13 @@ bool clock_id_string(uint32_t root_number, uint32_t ticks, char *buf,
   return (size_t)res < bufsize;
 }
 
+// The process identity that prefixes the clocks we issue
+void w_clock_get_identity(uint64_t *start_time, int *pid)
+{
+  *start_time = proc_start_time;
+  *pid = proc_pid;
+}
+
 // Renders the current clock id string to the supplied buffer.
 // Must be called with the root locked.
 static bool current_clock_id_string(w_root_t *root,
@@ -62,6 +70,7 @@ void annotate_with_clock(w_root_t *root, json_t *resp)
 {
   char buf[128];
 
+  w_journal_reserve_ticks(root);
   if (current_clock_id_string(root, buf, sizeof(buf))) {
     set_prop(resp, "clock", json_string_nocheck(buf));
   }
@@ -93,14 +102,54 @@ bool enqueue_response(struct watchman_client *client,
   return true;
 }
 
+/* Queues a subscription response that moves the named cursor to ticks
+ * once the client has actually been sent it, so that the cursor never
+ * runs ahead of what was delivered.
+ * must be called with the w_client_lock held */
+bool enqueue_cursor_response(struct watchman_client *client,
+    json_t *json, w_root_t *root, w_string_t *cursor, uint32_t ticks)
+{
+  if (!enqueue_response(client, json, true)) {
+    return false;
+  }
+
+  w_root_addref(root);
+  w_string_addref(cursor);
+  client->tail->cursor_root = root;
+  client->tail->cursor = cursor;
+  client->tail->cursor_ticks = ticks;
+
+  return true;
+}
+
+/* Releases a response; if it was sent and carries a cursor, the cursor
+ * moves forward to cover it */
+static void free_response(struct watchman_client_response *resp, bool sent)
+{
+  if (resp->cursor) {
+    if (sent) {
+      w_root_lock(resp->cursor_root);
+      if (!resp->cursor_root->cancelled) {
+        w_root_advance_cursor(resp->cursor_root, resp->cursor,
+            resp->cursor_ticks);
+      }
+      w_root_unlock(resp->cursor_root);
+    }
+    w_string_delref(resp->cursor);
+    w_root_delref(resp->cursor_root);
+  }
+  json_decref(resp->json);
+  free(resp);
+}
+
 void send_and_dispose_response(struct watchman_client *client,
     json_t *response)
 {
-  pthread_mutex_lock(&w_client_lock);
+  w_clients_lock();
   if (!enqueue_response(client, response, false)) {
     json_decref(response);
   }
-  pthread_mutex_unlock(&w_client_lock);
+  w_clients_unlock();
 }
 
 void send_error_response(struct watchman_client *client,
@@ -120,6 +169,25 @@ void send_error_response(struct watchman_client *client,
   send_and_dispose_response(client, resp);
 }
 
+void w_clients_lock_at(const char *site)
+{
+  uint64_t start = w_lockprof_begin();
+
+  pthread_mutex_lock(&w_client_lock);
+  w_lock_hold_enter(&w_lock_class_clients, &client_lock_hold, site, start);
+}
+
+void w_clients_unlock(void)
+{
+  w_lock_hold_exit(&w_lock_class_clients, &client_lock_hold);
+  pthread_mutex_unlock(&w_client_lock);
+}
+
+W_METRIC_GAUGE(clients_connected, "clients_connected",
+    "Number of connected clients");
+W_METRIC_COUNTER(responses_sent, "responses_sent_total",
+    "Number of PDUs sent to clients");
+
 static void client_delete(struct watchman_client *client)
 {
   struct watchman_client_response *resp;
@@ -132,8 +200,7 @@ static void client_delete(struct watchman_client *client)
   while (client->head) {
     resp = client->head;
     client->head = resp->next;
-    json_decref(resp->json);
-    free(resp);
+    free_response(resp, false);
   }
 
   w_json_buffer_free(&client->reader);
@@ -142,6 +209,7 @@ static void client_delete(struct watchman_client *client)
   w_stm_shutdown(client->stm);
   w_stm_close(client->stm);
   free(client);
+  w_metric_dec(&clients_connected);
 }
 
 static void delete_subscription(w_ht_val_t val)
@@ -149,6 +217,9 @@ static void delete_subscription(w_ht_val_t val)
   struct watchman_client_subscription *sub = w_ht_val_ptr(val);
 
   w_string_delref(sub->name);
+  if (sub->cursor) {
+    w_string_delref(sub->cursor);
+  }
   w_query_delref(sub->query);
   free(sub);
 }
@@ -242,6 +313,16 @@ struct w_clockspec *w_clockspec_parse(json_t *value)
 void w_clockspec_eval(w_root_t *root,
     const struct w_clockspec *spec,
     struct w_query_since *since)
+{
+  w_clockspec_eval_cursor(root, spec, since, true);
+}
+
+// As w_clockspec_eval, but a named cursor is only moved forward to the
+// present if advance_cursor is set
+void w_clockspec_eval_cursor(w_root_t *root,
+    const struct w_clockspec *spec,
+    struct w_query_since *since,
+    bool advance_cursor)
 {
   if (spec == NULL) {
     since->is_timestamp = false;
@@ -274,13 +355,16 @@ void w_clockspec_eval(w_root_t *root,
       since->clock.ticks = (uint32_t)ticks_val;
     }
 
-    // Bump the tick value and record it against the cursor.
-    // We need to bump the tick value so that repeated queries
-    // when nothing has changed in the filesystem won't continue
-    // to return the same set of files; we only want the first
-    // of these to return the files and the rest to return nothing
-    // until something subsequently changes
-    w_ht_replace(root->cursors, w_ht_ptr_val(cursor), ++root->ticks);
+    if (advance_cursor) {
+      // Bump the tick value and record it against the cursor.
+      // We need to bump the tick value so that repeated queries
+      // when nothing has changed in the filesystem won't continue
+      // to return the same set of files; we only want the first
+      // of these to return the files and the rest to return nothing
+      // until something subsequently changes
+      w_ht_replace(root->cursors, w_ht_ptr_val(cursor), ++root->ticks);
+      w_journal_record_cursor(root, cursor, root->ticks);
+    }
 
     w_log(W_LOG_DBG, "resolved cursor %.*s -> %" PRIu32 "\n",
         cursor->len, cursor->buf, since->clock.ticks);
@@ -288,9 +372,12 @@ void w_clockspec_eval(w_root_t *root,
   }
 
   // spec->tag == w_cs_clock
-  if (spec->clock.start_time == proc_start_time &&
-      spec->clock.pid == proc_pid &&
-      spec->clock.root_number == root->number) {
+  if ((spec->clock.start_time == proc_start_time &&
+       spec->clock.pid == proc_pid &&
+       spec->clock.root_number == root->number) ||
+      // or one issued before a restart, for a tree we restored
+      w_journal_owns_clock(root, spec->clock.start_time, spec->clock.pid,
+        spec->clock.root_number)) {
 
     since->clock.is_fresh_instance =
       spec->clock.ticks < root->last_age_out_tick;
@@ -315,6 +402,38 @@ void w_clockspec_eval(w_root_t *root,
   since->clock.ticks = 0;
 }
 
+/* Moves a named cursor forward to ticks, creating it if need be, as
+ * when a subscription that started from the cursor delivers results.
+ * A cursor that has already moved past ticks is left alone.
+ * Must be called with the root locked */
+void w_root_advance_cursor(w_root_t *root, w_string_t *cursor,
+    uint32_t ticks)
+{
+  w_ht_val_t ticks_val;
+
+  if (w_ht_lookup(root->cursors, w_ht_ptr_val(cursor), &ticks_val, false) &&
+      ticks_val >= ticks) {
+    return;
+  }
+  w_ht_replace(root->cursors, w_ht_ptr_val(cursor), ticks);
+  w_journal_record_cursor(root, cursor, ticks);
+}
+
+struct w_clockspec *w_clockspec_copy(const struct w_clockspec *spec)
+{
+  struct w_clockspec *copy;
+
+  copy = malloc(sizeof(*copy));
+  if (!copy) {
+    return NULL;
+  }
+  *copy = *spec;
+  if (copy->tag == w_cs_named_cursor) {
+    w_string_addref(copy->named_cursor.cursor);
+  }
+  return copy;
+}
+
 void w_clockspec_free(struct w_clockspec *spec)
 {
   if (spec->tag == w_cs_named_cursor) {
@@ -485,11 +604,11 @@ static void *client_thread(void *ptr)
     }
 
     /* de-queue the pending responses under the lock */
-    pthread_mutex_lock(&w_client_lock);
+    w_clients_lock();
     queued_responses_to_send = client->head;
     client->head = NULL;
     client->tail = NULL;
-    pthread_mutex_unlock(&w_client_lock);
+    w_clients_unlock();
 
     /* now send our response(s) */
     while (queued_responses_to_send) {
@@ -497,6 +616,8 @@ static void *client_thread(void *ptr)
         queued_responses_to_send;
 
       if (send_ok) {
+        uint64_t span = w_trace_begin();
+
         w_stm_set_nonblock(client->stm, false);
         /* Return the data in the same format that was used to ask for it.
          * Don't bother sending any more messages if the client disconnects,
@@ -505,12 +626,13 @@ static void *client_thread(void *ptr)
         send_ok = w_ser_write_pdu(client->pdu_type, &client->writer,
                                   client->stm, response_to_send->json);
         w_stm_set_nonblock(client->stm, true);
+        w_metric_inc(&responses_sent);
+        w_trace_end("client", "write_pdu", span, NULL);
       }
 
       queued_responses_to_send = response_to_send->next;
 
-      json_decref(response_to_send->json);
-      free(response_to_send);
+      free_response(response_to_send, send_ok);
     }
   }
 
@@ -518,9 +640,9 @@ disconected:
   // Remove the client from the map before we tear it down, as this makes
   // it easier to flush out pending writes on windows without worrying
   // about w_log_to_clients contending for the write buffers
-  pthread_mutex_lock(&w_client_lock);
+  w_clients_lock();
   w_ht_del(clients, w_ht_ptr_val(client));
-  pthread_mutex_unlock(&w_client_lock);
+  w_clients_unlock();
 
   client_delete(client);
 
@@ -532,10 +654,10 @@ bool w_should_log_to_clients(int level)
   w_ht_iter_t iter;
   bool result = false;
 
-  pthread_mutex_lock(&w_client_lock);
+  w_clients_lock();
 
   if (!clients) {
-    pthread_mutex_unlock(&w_client_lock);
+    w_clients_unlock();
     return false;
   }
 
@@ -548,7 +670,7 @@ bool w_should_log_to_clients(int level)
     }
 
   } while (w_ht_next(clients, &iter));
-  pthread_mutex_unlock(&w_client_lock);
+  w_clients_unlock();
 
   return result;
 }
@@ -562,7 +684,7 @@ void w_log_to_clients(int level, const char *buf)
     return;
   }
 
-  pthread_mutex_lock(&w_client_lock);
+  w_clients_lock();
   if (w_ht_first(clients, &iter)) do {
     struct watchman_client *client = w_ht_val_ptr(iter.value);
 
@@ -577,7 +699,7 @@ void w_log_to_clients(int level, const char *buf)
     }
 
   } while (w_ht_next(clients, &iter));
-  pthread_mutex_unlock(&w_client_lock);
+  w_clients_unlock();
 }
 
 static void *child_reaper(void *arg)
@@ -771,9 +893,10 @@ static struct watchman_client *make_new_client(w_stm_t stm) {
   }
   client->subscriptions = w_ht_new(2, &subscription_hash_funcs);
 
-  pthread_mutex_lock(&w_client_lock);
+  w_clients_lock();
   w_ht_set(clients, w_ht_ptr_val(client), w_ht_ptr_val(client));
-  pthread_mutex_unlock(&w_client_lock);
+  w_clients_unlock();
+  w_metric_inc(&clients_connected);
 
   // Start a thread for the client.
   // We used to use libevent for this, but we have
@@ -782,9 +905,9 @@ static struct watchman_client *make_new_client(w_stm_t stm) {
   // server architecture.
   if (pthread_create(&thr, &attr, client_thread, client)) {
     // It didn't work out, sorry!
-    pthread_mutex_lock(&w_client_lock);
+    w_clients_lock();
     w_ht_del(clients, w_ht_ptr_val(client));
-    pthread_mutex_unlock(&w_client_lock);
+    w_clients_unlock();
     client_delete(client);
   }
 
@@ -1049,6 +1172,7 @@ bool w_start_listener(const char *path)
   }
 
   w_state_load();
+  w_metrics_start_exporter();
 
 #ifdef HAVE_LIBGIMLI_H
   if (hb) {
@@ -1082,7 +1206,7 @@ bool w_start_listener(const char *path)
     do {
       w_ht_iter_t iter;
 
-      pthread_mutex_lock(&w_client_lock);
+      w_clients_lock();
       n_clients = w_ht_size(clients);
 
       if (w_ht_first(clients, &iter)) do {
@@ -1090,7 +1214,7 @@ bool w_start_listener(const char *path)
         w_event_set(client->ping);
       } while (w_ht_next(clients, &iter));
 
-      pthread_mutex_unlock(&w_client_lock);
+      w_clients_unlock();
 
       if (n_clients != last_count) {
         w_log(W_LOG_ERR, "waiting for %d clients to terminate\n", n_clients);
@@ -1100,6 +1224,7 @@ bool w_start_listener(const char *path)
     } while (n_clients > 0);
   }
 
+  w_state_flush();
   w_root_free_watched_roots();
 
   pthread_join(reaper_thread, &ignored);
@@ -0,0 +1,208 @@
+/* Copyright 2015-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+
+bool w_lockprof_enabled = false;
+
+W_METRIC_HISTOGRAM(root_wait, "lock_root_wait_usec",
+    "Time spent waiting to acquire a root lock", "usec");
+W_METRIC_HISTOGRAM(root_hold, "lock_root_hold_usec",
+    "Time for which a root lock was held", "usec");
+W_METRIC_HISTOGRAM(clients_wait, "lock_clients_wait_usec",
+    "Time spent waiting to acquire the client lock", "usec");
+W_METRIC_HISTOGRAM(clients_hold, "lock_clients_hold_usec",
+    "Time for which the client lock was held", "usec");
+W_METRIC_HISTOGRAM(pending_wait, "lock_pending_wait_usec",
+    "Time spent waiting to acquire a pending collection lock", "usec");
+W_METRIC_HISTOGRAM(pending_hold, "lock_pending_hold_usec",
+    "Time for which a pending collection lock was held", "usec");
+
+struct w_lock_class w_lock_class_root = {
+  "root", &root_wait, &root_hold };
+struct w_lock_class w_lock_class_clients = {
+  "clients", &clients_wait, &clients_hold };
+struct w_lock_class w_lock_class_pending = {
+  "pending", &pending_wait, &pending_hold };
+
+static struct w_lock_class *lock_classes[] = {
+  &w_lock_class_root,
+  &w_lock_class_clients,
+  &w_lock_class_pending,
+};
+
+struct site_stats {
+  const char *site;
+  struct w_lock_class *cls;
+  uint64_t acquisitions;
+  uint64_t wait_usec;
+  uint64_t wait_max_usec;
+  uint64_t holds;
+  uint64_t hold_usec;
+  uint64_t hold_max_usec;
+};
+
+static void del_site(w_ht_val_t val) {
+  free(w_ht_val_ptr(val));
+}
+
+// Keyed by the site tag pointer; each tag is a distinct literal
+static const struct watchman_hash_funcs site_funcs = {
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  del_site
+};
+
+// Protects sites.  Always acquired last, with a profiled lock held
+static pthread_mutex_t site_lock = PTHREAD_MUTEX_INITIALIZER;
+static w_ht_t *sites = NULL;
+
+// Must be called with site_lock held
+static struct site_stats *get_site(struct w_lock_class *cls,
+    const char *site) {
+  struct site_stats *stats;
+
+  if (!sites) {
+    sites = w_ht_new(64, &site_funcs);
+  }
+  stats = w_ht_val_ptr(w_ht_get(sites, w_ht_ptr_val(site)));
+  if (!stats) {
+    stats = calloc(1, sizeof(*stats));
+    if (!stats) {
+      return NULL;
+    }
+    stats->site = site;
+    stats->cls = cls;
+    w_ht_set(sites, w_ht_ptr_val(site), w_ht_ptr_val(stats));
+  }
+  return stats;
+}
+
+void w_lockprof_acquired(struct w_lock_class *cls, struct w_lock_hold *hold,
+    const char *site, uint64_t wait_start) {
+  uint64_t now = w_metric_now_usec();
+  struct site_stats *stats;
+
+  hold->acquired = now;
+  hold->site = site;
+
+  // Re-acquisitions after a condition wait have no meaningful wait time
+  if (!wait_start) {
+    return;
+  }
+
+  w_metric_observe(cls->wait, now - wait_start);
+
+  pthread_mutex_lock(&site_lock);
+  stats = get_site(cls, site);
+  if (stats) {
+    stats->acquisitions++;
+    stats->wait_usec += now - wait_start;
+    stats->wait_max_usec = MAX(stats->wait_max_usec, now - wait_start);
+  }
+  pthread_mutex_unlock(&site_lock);
+}
+
+void w_lockprof_released(struct w_lock_class *cls, struct w_lock_hold *hold) {
+  uint64_t held = w_metric_now_usec() - hold->acquired;
+  struct site_stats *stats;
+
+  hold->acquired = 0;
+  w_metric_observe(cls->hold, held);
+
+  pthread_mutex_lock(&site_lock);
+  stats = get_site(cls, hold->site);
+  if (stats) {
+    stats->holds++;
+    stats->hold_usec += held;
+    stats->hold_max_usec = MAX(stats->hold_max_usec, held);
+  }
+  pthread_mutex_unlock(&site_lock);
+}
+
+void w_lockprof_start(void) {
+  uint32_t i;
+
+  pthread_mutex_lock(&site_lock);
+  if (sites) {
+    w_ht_free_entries(sites);
+  }
+  for (i = 0; i < sizeof(lock_classes) / sizeof(lock_classes[0]); i++) {
+    w_metric_reset(lock_classes[i]->wait);
+    w_metric_reset(lock_classes[i]->hold);
+  }
+  w_lockprof_enabled = true;
+  pthread_mutex_unlock(&site_lock);
+
+  w_log(W_LOG_ERR, "lock profiling enabled\n");
+}
+
+void w_lockprof_stop(void) {
+  w_lockprof_enabled = false;
+  w_log(W_LOG_ERR, "lock profiling disabled\n");
+}
+
+static int compare_hold_usec(const void *a, const void *b) {
+  const struct site_stats *sa = *(struct site_stats**)a;
+  const struct site_stats *sb = *(struct site_stats**)b;
+
+  if (sa->hold_usec != sb->hold_usec) {
+    return sa->hold_usec > sb->hold_usec ? -1 : 1;
+  }
+  return strcmp(sa->site, sb->site);
+}
+
+/* Returns the per-lock histograms along with the max_sites call sites
+ * that held their locks for the longest in total */
+json_t *w_lockprof_to_json(uint32_t max_sites) {
+  json_t *locks = json_object();
+  json_t *top = json_array();
+  struct site_stats **sorted = NULL;
+  uint32_t i, n = 0;
+  w_ht_iter_t iter;
+
+  for (i = 0; i < sizeof(lock_classes) / sizeof(lock_classes[0]); i++) {
+    set_prop(locks, lock_classes[i]->name, json_pack("{s:o, s:o}",
+          "wait", w_metric_to_json(lock_classes[i]->wait),
+          "hold", w_metric_to_json(lock_classes[i]->hold)));
+  }
+
+  pthread_mutex_lock(&site_lock);
+  if (sites && w_ht_size(sites)) {
+    sorted = calloc(w_ht_size(sites), sizeof(*sorted));
+  }
+  if (sorted && w_ht_first(sites, &iter)) do {
+    sorted[n++] = w_ht_val_ptr(iter.value);
+  } while (w_ht_next(sites, &iter));
+
+  if (sorted) {
+    qsort(sorted, n, sizeof(*sorted), compare_hold_usec);
+    for (i = 0; i < n && i < max_sites; i++) {
+      struct site_stats *stats = sorted[i];
+
+      json_array_append_new(top, json_pack(
+            "{s:s, s:s, s:I, s:I, s:I, s:I, s:I, s:I}",
+            "site", stats->site,
+            "lock", stats->cls->name,
+            "acquisitions", (json_int_t)stats->acquisitions,
+            "wait_usec", (json_int_t)stats->wait_usec,
+            "wait_max_usec", (json_int_t)stats->wait_max_usec,
+            "holds", (json_int_t)stats->holds,
+            "hold_usec", (json_int_t)stats->hold_usec,
+            "hold_max_usec", (json_int_t)stats->hold_max_usec));
+    }
+  }
+  pthread_mutex_unlock(&site_lock);
+  free(sorted);
+
+  return json_pack("{s:b, s:o, s:o}",
+      "enabled", w_lockprof_enabled,
+      "locks", locks,
+      "top_sites", top);
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -0,0 +1,368 @@
+/* Copyright 2015-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+
+// Linked via metric->next.  Registration happens from constructors
+// before any threads are started, so readers don't need a lock
+static struct watchman_metric *metrics = NULL;
+
+W_METRIC_GAUGE(rss_bytes, "rss_bytes",
+    "Resident set size of the watchman process");
+
+void w_metric_register(struct watchman_metric *metric) {
+  metric->next = metrics;
+  metrics = metric;
+}
+
+uint64_t w_metric_now_usec(void) {
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+    return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+  }
+#endif
+  {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((uint64_t)tv.tv_sec * 1000000) + tv.tv_usec;
+  }
+}
+
+static uint32_t hist_bucket(uint64_t value) {
+  int e;
+
+  if (value < W_METRIC_HIST_LINEAR) {
+    return (uint32_t)value;
+  }
+  // e is the position of the highest set bit; at least 4
+  e = 63 - __builtin_clzll(value);
+  return W_METRIC_HIST_LINEAR + (e - 4) * W_METRIC_HIST_SUB +
+    (uint32_t)((value >> (e - 2)) & (W_METRIC_HIST_SUB - 1));
+}
+
+// Returns the largest value that maps to the given bucket
+static uint64_t hist_bucket_upper(uint32_t bucket) {
+  uint32_t e, sub;
+  uint64_t lower;
+
+  if (bucket < W_METRIC_HIST_LINEAR) {
+    return bucket;
+  }
+  e = 4 + (bucket - W_METRIC_HIST_LINEAR) / W_METRIC_HIST_SUB;
+  sub = (bucket - W_METRIC_HIST_LINEAR) % W_METRIC_HIST_SUB;
+  lower = (uint64_t)(W_METRIC_HIST_SUB + sub) << (e - 2);
+  return lower + ((uint64_t)1 << (e - 2)) - 1;
+}
+
+void w_metric_observe(struct watchman_metric *metric, uint64_t value) {
+  uint64_t prev;
+
+  __sync_fetch_and_add(&metric->buckets[hist_bucket(value)], 1);
+  __sync_fetch_and_add(&metric->count, 1);
+  __sync_fetch_and_add(&metric->value, (int64_t)value);
+
+  prev = metric->max;
+  while (value > prev) {
+    if (__sync_bool_compare_and_swap(&metric->max, prev, value)) {
+      break;
+    }
+    prev = metric->max;
+  }
+}
+
+// Estimates the value at the given quantile from the buckets.
+// The result is capped by the observed max.
+static uint64_t hist_quantile(struct watchman_metric *metric,
+    uint64_t count, double q) {
+  uint64_t target = (uint64_t)(q * count);
+  uint64_t seen = 0;
+  uint32_t i;
+
+  if (count == 0) {
+    return 0;
+  }
+  if (target == 0) {
+    target = 1;
+  }
+  for (i = 0; i < W_METRIC_HIST_BUCKETS; i++) {
+    seen += metric->buckets[i];
+    if (seen >= target) {
+      uint64_t upper = hist_bucket_upper(i);
+      return upper < metric->max ? upper : metric->max;
+    }
+  }
+  return metric->max;
+}
+
+static const struct {
+  const char *label;
+  double q;
+} quantiles[] = {
+  { "0.5", 0.5 },
+  { "0.9", 0.9 },
+  { "0.99", 0.99 },
+};
+
+static void sample_process_metrics(void) {
+#ifdef __linux__
+  FILE *f = fopen("/proc/self/statm", "r");
+  unsigned long size, resident;
+
+  if (f) {
+    if (fscanf(f, "%lu %lu", &size, &resident) == 2) {
+      w_metric_set(&rss_bytes, (int64_t)resident * sysconf(_SC_PAGESIZE));
+    }
+    fclose(f);
+  }
+#elif !defined(_WIN32)
+  struct rusage ru;
+
+  // Not the current RSS, but the best that is portably available
+  if (getrusage(RUSAGE_SELF, &ru) == 0) {
+# ifdef __APPLE__
+    w_metric_set(&rss_bytes, ru.ru_maxrss);
+# else
+    w_metric_set(&rss_bytes, (int64_t)ru.ru_maxrss * 1024);
+# endif
+  }
+#endif
+}
+
+static const char *type_name(enum w_metric_type type) {
+  switch (type) {
+    case W_METRIC_COUNTER:
+      return "counter";
+    case W_METRIC_GAUGE:
+      return "gauge";
+    case W_METRIC_HISTOGRAM:
+      return "histogram";
+  }
+  return "unknown";
+}
+
+void w_metric_reset(struct watchman_metric *metric) {
+  uint32_t i;
+
+  if (metric->type == W_METRIC_HISTOGRAM) {
+    for (i = 0; i < W_METRIC_HIST_BUCKETS; i++) {
+      metric->buckets[i] = 0;
+    }
+    metric->count = 0;
+    metric->max = 0;
+  }
+  w_metric_set(metric, 0);
+}
+
+json_t *w_metric_to_json(struct watchman_metric *m) {
+  json_t *item = json_pack("{s:s, s:s}",
+      "type", type_name(m->type),
+      "help", m->help);
+
+  if (m->type == W_METRIC_HISTOGRAM) {
+    uint64_t count = m->count;
+    uint32_t q;
+
+    set_prop(item, "unit", json_string_nocheck(m->unit));
+    set_prop(item, "count", json_integer(count));
+    set_prop(item, "sum", json_integer(m->value));
+    set_prop(item, "max", json_integer(m->max));
+    for (q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+      char key[16];
+      snprintf(key, sizeof(key), "p%g", quantiles[q].q * 100);
+      set_prop(item, key,
+          json_integer(hist_quantile(m, count, quantiles[q].q)));
+    }
+  } else {
+    set_prop(item, "value", json_integer(m->value));
+  }
+  return item;
+}
+
+json_t *w_metrics_to_json(void) {
+  struct watchman_metric *m;
+  json_t *res = json_object();
+
+  sample_process_metrics();
+
+  for (m = metrics; m; m = m->next) {
+    set_prop(res, m->name, w_metric_to_json(m));
+  }
+
+  return res;
+}
+
+/* Render the registry in the Prometheus text exposition format.
+ * Histograms are exported as summaries with precomputed quantiles */
+w_string_t *w_metrics_to_prometheus(void) {
+  struct watchman_metric *m;
+  char *buf = NULL;
+  size_t len = 0;
+  FILE *f;
+  w_string_t *res;
+
+  f = open_memstream(&buf, &len);
+  if (!f) {
+    return NULL;
+  }
+
+  sample_process_metrics();
+
+  for (m = metrics; m; m = m->next) {
+    fprintf(f, "# HELP watchman_%s %s\n", m->name, m->help);
+    if (m->type == W_METRIC_HISTOGRAM) {
+      uint64_t count = m->count;
+      uint32_t q;
+
+      fprintf(f, "# TYPE watchman_%s summary\n", m->name);
+      for (q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+        fprintf(f, "watchman_%s{quantile=\"%s\"} %" PRIu64 "\n",
+            m->name, quantiles[q].label,
+            hist_quantile(m, count, quantiles[q].q));
+      }
+      fprintf(f, "watchman_%s_sum %" PRId64 "\n", m->name, m->value);
+      fprintf(f, "watchman_%s_count %" PRIu64 "\n", m->name, count);
+    } else {
+      fprintf(f, "# TYPE watchman_%s %s\n", m->name, type_name(m->type));
+      fprintf(f, "watchman_%s %" PRId64 "\n", m->name, m->value);
+    }
+  }
+
+  fclose(f);
+  res = w_string_new(buf);
+  free(buf);
+  return res;
+}
+
+#ifndef _WIN32
+static void serve_prometheus(int fd) {
+  static const char hdr[] = "HTTP/1.0 200 OK\r\n"
+    "Content-Type: text/plain; version=0.0.4\r\n"
+    "Connection: close\r\n\r\n";
+  struct pollfd pfd;
+  char req[1024];
+  w_string_t *body;
+
+  // Consume the request, if the scraper sends one promptly; we
+  // respond with the same document regardless of what was asked for
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, 1000) == 1) {
+    ignore_result(read(fd, req, sizeof(req)));
+  }
+
+  body = w_metrics_to_prometheus();
+  if (!body) {
+    return;
+  }
+  if (write(fd, hdr, sizeof(hdr) - 1) == (ssize_t)(sizeof(hdr) - 1)) {
+    const char *p = body->buf;
+    uint32_t remaining = body->len;
+
+    while (remaining > 0) {
+      ssize_t n = write(fd, p, remaining);
+      if (n <= 0) {
+        break;
+      }
+      p += n;
+      remaining -= (uint32_t)n;
+    }
+  }
+  w_string_delref(body);
+}
+
+static void *exporter_thread(void *arg) {
+  int listen_fd = (int)(intptr_t)arg;
+
+  w_set_thread_name("metrics");
+
+  for (;;) {
+    int fd = accept(listen_fd, NULL, 0);
+
+    if (fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      w_log(W_LOG_ERR, "metrics_socket: accept: %s\n", strerror(errno));
+      break;
+    }
+    w_set_cloexec(fd);
+    serve_prometheus(fd);
+    close(fd);
+  }
+
+  close(listen_fd);
+  return NULL;
+}
+#endif
+
+/* If the metrics_socket option is set in the global configuration,
+ * serve the Prometheus text format on a unix socket at that path */
+bool w_metrics_start_exporter(void) {
+#ifndef _WIN32
+  const char *path = cfg_get_string(NULL, "metrics_socket", NULL);
+  struct sockaddr_un un;
+  struct stat st;
+  pthread_attr_t attr;
+  pthread_t thr;
+  int fd;
+
+  if (!path) {
+    return true;
+  }
+
+  if (strlen(path) >= sizeof(un.sun_path) - 1) {
+    w_log(W_LOG_ERR, "metrics_socket: %s: path is too long\n", path);
+    return false;
+  }
+
+  // Only replace a socket left behind by an earlier run; the path is
+  // configurable, so don't clobber whatever else might live there
+  if (lstat(path, &st) == 0 && !S_ISSOCK(st.st_mode)) {
+    w_log(W_LOG_ERR, "metrics_socket: %s exists and is not a socket\n",
+        path);
+    return false;
+  }
+
+  fd = socket(PF_LOCAL, SOCK_STREAM, 0);
+  if (fd == -1) {
+    w_log(W_LOG_ERR, "metrics_socket: socket: %s\n", strerror(errno));
+    return false;
+  }
+  w_set_cloexec(fd);
+
+  memset(&un, 0, sizeof(un));
+  un.sun_family = PF_LOCAL;
+  strcpy(un.sun_path, path);
+  unlink(path);
+
+  // Nobody can connect until we listen, so tightening the permissions
+  // in between leaves no window in which others can read the metrics
+  if (bind(fd, (struct sockaddr*)&un, sizeof(un)) != 0 ||
+      chmod(path, 0600) != 0 ||
+      listen(fd, 20) != 0) {
+    w_log(W_LOG_ERR, "metrics_socket: bind/chmod/listen(%s): %s\n",
+        path, strerror(errno));
+    close(fd);
+    return false;
+  }
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&thr, &attr, exporter_thread, (void*)(intptr_t)fd)) {
+    w_log(W_LOG_ERR, "metrics_socket: pthread_create: %s\n",
+        strerror(errno));
+    pthread_attr_destroy(&attr);
+    close(fd);
+    return false;
+  }
+  pthread_attr_destroy(&attr);
+
+  w_log(W_LOG_ERR, "serving prometheus metrics on %s\n", path);
+#endif
+  return true;
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -315,3 +315,56 @@ Client.prototype.end = function() {
   }
   this.bunser = null;
 }
+
+// Convert the `files` member of a query or subscription response that
+// was made with `result_format: 'columns'` into native arrays.
+// Integer columns become BigInt64Arrays where the runtime has them, so
+// that 64-bit values keep their precision.  Elsewhere they become
+// Float64Arrays, and a value that a double can't hold exactly throws.
+// String columns arrive as a string table and are expanded into one
+// value per file; everything else is left as a regular Array.  Returns
+// an object keyed by field name.
+function columnsToArrays(files) {
+  var res = {};
+  Object.keys(files).forEach(function (field) {
+    var values = files[field];
+    if (!Array.isArray(values)) {
+      res[field] = values.index.map(function (i) {
+        return i >= 0 ? values.strings[i] : null;
+      });
+      return;
+    }
+    var isInt = values.length > 0 && values.every(function (v) {
+      return (typeof v === 'number' && v % 1 === 0) ||
+             (v !== null && typeof v === 'object' &&
+              typeof v.toNumber === 'function');
+    });
+    if (!isInt) {
+      res[field] = values;
+      return;
+    }
+    var arr, i, v;
+    if (typeof BigInt64Array !== 'undefined') {
+      arr = new BigInt64Array(values.length);
+      for (i = 0; i < values.length; i++) {
+        v = values[i];
+        arr[i] = typeof v === 'number' ? BigInt(v) :
+          BigInt.asIntN(64, BigInt('0x' + v.toOctetString()));
+      }
+    } else {
+      arr = new Float64Array(values.length);
+      for (i = 0; i < values.length; i++) {
+        v = values[i];
+        arr[i] = typeof v === 'number' ? v : v.toNumber(false);
+        if (!isFinite(arr[i])) {
+          throw new Error('value ' + v + ' of column ' + field +
+                          ' does not fit in a Float64Array');
+        }
+      }
+    }
+    res[field] = arr;
+  });
+  return res;
+}
+
+module.exports.columnsToArrays = columnsToArrays;
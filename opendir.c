@@ -157,6 +157,17 @@ DIR *opendir_nofollow(const char *path)
 #endif
 }
 
+#ifdef HAVE_GETATTRLISTBULK
+static pthread_once_t bulkstat_once = PTHREAD_ONCE_INIT;
+static bool use_bulkstat = true;
+
+// This is a global option, so it is read just once rather than for
+// every directory that we open
+static void read_bulkstat_option(void) {
+  use_bulkstat = cfg_get_bool(NULL, "_use_bulkstat", true);
+}
+#endif
+
 struct watchman_dir_handle *w_dir_open(const char *path) {
   struct watchman_dir_handle *dir = calloc(1, sizeof(*dir));
   int err;
@@ -168,7 +179,8 @@ struct watchman_dir_handle *w_dir_open(const char *path) {
   // This option is here temporarily in case we discover problems with
   // bulkstat and need to disable it.  We will remove this option in
   // a future release of watchman
-  if (cfg_get_bool(NULL, "_use_bulkstat", true)) {
+  pthread_once(&bulkstat_once, read_bulkstat_option);
+  if (use_bulkstat) {
     dir->fd = open_dir_as_fd_no_symlinks(path,
                   O_NOFOLLOW | O_CLOEXEC | O_RDONLY);
     if (dir->fd == -1) {
@@ -3,6 +3,11 @@
 
 #include "watchman.h"
 
+W_METRIC_COUNTER(pending_added, "pending_added_total",
+    "Number of paths added to pending collections");
+W_METRIC_COUNTER(pending_coalesced, "pending_coalesced_total",
+    "Number of pending paths merged with an existing entry");
+
 /* Free a pending_fs node */
 void w_pending_fs_free(struct watchman_pending_fs *p) {
   w_string_delref(p->path);
@@ -13,6 +18,8 @@ void w_pending_fs_free(struct watchman_pending_fs *p) {
 bool w_pending_coll_init(struct watchman_pending_collection *coll) {
   coll->pending = NULL;
   coll->pinged = false;
+  coll->job = NULL;
+  memset(&coll->lock_hold, 0, sizeof(coll->lock_hold));
   coll->pending_uniq = w_ht_new(WATCHMAN_BATCH_LIMIT, &w_ht_string_funcs);
   if (!coll->pending_uniq) {
     return false;
@@ -48,24 +55,26 @@ void w_pending_coll_drain(struct watchman_pending_collection *coll) {
 /* compute a deadline on entry, then obtain the collection lock
  * and wait until the deadline expires or until the collection is
  * pinged.  On Return, the caller owns the collection lock. */
-bool w_pending_coll_lock_and_wait(struct watchman_pending_collection *coll,
-    int timeoutms) {
+bool w_pending_coll_lock_and_wait_at(struct watchman_pending_collection *coll,
+    int timeoutms, const char *site) {
   struct timespec deadline;
   int errcode;
 
   if (timeoutms != -1) {
     w_timeoutms_to_abs_timespec(timeoutms, &deadline);
   }
-  w_pending_coll_lock(coll);
+  w_pending_coll_lock_at(coll, site);
   if (coll->pending || coll->pinged) {
     coll->pinged = false;
     return true;
   }
+  w_lock_hold_exit(&w_lock_class_pending, &coll->lock_hold);
   if (timeoutms == -1) {
     errcode = pthread_cond_wait(&coll->cond, &coll->lock);
   } else {
     errcode = pthread_cond_timedwait(&coll->cond, &coll->lock, &deadline);
   }
+  w_lock_hold_resume(&w_lock_class_pending, &coll->lock_hold, site);
 
   return errcode == 0;
 }
@@ -73,19 +82,28 @@ bool w_pending_coll_lock_and_wait(struct watchman_pending_collection *coll,
 void w_pending_coll_ping(struct watchman_pending_collection *coll) {
   coll->pinged = true;
   pthread_cond_broadcast(&coll->cond);
+  if (coll->job) {
+    w_pool_job_kick(coll->job);
+  }
 }
 
 /* obtain the collection lock */
-void w_pending_coll_lock(struct watchman_pending_collection *coll) {
+void w_pending_coll_lock_at(struct watchman_pending_collection *coll,
+    const char *site) {
+  uint64_t start = w_lockprof_begin();
   int err = pthread_mutex_lock(&coll->lock);
   if (err != 0) {
     w_log(W_LOG_FATAL, "lock assertion: %s\n", strerror(err));
   }
+  w_lock_hold_enter(&w_lock_class_pending, &coll->lock_hold, site, start);
 }
 
 /* release the collection lock */
 void w_pending_coll_unlock(struct watchman_pending_collection *coll) {
-  int err = pthread_mutex_unlock(&coll->lock);
+  int err;
+
+  w_lock_hold_exit(&w_lock_class_pending, &coll->lock_hold);
+  err = pthread_mutex_unlock(&coll->lock);
   if (err != 0) {
     w_log(W_LOG_FATAL, "unlock assertion: %s\n", strerror(err));
   }
@@ -93,12 +111,13 @@ void w_pending_coll_unlock(struct watchman_pending_collection *coll) {
 
 static inline void consolidate_item(struct watchman_pending_fs *p,
     int flags) {
-  // Increase the strength of the pending item if either of these
+  // Increase the strength of the pending item if any of these
   // flags are set.
-  // We upgrade crawl-only as well as recursive; it indicates that
+  // We upgrade crawl-only and rescan as well as recursive; it indicates that
   // we've recently just performed the stat and we want to avoid
   // infinitely trying to stat-and-crawl
-  p->flags |= flags & (W_PENDING_CRAWL_ONLY|W_PENDING_RECURSIVE);
+  p->flags |= flags & (W_PENDING_CRAWL_ONLY|W_PENDING_RECURSIVE|
+      W_PENDING_RESCAN);
 }
 
 /* add a pending entry.  Will consolidate an existing entry with the
@@ -112,6 +131,7 @@ bool w_pending_coll_add(struct watchman_pending_collection *coll,
   if (p) {
     /* Entry already exists: consolidate */
     consolidate_item(p, flags);
+    w_metric_inc(&pending_coalesced);
     /* all done */
     return true;
   }
@@ -131,6 +151,7 @@ bool w_pending_coll_add(struct watchman_pending_collection *coll,
   p->next = coll->pending;
   coll->pending = p;
   w_ht_set(coll->pending_uniq, w_ht_ptr_val(path), w_ht_ptr_val(p));
+  w_metric_inc(&pending_added);
 
   return true;
 }
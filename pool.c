@@ -0,0 +1,430 @@
+/* Copyright 2015-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+
+struct pool_fd {
+  int fd;
+  // NULL once the owning job has disarmed; the poller then frees this
+  struct w_pool_job *job;
+  bool armed;
+  struct pool_fd *next;
+};
+
+struct w_pool_job {
+  const char *name;
+  w_pool_job_func func;
+  w_pool_job_release release;
+  void *arg;
+
+  // All of the following are protected by pool_lock
+  bool queued;
+  bool running;
+  // kicked while running; run again once it returns
+  bool rerun;
+  // the next run was requested by a kick rather than a timer
+  bool kicked;
+  bool retired;
+  // monotonic usec at which to run, or 0
+  uint64_t deadline;
+  // monotonic usec at which it was placed in the run queue
+  uint64_t queued_at;
+  bool in_timers;
+
+  struct w_pool_job *next;
+  struct w_pool_job *timer_next;
+  struct pool_fd *fdreg;
+};
+
+W_METRIC_GAUGE(pool_threads, "pool_threads",
+    "Number of worker threads in the shared pool");
+W_METRIC_COUNTER(pool_runs, "pool_job_runs_total",
+    "Number of times a job was run by the shared pool");
+W_METRIC_HISTOGRAM(pool_queue_delay, "pool_queue_delay_usec",
+    "Time that runnable jobs waited for a free worker", "usec");
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static struct w_pool_job *runq_head = NULL, *runq_tail = NULL;
+static struct w_pool_job *timers = NULL;
+
+// Descriptors multiplexed by the poller thread
+static struct pool_fd *fds = NULL;
+static int poller_wake[2] = { -1, -1 };
+static bool poller_running = false;
+
+// Must be called with pool_lock held
+static void enqueue(struct w_pool_job *job, bool kicked) {
+  if (job->retired) {
+    return;
+  }
+  if (kicked) {
+    job->kicked = true;
+  }
+  if (job->running) {
+    job->rerun = true;
+    return;
+  }
+  if (job->queued) {
+    return;
+  }
+  job->queued = true;
+  job->queued_at = w_metric_now_usec();
+  job->next = NULL;
+  if (runq_tail) {
+    runq_tail->next = job;
+  } else {
+    runq_head = job;
+  }
+  runq_tail = job;
+  pthread_cond_signal(&pool_cond);
+}
+
+// Must be called with pool_lock held
+static void remove_timer(struct w_pool_job *job) {
+  struct w_pool_job **prev;
+
+  if (!job->in_timers) {
+    return;
+  }
+  for (prev = &timers; *prev; prev = &(*prev)->timer_next) {
+    if (*prev == job) {
+      *prev = job->timer_next;
+      break;
+    }
+  }
+  job->in_timers = false;
+  job->deadline = 0;
+}
+
+/* Queues the jobs whose timers have expired and returns the earliest
+ * deadline that remains, or 0 if there are none.
+ * Must be called with pool_lock held */
+static uint64_t fire_timers(void) {
+  uint64_t now = w_metric_now_usec();
+  uint64_t earliest = 0;
+  struct w_pool_job *job, *next;
+
+  for (job = timers; job; job = next) {
+    next = job->timer_next;
+    if (job->running) {
+      // It will reschedule or return to us when it is done
+      continue;
+    }
+    if (job->deadline <= now) {
+      remove_timer(job);
+      enqueue(job, false);
+      continue;
+    }
+    if (earliest == 0 || job->deadline < earliest) {
+      earliest = job->deadline;
+    }
+  }
+  return earliest;
+}
+
+static void wake_poller(void) {
+  char c = 'w';
+
+  if (poller_wake[1] != -1) {
+    ignore_result(write(poller_wake[1], &c, 1));
+  }
+}
+
+// Must be called with pool_lock held
+static void disarm_fd(struct w_pool_job *job) {
+  if (job->fdreg) {
+    job->fdreg->job = NULL;
+    job->fdreg->armed = false;
+    job->fdreg = NULL;
+    wake_poller();
+  }
+}
+
+static void *worker_thread(void *arg) {
+  struct w_pool_job *job;
+  bool kicked, keep;
+  uint64_t queued_at;
+
+  w_set_thread_name("pool %d", (int)(intptr_t)arg);
+
+  pthread_mutex_lock(&pool_lock);
+  for (;;) {
+    job = runq_head;
+    if (!job) {
+      uint64_t deadline = fire_timers();
+
+      if (runq_head) {
+        continue;
+      }
+      if (deadline) {
+        struct timespec ts;
+        uint64_t now = w_metric_now_usec();
+        int ms = deadline > now ? (int)((deadline - now + 999) / 1000) : 0;
+
+        w_timeoutms_to_abs_timespec(ms, &ts);
+        pthread_cond_timedwait(&pool_cond, &pool_lock, &ts);
+      } else {
+        pthread_cond_wait(&pool_cond, &pool_lock);
+      }
+      continue;
+    }
+
+    runq_head = job->next;
+    if (!runq_head) {
+      runq_tail = NULL;
+    }
+    job->queued = false;
+    job->running = true;
+    kicked = job->kicked;
+    job->kicked = false;
+    queued_at = job->queued_at;
+    remove_timer(job);
+    if (job->fdreg && job->fdreg->armed) {
+      // Kicked by something other than the poller; the job will re-arm
+      job->fdreg->armed = false;
+      wake_poller();
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    w_metric_observe_since(&pool_queue_delay, queued_at);
+    w_metric_inc(&pool_runs);
+    keep = job->func(job->arg, kicked);
+
+    pthread_mutex_lock(&pool_lock);
+    job->running = false;
+    if (!keep) {
+      job->retired = true;
+      remove_timer(job);
+      disarm_fd(job);
+      if (job->release) {
+        // The release function may free the job; don't touch it again
+        pthread_mutex_unlock(&pool_lock);
+        job->release(job->arg);
+        pthread_mutex_lock(&pool_lock);
+      }
+    } else if (job->rerun) {
+      job->rerun = false;
+      enqueue(job, false);
+    }
+  }
+  return NULL;
+}
+
+#ifndef _WIN32
+static void *poller_thread(void *arg) {
+  struct pollfd *pfds = NULL;
+  struct pool_fd **regs = NULL;
+  uint32_t alloc = 0, n, i;
+  unused_parameter(arg);
+
+  w_set_thread_name("poller");
+
+  for (;;) {
+    struct pool_fd *reg, **prev;
+    char buf[64];
+
+    pthread_mutex_lock(&pool_lock);
+    n = 1;
+    prev = &fds;
+    while ((reg = *prev) != NULL) {
+      if (!reg->job) {
+        *prev = reg->next;
+        free(reg);
+        continue;
+      }
+      prev = &reg->next;
+      n++;
+    }
+    if (n > alloc) {
+      alloc = n * 2;
+      pfds = realloc(pfds, alloc * sizeof(*pfds));
+      regs = realloc(regs, alloc * sizeof(*regs));
+      if (!pfds || !regs) {
+        w_log(W_LOG_FATAL, "poller: out of memory\n");
+      }
+    }
+    pfds[0].fd = poller_wake[0];
+    pfds[0].events = POLLIN;
+    regs[0] = NULL;
+    n = 1;
+    for (reg = fds; reg; reg = reg->next) {
+      if (!reg->armed) {
+        continue;
+      }
+      pfds[n].fd = reg->fd;
+      pfds[n].events = POLLIN;
+      regs[n] = reg;
+      n++;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (poll(pfds, n, -1) == -1) {
+      if (errno != EINTR) {
+        w_log(W_LOG_ERR, "poller: poll: %s\n", strerror(errno));
+      }
+      continue;
+    }
+
+    if (pfds[0].revents) {
+      while (read(poller_wake[0], buf, sizeof(buf)) > 0) {
+        ;
+      }
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    // regs are only freed by this thread, so they are still valid, but
+    // they may have been disarmed or pointed at a new descriptor
+    for (i = 1; i < n; i++) {
+      reg = regs[i];
+      if (pfds[i].revents && reg->job && reg->armed &&
+          reg->fd == pfds[i].fd) {
+        reg->armed = false;
+        enqueue(reg->job, true);
+      }
+    }
+    pthread_mutex_unlock(&pool_lock);
+  }
+  return NULL;
+}
+#endif
+
+static bool start_thread(void *(*func)(void*), void *arg) {
+  pthread_attr_t attr;
+  pthread_t thr;
+  int err;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  err = pthread_create(&thr, &attr, func, arg);
+  pthread_attr_destroy(&attr);
+
+  if (err) {
+    w_log(W_LOG_ERR, "pool: pthread_create: %s\n", strerror(err));
+    return false;
+  }
+  return true;
+}
+
+static void pool_start(void) {
+  json_int_t size = cfg_get_int(NULL, "thread_pool_size", 0);
+  json_int_t i;
+
+  if (size <= 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+    size = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    size = MAX(size, 2);
+  }
+
+  for (i = 0; i < size; i++) {
+    if (start_thread(worker_thread, (void*)(intptr_t)i)) {
+      w_metric_inc(&pool_threads);
+    }
+  }
+  if (pool_threads.value == 0) {
+    w_log(W_LOG_FATAL, "pool: unable to start any worker threads\n");
+  }
+  w_log(W_LOG_ERR, "started thread pool with %" PRId64 " workers\n",
+      pool_threads.value);
+
+#ifndef _WIN32
+  if (pipe(poller_wake) == 0) {
+    w_set_cloexec(poller_wake[0]);
+    w_set_cloexec(poller_wake[1]);
+    w_set_nonblock(poller_wake[0]);
+    w_set_nonblock(poller_wake[1]);
+    poller_running = start_thread(poller_thread, NULL);
+  } else {
+    w_log(W_LOG_ERR, "pool: pipe: %s\n", strerror(errno));
+  }
+#endif
+}
+
+struct w_pool_job *w_pool_job_new(const char *name, w_pool_job_func func,
+    w_pool_job_release release, void *arg) {
+  struct w_pool_job *job;
+
+  pthread_once(&pool_once, pool_start);
+
+  job = calloc(1, sizeof(*job));
+  if (!job) {
+    return NULL;
+  }
+  job->name = name;
+  job->func = func;
+  job->release = release;
+  job->arg = arg;
+  return job;
+}
+
+void w_pool_job_free(struct w_pool_job *job) {
+  pthread_mutex_lock(&pool_lock);
+  assert(!job->queued && !job->running);
+  remove_timer(job);
+  disarm_fd(job);
+  pthread_mutex_unlock(&pool_lock);
+  free(job);
+}
+
+void w_pool_job_kick(struct w_pool_job *job) {
+  pthread_mutex_lock(&pool_lock);
+  enqueue(job, true);
+  pthread_mutex_unlock(&pool_lock);
+}
+
+void w_pool_job_run_after(struct w_pool_job *job, int timeoutms) {
+  pthread_mutex_lock(&pool_lock);
+  if (!job->retired) {
+    job->deadline = w_metric_now_usec() + ((uint64_t)timeoutms * 1000);
+    if (!job->in_timers) {
+      job->in_timers = true;
+      job->timer_next = timers;
+      timers = job;
+    }
+    // Let an idle worker recompute how long it should sleep
+    pthread_cond_signal(&pool_cond);
+  }
+  pthread_mutex_unlock(&pool_lock);
+}
+
+bool w_pool_job_arm_fd(struct w_pool_job *job, int fd) {
+  struct pool_fd *reg;
+
+  if (!poller_running || fd == -1) {
+    return false;
+  }
+
+  pthread_mutex_lock(&pool_lock);
+  if (job->retired) {
+    pthread_mutex_unlock(&pool_lock);
+    return true;
+  }
+  reg = job->fdreg;
+  if (!reg) {
+    reg = calloc(1, sizeof(*reg));
+    if (!reg) {
+      pthread_mutex_unlock(&pool_lock);
+      return false;
+    }
+    reg->job = job;
+    reg->next = fds;
+    fds = reg;
+    job->fdreg = reg;
+  }
+  reg->fd = fd;
+  reg->armed = true;
+  wake_poller();
+  pthread_mutex_unlock(&pool_lock);
+  return true;
+}
+
+void w_pool_job_disarm_fd(struct w_pool_job *job) {
+  pthread_mutex_lock(&pool_lock);
+  disarm_fd(job);
+  pthread_mutex_unlock(&pool_lock);
+}
+
+/* vim:ts=2:sw=2:et:
+ */
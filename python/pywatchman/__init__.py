@@ -27,6 +27,7 @@
 # OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 import os
+import array
 import errno
 import socket
 import subprocess
@@ -43,6 +44,45 @@ import capabilities
 # 2 bytes marker, 1 byte int size, 8 bytes int64 value
 sniff_len = 13
 
+# Typecode for packed signed 64-bit integer arrays.  Python 2 has no 'q'
+# typecode, and 'l' is only 64-bit on LP64 platforms; where neither is
+# 64-bit, integer columns are decoded into lists instead.
+int64_typecode = None
+for typecode in ('q', 'l'):
+    try:
+        if array.array(typecode).itemsize == 8:
+            int64_typecode = typecode
+            break
+    except ValueError:
+        pass
+
+
+def columns_to_arrays(files):
+    """ Convert a result_format='columns' file list to native arrays
+
+    Each integer column (size, mode, mtime_ms and so on) is packed into
+    an array.array of signed 64-bit values, or a list of ints if this
+    platform has no 64-bit array typecode.  String columns (name, type,
+    oclock and cclock) arrive as a string table and are expanded into
+    one value per file; the remaining columns (exists, new, ...) are
+    returned as plain lists.  The result is a dict keyed by field name.
+    """
+    res = {}
+    for field, values in files.items():
+        if isinstance(values, dict):
+            strings = values['strings']
+            res[field] = [strings[i] if i >= 0 else None
+                          for i in values['index']]
+        elif all(isinstance(v, (int, long)) and not isinstance(v, bool)
+                 for v in values) and len(values) > 0:
+            if int64_typecode is None:
+                res[field] = [int(v) for v in values]
+            else:
+                res[field] = array.array(int64_typecode, values)
+        else:
+            res[field] = list(values)
+    return res
+
 
 class WatchmanError(Exception):
     pass
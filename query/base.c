@@ -27,6 +27,22 @@ static bool eval_not(struct w_query_ctx *ctx,
   return !w_query_expr_evaluate(expr, ctx, file);
 }
 
+static void eval_not_block(struct w_query_ctx *ctx,
+    struct w_query_block *block,
+    const uint64_t *in,
+    uint64_t *out,
+    void *data)
+{
+  w_query_expr *expr = data;
+  uint64_t matched[W_QUERY_BLOCK_WORDS];
+  uint32_t w;
+
+  w_query_expr_evaluate_block(expr, ctx, block, in, matched);
+  for (w = 0; w < W_QUERY_BLOCK_WORDS; w++) {
+    out[w] = in[w] & ~matched[w];
+  }
+}
+
 static w_query_expr *not_parser(w_query *query, json_t *term)
 {
   json_t *other;
@@ -45,7 +61,8 @@ static w_query_expr *not_parser(w_query *query, json_t *term)
     return NULL;
   }
 
-  return w_query_expr_new(eval_not, dispose_expr, other_expr);
+  return w_query_expr_new_with_block(eval_not, eval_not_block, dispose_expr,
+      other_expr);
 }
 W_TERM_PARSER("not", not_parser)
 
@@ -58,11 +75,27 @@ static bool eval_bool(struct w_query_ctx *ctx,
   return data ? true : false;
 }
 
+static void eval_bool_block(struct w_query_ctx *ctx,
+    struct w_query_block *block,
+    const uint64_t *in,
+    uint64_t *out,
+    void *data)
+{
+  uint32_t w;
+
+  unused_parameter(ctx);
+  unused_parameter(block);
+  for (w = 0; w < W_QUERY_BLOCK_WORDS; w++) {
+    out[w] = data ? in[w] : 0;
+  }
+}
+
 static w_query_expr *true_parser(w_query *query, json_t *term)
 {
   unused_parameter(term);
   unused_parameter(query);
-  return w_query_expr_new(eval_bool, NULL, (void*)1);
+  return w_query_expr_new_with_block(eval_bool, eval_bool_block, NULL,
+      (void*)1);
 }
 W_TERM_PARSER("true", true_parser)
 
@@ -70,7 +103,7 @@ static w_query_expr *false_parser(w_query *query, json_t *term)
 {
   unused_parameter(term);
   unused_parameter(query);
-  return w_query_expr_new(eval_bool, NULL, 0);
+  return w_query_expr_new_with_block(eval_bool, eval_bool_block, NULL, 0);
 }
 W_TERM_PARSER("false", false_parser)
 
@@ -97,6 +130,41 @@ static bool eval_list(struct w_query_ctx *ctx,
   return list->allof;
 }
 
+/* Each term is only evaluated over the files that it could still change
+ * the outcome for: for allof, those that every term so far matched, and
+ * for anyof, those that none of them did */
+static void eval_list_block(struct w_query_ctx *ctx,
+    struct w_query_block *block,
+    const uint64_t *in,
+    uint64_t *out,
+    void *data)
+{
+  struct w_expr_list *list = data;
+  uint64_t undecided[W_QUERY_BLOCK_WORDS], matched[W_QUERY_BLOCK_WORDS];
+  uint64_t any;
+  size_t i;
+  uint32_t w;
+
+  memcpy(undecided, in, sizeof(undecided));
+  for (i = 0; i < list->num; i++) {
+    w_query_expr_evaluate_block(list->exprs[i], ctx, block, undecided,
+        matched);
+
+    any = 0;
+    for (w = 0; w < W_QUERY_BLOCK_WORDS; w++) {
+      undecided[w] = list->allof ? matched[w] : undecided[w] & ~matched[w];
+      any |= undecided[w];
+    }
+    if (!any) {
+      break;
+    }
+  }
+
+  for (w = 0; w < W_QUERY_BLOCK_WORDS; w++) {
+    out[w] = list->allof ? undecided[w] : in[w] & ~undecided[w];
+  }
+}
+
 static void dispose_list(void *data)
 {
   struct w_expr_list *list = data;
@@ -147,7 +215,8 @@ static w_query_expr *parse_list(w_query *query, json_t *term, bool allof)
     list->exprs[i] = parsed;
   }
 
-  return w_query_expr_new(eval_list, dispose_list, list);
+  return w_query_expr_new_with_block(eval_list, eval_list_block,
+      dispose_list, list);
 }
 
 static w_query_expr *anyof_parser(w_query *query, json_t *term)
@@ -0,0 +1,187 @@
+/* Copyright 2015-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+
+/* A cache of parsed queries.
+ *
+ * Tools tend to issue the same few queries over and over, differing
+ * only in their since clock, and parsing them can be costly: regex
+ * terms compile a pattern and name terms with long lists build a hash
+ * table.  So queries are parsed without their since and kept, keyed by
+ * the number of the root and the text of the query spec with its keys
+ * sorted and since left out.  Each request gets its own copy of the
+ * kept query with its own since, sharing the parsed expression.
+ *
+ * The query_cache_size option bounds how many are kept; the least
+ * recently used is dropped to make room.  Expressions are only ever
+ * evaluated with their root locked, so a shared one is never in use by
+ * two threads at once. */
+
+W_METRIC_COUNTER(query_cache_hits, "query_cache_hits_total",
+    "Number of queries whose parse was reused from the query cache");
+W_METRIC_COUNTER(query_cache_misses, "query_cache_misses_total",
+    "Number of queries that were parsed and added to the query cache");
+W_METRIC_GAUGE(query_cache_entries, "query_cache_entries",
+    "Number of parsed queries held in the query cache");
+
+struct cache_entry {
+  w_string_t *key;
+  w_query *query;
+  // in order of use, most recent first
+  struct cache_entry *prev, *next;
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static w_ht_t *cache = NULL;
+static struct cache_entry *most_recent = NULL, *least_recent = NULL;
+
+static void unlink_entry(struct cache_entry *entry)
+{
+  if (entry->prev) {
+    entry->prev->next = entry->next;
+  } else {
+    most_recent = entry->next;
+  }
+  if (entry->next) {
+    entry->next->prev = entry->prev;
+  } else {
+    least_recent = entry->prev;
+  }
+  entry->prev = entry->next = NULL;
+}
+
+static void link_entry(struct cache_entry *entry)
+{
+  entry->next = most_recent;
+  entry->prev = NULL;
+  if (most_recent) {
+    most_recent->prev = entry;
+  } else {
+    least_recent = entry;
+  }
+  most_recent = entry;
+}
+
+// Returns a new ref to the kept query for key, if any
+static w_query *lookup(w_string_t *key)
+{
+  struct cache_entry *entry;
+  w_query *query = NULL;
+
+  pthread_mutex_lock(&cache_lock);
+  if (cache) {
+    entry = w_ht_val_ptr(w_ht_get(cache, w_ht_ptr_val(key)));
+    if (entry) {
+      unlink_entry(entry);
+      link_entry(entry);
+      query = entry->query;
+      w_refcnt_add(&query->refcnt);
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return query;
+}
+
+static void insert(w_string_t *key, w_query *query, uint32_t capacity)
+{
+  struct cache_entry *entry;
+
+  pthread_mutex_lock(&cache_lock);
+  if (!cache) {
+    cache = w_ht_new(capacity, &w_ht_string_funcs);
+  }
+  // Another client may have got there first
+  if (!cache || w_ht_get(cache, w_ht_ptr_val(key))) {
+    pthread_mutex_unlock(&cache_lock);
+    return;
+  }
+
+  entry = calloc(1, sizeof(*entry));
+  if (!entry) {
+    pthread_mutex_unlock(&cache_lock);
+    return;
+  }
+  entry->key = key;
+  w_string_addref(key);
+  entry->query = query;
+  w_refcnt_add(&query->refcnt);
+  w_ht_set(cache, w_ht_ptr_val(key), w_ht_ptr_val(entry));
+  link_entry(entry);
+  w_metric_inc(&query_cache_entries);
+
+  while (w_ht_size(cache) > capacity) {
+    struct cache_entry *victim = least_recent;
+
+    unlink_entry(victim);
+    w_ht_del(cache, w_ht_ptr_val(victim->key));
+    w_string_delref(victim->key);
+    w_query_delref(victim->query);
+    free(victim);
+    w_metric_dec(&query_cache_entries);
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+// The key for query, a copy of the query spec without its since
+static w_string_t *make_key(w_root_t *root, json_t *shape)
+{
+  w_string_t *key;
+  char *text;
+
+  text = json_dumps(shape, JSON_COMPACT | JSON_SORT_KEYS);
+  if (!text) {
+    return NULL;
+  }
+  key = w_string_make_printf("%" PRIu32 ":%s", root->number, text);
+  free(text);
+  return key;
+}
+
+w_query *w_query_parse_cached(w_root_t *root, json_t *query, char **errmsg)
+{
+  json_int_t capacity = cfg_get_int(NULL, "query_cache_size", 256);
+  json_t *shape;
+  w_string_t *key;
+  w_query *tmpl, *res;
+
+  if (capacity <= 0 || !json_is_object(query)) {
+    return w_query_parse(root, query, errmsg);
+  }
+
+  shape = json_copy(query);
+  if (!shape) {
+    return w_query_parse(root, query, errmsg);
+  }
+  json_object_del(shape, "since");
+
+  key = make_key(root, shape);
+  if (!key) {
+    // It can't be printed, e.g. because it has binary strings
+    json_decref(shape);
+    return w_query_parse(root, query, errmsg);
+  }
+
+  tmpl = lookup(key);
+  if (tmpl) {
+    w_metric_inc(&query_cache_hits);
+  } else {
+    tmpl = w_query_parse(root, shape, errmsg);
+    if (!tmpl) {
+      json_decref(shape);
+      w_string_delref(key);
+      return NULL;
+    }
+    w_metric_inc(&query_cache_misses);
+    insert(key, tmpl, (uint32_t)MIN(capacity, UINT32_MAX));
+  }
+  json_decref(shape);
+  w_string_delref(key);
+
+  res = w_query_clone_with_since(tmpl, query, errmsg);
+  w_query_delref(tmpl);
+  return res;
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -13,11 +13,24 @@ static bool eval_exists(struct w_query_ctx *ctx,
   return file->exists;
 }
 
+static void eval_exists_block(struct w_query_ctx *ctx,
+    struct w_query_block *block,
+    const uint64_t *in,
+    uint64_t *out,
+    void *data)
+{
+  unused_parameter(ctx);
+  unused_parameter(data);
+
+  w_query_block_select(block, block->exists, in, out);
+}
+
 static w_query_expr *exists_parser(w_query *query, json_t *term)
 {
   unused_parameter(query);
   unused_parameter(term);
-  return w_query_expr_new(eval_exists, NULL, NULL);
+  return w_query_expr_new_with_block(eval_exists, eval_exists_block, NULL,
+      NULL);
 }
 W_TERM_PARSER("exists", exists_parser)
 
@@ -39,11 +52,32 @@ static bool eval_empty(struct w_query_ctx *ctx,
   return false;
 }
 
+static void eval_empty_block(struct w_query_ctx *ctx,
+    struct w_query_block *block,
+    const uint64_t *in,
+    uint64_t *out,
+    void *data)
+{
+  uint8_t sel[W_QUERY_BLOCK_SIZE];
+  uint32_t i;
+
+  unused_parameter(ctx);
+  unused_parameter(data);
+
+  for (i = 0; i < block->num; i++) {
+    sel[i] = block->exists[i] &
+      (block->fmt[i] == S_IFDIR || block->fmt[i] == S_IFREG) &
+      (block->size[i] == 0);
+  }
+  w_query_block_select(block, sel, in, out);
+}
+
 static w_query_expr *empty_parser(w_query *query, json_t *term)
 {
   unused_parameter(query);
   unused_parameter(term);
-  return w_query_expr_new(eval_empty, NULL, NULL);
+  return w_query_expr_new_with_block(eval_empty, eval_empty_block, NULL,
+      NULL);
 }
 W_TERM_PARSER("empty", empty_parser)
 
@@ -5,6 +5,20 @@
 
 /* Query evaluator */
 
+W_METRIC_HISTOGRAM(query_duration, "query_duration_usec",
+    "Time taken to execute queries, including sync", "usec");
+W_METRIC_HISTOGRAM(query_results, "query_results",
+    "Number of files matched per query", "files");
+W_METRIC_COUNTER(query_index_scans, "query_index_scans_total",
+    "Number of queries whose files were generated from an ordered index");
+W_METRIC_COUNTER(query_limit_stops, "query_limit_stops_total",
+    "Number of queries whose generation stopped early at their limit");
+W_METRIC_COUNTER(query_blocks, "query_blocks_total",
+    "Number of blocks of candidate files evaluated by queries");
+W_METRIC_COUNTER(query_block_fallbacks, "query_block_fallbacks_total",
+    "Number of times a term with no block evaluator was evaluated over a "
+    "block a file at a time");
+
 bool w_query_expr_evaluate(
     w_query_expr *expr,
     struct w_query_ctx *ctx,
@@ -41,49 +55,186 @@ w_string_t *w_query_ctx_get_wholename(
   return ctx->wholename;
 }
 
-bool w_query_process_file(
-    w_query *query,
-    struct w_query_ctx *ctx,
-    struct watchman_file *file)
+static void set_ctx_file(struct w_query_ctx *ctx, struct watchman_file *file)
 {
-  struct watchman_rule_match *m;
-
+  if (ctx->file == file) {
+    return;
+  }
   if (ctx->wholename) {
     w_string_delref(ctx->wholename);
     ctx->wholename = NULL;
   }
   ctx->file = file;
+}
 
-  // For fresh instances, only return files that currently exist.
-  if (!ctx->since.is_timestamp && ctx->since.clock.is_fresh_instance &&
-      !file->exists) {
-    return true;
+void w_query_block_select(const struct w_query_block *block,
+    const uint8_t *sel, const uint64_t *in, uint64_t *out)
+{
+  uint64_t bits[W_QUERY_BLOCK_WORDS];
+  uint32_t i, w;
+
+  memset(bits, 0, sizeof(bits));
+  for (i = 0; i < block->num; i++) {
+    bits[i / 64] |= (uint64_t)(sel[i] != 0) << (i % 64);
   }
+  for (w = 0; w < W_QUERY_BLOCK_WORDS; w++) {
+    out[w] = in[w] & bits[w];
+  }
+}
 
-  // We produce an output for this file if there is no expression,
-  // or if the expression matched.
-  if (query->expr && !w_query_expr_evaluate(query->expr, ctx, file)) {
-    // No matched
-    return true;
+/* in and out must not be the same array, as out is cleared before
+ * terms without a block evaluator look at in */
+void w_query_expr_evaluate_block(
+    w_query_expr *expr,
+    struct w_query_ctx *ctx,
+    struct w_query_block *block,
+    const uint64_t *in,
+    uint64_t *out)
+{
+  uint32_t i;
+
+  if (expr->evaluate_block) {
+    expr->evaluate_block(ctx, block, in, out, expr->data);
+    return;
   }
 
-  // Need more room?
-  if (ctx->num_results + 1 > ctx->num_allocd) {
-    uint32_t new_num = ctx->num_allocd ? ctx->num_allocd * 2 : 64;
-    struct watchman_rule_match *res;
+  w_metric_inc(&query_block_fallbacks);
+  memset(out, 0, W_QUERY_BLOCK_WORDS * sizeof(*out));
+  for (i = 0; i < block->num; i++) {
+    if (!(in[i / 64] >> (i % 64) & 1)) {
+      continue;
+    }
+    set_ctx_file(ctx, block->files[i]);
+    if (expr->evaluate(ctx, block->files[i], expr->data)) {
+      out[i / 64] |= 1ULL << (i % 64);
+    }
+  }
+}
 
-    res = realloc(ctx->results, new_num * sizeof(*res));
-    if (!res) {
-      w_log(W_LOG_ERR, "out of memory while capturing matches!\n");
-      return false;
+/* Result ordering.
+ *
+ * When a query has a limit as well as an order, the results captured so
+ * far are kept as a binary heap whose top is the one that sorts last,
+ * so that a further match need only be compared with that one to know
+ * whether it makes the cut.  The results are sorted in place once
+ * generation is done. */
+
+static int compare_keys(int64_t a, int64_t b)
+{
+  return a < b ? -1 : a > b ? 1 : 0;
+}
+
+// Whether a sorts before (< 0) or after (> 0) b in the query's order
+static int compare_results(w_query *query,
+    const struct watchman_rule_match *a, const struct watchman_rule_match *b)
+{
+  int res;
+
+  switch (query->order_by) {
+    case W_QUERY_ORDER_OTIME:
+      res = compare_keys(a->file->otime.ticks, b->file->otime.ticks);
+      break;
+    case W_QUERY_ORDER_MTIME:
+      res = compare_keys(a->file->stat.mtime.tv_sec,
+          b->file->stat.mtime.tv_sec);
+      if (!res) {
+        res = compare_keys(a->file->stat.mtime.tv_nsec,
+            b->file->stat.mtime.tv_nsec);
+      }
+      break;
+    case W_QUERY_ORDER_SIZE:
+      res = compare_keys(a->file->stat.size, b->file->stat.size);
+      break;
+    case W_QUERY_ORDER_NAME:
+      res = w_string_compare(a->relname, b->relname);
+      break;
+    default:
+      res = 0;
+  }
+  return query->order_desc ? -res : res;
+}
+
+static void swap_results(struct watchman_rule_match *results,
+    uint32_t i, uint32_t j)
+{
+  struct watchman_rule_match tmp = results[i];
+
+  results[i] = results[j];
+  results[j] = tmp;
+}
+
+static void sift_up(w_query *query, struct watchman_rule_match *results,
+    uint32_t i)
+{
+  while (i > 0) {
+    uint32_t parent = (i - 1) / 2;
+
+    if (compare_results(query, &results[parent], &results[i]) >= 0) {
+      break;
     }
+    swap_results(results, parent, i);
+    i = parent;
+  }
+}
 
-    ctx->results = res;
-    ctx->num_allocd = new_num;
+static void sift_down(w_query *query, struct watchman_rule_match *results,
+    uint32_t i, uint32_t n)
+{
+  for (;;) {
+    uint32_t last = i, l = 2 * i + 1, r = 2 * i + 2;
+
+    if (l < n && compare_results(query, &results[l], &results[last]) > 0) {
+      last = l;
+    }
+    if (r < n && compare_results(query, &results[r], &results[last]) > 0) {
+      last = r;
+    }
+    if (last == i) {
+      return;
+    }
+    swap_results(results, i, last);
+    i = last;
   }
+}
 
-  m = &ctx->results[ctx->num_results++];
+static void sort_results(w_query *query, struct w_query_ctx *ctx)
+{
+  uint32_t i, n = ctx->num_results;
+
+  if (!query->order_by || n < 2) {
+    return;
+  }
 
+  // With a limit, the results are already a heap
+  if (!query->limit) {
+    for (i = n / 2; i-- > 0; ) {
+      sift_down(query, ctx->results, i, n);
+    }
+  }
+  for (i = n - 1; i > 0; i--) {
+    swap_results(ctx->results, 0, i);
+    sift_down(query, ctx->results, 0, i);
+  }
+}
+
+// Whether no further file could make it into the results
+static bool limit_reached(struct w_query_ctx *ctx)
+{
+  w_query *query = ctx->query;
+
+  if (!query->limit || ctx->num_results < query->limit) {
+    return false;
+  }
+  // Unordered, any matches will do; and when the latest are wanted and
+  // the files are produced latest first, so will the first ones
+  return query->order_by == W_QUERY_ORDER_NONE ||
+    (query->order_by == W_QUERY_ORDER_OTIME && query->order_desc &&
+     ctx->otime_order);
+}
+
+static bool fill_result(struct w_query_ctx *ctx,
+    struct watchman_rule_match *m, struct watchman_file *file)
+{
   m->root_number = ctx->root->number;
   m->relname = w_query_ctx_get_wholename(ctx);
   if (!m->relname) {
@@ -104,6 +255,143 @@ bool w_query_process_file(
   return true;
 }
 
+static bool add_result(struct w_query_ctx *ctx, struct watchman_file *file)
+{
+  w_query *query = ctx->query;
+  bool heap = query->order_by && query->limit;
+
+  if (!heap && query->limit && ctx->num_results == query->limit) {
+    return true;
+  }
+
+  set_ctx_file(ctx, file);
+
+  // When there are already enough results, this one must displace the
+  // one that sorts last
+  if (heap && ctx->num_results == query->limit) {
+    struct watchman_rule_match cand;
+
+    cand.file = file;
+    cand.relname = NULL;
+    if (query->order_by == W_QUERY_ORDER_NAME) {
+      cand.relname = w_query_ctx_get_wholename(ctx);
+      if (!cand.relname) {
+        w_log(W_LOG_ERR, "out of memory while capturing matches!\n");
+        return false;
+      }
+    }
+    if (compare_results(query, &cand, &ctx->results[0]) >= 0) {
+      return true;
+    }
+
+    w_string_delref(ctx->results[0].relname);
+    if (!fill_result(ctx, &ctx->results[0], file)) {
+      return false;
+    }
+    sift_down(query, ctx->results, 0, ctx->num_results);
+    return true;
+  }
+
+  // Need more room?
+  if (ctx->num_results + 1 > ctx->num_allocd) {
+    uint32_t new_num = ctx->num_allocd ? ctx->num_allocd * 2 : 64;
+    struct watchman_rule_match *res;
+
+    if (query->limit && new_num > query->limit) {
+      new_num = query->limit;
+    }
+    res = realloc(ctx->results, new_num * sizeof(*res));
+    if (!res) {
+      w_log(W_LOG_ERR, "out of memory while capturing matches!\n");
+      return false;
+    }
+
+    ctx->results = res;
+    ctx->num_allocd = new_num;
+  }
+
+  if (!fill_result(ctx, &ctx->results[ctx->num_results++], file)) {
+    return false;
+  }
+  if (heap) {
+    sift_up(query, ctx->results, ctx->num_results - 1);
+  }
+
+  return true;
+}
+
+/* Evaluates the expression over the pending block of candidates and
+ * captures those that match, in the order they were generated */
+static bool evaluate_block(w_query *query, struct w_query_ctx *ctx)
+{
+  struct w_query_block *block = ctx->block;
+  uint64_t in[W_QUERY_BLOCK_WORDS], out[W_QUERY_BLOCK_WORDS];
+  bool result = true;
+  uint32_t i;
+
+  if (!block->num) {
+    return true;
+  }
+  w_metric_inc(&query_blocks);
+
+  memset(in, 0, sizeof(in));
+  for (i = 0; i < block->num; i++) {
+    struct watchman_file *file = block->files[i];
+
+    block->exists[i] = file->exists;
+    block->fmt[i] = file->stat.mode & S_IFMT;
+    block->size[i] = file->stat.size;
+    in[i / 64] |= 1ULL << (i % 64);
+  }
+
+  // For fresh instances, only return files that currently exist.
+  if (!ctx->since.is_timestamp && ctx->since.clock.is_fresh_instance) {
+    w_query_block_select(block, block->exists, in, in);
+  }
+
+  // We produce an output for a file if there is no expression,
+  // or if the expression matched.
+  if (query->expr) {
+    w_query_expr_evaluate_block(query->expr, ctx, block, in, out);
+  } else {
+    memcpy(out, in, sizeof(out));
+  }
+
+  for (i = 0; i < block->num; i++) {
+    if (!(out[i / 64] >> (i % 64) & 1)) {
+      continue;
+    }
+    if (!add_result(ctx, block->files[i])) {
+      result = false;
+      break;
+    }
+    // Tell the generators to stop
+    if (limit_reached(ctx)) {
+      w_metric_inc(&query_limit_stops);
+      result = false;
+      break;
+    }
+  }
+  block->num = 0;
+  return result;
+}
+
+/* Files are not evaluated as they are generated, but gathered into
+ * blocks that are evaluated together */
+bool w_query_process_file(
+    w_query *query,
+    struct w_query_ctx *ctx,
+    struct watchman_file *file)
+{
+  struct w_query_block *block = ctx->block;
+
+  block->files[block->num++] = file;
+  if (block->num == W_QUERY_BLOCK_SIZE) {
+    return evaluate_block(query, ctx);
+  }
+  return true;
+}
+
 void w_match_results_free(uint32_t num_matches,
     struct watchman_rule_match *matches)
 {
@@ -131,6 +419,70 @@ bool w_query_file_matches_relative_root(
     || w_string_startswith(parent_path, ctx->query->relative_root_slash);
 }
 
+// Whether the Bloom filter of dir allows that a file below it matches
+// the query's expression
+static bool bloom_may_match(struct w_query_ctx *ctx, struct watchman_dir *dir)
+{
+  w_query *query = ctx->query;
+
+  if (!query->use_bloom) {
+    return true;
+  }
+  return w_bloom_dir_may_contain(ctx->root, dir, query->bloom_keys,
+      query->num_bloom_keys);
+}
+
+static bool changed_in_dir(
+    w_query *query,
+    struct w_query_ctx *ctx,
+    struct watchman_dir *dir,
+    uint32_t min_ticks)
+{
+  w_ht_iter_t i;
+
+  if (dir->summary.max_ticks < min_ticks || !bloom_may_match(ctx, dir)) {
+    return true;
+  }
+
+  if (w_ht_first(dir->files, &i)) do {
+    struct watchman_file *file = w_ht_val_ptr(i.value);
+
+    if (file->otime.ticks >= min_ticks &&
+        !w_query_process_file(query, ctx, file)) {
+      return false;
+    }
+  } while (w_ht_next(dir->files, &i));
+
+  if (w_ht_first(dir->dirs, &i)) do {
+    struct watchman_dir *child = w_ht_val_ptr(i.value);
+
+    if (!changed_in_dir(query, ctx, child, min_ticks)) {
+      return false;
+    }
+  } while (w_ht_next(dir->dirs, &i));
+
+  return true;
+}
+
+/* When a query is scoped to a relative root, walking the part of the
+ * tree below it costs in proportion to the dirs that have changed
+ * there, rather than to everything that has changed in the root */
+bool w_query_process_relative_root_changes(
+    w_query *query,
+    w_root_t *root,
+    struct w_query_ctx *ctx,
+    uint32_t min_ticks)
+{
+  struct watchman_dir *dir;
+
+  dir = w_root_resolve_dir(root, query->relative_root, false);
+  if (!dir) {
+    // Nothing has ever been there
+    return true;
+  }
+  return changed_in_dir(query, ctx, dir, min_ticks);
+}
+
 static bool time_generator(
     w_query *query,
     w_root_t *root,
@@ -138,6 +490,11 @@ static bool time_generator(
 {
   struct watchman_file *f;
 
+  if (!ctx->since.is_timestamp && query->relative_root) {
+    return w_query_process_relative_root_changes(query, root, ctx,
+        ctx->since.clock.ticks);
+  }
+
   // Walk back in time until we hit the boundary
   for (f = root->latest_file; f; f = f->next) {
     if (ctx->since.is_timestamp &&
@@ -161,30 +518,92 @@ static bool time_generator(
   return true;
 }
 
+/* Generates the files in bucket; if filter is set, only those whose
+ * names end in .filter */
+static bool bucket_generator(
+    w_query *query,
+    struct w_query_ctx *ctx,
+    struct w_suffix_bucket *bucket,
+    w_string_t *filter)
+{
+  uint32_t i;
+
+  for (i = 0; bucket && i < bucket->len; i++) {
+    struct watchman_file *f = bucket->files[i];
+
+    if (!f) {
+      continue;
+    }
+    if (filter && !w_string_suffix_match(f->name, filter)) {
+      continue;
+    }
+    if (!w_query_file_matches_relative_root(ctx, f)) {
+      continue;
+    }
+
+    if (!w_query_process_file(query, ctx, f)) {
+      return false;
+    }
+  }
+  return true;
+}
+
 static bool suffix_generator(
     w_query *query,
     w_root_t *root,
     struct w_query_ctx *ctx)
 {
-  uint32_t i;
-  struct watchman_file *f;
+  uint32_t i, j;
 
   for (i = 0; i < query->nsuffixes; i++) {
-    // Head of suffix index for this suffix
-    f = w_ht_val_ptr(w_ht_get(root->suffixes,
-          w_ht_ptr_val(query->suffixes[i])));
-
+    w_string_t *suffix = query->suffixes[i];
+    w_string_t *last;
+    bool indexed = false;
+    int dot;
+
+    for (dot = (int)suffix->len - 1; dot >= 0; dot--) {
+      if (suffix->buf[dot] == '.') {
+        break;
+      }
+    }
+    if (dot < 0) {
+      if (!bucket_generator(query, ctx,
+            w_root_suffix_bucket(root, suffix), NULL)) {
+        return false;
+      }
+      continue;
+    }
 
-    // Walk and process
-    for (; f; f = f->suffix_next) {
-      if (!w_query_file_matches_relative_root(ctx, f)) {
-        continue;
+    /* A multi-part suffix has a bucket of its own if it is one of the
+     * indexed_suffixes; the files ending in a longer one that ends in
+     * it are in the bucket of that one instead */
+    for (j = 0; j < root->num_compound_suffixes; j++) {
+      if (w_string_equal(root->compound_suffixes[j], suffix)) {
+        indexed = true;
       }
+    }
+    for (j = 0; indexed && j < root->num_compound_suffixes; j++) {
+      w_string_t *compound = root->compound_suffixes[j];
 
-      if (!w_query_process_file(query, ctx, f)) {
+      if ((w_string_equal(compound, suffix) ||
+            w_string_suffix_match(compound, suffix)) &&
+          !bucket_generator(query, ctx,
+            w_root_suffix_bucket(root, compound), NULL)) {
         return false;
       }
     }
+    if (indexed) {
+      continue;
+    }
+
+    // Otherwise pick them out of the bucket of its last part
+    last = w_string_slice(suffix, dot + 1, suffix->len - (dot + 1));
+    if (!bucket_generator(query, ctx, w_root_suffix_bucket(root, last),
+          suffix)) {
+      w_string_delref(last);
+      return false;
+    }
+    w_string_delref(last);
   }
   return true;
 }
@@ -208,6 +627,45 @@ static bool all_files_generator(
   return true;
 }
 
+/* Generates the files whose indexed field lies in the range that the
+ * query's expression implies, rather than all of them */
+static bool index_generator(
+    w_query *query,
+    w_root_t *root,
+    struct w_query_ctx *ctx,
+    w_skiplist_t *index)
+{
+  struct w_skiplist_node *node;
+  int64_t min = query->index_min;
+
+  if (query->index_since) {
+    struct w_query_since since;
+
+    w_clockspec_eval(root, query->index_since, &since);
+    if (since.is_timestamp || since.clock.is_fresh_instance) {
+      // Every file that exists matches
+      return all_files_generator(query, root, ctx);
+    }
+    min = MAX(min, (int64_t)since.clock.ticks + 1);
+  }
+
+  w_metric_inc(&query_index_scans);
+  for (node = w_skiplist_seek(index, min);
+      node && w_skiplist_key(node) <= query->index_max;
+      node = w_skiplist_next(node)) {
+    struct watchman_file *f = w_skiplist_val(node);
+
+    if (!w_query_file_matches_relative_root(ctx, f)) {
+      continue;
+    }
+
+    if (!w_query_process_file(query, ctx, f)) {
+      return false;
+    }
+  }
+  return true;
+}
+
 static bool dir_generator(
     w_query *query,
     w_root_t *root,
@@ -216,6 +674,7 @@ static bool dir_generator(
     uint32_t depth)
 {
   w_ht_iter_t i;
+  uint32_t walked = 0;
 
   if (w_ht_first(dir->files, &i)) do {
     struct watchman_file *file = w_ht_val_ptr(i.value);
@@ -228,11 +687,22 @@ static bool dir_generator(
   if (depth > 0 && w_ht_first(dir->dirs, &i)) do {
     struct watchman_dir *child = w_ht_val_ptr(i.value);
 
+    if (!bloom_may_match(ctx, child)) {
+      continue;
+    }
+    walked++;
     if (!dir_generator(query, root, ctx, child, depth - 1)) {
       return false;
     }
   } while (w_ht_next(dir->dirs, &i));
 
+  // If the filters of all of the child dirs ruled them out, we can tell
+  // whether this dir's filter was right to let us in
+  if (query->use_bloom && root->config.bloom_bits_per_file && !walked &&
+      (depth > 0 || !dir->dirs || !w_ht_size(dir->dirs))) {
+    w_bloom_dir_walked(dir, query->bloom_keys, query->num_bloom_keys);
+  }
+
   return true;
 }
 
@@ -309,8 +779,8 @@ static bool path_generator(
     w_string_delref(full_name);
 is_dir:
     // We got a dir; process recursively to specified depth
-    if (dir && !dir_generator(query, root, ctx, dir,
-          query->paths[i].depth)) {
+    if (dir && bloom_may_match(ctx, dir) &&
+        !dir_generator(query, root, ctx, dir, query->paths[i].depth)) {
       return false;
     }
   }
@@ -325,11 +795,18 @@ static bool default_generators(
     void *gendata)
 {
   bool generated = false;
+  bool time_based = ctx->since.is_timestamp ||
+    !ctx->since.clock.is_fresh_instance;
 
   unused_parameter(gendata);
 
+  // Walks of the whole recency list produce the files most recently
+  // changed first, as long as there is no other generator to follow
+  ctx->otime_order = !query->suffixes && !query->npaths &&
+    !(time_based && !ctx->since.is_timestamp && query->relative_root);
+
   // Time based query
-  if (ctx->since.is_timestamp || !ctx->since.clock.is_fresh_instance) {
+  if (time_based) {
     if (!time_generator(query, root, ctx)) {
       return false;
     }
@@ -354,7 +831,17 @@ static bool default_generators(
   // And finally, if there were no other generators, we walk all known
   // files
   if (!generated) {
-    if (!all_files_generator(query, root, ctx)) {
+    w_skiplist_t *index = NULL;
+
+    if (query->use_index) {
+      index = w_root_get_index(root, query->index_field);
+    }
+    if (index) {
+      ctx->otime_order = false;
+      if (!index_generator(query, root, ctx, index)) {
+        return false;
+      }
+    } else if (!all_files_generator(query, root, ctx)) {
       return false;
     }
   }
@@ -378,6 +865,9 @@ bool w_query_execute(
     void *gendata)
 {
   struct w_query_ctx ctx;
+  uint64_t start = w_metric_now_usec();
+  uint64_t span = w_trace_begin();
+  uint64_t phase;
 
   memset(&ctx, 0, sizeof(ctx));
   ctx.query = query;
@@ -385,12 +875,32 @@ bool w_query_execute(
 
   memset(res, 0, sizeof(*res));
 
-  if (query->sync_timeout && !w_root_sync_to_now(root, query->sync_timeout)) {
-    ignore_result(asprintf(&res->errmsg, "synchronization failed: %s\n",
-        strerror(errno)));
+  ctx.block = calloc(1, sizeof(*ctx.block));
+  if (!ctx.block) {
+    res->errmsg = strdup("out of memory");
     return false;
   }
 
+  if (query->sync_timeout) {
+    struct watchman_sync sync;
+    struct timespec deadline;
+
+    if (!w_root_sync_begin(root, &sync)) {
+      ignore_result(asprintf(&res->errmsg, "synchronization failed: %s\n",
+          strerror(errno)));
+      free(ctx.block);
+      return false;
+    }
+    w_timeoutms_to_abs_timespec(query->sync_timeout, &deadline);
+    if (!w_root_sync_wait(root, &sync, &deadline)) {
+      ignore_result(asprintf(&res->errmsg, "synchronization failed: %s\n",
+          strerror(errno)));
+      free(ctx.block);
+      return false;
+    }
+    res->partial_sync = sync.partial;
+  }
+
   /* The first stage of execution is generation.
    * We generate a series of file inputs to pass to
    * the query executor.
@@ -403,12 +913,23 @@ bool w_query_execute(
    */
 
   // Lock the root and begin generation
+  phase = w_trace_begin();
   w_root_lock(root);
+  w_trace_end("query", "lock_wait", phase, NULL);
+
+  // Bring an evicted tree back into memory
+  if (root->evicted && !w_root_rehydrate(root, &res->errmsg)) {
+    w_root_unlock(root);
+    free(ctx.block);
+    return false;
+  }
   res->root_number = root->number;
   res->ticks = root->ticks;
+  w_journal_reserve_ticks(root);
 
   // Evaluate the cursor for this root
-  w_clockspec_eval(root, query->since_spec, &ctx.since);
+  w_clockspec_eval_cursor(root, query->since_spec, &ctx.since,
+      !query->hold_cursor);
 
   res->is_fresh_instance = !ctx.since.is_timestamp &&
     ctx.since.clock.is_fresh_instance;
@@ -418,7 +939,12 @@ bool w_query_execute(
       generator = default_generators;
     }
 
+    phase = w_trace_begin();
     generator(query, root, &ctx, gendata);
+    // Evaluate whatever is left over after the last full block
+    evaluate_block(query, &ctx);
+    sort_results(query, &ctx);
+    w_trace_end("query", "generate", phase, NULL);
   }
 
   w_root_unlock(root);
@@ -426,9 +952,13 @@ bool w_query_execute(
   if (ctx.wholename) {
     w_string_delref(ctx.wholename);
   }
+  free(ctx.block);
   res->results = ctx.results;
   res->num_results = ctx.num_results;
 
+  w_metric_observe_since(&query_duration, start);
+  w_metric_observe(&query_results, res->num_results);
+  w_trace_end("query", "query_execute", span, root->root_path->buf);
   return true;
 }
 
@@ -78,11 +78,11 @@ MAKE_INT_FIELD(dev, dev)
 MAKE_INT_FIELD(nlink, nlink)
 
 #define MAKE_TIME_FIELD_DEFS(type) \
-  { #type "time", make_##type##time }, \
-  { #type "time_ms", make_##type##time_ms }, \
-  { #type "time_us", make_##type##time_us }, \
-  { #type "time_ns", make_##type##time_ns }, \
-  { #type "time_f", make_##type##time_f }
+  { #type "time", make_##type##time, false }, \
+  { #type "time_ms", make_##type##time_ms, false }, \
+  { #type "time_us", make_##type##time_us, false }, \
+  { #type "time_ns", make_##type##time_ns, false }, \
+  { #type "time_f", make_##type##time_f, false }
 
 static json_t *make_type_field(struct watchman_rule_match *match) {
   // Bias towards the more common file types first
@@ -118,24 +118,27 @@ static json_t *make_type_field(struct watchman_rule_match *match) {
 static struct w_query_field_renderer {
   const char *name;
   json_t *(*make)(struct watchman_rule_match *match);
+  // Set for fields whose values are strings; these are rendered
+  // as a string table in column-oriented results
+  bool is_string;
 } field_defs[] = {
-  { "name", make_name },
-  { "exists", make_exists },
-  { "size", make_size },
-  { "mode", make_mode },
-  { "uid", make_uid },
-  { "gid", make_gid },
+  { "name", make_name, true },
+  { "exists", make_exists, false },
+  { "size", make_size, false },
+  { "mode", make_mode, false },
+  { "uid", make_uid, false },
+  { "gid", make_gid, false },
   MAKE_TIME_FIELD_DEFS(a),
   MAKE_TIME_FIELD_DEFS(m),
   MAKE_TIME_FIELD_DEFS(c),
-  { "ino", make_ino },
-  { "dev", make_dev },
-  { "nlink", make_nlink },
-  { "new", make_new },
-  { "oclock", make_oclock },
-  { "cclock", make_cclock },
-  { "type", make_type_field },
-  { NULL, NULL }
+  { "ino", make_ino, false },
+  { "dev", make_dev, false },
+  { "nlink", make_nlink, false },
+  { "new", make_new, false },
+  { "oclock", make_oclock, true },
+  { "cclock", make_cclock, true },
+  { "type", make_type_field, true },
+  { NULL, NULL, false }
 };
 
 static w_ctor_fn_type(register_field_capabilities) {
@@ -149,14 +152,92 @@ static w_ctor_fn_type(register_field_capabilities) {
 }
 w_ctor_fn_reg(register_field_capabilities)
 
-json_t *w_query_results_to_json(
+W_CAP_REG("result-format-columns")
+
+/* Render a string field as a string table: an object holding the
+ * distinct values in order of first appearance, and an index array
+ * giving the position of each result's value in that table */
+static json_t *make_string_table(
+    struct w_query_field_renderer *field,
+    uint32_t num_results,
+    struct watchman_rule_match *results)
+{
+  json_t *strings = json_array();
+  json_t *index = json_array_of_size(num_results);
+  json_t *seen = json_object();
+  json_t *table;
+  uint32_t i;
+
+  for (i = 0; i < num_results; i++) {
+    json_t *value = field->make(&results[i]);
+    const char *str = json_string_value(value);
+    json_t *pos;
+
+    if (!str) {
+      // Can only happen if we failed to render the value
+      json_decref(value);
+      json_array_append_new(index, json_integer(-1));
+      continue;
+    }
+    pos = json_object_get(seen, str);
+    if (!pos) {
+      pos = json_integer(json_array_size(strings));
+      json_object_set_new_nocheck(seen, str, pos);
+      json_array_append(strings, value);
+    }
+    json_array_append(index, pos);
+    json_decref(value);
+  }
+  json_decref(seen);
+
+  table = json_object_of_size(2);
+  set_prop(table, "strings", strings);
+  set_prop(table, "index", index);
+  return table;
+}
+
+/* Render the results as an object holding one array per field.
+ * Each array has num_results entries in the same order, so the
+ * values for a given file live at the same index in every column.
+ * Integer fields yield homogeneous integer arrays that clients can
+ * load straight into packed native arrays.  String fields yield a
+ * string table, so that each distinct value is sent only once and
+ * the column itself is an integer array */
+static json_t *results_to_columns(
+    struct w_query_field_list *field_list,
+    uint32_t num_results,
+    struct watchman_rule_match *results)
+{
+  json_t *columns = json_object_of_size(field_list->num_fields);
+  uint32_t i, f;
+
+  for (f = 0; f < field_list->num_fields; f++) {
+    json_t *col;
+
+    if (field_list->fields[f]->is_string) {
+      col = make_string_table(field_list->fields[f], num_results, results);
+    } else {
+      col = json_array_of_size(num_results);
+      for (i = 0; i < num_results; i++) {
+        json_array_append_new(col, field_list->fields[f]->make(&results[i]));
+      }
+    }
+    set_prop(columns, field_list->fields[f]->name, col);
+  }
+
+  return columns;
+}
+
+static json_t *results_to_rows(
     struct w_query_field_list *field_list,
     uint32_t num_results,
     struct watchman_rule_match *results)
 {
-  json_t *file_list = json_array_of_size(num_results);
+  json_t *file_list;
   uint32_t i, f;
 
+  file_list = json_array_of_size(num_results);
+
   // build a template for the serializer
   if (num_results && field_list->num_fields > 1) {
     json_t *templ = json_array_of_size(field_list->num_fields);
@@ -187,6 +268,23 @@ json_t *w_query_results_to_json(
   return file_list;
 }
 
+json_t *w_query_results_to_json(
+    struct w_query_field_list *field_list,
+    uint32_t num_results,
+    struct watchman_rule_match *results)
+{
+  uint64_t span = w_trace_begin();
+  json_t *file_list;
+
+  if (field_list->columns) {
+    file_list = results_to_columns(field_list, num_results, results);
+  } else {
+    file_list = results_to_rows(field_list, num_results, results);
+  }
+
+  w_trace_end("query", "render_results", span, NULL);
+  return file_list;
+}
 
 bool parse_field_list(json_t *field_list,
     struct w_query_field_list *selected,
@@ -243,5 +341,31 @@ bool parse_field_list(json_t *field_list,
   return true;
 }
 
+bool parse_result_format(json_t *query_spec,
+    struct w_query_field_list *selected,
+    char **errmsg)
+{
+  json_t *fmt = json_object_get(query_spec, "result_format");
+  const char *name;
+
+  selected->columns = false;
+
+  if (!fmt) {
+    return true;
+  }
+
+  name = json_string_value(fmt);
+  if (name && !strcmp(name, "rows")) {
+    return true;
+  }
+  if (name && !strcmp(name, "columns")) {
+    selected->columns = true;
+    return true;
+  }
+
+  *errmsg = strdup("result_format must be one of 'rows' or 'columns'");
+  return false;
+}
+
 /* vim:ts=2:sw=2:et:
  */
@@ -80,6 +80,50 @@ bool eval_int_compare(json_int_t ival, struct w_query_int_compare *comp) {
   }
 }
 
+/* Sets sel[i] to whether ivals[i] satisfies comp, for each of the num
+ * values; the comparison is chosen once rather than for each value */
+void eval_int_compare_block(const int64_t *ivals, uint32_t num,
+    struct w_query_int_compare *comp, uint8_t *sel)
+{
+  int64_t operand = comp->operand;
+  uint32_t i;
+
+  switch (comp->op) {
+    case W_QUERY_ICMP_EQ:
+      for (i = 0; i < num; i++) {
+        sel[i] = ivals[i] == operand;
+      }
+      break;
+    case W_QUERY_ICMP_NE:
+      for (i = 0; i < num; i++) {
+        sel[i] = ivals[i] != operand;
+      }
+      break;
+    case W_QUERY_ICMP_GT:
+      for (i = 0; i < num; i++) {
+        sel[i] = ivals[i] > operand;
+      }
+      break;
+    case W_QUERY_ICMP_GE:
+      for (i = 0; i < num; i++) {
+        sel[i] = ivals[i] >= operand;
+      }
+      break;
+    case W_QUERY_ICMP_LT:
+      for (i = 0; i < num; i++) {
+        sel[i] = ivals[i] < operand;
+      }
+      break;
+    case W_QUERY_ICMP_LE:
+      for (i = 0; i < num; i++) {
+        sel[i] = ivals[i] <= operand;
+      }
+      break;
+    default:
+      memset(sel, 0, num);
+  }
+}
+
 static bool eval_size(struct w_query_ctx *ctx, struct watchman_file *file,
     void *data)
 {
@@ -94,6 +138,25 @@ static bool eval_size(struct w_query_ctx *ctx, struct watchman_file *file,
   return eval_int_compare(file->stat.size, comp);
 }
 
+static void eval_size_block(struct w_query_ctx *ctx,
+    struct w_query_block *block,
+    const uint64_t *in,
+    uint64_t *out,
+    void *data)
+{
+  uint8_t sel[W_QUERY_BLOCK_SIZE];
+  uint32_t i;
+
+  unused_parameter(ctx);
+
+  eval_int_compare_block(block->size, block->num, data, sel);
+  // Removed files never evaluate true
+  for (i = 0; i < block->num; i++) {
+    sel[i] &= block->exists[i];
+  }
+  w_query_block_select(block, sel, in, out);
+}
+
 static w_query_expr *size_parser(w_query *query, json_t *term) {
   struct w_query_int_compare *comp;
 
@@ -113,7 +176,7 @@ static w_query_expr *size_parser(w_query *query, json_t *term) {
     return NULL;
   }
 
-  return w_query_expr_new(eval_size, free, comp);
+  return w_query_expr_new_with_block(eval_size, eval_size_block, free, comp);
 }
 W_TERM_PARSER("size", size_parser)
 
@@ -221,6 +221,266 @@ static bool parse_relative_root(w_root_t *root, w_query *res, json_t *query)
   return true;
 }
 
+static bool append_bloom_key(struct w_bloom_key **keys, uint32_t *num,
+    const struct w_bloom_key *key)
+{
+  struct w_bloom_key *grown;
+
+  grown = realloc(*keys, (*num + 1) * sizeof(*grown));
+  if (!grown) {
+    return false;
+  }
+  grown[(*num)++] = *key;
+  *keys = grown;
+  return true;
+}
+
+// Adds the key for the basename of a name or iname term argument
+static bool append_name_key(struct w_bloom_key **keys, uint32_t *num,
+    json_t *name)
+{
+  struct w_bloom_key key;
+  const char *str = json_string_value(name);
+  const char *base;
+
+  for (base = str + strlen(str); base > str; base--) {
+    if (base[-1] == '/' || base[-1] == WATCHMAN_DIR_SEP) {
+      break;
+    }
+  }
+  w_bloom_key_name(&key, base, u32_strlen(base));
+  return append_bloom_key(keys, num, &key);
+}
+
+/* Works out the names and suffixes of which a file must have at least
+ * one for the expression term to match it, adding their keys to *keys.
+ * Returns false if the term doesn't narrow things down that way.  The
+ * term has already been parsed, so it is known to be well formed */
+static bool collect_bloom_keys(json_t *term, struct w_bloom_key **keys,
+    uint32_t *num)
+{
+  const char *name;
+  json_t *arg;
+  uint32_t i;
+
+  if (json_is_string(term)) {
+    // Nothing can match "false"
+    return !strcmp(json_string_value(term), "false");
+  }
+  name = json_string_value(json_array_get(term, 0));
+  arg = json_array_get(term, 1);
+
+  if (!strcmp(name, "false")) {
+    return true;
+  }
+
+  if (!strcmp(name, "name") || !strcmp(name, "iname")) {
+    if (json_is_string(arg)) {
+      return append_name_key(keys, num, arg);
+    }
+    for (i = 0; i < json_array_size(arg); i++) {
+      if (!append_name_key(keys, num, json_array_get(arg, i))) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  if (!strcmp(name, "suffix")) {
+    struct w_bloom_key key;
+    const char *suffix = json_string_value(arg);
+    uint32_t len = u32_strlen(suffix), dots = 0;
+
+    for (i = 0; i < len; i++) {
+      if (suffix[i] == '.') {
+        dots++;
+      }
+    }
+    // Files aren't filed under empty suffixes or ones with many dots
+    if (len == 0 || dots > W_BLOOM_MAX_NAME_KEYS - 2) {
+      return false;
+    }
+    w_bloom_key_suffix(&key, suffix, len);
+    return append_bloom_key(keys, num, &key);
+  }
+
+  if (!strcmp(name, "anyof")) {
+    // A match must match one of the terms
+    for (i = 1; i < json_array_size(term); i++) {
+      if (!collect_bloom_keys(json_array_get(term, i), keys, num)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  if (!strcmp(name, "allof")) {
+    // A match must match all of the terms, so the one that allows the
+    // fewest keys will do
+    struct w_bloom_key *best = NULL;
+    uint32_t num_best = 0;
+    bool found = false;
+
+    for (i = 1; i < json_array_size(term); i++) {
+      struct w_bloom_key *these = NULL;
+      uint32_t num_these = 0;
+
+      if (collect_bloom_keys(json_array_get(term, i), &these, &num_these) &&
+          (!found || num_these < num_best)) {
+        free(best);
+        best = these;
+        num_best = num_these;
+        found = true;
+      } else {
+        free(these);
+      }
+    }
+    for (i = 0; found && i < num_best; i++) {
+      found = append_bloom_key(keys, num, &best[i]);
+    }
+    free(best);
+    return found;
+  }
+
+  return false;
+}
+
+// A range of one of the fields that roots can keep ordered indexes on
+struct index_range {
+  enum w_index_field field;
+  int64_t min, max;
+  // for cclock, the clock after which files must have been created
+  struct w_clockspec *since;
+};
+
+static bool set_range(struct index_range *range, enum w_index_field field,
+    int64_t min, int64_t max)
+{
+  range->field = field;
+  range->min = min;
+  range->max = max;
+  range->since = NULL;
+  return true;
+}
+
+static bool size_range(json_t *term, struct index_range *range)
+{
+  const char *op = json_string_value(json_array_get(term, 1));
+  json_int_t operand = json_integer_value(json_array_get(term, 2));
+
+  if (!strcmp(op, "eq")) {
+    return set_range(range, W_INDEX_SIZE, operand, operand);
+  }
+  if (!strcmp(op, "ge")) {
+    return set_range(range, W_INDEX_SIZE, operand, INT64_MAX);
+  }
+  if (!strcmp(op, "gt") && operand < INT64_MAX) {
+    return set_range(range, W_INDEX_SIZE, operand + 1, INT64_MAX);
+  }
+  if (!strcmp(op, "le")) {
+    return set_range(range, W_INDEX_SIZE, INT64_MIN, operand);
+  }
+  if (!strcmp(op, "lt") && operand > INT64_MIN) {
+    return set_range(range, W_INDEX_SIZE, INT64_MIN, operand - 1);
+  }
+  return false;
+}
+
+static bool since_range(json_t *term, struct index_range *range)
+{
+  const char *field = json_string_value(json_array_get(term, 2));
+  struct w_clockspec *spec;
+
+  if (!field) {
+    // oclock
+    return false;
+  }
+  spec = w_clockspec_parse(json_array_get(term, 1));
+  if (!spec) {
+    return false;
+  }
+
+  if (!strcmp(field, "mtime") && spec->tag == w_cs_timestamp) {
+    set_range(range, W_INDEX_MTIME, (int64_t)spec->timestamp.tv_sec + 1,
+        INT64_MAX);
+    w_clockspec_free(spec);
+    return true;
+  }
+  if (!strcmp(field, "cclock") && spec->tag == w_cs_clock) {
+    // The tick is only known once the clock is evaluated against the
+    // root, when the query is executed
+    set_range(range, W_INDEX_CCLOCK, INT64_MIN, INT64_MAX);
+    range->since = spec;
+    return true;
+  }
+  w_clockspec_free(spec);
+  return false;
+}
+
+/* Works out a range of one of the indexed fields in which that field of
+ * a file must lie for the expression term to match it.  Returns false if
+ * the term implies no such range.  The term has already been parsed, so
+ * it is known to be well formed */
+static bool collect_index_range(json_t *term, struct index_range *range)
+{
+  const char *name;
+  bool found = false;
+  uint32_t i;
+
+  if (!json_is_array(term)) {
+    return false;
+  }
+  name = json_string_value(json_array_get(term, 0));
+
+  if (!strcmp(name, "size")) {
+    return size_range(term, range);
+  }
+  if (!strcmp(name, "since")) {
+    return since_range(term, range);
+  }
+
+  if (!strcmp(name, "allof")) {
+    // A match must match all of the terms, so the ranges that they
+    // imply of the first field that any of them implies one of combine
+    for (i = 1; i < json_array_size(term); i++) {
+      struct index_range sub;
+
+      if (!collect_index_range(json_array_get(term, i), &sub)) {
+        continue;
+      }
+      if (!found) {
+        *range = sub;
+        found = true;
+        continue;
+      }
+      if (sub.field == range->field && !sub.since && !range->since) {
+        range->min = MAX(range->min, sub.min);
+        range->max = MIN(range->max, sub.max);
+      }
+      if (sub.since) {
+        w_clockspec_free(sub.since);
+      }
+    }
+    return found;
+  }
+
+  return false;
+}
+
+static bool parse_index_range(w_query *res, json_t *exp)
+{
+  struct index_range range;
+
+  if (!collect_index_range(exp, &range)) {
+    return false;
+  }
+  res->index_field = range.field;
+  res->index_min = range.min;
+  res->index_max = range.max;
+  res->index_since = range.since;
+  return true;
+}
+
 static bool parse_query_expression(w_query *res, json_t *query)
 {
   json_t *exp;
@@ -236,6 +496,9 @@ static bool parse_query_expression(w_query *res, json_t *query)
     return false;
   }
 
+  res->use_bloom = collect_bloom_keys(exp, &res->bloom_keys,
+      &res->num_bloom_keys);
+  res->use_index = parse_index_range(res, exp);
   return true;
 }
 
@@ -272,6 +535,77 @@ static bool parse_empty_on_fresh_instance(w_query *res, json_t *query)
   return true;
 }
 
+static const struct {
+  const char *name;
+  enum w_query_order order;
+} order_names[] = {
+  {"otime", W_QUERY_ORDER_OTIME},
+  {"mtime", W_QUERY_ORDER_MTIME},
+  {"size", W_QUERY_ORDER_SIZE},
+  {"name", W_QUERY_ORDER_NAME},
+};
+
+/* order_by is either a field name, for ascending order, or an array of
+ * a field name and "asc" or "desc" */
+static bool parse_order_by(w_query *res, json_t *query)
+{
+  json_t *order_by;
+  const char *name, *dir = "asc";
+  size_t i;
+
+  order_by = json_object_get(query, "order_by");
+  if (!order_by) {
+    return true;
+  }
+
+  if (json_is_string(order_by)) {
+    name = json_string_value(order_by);
+  } else if (json_unpack(order_by, "[s,s]", &name, &dir) != 0) {
+    res->errmsg = strdup(
+        "order_by must be a field name or [field name, \"asc\"|\"desc\"]");
+    return false;
+  }
+
+  if (!strcmp(dir, "desc")) {
+    res->order_desc = true;
+  } else if (strcmp(dir, "asc")) {
+    ignore_result(asprintf(&res->errmsg,
+        "order_by direction must be \"asc\" or \"desc\", not `%s'", dir));
+    return false;
+  }
+
+  for (i = 0; i < sizeof(order_names) / sizeof(order_names[0]); i++) {
+    if (!strcmp(order_names[i].name, name)) {
+      res->order_by = order_names[i].order;
+      return true;
+    }
+  }
+  ignore_result(asprintf(&res->errmsg,
+      "can't order_by `%s'; use one of otime, mtime, size or name", name));
+  return false;
+}
+W_CAP_REG("query-order-by")
+
+static bool parse_limit(w_query *res, json_t *query)
+{
+  json_int_t value = 0;
+
+  if (query &&
+      json_unpack(query, "{s?:I*}", "limit", &value) != 0) {
+    res->errmsg = strdup("limit must be an integer value > 0");
+    return false;
+  }
+
+  if (value < 0 || value > UINT32_MAX ||
+      (value == 0 && json_object_get(query, "limit"))) {
+    res->errmsg = strdup("limit must be an integer value > 0");
+    return false;
+  }
+
+  res->limit = (uint32_t)value;
+  return true;
+}
+
 w_query *w_query_parse(w_root_t *root, json_t *query, char **errmsg)
 {
   w_query *res;
@@ -298,6 +632,10 @@ w_query *w_query_parse(w_root_t *root, json_t *query, char **errmsg)
     goto error;
   }
 
+  if (!parse_order_by(res, query) || !parse_limit(res, query)) {
+    goto error;
+  }
+
   /* Look for path generators */
   if (!parse_paths(res, query)) {
     goto error;
@@ -331,6 +669,98 @@ error:
   return NULL;
 }
 
+/* Returns a query like tmpl, which was parsed without a since, but with
+ * the since of the query spec.  The expression is shared with tmpl; the
+ * rest is the new query's own */
+w_query *w_query_clone_with_since(w_query *tmpl, json_t *query,
+    char **errmsg)
+{
+  w_query *res;
+  size_t i;
+
+  *errmsg = NULL;
+
+  res = malloc(sizeof(*res));
+  if (!res) {
+    *errmsg = strdup("out of memory");
+    return NULL;
+  }
+  *res = *tmpl;
+  res->refcnt = 1;
+  res->errmsg = NULL;
+  res->since_spec = NULL;
+  res->paths = NULL;
+  res->npaths = 0;
+  res->suffixes = NULL;
+  res->nsuffixes = 0;
+  res->bloom_keys = NULL;
+  res->index_since = NULL;
+
+  if (res->relative_root) {
+    w_string_addref(res->relative_root);
+  }
+  if (res->relative_root_slash) {
+    w_string_addref(res->relative_root_slash);
+  }
+  if (res->expr) {
+    w_query_expr_addref(res->expr);
+  }
+
+  if (tmpl->npaths) {
+    res->paths = calloc(tmpl->npaths, sizeof(*res->paths));
+    if (!res->paths) {
+      goto oom;
+    }
+    for (i = 0; i < tmpl->npaths; i++) {
+      res->paths[i] = tmpl->paths[i];
+      w_string_addref(res->paths[i].name);
+    }
+    res->npaths = tmpl->npaths;
+  }
+
+  if (tmpl->suffixes) {
+    res->suffixes = calloc(tmpl->nsuffixes, sizeof(*res->suffixes));
+    if (!res->suffixes) {
+      goto oom;
+    }
+    for (i = 0; i < tmpl->nsuffixes; i++) {
+      res->suffixes[i] = tmpl->suffixes[i];
+      w_string_addref(res->suffixes[i]);
+    }
+    res->nsuffixes = tmpl->nsuffixes;
+  }
+
+  if (tmpl->num_bloom_keys) {
+    res->bloom_keys = malloc(tmpl->num_bloom_keys * sizeof(*res->bloom_keys));
+    if (!res->bloom_keys) {
+      goto oom;
+    }
+    memcpy(res->bloom_keys, tmpl->bloom_keys,
+        tmpl->num_bloom_keys * sizeof(*res->bloom_keys));
+  }
+
+  if (tmpl->index_since) {
+    res->index_since = w_clockspec_copy(tmpl->index_since);
+    if (!res->index_since) {
+      goto oom;
+    }
+  }
+
+  if (!parse_since(res, query)) {
+    *errmsg = res->errmsg;
+    res->errmsg = NULL;
+    w_query_delref(res);
+    return NULL;
+  }
+
+  return res;
+
+oom:
+  *errmsg = strdup("out of memory");
+  w_query_delref(res);
+  return NULL;
+}
+
 bool w_query_legacy_field_list(struct w_query_field_list *flist)
 {
   static const char *names[] = {
@@ -524,6 +954,10 @@ void w_query_delref(w_query *query)
     free(query->suffixes);
   }
 
+  free(query->bloom_keys);
+  if (query->index_since) {
+    w_clockspec_free(query->index_since);
+  }
   free(query);
 }
 
@@ -532,6 +966,16 @@ w_query_expr *w_query_expr_new(
     w_query_expr_dispose_func dispose,
     void *data
 )
+{
+  return w_query_expr_new_with_block(evaluate, NULL, dispose, data);
+}
+
+w_query_expr *w_query_expr_new_with_block(
+    w_query_expr_eval_func evaluate,
+    w_query_expr_block_func evaluate_block,
+    w_query_expr_dispose_func dispose,
+    void *data
+)
 {
   w_query_expr *expr;
 
@@ -541,12 +985,18 @@ w_query_expr *w_query_expr_new(
   }
   expr->refcnt = 1;
   expr->evaluate = evaluate;
+  expr->evaluate_block = evaluate_block;
   expr->dispose = dispose;
   expr->data = data;
 
   return expr;
 }
 
+void w_query_expr_addref(w_query_expr *expr)
+{
+  w_refcnt_add(&expr->refcnt);
+}
+
 void w_query_expr_delref(w_query_expr *expr)
 {
   if (!w_refcnt_del(&expr->refcnt)) {
@@ -14,6 +14,25 @@ static bool eval_suffix(struct w_query_ctx *ctx,
   return w_string_suffix_match(file->name, suffix);
 }
 
+static void eval_suffix_block(struct w_query_ctx *ctx,
+    struct w_query_block *block,
+    const uint64_t *in,
+    uint64_t *out,
+    void *data)
+{
+  w_string_t *suffix = data;
+  uint8_t sel[W_QUERY_BLOCK_SIZE];
+  uint32_t i;
+
+  unused_parameter(ctx);
+
+  for (i = 0; i < block->num; i++) {
+    sel[i] = (in[i / 64] >> (i % 64) & 1) &&
+      w_string_suffix_match(block->files[i]->name, suffix);
+  }
+  w_query_block_select(block, sel, in, out);
+}
+
 static void dispose_suffix(void *data)
 {
   w_string_t *suffix = data;
@@ -51,7 +70,8 @@ static w_query_expr *suffix_parser(w_query *query, json_t *term)
     return NULL;
   }
 
-  return w_query_expr_new(eval_suffix, dispose_suffix, str);
+  return w_query_expr_new_with_block(eval_suffix, eval_suffix_block,
+      dispose_suffix, str);
 }
 W_TERM_PARSER("suffix", suffix_parser)
 
@@ -35,6 +35,51 @@ static bool eval_type(struct w_query_ctx *ctx,
   }
 }
 
+// The S_IFMT bits of files of the type named by arg
+static uint32_t type_fmt(intptr_t arg)
+{
+  switch (arg) {
+    case 'b':
+      return S_IFBLK;
+    case 'c':
+      return S_IFCHR;
+    case 'd':
+      return S_IFDIR;
+    case 'f':
+      return S_IFREG;
+    case 'p':
+      return S_IFIFO;
+    case 'l':
+      return S_IFLNK;
+    case 's':
+      return S_IFSOCK;
+#ifdef S_IFDOOR
+    case 'D':
+      return S_IFDOOR;
+#endif
+    default:
+      return 0;
+  }
+}
+
+static void eval_type_block(struct w_query_ctx *ctx,
+    struct w_query_block *block,
+    const uint64_t *in,
+    uint64_t *out,
+    void *data)
+{
+  uint32_t fmt = type_fmt((intptr_t)data);
+  uint8_t sel[W_QUERY_BLOCK_SIZE];
+  uint32_t i;
+
+  unused_parameter(ctx);
+
+  for (i = 0; i < block->num; i++) {
+    sel[i] = fmt && block->fmt[i] == fmt;
+  }
+  w_query_block_select(block, sel, in, out);
+}
+
 static void dispose_type(void *data)
 {
   unused_parameter(data);
@@ -59,7 +104,8 @@ static w_query_expr *type_parser(w_query *query, json_t *term)
 
   arg = *found;
 
-  return w_query_expr_new(eval_type, dispose_type, (void*)arg);
+  return w_query_expr_new_with_block(eval_type, eval_type_block,
+      dispose_type, (void*)arg);
 }
 W_TERM_PARSER("type", type_parser)
 
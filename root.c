@@ -6,8 +6,12 @@
 # include <sys/attr.h>
 #endif
 
-static struct watchman_ops *watcher_ops = NULL;
-static watchman_global_watcher_t watcher = NULL;
+// The native watcher for this system, used unless a root is polled
+static struct watchman_ops *default_ops = NULL;
+static watchman_global_watcher_t default_watcher = NULL;
+#ifndef _WIN32
+static watchman_global_watcher_t poll_global = NULL;
+#endif
 static w_ht_t *watched_roots = NULL;
 static volatile long live_roots = 0;
 static pthread_mutex_t root_lock = PTHREAD_MUTEX_INITIALIZER;
@@ -16,6 +20,28 @@ static pthread_mutex_t root_lock = PTHREAD_MUTEX_INITIALIZER;
 // helps avoid confusion if a root is removed and then added again.
 static long next_root_number = 1;
 
+// How long the crawl may run before it lets other pool jobs have a turn
+#define CRAWL_SLICE_USEC 20000
+
+W_METRIC_GAUGE(roots_watched, "roots_watched", "Number of watched roots");
+W_METRIC_GAUGE(files_tracked, "files_tracked",
+    "Number of file nodes held in memory across all roots");
+W_METRIC_GAUGE(dirs_tracked, "dirs_tracked",
+    "Number of dir nodes held in memory across all roots");
+W_METRIC_COUNTER(recrawls, "recrawls_total", "Number of recrawls scheduled");
+W_METRIC_COUNTER(pending_processed, "pending_processed_total",
+    "Number of pending paths processed");
+W_METRIC_HISTOGRAM(sync_duration, "sync_duration_usec",
+    "Time spent waiting for a sync cookie to be observed", "usec");
+W_METRIC_COUNTER(partial_syncs, "partial_syncs_total",
+    "Number of syncs after which some changes may not have been seen");
+W_METRIC_HISTOGRAM(crawl_duration, "crawl_duration_usec",
+    "Time taken by initial crawls and recrawls", "usec");
+W_METRIC_COUNTER(crawl_slices, "crawl_slices_total",
+    "Number of slices that initial crawls and recrawls ran in");
+W_METRIC_HISTOGRAM(notify_batch, "notify_batch_size",
+    "Number of unique paths queued per batch of notifications", "paths");
+
 /* Some error conditions will put us into a non-recoverable state where we
  * can't guarantee that we will be operating correctly.  Rather than suffering
  * in silence and misleading our clients, we'll poison ourselves and advertise
@@ -23,7 +49,7 @@ static long next_root_number = 1;
 char *poisoned_reason = NULL;
 
 static void crawler(w_root_t *root, struct watchman_pending_collection *coll,
-    w_string_t *dir_name, struct timeval now, bool recursive);
+    w_string_t *dir_name, struct timeval now, bool recursive, bool rescan);
 
 static void w_root_teardown(w_root_t *root);
 
@@ -64,7 +90,9 @@ static void delete_dir(w_ht_val_t val)
     w_ht_free(dir->dirs);
     dir->dirs = NULL;
   }
+  w_bloom_free(dir->bloom);
   free(dir);
+  w_metric_dec(&dirs_tracked);
 }
 
 static const struct watchman_hash_funcs dirname_hash_funcs = {
@@ -76,36 +104,151 @@ static const struct watchman_hash_funcs dirname_hash_funcs = {
   delete_dir
 };
 
-static void load_root_config(w_root_t *root, const char *path)
+/* Loads the .watchmanconfig of the root at path.  Returns NULL if
+ * there is none; if it can't be used, *ok is set to false */
+static json_t *load_root_config(const char *path, bool *ok)
 {
   char cfgfilename[WATCHMAN_NAME_MAX];
   json_error_t err;
+  json_t *config;
 
+  *ok = true;
   snprintf(cfgfilename, sizeof(cfgfilename), "%s%c.watchmanconfig",
       path, WATCHMAN_DIR_SEP);
 
   if (!w_path_exists(cfgfilename)) {
     if (errno == ENOENT) {
-      return;
+      return NULL;
     }
     w_log(W_LOG_ERR, "%s is not accessible: %s\n",
         cfgfilename, strerror(errno));
-    return;
+    *ok = false;
+    return NULL;
   }
 
-  root->config_file = json_load_file(cfgfilename, 0, &err);
-  if (!root->config_file) {
+  config = json_load_file(cfgfilename, 0, &err);
+  if (!config) {
     w_log(W_LOG_ERR, "failed to parse json from %s: %s\n",
         cfgfilename, err.text);
+    *ok = false;
+  }
+  return config;
+}
+
+// Evaluates the hot-path options against the current configuration
+static void compile_root_config(w_root_t *root,
+    struct watchman_root_config *cfg)
+{
+  json_int_t bits;
+
+  cfg->trigger_settle = (int)cfg_get_int(
+      root, "settle", DEFAULT_SETTLE_PERIOD);
+  cfg->gc_age = (int)cfg_get_int(root, "gc_age_seconds", DEFAULT_GC_AGE);
+  cfg->gc_interval = (int)cfg_get_int(root, "gc_interval_seconds",
+      DEFAULT_GC_INTERVAL);
+  cfg->idle_reap_age = (int)cfg_get_int(root, "idle_reap_age_seconds",
+      DEFAULT_REAP_AGE);
+  cfg->hint_num_files_per_dir = (uint32_t)cfg_get_int(
+      root, "hint_num_files_per_dir", 64);
+  bits = cfg_get_int(root, "bloom_bits_per_file", 0);
+  cfg->bloom_bits_per_file = bits > 0 ? (uint32_t)MIN(bits, 64) : 0;
+  cfg->index_fields = w_root_parse_index_fields(root);
+  cfg->iothrottle = cfg_get_bool(root, "iothrottle", false);
+}
+
+static bool json_member_equal(json_t *a, json_t *b, const char *name)
+{
+  json_t *va = a ? json_object_get(a, name) : NULL;
+  json_t *vb = b ? json_object_get(b, name) : NULL;
+
+  if (!va || !vb) {
+    return va == vb;
+  }
+  return json_equal(va, vb);
+}
+
+/* Picks up a change to the .watchmanconfig of the root.  The ignore
+ * rules decide what is in the tree, so changes to them only take effect
+ * when the root is next watched, and until then the rules compiled at
+ * watch time are kept; all other options apply at once, without a
+ * recrawl.
+ * Must be called with the root locked */
+static void reload_root_config(w_root_t *root)
+{
+  struct watchman_root_config cfg;
+  json_t *old = root->config_file;
+  json_t *config;
+  bool ok;
+
+  config = load_root_config(root->root_path->buf, &ok);
+  if (!ok) {
+    // Most likely caught in the middle of an edit; we'll be told again
+    if (config) {
+      json_decref(config);
+    }
+    return;
+  }
+  if ((!old && !config) || (old && config && json_equal(old, config))) {
+    if (config) {
+      json_decref(config);
+    }
+    return;
   }
+  if (!json_member_equal(old, config, "ignore_dirs") ||
+      !json_member_equal(old, config, "ignore_vcs")) {
+    // The ignore rules compiled at watch time stay in force
+    w_log(W_LOG_ERR, "%.*s: changes to ignore_dirs and ignore_vcs take "
+        "effect when the root is next watched\n",
+        root->root_path->len, root->root_path->buf);
+  }
+
+  cfg_swap_root_config(root, config);
+  compile_root_config(root, &cfg);
+  root->config = cfg;
+  w_root_free_indexes(root, W_INDEX_ALL & ~cfg.index_fields);
+  if (!json_member_equal(old, config, "indexed_suffixes")) {
+    w_root_rebuild_suffix_index(root);
+  }
+  if (old) {
+    json_decref(old);
+  }
+  w_log(W_LOG_ERR, "reloaded .watchmanconfig of %.*s\n",
+      root->root_path->len, root->root_path->buf);
+}
+
+static bool is_root_config_path(w_root_t *root, w_string_t *full_path)
+{
+  static const char name[] = ".watchmanconfig";
+
+  return full_path->len == root->root_path->len + sizeof(name) &&
+    w_string_startswith(full_path, root->root_path) &&
+    full_path->buf[root->root_path->len] == WATCHMAN_DIR_SEP &&
+    !memcmp(full_path->buf + root->root_path->len + 1, name,
+        sizeof(name) - 1);
 }
 
 static size_t root_init_offset = offsetof(w_root_t, _init_sentinel_);
 
+// Sets up an empty tree holding only the root dir
+static void init_tree(w_root_t *root)
+{
+  struct watchman_dir *dir;
+
+  w_root_init_suffix_index(root);
+  root->dirname_to_dir = w_ht_new(HINT_NUM_DIRS, &dirname_hash_funcs);
+
+  // "manually" populate the initial dir, as the dir resolver will
+  // try to find its parent and we don't want it to for the root
+  dir = calloc(1, sizeof(*dir));
+  dir->path = root->root_path;
+  w_string_addref(dir->path);
+  w_ht_set(root->dirname_to_dir, w_ht_ptr_val(dir->path), w_ht_ptr_val(dir));
+  w_metric_inc(&dirs_tracked);
+}
+
 // internal initialization for root
 static bool w_root_init(w_root_t *root, char **errmsg)
 {
-  struct watchman_dir *dir;
   struct watchman_dir_handle *osdir;
 
   memset((char *)root + root_init_offset, 0,
@@ -120,25 +263,16 @@ static bool w_root_init(w_root_t *root, char **errmsg)
   }
   w_dir_close(osdir);
 
-  if (!watcher_ops->root_init(watcher, root, errmsg)) {
+  if (!root->watcher_ops->root_init(root->watcher, root, errmsg)) {
     return false;
   }
 
   root->number = __sync_fetch_and_add(&next_root_number, 1);
 
   root->cursors = w_ht_new(2, &w_ht_string_funcs);
-  root->suffixes = w_ht_new(2, &w_ht_string_funcs);
-
-  root->dirname_to_dir = w_ht_new(HINT_NUM_DIRS, &dirname_hash_funcs);
+  init_tree(root);
   root->ticks = 1;
 
-  // "manually" populate the initial dir, as the dir resolver will
-  // try to find its parent and we don't want it to for the root
-  dir = calloc(1, sizeof(*dir));
-  dir->path = root->root_path;
-  w_string_addref(dir->path);
-  w_ht_set(root->dirname_to_dir, w_ht_ptr_val(dir->path), w_ht_ptr_val(dir));
-
   time(&root->last_cmd_timestamp);
 
   return root;
@@ -191,14 +325,16 @@ static bool apply_ignore_vcs_configuration(w_root_t *root, char **errmsg)
 
     // if we are completely ignoring this dir, we have nothing more to
     // do here
-    if (w_ht_get(root->ignore_dirs, w_ht_ptr_val(fullname))) {
+    if (w_ignore_check(&root->ignore, root->root_path, fullname->buf,
+          fullname->len) == W_IGNORE_SELF) {
       w_string_delref(fullname);
       w_string_delref(name);
       continue;
     }
 
-    w_ht_set(root->ignore_vcs, w_ht_ptr_val(fullname),
-        w_ht_ptr_val(fullname));
+    if (!w_ignore_add(&root->ignore, ignore, true)) {
+      w_log(W_LOG_ERR, "unable to ignore_vcs %s\n", ignore);
+    }
 
     // While we're at it, see if we can find out where to put our
     // query cookie information
@@ -226,10 +362,31 @@ static bool apply_ignore_vcs_configuration(w_root_t *root, char **errmsg)
   return true;
 }
 
+/* Entries of ignore_dirs that were plain names before globs were
+ * supported change meaning if they contain glob characters; warn about
+ * those that name an existing dir, as the user most likely meant it */
+static void warn_if_glob_names_dir(w_root_t *root, const char *ignore)
+{
+  w_string_t *name, *fullname;
+  struct stat st;
+
+  if (!w_ignore_is_glob(ignore)) {
+    return;
+  }
+  name = w_string_new(ignore);
+  fullname = w_string_path_cat(root->root_path, name);
+  if (lstat(fullname->buf, &st) == 0 && S_ISDIR(st.st_mode)) {
+    w_log(W_LOG_ERR,
+        "ignore_dirs entry %s is matched as a glob pattern, not as the dir "
+        "%.*s; escape *, ? and [ with a backslash to ignore that dir\n",
+        ignore, fullname->len, fullname->buf);
+  }
+  w_string_delref(name);
+  w_string_delref(fullname);
+}
+
 static void apply_ignore_configuration(w_root_t *root)
 {
-  w_string_t *name;
-  w_string_t *fullname;
   uint8_t i;
   json_t *ignores;
 
@@ -250,14 +407,13 @@ static void apply_ignore_configuration(w_root_t *root)
       continue;
     }
 
-    name = w_string_new(ignore);
-    fullname = w_string_path_cat(root->root_path, name);
-    w_ht_set(root->ignore_dirs, w_ht_ptr_val(fullname),
-        w_ht_ptr_val(fullname));
-    w_log(W_LOG_DBG, "ignoring %.*s recursively\n",
-        fullname->len, fullname->buf);
-    w_string_delref(fullname);
-    w_string_delref(name);
+    warn_if_glob_names_dir(root, ignore);
+    if (!w_ignore_add(&root->ignore, ignore, false)) {
+      w_log(W_LOG_ERR, "unable to ignore_dirs %s\n", ignore);
+      continue;
+    }
+    w_log(W_LOG_DBG, "ignoring %.*s%c%s recursively\n",
+        root->root_path->len, root->root_path->buf, WATCHMAN_DIR_SEP, ignore);
   }
 }
 
@@ -273,10 +429,65 @@ static bool is_case_sensitive_filesystem(const char *path) {
 #endif
 }
 
+// Returns true if fs_type is listed in the named global config array
+static bool is_fstype_listed(w_string_t *fs_type, const char *option)
+{
+  json_t *fstypes = cfg_get_json(NULL, option);
+  uint32_t i;
+
+  if (!fstypes || !json_is_array(fstypes)) {
+    return false;
+  }
+  for (i = 0; i < json_array_size(fstypes); i++) {
+    const char *name = json_string_value(json_array_get(fstypes, i));
+
+    if (name && w_string_equal_cstring(fs_type, name)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Roots are watched by the native watcher unless they are on one of
+ * the poll_fstypes, where notifications don't see remote changes, or
+ * their .watchmanconfig asks for the poll watcher */
+static void select_watcher(w_root_t *root)
+{
+  root->watcher_ops = default_ops;
+  root->watcher = default_watcher;
+#ifndef _WIN32
+  {
+    const char *name = cfg_get_string(root, "watcher", NULL);
+    bool use_poll = false;
+
+    if (name && !strcmp(name, poll_watcher.name)) {
+      use_poll = true;
+    } else if (name && strcmp(name, default_ops->name)) {
+      w_log(W_LOG_ERR, "%.*s: unknown watcher \"%s\", using %s\n",
+          root->root_path->len, root->root_path->buf, name,
+          default_ops->name);
+    } else if (!name) {
+      w_string_t *fs_type = w_fstype(root->root_path->buf);
+
+      use_poll = is_fstype_listed(fs_type, "poll_fstypes");
+      w_string_delref(fs_type);
+    }
+
+    if (use_poll) {
+      root->watcher_ops = &poll_watcher;
+      root->watcher = poll_global;
+      w_log(W_LOG_ERR, "%.*s: using the %s watcher\n",
+          root->root_path->len, root->root_path->buf, poll_watcher.name);
+    }
+  }
+#endif
+}
+
 static w_root_t *w_root_new(const char *path, char **errmsg)
 {
   w_root_t *root = calloc(1, sizeof(*root));
   pthread_mutexattr_t attr;
+  bool config_ok;
 
   assert(root != NULL);
 
@@ -290,22 +501,20 @@ static w_root_t *w_root_new(const char *path, char **errmsg)
   root->case_sensitive = is_case_sensitive_filesystem(path);
 
   w_pending_coll_init(&root->pending);
+  w_pending_coll_init(&root->notify_pending);
+  w_pending_coll_init(&root->io_pending);
+  w_pending_coll_init(&root->evicted_pending);
   root->root_path = w_string_new(path);
   root->commands = w_ht_new(2, &trigger_hash_funcs);
   root->query_cookies = w_ht_new(2, &w_ht_string_funcs);
-  root->ignore_vcs = w_ht_new(2, &w_ht_string_funcs);
-  root->ignore_dirs = w_ht_new(2, &w_ht_string_funcs);
+  w_ignore_init(&root->ignore);
 
-  load_root_config(root, path);
-  root->trigger_settle = (int)cfg_get_int(
-      root, "settle", DEFAULT_SETTLE_PERIOD);
-  root->gc_age = (int)cfg_get_int(root, "gc_age_seconds", DEFAULT_GC_AGE);
-  root->gc_interval = (int)cfg_get_int(root, "gc_interval_seconds",
-      DEFAULT_GC_INTERVAL);
-  root->idle_reap_age = (int)cfg_get_int(root, "idle_reap_age_seconds",
-      DEFAULT_REAP_AGE);
+  // A config file that we can't read is reported and then ignored
+  root->config_file = load_root_config(path, &config_ok);
+  compile_root_config(root, &root->config);
 
   apply_ignore_configuration(root);
+  select_watcher(root);
 
   if (!apply_ignore_vcs_configuration(root, errmsg)) {
     w_root_delref(root);
@@ -319,9 +528,10 @@ static w_root_t *w_root_new(const char *path, char **errmsg)
   return root;
 }
 
-void w_root_lock(w_root_t *root)
+void w_root_lock_at(w_root_t *root, const char *site)
 {
   int err;
+  uint64_t start = w_lockprof_begin();
 
   err = pthread_mutex_lock(&root->lock);
   if (err != 0) {
@@ -331,12 +541,14 @@ void w_root_lock(w_root_t *root)
         strerror(err)
     );
   }
+  w_lock_hold_enter(&w_lock_class_root, &root->lock_hold, site, start);
 }
 
 void w_root_unlock(w_root_t *root)
 {
   int err;
 
+  w_lock_hold_exit(&w_lock_class_root, &root->lock_hold);
   err = pthread_mutex_unlock(&root->lock);
   if (err != 0) {
     w_log(W_LOG_FATAL, "lock: [%.*s] %s\n",
@@ -358,83 +570,153 @@ void w_timeoutms_to_abs_timespec(int timeoutms, struct timespec *deadline) {
   w_timeval_to_timespec(target, deadline);
 }
 
-/* Ensure that we're synchronized with the state of the
- * filesystem at the current time.
- * We do this by touching a cookie file and waiting to
- * observe it via inotify.  When we see it we know that
- * we've seen everything up to the point in time at which
- * we're asking questions.
- * Returns true if we observe the change within the requested
- * time, false otherwise.
- * Must be called with the root UNLOCKED.  This function
- * will acquire and release the root lock.
- */
-bool w_root_sync_to_now(w_root_t *root, int timeoutms)
+// Creates the cookie file, returning false with errno set on failure
+static bool touch_cookie(w_string_t *path)
 {
-  uint32_t tick;
-  struct watchman_query_cookie cookie;
-  w_string_t *path_str;
   w_stm_t file;
-  int errcode = 0;
-  struct timespec deadline;
+  int errcode;
 
-  if (pthread_cond_init(&cookie.cond, NULL)) {
+  file = w_stm_open(path->buf, O_CREAT|O_TRUNC|O_WRONLY|O_CLOEXEC, 0700);
+  if (!file) {
+    errcode = errno;
+    w_log(W_LOG_ERR, "sync_to_now: creat(%s) failed: %s\n",
+        path->buf, strerror(errcode));
+    errno = errcode;
+    return false;
+  }
+  w_stm_close(file);
+  return true;
+}
+
+/* Lets the watcher look for changes made before the cookie, processing
+ * any that it finds straight away.  The io job may already hold the
+ * cookie's notification, so leaving them in root->pending could let it
+ * see the cookie first.
+ * Must be called with the root locked */
+static bool sync_watcher(w_root_t *root)
+{
+  struct watchman_pending_collection coll;
+  bool complete;
+
+  if (!root->watcher_ops->root_sync) {
+    return true;
+  }
+  if (!w_pending_coll_init(&coll)) {
+    return false;
+  }
+  complete = root->watcher_ops->root_sync(root->watcher, root, &coll);
+  if (w_pending_coll_size(&coll) > 0 && root->done_initial &&
+      !w_root_defer_pending(root, &coll)) {
+    while (w_root_process_pending(root, &coll, false)) {
+      ;
+    }
+  }
+  w_pending_coll_destroy(&coll);
+  if (!complete) {
+    w_metric_inc(&partial_syncs);
+  }
+  return complete;
+}
+
+/* Issue a sync cookie: touch a cookie file whose notification tells
+ * us that we have seen everything up to the point in time at which
+ * it was created.  Use w_root_sync_wait to wait for it to be observed.
+ * Issuing cookies for several roots before waiting for any of them
+ * lets their notifications be processed concurrently.
+ * Returns false, with errno set, if the cookie could not be created.
+ * Must be called with the root UNLOCKED.
+ */
+bool w_root_sync_begin(w_root_t *root, struct watchman_sync *sync)
+{
+  int errcode;
+
+  sync->start = w_metric_now_usec();
+  sync->span = w_trace_begin();
+  sync->path = NULL;
+  sync->partial = false;
+
+  if (pthread_cond_init(&sync->cookie.cond, NULL)) {
     errcode = errno;
     w_log(W_LOG_ERR, "sync_to_now: cond_init failed: %s\n", strerror(errcode));
     errno = errcode;
     return false;
   }
-  cookie.seen = false;
+  sync->cookie.seen = false;
 
   /* generate a cookie name: cookie prefix + id */
   w_root_lock(root);
-  tick = root->ticks++;
-  path_str = w_string_make_printf("%.*s%" PRIu32 "-%" PRIu32,
-                                  root->query_cookie_prefix->len,
-                                  root->query_cookie_prefix->buf,
-                                  root->number, tick);
+  sync->path = w_string_make_printf("%.*s%" PRIu32 "-%" PRIu32,
+                                    root->query_cookie_prefix->len,
+                                    root->query_cookie_prefix->buf,
+                                    root->number, root->ticks++);
   /* insert our cookie in the map */
-  w_ht_set(root->query_cookies, w_ht_ptr_val(path_str),
-      w_ht_ptr_val(&cookie));
+  w_ht_set(root->query_cookies, w_ht_ptr_val(sync->path),
+      w_ht_ptr_val(&sync->cookie));
 
   /* touch the file */
-  file = w_stm_open(path_str->buf, O_CREAT|O_TRUNC|O_WRONLY|O_CLOEXEC, 0700);
-  if (!file) {
+  if (!touch_cookie(sync->path)) {
     errcode = errno;
-    w_log(W_LOG_ERR, "sync_to_now: creat(%s) failed: %s\n",
-        path_str->buf, strerror(errcode));
-    goto out;
+    w_ht_del(root->query_cookies, w_ht_ptr_val(sync->path));
+    w_root_unlock(root);
+    w_string_delref(sync->path);
+    sync->path = NULL;
+    pthread_cond_destroy(&sync->cookie.cond);
+    errno = errcode;
+    return false;
   }
-  w_stm_close(file);
-
-  /* compute deadline */
-  w_timeoutms_to_abs_timespec(timeoutms, &deadline);
+  sync->partial = !sync_watcher(root);
+  w_root_unlock(root);
+  return true;
+}
 
-  w_log(W_LOG_DBG, "sync_to_now [%s] waiting\n", path_str->buf);
+/* Wait until the cookie issued by w_root_sync_begin has been observed,
+ * or until deadline has passed, and release it.
+ * Returns true if we observe the change in time, false otherwise.
+ * Must be called with the root UNLOCKED.  This function
+ * will acquire and release the root lock.
+ */
+bool w_root_sync_wait(w_root_t *root, struct watchman_sync *sync,
+    const struct timespec *deadline)
+{
+  int errcode = 0;
+  bool ready;
 
-  /* timed cond wait (unlocks root lock, reacquires) */
-  while (!cookie.seen) {
-    errcode = pthread_cond_timedwait(&cookie.cond, &root->lock, &deadline);
-    if (errcode && !cookie.seen) {
+  w_root_lock(root);
+  w_log(W_LOG_DBG, "sync_to_now [%s] waiting\n", sync->path->buf);
+
+  /* timed cond wait (unlocks root lock, reacquires).  The crawl gives
+   * up the lock between slices, so also wait for it to finish rather
+   * than let the query see part of the tree */
+  while (!sync->cookie.seen || !root->done_initial) {
+    w_lock_hold_exit(&w_lock_class_root, &root->lock_hold);
+    errcode = pthread_cond_timedwait(&sync->cookie.cond, &root->lock,
+        deadline);
+    w_lock_hold_resume(&w_lock_class_root, &root->lock_hold, W_LOCK_SITE);
+    if (errcode && (!sync->cookie.seen || !root->done_initial)) {
       w_log(W_LOG_ERR,
           "sync_to_now: %s timedwait failed: %d: istimeout=%d %s\n",
-          path_str->buf, errcode, errcode == ETIMEDOUT, strerror(errcode));
-      goto out;
+          sync->path->buf, errcode, errcode == ETIMEDOUT, strerror(errcode));
+      break;
     }
   }
-  w_log(W_LOG_DBG, "sync_to_now [%s] done\n", path_str->buf);
+  ready = sync->cookie.seen && root->done_initial;
+  if (ready) {
+    w_log(W_LOG_DBG, "sync_to_now [%s] done\n", sync->path->buf);
+  }
 
-out:
   // can't unlink the file until after the cookie has been observed because
   // we don't know which file got changed until we look in the cookie dir
-  unlink(path_str->buf);
-  w_ht_del(root->query_cookies, w_ht_ptr_val(path_str));
+  unlink(sync->path->buf);
+  w_ht_del(root->query_cookies, w_ht_ptr_val(sync->path));
   w_root_unlock(root);
 
-  w_string_delref(path_str);
-  pthread_cond_destroy(&cookie.cond);
+  w_string_delref(sync->path);
+  sync->path = NULL;
+  pthread_cond_destroy(&sync->cookie.cond);
+  w_metric_observe_since(&sync_duration, sync->start);
+  w_trace_end("root", "sync_to_now", sync->span, root->root_path->buf);
 
-  if (!cookie.seen) {
+  if (!ready) {
     errno = errcode;
     return false;
   }
@@ -442,11 +724,38 @@ out:
   return true;
 }
 
+/* Ensure that we're synchronized with the state of the
+ * filesystem at the current time.
+ * We do this by touching a cookie file and waiting to
+ * observe it via inotify.  When we see it we know that
+ * we've seen everything up to the point in time at which
+ * we're asking questions.
+ * Returns true if we observe the change within the requested
+ * time, false otherwise.
+ * Must be called with the root UNLOCKED.  This function
+ * will acquire and release the root lock.
+ */
+bool w_root_sync_to_now(w_root_t *root, int timeoutms)
+{
+  struct watchman_sync sync;
+  struct timespec deadline;
+
+  if (!w_root_sync_begin(root, &sync)) {
+    return false;
+  }
+
+  /* compute deadline */
+  w_timeoutms_to_abs_timespec(timeoutms, &deadline);
+
+  return w_root_sync_wait(root, &sync, &deadline);
+}
+
 bool w_root_process_pending(w_root_t *root,
     struct watchman_pending_collection *coll,
     bool pull_from_root)
 {
   struct watchman_pending_fs *p, *pending;
+  uint64_t span;
 
   if (pull_from_root) {
     // You MUST own root->pending lock for this
@@ -460,6 +769,8 @@ bool w_root_process_pending(w_root_t *root,
   w_log(W_LOG_DBG, "processing %d events in %s\n",
       w_ht_size(coll->pending_uniq), root->root_path->buf);
 
+  span = w_trace_begin();
+
   // Steal the contents
   pending = coll->pending;
   coll->pending = NULL;
@@ -471,11 +782,13 @@ bool w_root_process_pending(w_root_t *root,
 
     if (!root->cancelled) {
       w_root_process_path(root, coll, p->path, p->now, p->flags, NULL);
+      w_metric_inc(&pending_processed);
     }
 
     w_pending_fs_free(p);
   }
 
+  w_trace_end("root", "process_pending", span, root->root_path->buf);
   return true;
 }
 
@@ -499,6 +812,7 @@ struct watchman_dir *w_root_resolve_dir(w_root_t *root,
   dir = calloc(1, sizeof(*dir));
   dir->path = dir_name;
   w_string_addref(dir->path);
+  dir->parent = parent;
 
   if (!parent->dirs) {
     parent->dirs = w_ht_new(2, &w_ht_string_funcs);
@@ -507,6 +821,7 @@ struct watchman_dir *w_root_resolve_dir(w_root_t *root,
   assert(w_ht_set(parent->dirs, w_ht_ptr_val(dir_name), w_ht_ptr_val(dir)));
   assert(w_ht_set(root->dirname_to_dir,
         w_ht_ptr_val(dir_name), w_ht_ptr_val(dir)));
+  w_metric_inc(&dirs_tracked);
 
   return dir;
 }
@@ -529,12 +844,12 @@ static void apply_dir_size_hint(w_root_t *root, struct watchman_dir *dir,
 
 static void watch_file(w_root_t *root, struct watchman_file *file)
 {
-  watcher_ops->root_start_watch_file(watcher, root, file);
+  root->watcher_ops->root_start_watch_file(root->watcher, root, file);
 }
 
 static void stop_watching_file(w_root_t *root, struct watchman_file *file)
 {
-  watcher_ops->root_stop_watch_file(watcher, root, file);
+  root->watcher_ops->root_stop_watch_file(root->watcher, root, file);
 }
 
 static void remove_from_file_list(w_root_t *root, struct watchman_file *file)
@@ -550,45 +865,94 @@ static void remove_from_file_list(w_root_t *root, struct watchman_file *file)
   }
 }
 
-static void remove_from_suffix_list(w_root_t *root, struct watchman_file *file)
+// Adds to the summaries of dir and the dirs that contain it
+static void adjust_summaries(struct watchman_dir *dir, int32_t files,
+    int32_t dirs, int64_t bytes)
 {
-  w_string_t *suffix = w_string_suffix(file->name);
-  struct watchman_file *sufhead;
+  for (; dir; dir = dir->parent) {
+    dir->summary.num_files += files;
+    dir->summary.num_dirs += dirs;
+    dir->summary.num_bytes += bytes;
+  }
+}
 
-  if (!suffix) {
-    return;
+// What a counted file with the stat info st adds to the summaries
+static void file_contribution(const struct watchman_stat *st,
+    int32_t *files, int32_t *dirs, int64_t *bytes)
+{
+  if (S_ISDIR(st->mode)) {
+    *files = 0;
+    *dirs = 1;
+    *bytes = 0;
+  } else {
+    *files = 1;
+    *dirs = 0;
+    *bytes = st->size;
   }
+}
 
-  sufhead = w_ht_val_ptr(w_ht_get(root->suffixes, w_ht_ptr_val(suffix)));
-  if (sufhead) {
-    if (file->suffix_prev) {
-      file->suffix_prev->suffix_next = file->suffix_next;
-    }
-    if (file->suffix_next) {
-      file->suffix_next->suffix_prev = file->suffix_prev;
-    }
-    if (sufhead == file) {
-      sufhead = file->suffix_next;
-      w_ht_replace(root->suffixes, w_ht_ptr_val(suffix),
-          w_ht_ptr_val(sufhead));
+/* Brings the summaries of the dirs containing file up to date with its
+ * existence and otime.  Each dir's max_ticks is at least that of the
+ * dirs below it, so the walk up can stop at the first dir that has
+ * already seen a change this recent */
+void w_root_summarize_file(struct watchman_file *file)
+{
+  struct watchman_dir *dir;
+
+  if (file->exists != file->counted) {
+    int32_t files, dirs;
+    int64_t bytes;
+
+    file_contribution(&file->stat, &files, &dirs, &bytes);
+    if (file->exists) {
+      adjust_summaries(file->parent, files, dirs, bytes);
+    } else {
+      adjust_summaries(file->parent, -files, -dirs, -bytes);
     }
+    file->counted = file->exists;
   }
 
-  w_string_delref(suffix);
+  for (dir = file->parent;
+      dir && dir->summary.max_ticks < file->otime.ticks;
+      dir = dir->parent) {
+    dir->summary.max_ticks = file->otime.ticks;
+  }
 }
 
-void w_root_mark_file_changed(w_root_t *root, struct watchman_file *file,
-    struct timeval now)
+// Replaces the stat info of file, keeping the summaries in step
+void w_root_set_file_stat(w_root_t *root, struct watchman_file *file,
+    const struct watchman_stat *st)
 {
-  if (file->exists) {
-    watch_file(root, file);
-  } else {
-    stop_watching_file(root, file);
-  }
+  unsigned rekey = 0;
 
-  file->otime.tv = now;
-  file->otime.ticks = root->ticks;
+  if (file->counted) {
+    int32_t old_files, old_dirs, new_files, new_dirs;
+    int64_t old_bytes, new_bytes;
 
+    file_contribution(&file->stat, &old_files, &old_dirs, &old_bytes);
+    file_contribution(st, &new_files, &new_dirs, &new_bytes);
+    if (old_files != new_files || old_dirs != new_dirs ||
+        old_bytes != new_bytes) {
+      adjust_summaries(file->parent, new_files - old_files,
+          new_dirs - old_dirs, new_bytes - old_bytes);
+    }
+  }
+  if (file->stat.size != st->size) {
+    rekey |= W_INDEX_BIT(W_INDEX_SIZE);
+  }
+  if (file->stat.mtime.tv_sec != st->mtime.tv_sec) {
+    rekey |= W_INDEX_BIT(W_INDEX_MTIME);
+  }
+  w_root_unindex_file(root, file, rekey);
+  memcpy(&file->stat, st, sizeof(file->stat));
+  w_root_index_file(root, file, rekey);
+  w_root_summarize_file(file);
+}
+
+// Moves file to the head of the recency list, unlinking it first if it
+// is already on the list
+void w_root_make_latest_file(w_root_t *root, struct watchman_file *file)
+{
   if (root->latest_file != file) {
     // unlink from list
     remove_from_file_list(root, file);
@@ -601,6 +965,22 @@ void w_root_mark_file_changed(w_root_t *root, struct watchman_file *file,
     file->prev = NULL;
     root->latest_file = file;
   }
+}
+
+void w_root_mark_file_changed(w_root_t *root, struct watchman_file *file,
+    struct timeval now)
+{
+  if (file->exists) {
+    watch_file(root, file);
+  } else {
+    stop_watching_file(root, file);
+  }
+
+  file->otime.tv = now;
+  file->otime.ticks = root->ticks;
+  w_root_summarize_file(file);
+
+  w_root_make_latest_file(root, file);
 
   // Flag that we have pending trigger info
   root->pending_trigger_tick = root->ticks;
@@ -611,8 +991,7 @@ struct watchman_file *w_root_resolve_file(w_root_t *root,
     struct watchman_dir *dir, w_string_t *file_name,
     struct timeval now)
 {
-  struct watchman_file *file, *sufhead;
-  w_string_t *suffix;
+  struct watchman_file *file;
 
   if (dir->files) {
     file = w_ht_val_ptr(w_ht_get(dir->files, w_ht_ptr_val(file_name)));
@@ -624,6 +1003,8 @@ struct watchman_file *w_root_resolve_file(w_root_t *root,
   }
 
   file = calloc(1, sizeof(*file));
+  w_metric_inc(&files_tracked);
+  root->num_files++;
   file->name = file_name;
   w_string_addref(file->name);
   file->parent = dir;
@@ -631,18 +1012,10 @@ struct watchman_file *w_root_resolve_file(w_root_t *root,
   file->ctime.ticks = root->ticks;
   file->ctime.tv = now;
 
-  suffix = w_string_suffix(file_name);
-  if (suffix) {
-    sufhead = w_ht_val_ptr(w_ht_get(root->suffixes, w_ht_ptr_val(suffix)));
-    file->suffix_next = sufhead;
-    if (sufhead) {
-      sufhead->suffix_prev = file;
-    }
-    w_ht_replace(root->suffixes, w_ht_ptr_val(suffix), w_ht_ptr_val(file));
-    w_string_delref(suffix);
-  }
-
+  w_root_index_suffix(root, file);
   w_ht_set(dir->files, w_ht_ptr_val(file->name), w_ht_ptr_val(file));
+  w_root_index_file(root, file, W_INDEX_ALL);
+  w_bloom_note_file(file);
   watch_file(root, file);
 
   return file;
@@ -661,7 +1034,7 @@ void stop_watching_dir(w_root_t *root, struct watchman_dir *dir)
     stop_watching_dir(root, child);
   } while (w_ht_next(dir->dirs, &i));
 
-  watcher_ops->root_stop_watch_dir(watcher, root, dir);
+  root->watcher_ops->root_stop_watch_dir(root->watcher, root, dir);
 }
 
 static bool did_file_change(struct watchman_stat *saved,
@@ -806,9 +1179,12 @@ static void stat_path(w_root_t *root,
   struct watchman_file *file = NULL;
   w_string_t *dir_name;
   w_string_t *file_name;
+  enum w_ignore_result ignore;
 
-  if (w_ht_get(root->ignore_dirs, w_ht_ptr_val(full_path))) {
-    w_log(W_LOG_DBG, "%.*s matches ignore_dir rules\n",
+  ignore = w_ignore_check(&root->ignore, root->root_path, full_path->buf,
+      full_path->len);
+  if (ignore == W_IGNORE_SELF) {
+    w_log(W_LOG_DBG, "%.*s matches ignore rules\n",
         full_path->len, full_path->buf);
     return;
   }
@@ -1010,7 +1386,9 @@ static void stat_path(w_root_t *root,
     if (!file->exists) {
       /* we're transitioning from deleted to existing,
        * so we're effectively new again */
+      w_root_unindex_file(root, file, W_INDEX_BIT(W_INDEX_CCLOCK));
       file->ctime.ticks = root->ticks;
+      w_root_index_file(root, file, W_INDEX_BIT(W_INDEX_CCLOCK));
       file->ctime.tv = now;
       /* if a dir was deleted and now exists again, we want
        * to crawl it again */
@@ -1029,7 +1407,7 @@ static void stat_path(w_root_t *root,
       w_root_mark_file_changed(root, file, now);
     }
 
-    memcpy(&file->stat, &st, sizeof(file->stat));
+    w_root_set_file_stat(root, file, &st);
 
     if (S_ISDIR(st.mode)) {
       if (dir_ent == NULL) {
@@ -1037,12 +1415,12 @@ static void stat_path(w_root_t *root,
       }
 
       // Don't recurse if our parent is an ignore dir
-      if (!w_ht_get(root->ignore_vcs, w_ht_ptr_val(dir_name)) ||
+      if (ignore != W_IGNORE_CONTENTS ||
           // but do if we're looking at the cookie dir (stat_path is never
           // called for the root itself)
           w_string_equal(full_path, root->query_cookie_dir)) {
 
-        if (!watcher_ops->flags & WATCHER_HAS_PER_FILE_NOTIFICATIONS) {
+        if (!root->watcher_ops->flags & WATCHER_HAS_PER_FILE_NOTIFICATIONS) {
           /* we always need to crawl, but may not need to be fully recursive */
           w_pending_coll_add(coll, full_path, now,
               W_PENDING_CRAWL_ONLY | (recursive ? W_PENDING_RECURSIVE : 0));
@@ -1063,7 +1441,7 @@ static void stat_path(w_root_t *root,
       // our former tree here
       w_root_mark_deleted(root, dir_ent, now, true);
     }
-    if ((watcher_ops->flags & WATCHER_HAS_PER_FILE_NOTIFICATIONS) &&
+    if ((root->watcher_ops->flags & WATCHER_HAS_PER_FILE_NOTIFICATIONS) &&
         !S_ISDIR(st.mode) &&
         !w_string_equal(dir_name, root->root_path)) {
       /* Make sure we update the mtime on the parent directory. */
@@ -1103,7 +1481,7 @@ void w_root_process_path(w_root_t *root,
   if (w_string_startswith(full_path, root->query_cookie_prefix)) {
     struct watchman_query_cookie *cookie;
     bool consider_cookie =
-      (watcher_ops->flags & WATCHER_HAS_PER_FILE_NOTIFICATIONS) ?
+      (root->watcher_ops->flags & WATCHER_HAS_PER_FILE_NOTIFICATIONS) ?
       ((flags & W_PENDING_VIA_NOTIFY) || !root->done_initial) : true;
 
     if (!consider_cookie) {
@@ -1127,10 +1505,19 @@ void w_root_process_path(w_root_t *root,
 
   if (w_string_equal(full_path, root->root_path)
       || flags & W_PENDING_CRAWL_ONLY) {
-    crawler(root, coll, full_path, now, flags & W_PENDING_RECURSIVE);
+    uint64_t span = w_trace_begin();
+
+    crawler(root, coll, full_path, now, flags & W_PENDING_RECURSIVE,
+        flags & W_PENDING_RESCAN);
+    w_trace_end("root", "crawler", span, full_path->buf);
   } else {
     stat_path(root, coll, full_path, now, flags & W_PENDING_RECURSIVE,
         flags & W_PENDING_VIA_NOTIFY, pre_stat);
+    // This includes the crawl, which finds changes made before we
+    // began to receive notifications
+    if (is_root_config_path(root, full_path)) {
+      reload_root_config(root);
+    }
   }
 }
 
@@ -1251,7 +1638,7 @@ void set_poison_state(w_root_t *root, w_string_t *dir,
 }
 
 static void crawler(w_root_t *root, struct watchman_pending_collection *coll,
-    w_string_t *dir_name, struct timeval now, bool recursive)
+    w_string_t *dir_name, struct timeval now, bool recursive, bool rescan)
 {
   struct watchman_dir *dir;
   struct watchman_file *file;
@@ -1261,8 +1648,12 @@ static void crawler(w_root_t *root, struct watchman_pending_collection *coll,
   char path[WATCHMAN_NAME_MAX];
   bool stat_all = false;
 
-  if (watcher_ops->flags & WATCHER_HAS_PER_FILE_NOTIFICATIONS) {
-    stat_all = watcher_ops->flags & WATCHER_COALESCED_RENAME;
+  if (rescan) {
+    // We're here because something in the dir changed, but we weren't
+    // told what
+    stat_all = true;
+  } else if (root->watcher_ops->flags & WATCHER_HAS_PER_FILE_NOTIFICATIONS) {
+    stat_all = root->watcher_ops->flags & WATCHER_COALESCED_RENAME;
   } else {
     // If the watcher doesn't give us per-file notifications for
     // watched dirs, then we'll end up explicitly tracking them
@@ -1282,7 +1673,8 @@ static void crawler(w_root_t *root, struct watchman_pending_collection *coll,
   /* Start watching and open the dir for crawling.
    * Whether we open the dir prior to watching or after is watcher specific,
    * so the operations are rolled together in our abstraction */
-  osdir = watcher_ops->root_start_watch_dir(watcher, root, dir, now, path);
+  osdir = root->watcher_ops->root_start_watch_dir(root->watcher, root, dir,
+      now, path);
   if (!osdir) {
     return;
   }
@@ -1303,7 +1695,7 @@ static void crawler(w_root_t *root, struct watchman_pending_collection *coll,
     // We just pass it through for the dir size hint and the hash
     // table implementation will round that up to the next power of 2
     apply_dir_size_hint(root, dir, num_dirs,
-        (uint32_t)cfg_get_int(root, "hint_num_files_per_dir", 64));
+        root->config.hint_num_files_per_dir);
   }
 
   /* flag for delete detection */
@@ -1339,8 +1731,9 @@ static void crawler(w_root_t *root, struct watchman_pending_collection *coll,
       w_string_t *full_path = w_string_path_cat_cstr(dir->path,
                                 dirent->d_name);
       if (full_path) {
+        // Known subdirs of a rescanned dir are rescanned on their own
         w_root_process_path(root, coll, full_path, now,
-            W_PENDING_RECURSIVE, dirent);
+            (recursive || !rescan) ? W_PENDING_RECURSIVE : 0, dirent);
         w_string_delref(full_path);
       } else {
         w_log(W_LOG_ERR, "OOM during crawl\n");
@@ -1406,8 +1799,9 @@ static void process_subscriptions(w_root_t *root)
 {
   w_ht_iter_t iter;
   bool vcs_in_progress;
+  uint64_t span = w_trace_begin();
 
-  pthread_mutex_lock(&w_client_lock);
+  w_clients_lock();
 
   if (!w_ht_first(clients, &iter)) {
     // No subscribers
@@ -1425,6 +1819,7 @@ static void process_subscriptions(w_root_t *root)
 
     if (w_ht_first(client->subscriptions, &citer)) do {
       struct watchman_client_subscription *sub = w_ht_val_ptr(citer.value);
+      uint64_t sub_span;
 
       if (sub->root != root) {
         w_log(W_LOG_DBG, "root doesn't match, skipping\n");
@@ -1445,14 +1840,18 @@ static void process_subscriptions(w_root_t *root)
         continue;
       }
 
+      sub_span = w_trace_begin();
       w_run_subscription_rules(client, sub, root);
+      w_trace_end("subscription", "run_subscription", sub_span,
+          sub->name->buf);
       sub->last_sub_tick = root->pending_sub_tick;
 
     } while (w_ht_next(client->subscriptions, &citer));
 
   } while (w_ht_next(clients, &iter));
 done:
-  pthread_mutex_unlock(&w_client_lock);
+  w_clients_unlock();
+  w_trace_end("root", "process_subscriptions", span, root->root_path->buf);
 }
 
 /* process any pending triggers.
@@ -1509,7 +1908,7 @@ static bool handle_should_recrawl(w_root_t *root)
       w_root_cancel(root);
     }
     root->recrawl_count++;
-    if (!watcher_ops->root_start(watcher, root)) {
+    if (!root->watcher_ops->root_start(root->watcher, root)) {
       w_log(W_LOG_ERR, "failed to start root %.*s, cancelling watch: %.*s\n",
           root->root_path->len, root->root_path->buf,
           root->failure_reason->len, root->failure_reason->buf);
@@ -1523,20 +1922,22 @@ static bool handle_should_recrawl(w_root_t *root)
 
 static bool wait_for_notify(w_root_t *root, int timeoutms)
 {
-  return watcher_ops->root_wait_notify(watcher, root, timeoutms);
+  return root->watcher_ops->root_wait_notify(root->watcher, root, timeoutms);
 }
 
 static bool consume_notify(w_root_t *root,
     struct watchman_pending_collection *coll)
 {
-  return watcher_ops->root_consume_notify(watcher, root, coll);
+  return root->watcher_ops->root_consume_notify(root->watcher, root, coll);
 }
 
-static void free_file_node(struct watchman_file *file)
+static void free_file_node(w_root_t *root, struct watchman_file *file)
 {
-  watcher_ops->file_free(watcher, file);
+  root->watcher_ops->file_free(root->watcher, file);
   w_string_delref(file->name);
   free(file);
+  w_metric_dec(&files_tracked);
+  root->num_files--;
 }
 
 static void record_aged_out_dir(w_root_t *root, w_ht_t *aged_dir_names,
@@ -1568,7 +1969,9 @@ static void age_out_file(w_root_t *root, w_ht_t *aged_dir_names,
 
   // And remove from the overall file list
   remove_from_file_list(root, file);
-  remove_from_suffix_list(root, file);
+  w_root_unindex_suffix(root, file);
+  w_root_unindex_file(root, file, W_INDEX_ALL);
+  w_bloom_forget_file(file);
 
   full_name = w_string_path_cat(file->parent->path, file->name);
 
@@ -1601,7 +2004,7 @@ static void age_out_file(w_root_t *root, w_ht_t *aged_dir_names,
 
   // And free it.  We don't need to stop watching it, because we already
   // stopped watching it when we marked it as !exists
-  free_file_node(file);
+  free_file_node(root, file);
 
   w_string_delref(full_name);
 }
@@ -1671,11 +2074,11 @@ void w_root_perform_age_out(w_root_t *root, int min_age)
   } while (w_ht_next(root->cursors, &i));
 }
 
-static bool root_has_subscriptions(w_root_t *root) {
+bool w_root_has_subscriptions(w_root_t *root) {
   bool has_subscribers = false;
   w_ht_iter_t iter;
 
-  pthread_mutex_lock(&w_client_lock);
+  w_clients_lock();
   if (w_ht_first(clients, &iter)) do {
     struct watchman_client *client = w_ht_val_ptr(iter.value);
     w_ht_iter_t citer;
@@ -1690,7 +2093,7 @@ static bool root_has_subscriptions(w_root_t *root) {
 
     } while (w_ht_next(client->subscriptions, &citer));
   } while (!has_subscribers && w_ht_next(clients, &iter));
-  pthread_mutex_unlock(&w_client_lock);
+  w_clients_unlock();
   return has_subscribers;
 }
 
@@ -1698,18 +2101,18 @@ static void consider_age_out(w_root_t *root)
 {
   time_t now;
 
-  if (root->gc_interval == 0) {
+  if (root->config.gc_interval == 0) {
     return;
   }
 
   time(&now);
 
-  if (now <= root->last_age_out_timestamp + root->gc_interval) {
+  if (now <= root->last_age_out_timestamp + root->config.gc_interval) {
     // Don't check too often
     return;
   }
 
-  w_root_perform_age_out(root, root->gc_age);
+  w_root_perform_age_out(root, root->config.gc_age);
 }
 
 // This is a little tricky.  We have to be called with root->lock
@@ -1718,23 +2121,24 @@ static void consider_age_out(w_root_t *root)
 static bool consider_reap(w_root_t *root) {
   time_t now;
 
-  if (root->idle_reap_age == 0) {
+  if (root->config.idle_reap_age == 0) {
     return false;
   }
 
   time(&now);
 
-  if (now > root->last_cmd_timestamp + root->idle_reap_age &&
+  if (now > root->last_cmd_timestamp + root->config.idle_reap_age &&
       (root->commands == NULL || w_ht_size(root->commands) == 0) &&
       (now > root->last_reap_timestamp) &&
-      !root_has_subscriptions(root)) {
+      !w_root_has_subscriptions(root)) {
     // We haven't had any activity in a while, and there are no registered
     // triggers or subscriptions against this watch.
     w_log(W_LOG_ERR, "root %.*s has had no activity in %d seconds and has "
         "no triggers or subscriptions, cancelling watch.  "
         "Set idle_reap_age_seconds in your .watchmanconfig to control "
         "this behavior\n",
-        root->root_path->len, root->root_path->buf, root->idle_reap_age);
+        root->root_path->len, root->root_path->buf,
+        root->config.idle_reap_age);
     return true;
   }
 
@@ -1743,11 +2147,96 @@ static bool consider_reap(w_root_t *root) {
   return false;
 }
 
+// Hand a batch of notifications over to the io job
+static void publish_notify_batch(w_root_t *root,
+    struct watchman_pending_collection *pending)
+{
+  if (w_pending_coll_size(pending) > 0) {
+    w_metric_observe(&notify_batch, w_pending_coll_size(pending));
+    w_pending_coll_lock(&root->pending);
+    w_pending_coll_append(&root->pending, pending);
+    w_pending_coll_ping(&root->pending);
+    w_pending_coll_unlock(&root->pending);
+  }
+}
+
+// Signal root_start that the watcher has been started
+static void signal_notify_started(w_root_t *root)
+{
+  w_pending_coll_lock(&root->pending);
+  root->pending.pinged = true;
+  w_pending_coll_ping(&root->pending);
+  w_pending_coll_unlock(&root->pending);
+}
+
 // we want to consume inotify events as quickly as possible
 // to minimize the risk that the kernel event buffer overflows,
-// so we do this as a blocking thread that reads the inotify
-// descriptor and then queues the filesystem IO work until after
-// we have drained the inotify descriptor
+// so we drain the notification descriptor and then queue the
+// filesystem IO work for the io job.  This runs on the shared
+// pool whenever the watcher's descriptor is readable.
+static bool notify_job(void *arg, bool kicked)
+{
+  w_root_t *root = arg;
+  struct watchman_pending_collection *pending = &root->notify_pending;
+  bool more = false;
+  unused_parameter(kicked);
+
+  if (!root->notify_started) {
+    root->notify_started = true;
+    if (!root->watcher_ops->root_start(root->watcher, root)) {
+      w_log(W_LOG_ERR, "failed to start root %.*s, cancelling watch: %.*s\n",
+          root->root_path->len, root->root_path->buf,
+          root->failure_reason->len, root->failure_reason->buf);
+      w_root_cancel(root);
+    }
+    signal_notify_started(root);
+  }
+
+  if (root->cancelled) {
+    return false;
+  }
+
+  while (wait_for_notify(root, 0) && consume_notify(root, pending)) {
+    if (w_pending_coll_size(pending) >= WATCHMAN_BATCH_LIMIT) {
+      more = true;
+      break;
+    }
+  }
+  publish_notify_batch(root, pending);
+
+  w_root_lock(root);
+  handle_should_recrawl(root);
+  w_root_unlock(root);
+
+  if (root->cancelled) {
+    return false;
+  }
+
+  if (more) {
+    // Let other jobs have a turn before we drain the rest
+    w_pool_job_kick(root->notify_job);
+    return true;
+  }
+  if (!w_pool_job_arm_fd(root->notify_job,
+        root->watcher_ops->root_notify_fd(root->watcher, root))) {
+    w_log(W_LOG_ERR, "unable to wait for notifications on %.*s, "
+        "cancelling watch\n",
+        root->root_path->len, root->root_path->buf);
+    w_root_cancel(root);
+    return false;
+  }
+  if (root->watcher_ops->root_timer_ms) {
+    int timeoutms = root->watcher_ops->root_timer_ms(root->watcher, root);
+
+    if (timeoutms >= 0) {
+      w_pool_job_run_after(root->notify_job, timeoutms);
+    }
+  }
+  return true;
+}
+
+// Used instead of notify_job for watchers that have no descriptor
+// to multiplex, or that have their own threads
 static void notify_thread(w_root_t *root)
 {
   struct watchman_pending_collection pending;
@@ -1757,7 +2246,7 @@ static void notify_thread(w_root_t *root)
     return;
   }
 
-  if (!watcher_ops->root_start(watcher, root)) {
+  if (!root->watcher_ops->root_start(root->watcher, root)) {
     w_log(W_LOG_ERR, "failed to start root %.*s, cancelling watch: %.*s\n",
         root->root_path->len, root->root_path->buf,
         root->failure_reason->len, root->failure_reason->buf);
@@ -1767,11 +2256,8 @@ static void notify_thread(w_root_t *root)
   }
 
   // signal that we're done here, so that we can start the
-  // io thread after this point
-  w_pending_coll_lock(&root->pending);
-  root->pending.pinged = true;
-  w_pending_coll_ping(&root->pending);
-  w_pending_coll_unlock(&root->pending);
+  // io job after this point
+  signal_notify_started(root);
 
   while (!root->cancelled) {
     // big number because not all watchers can deal with
@@ -1785,12 +2271,7 @@ static void notify_thread(w_root_t *root)
           break;
         }
       }
-      if (w_pending_coll_size(&pending) > 0) {
-        w_pending_coll_lock(&root->pending);
-        w_pending_coll_append(&root->pending, &pending);
-        w_pending_coll_ping(&root->pending);
-        w_pending_coll_unlock(&root->pending);
-      }
+      publish_notify_batch(root, &pending);
     }
 
     w_root_lock(root);
@@ -1801,113 +2282,202 @@ static void notify_thread(w_root_t *root)
   w_pending_coll_destroy(&pending);
 }
 
-static void io_thread(w_root_t *root)
+// Upper bound on the io job's sleep delay, in milliseconds
+static int io_max_timeout(w_root_t *root)
 {
-  int timeoutms, biggest_timeout;
-  struct watchman_pending_collection pending;
+  // These options are measured in seconds
+  int biggest_timeout = root->config.gc_interval;
 
-  timeoutms = root->trigger_settle;
-
-  // Upper bound on sleep delay.  These options are measured in seconds.
-  biggest_timeout = root->gc_interval;
   if (biggest_timeout == 0 ||
-      (root->idle_reap_age != 0 && root->idle_reap_age < biggest_timeout)) {
-    biggest_timeout = root->idle_reap_age;
+      (root->config.idle_reap_age != 0 &&
+       root->config.idle_reap_age < biggest_timeout)) {
+    biggest_timeout = root->config.idle_reap_age;
   }
   if (biggest_timeout == 0) {
     biggest_timeout = 86400;
   }
-  // And convert to milliseconds
-  biggest_timeout *= 1000;
+  return biggest_timeout * 1000;
+}
 
-  w_pending_coll_init(&pending);
+// Wakes the syncs that were waiting for the crawl to finish
+static void signal_cookies(w_root_t *root)
+{
+  w_ht_iter_t iter;
 
-  while (!root->cancelled) {
-    bool pinged;
+  if (w_ht_first(root->query_cookies, &iter)) do {
+    struct watchman_query_cookie *cookie = w_ht_val_ptr(iter.value);
 
-    if (!root->done_initial) {
-      struct timeval start;
+    pthread_cond_signal(&cookie->cond);
+  } while (w_ht_next(root->query_cookies, &iter));
+}
 
-      /* first order of business is to find all the files under our root */
-      if (cfg_get_bool(root, "iothrottle", false)) {
-        w_ioprio_set_low();
-      }
-      w_root_lock(root);
-      gettimeofday(&start, NULL);
-      w_pending_coll_add(&root->pending, root->root_path, start, 0);
-      while (w_root_process_pending(root, &pending, true)) {
-        ;
-      }
-      root->done_initial = true;
-      w_root_unlock(root);
-      if (cfg_get_bool(root, "iothrottle", false)) {
-        w_ioprio_set_normal();
-      }
+/* Crawls the root for up to CRAWL_SLICE_USEC and then gives the pool
+ * worker and the root lock back, so that a big root can't hold either
+ * for the whole of its crawl; pending holds the dirs that are still to
+ * be crawled.  Returns true once the crawl is complete */
+static bool crawl_slice(w_root_t *root,
+    struct watchman_pending_collection *pending)
+{
+  uint64_t slice_start = w_metric_now_usec();
+  uint64_t crawl_start;
+  struct watchman_pending_fs *p;
+  bool throttle, done = false;
 
-      w_log(W_LOG_ERR, "%scrawl complete\n", root->recrawl_count ? "re" : "");
-      timeoutms = root->trigger_settle;
+  w_metric_inc(&crawl_slices);
+  w_root_lock(root);
+  throttle = root->config.iothrottle;
+  if (throttle) {
+    w_ioprio_set_low();
+  }
+  if (!root->crawl_started) {
+    struct timeval start;
+
+    // Left over from a crawl that a recrawl interrupted
+    w_pending_coll_drain(pending);
+    root->crawl_started = true;
+    root->crawl_start_usec = slice_start;
+    gettimeofday(&start, NULL);
+    if (root->recrawl_count == 0 && w_journal_restore(root)) {
+      // We have the tree from before a restart; a recursive crawl will
+      // stat every node in it and so verify it against the filesystem
+      w_pending_coll_add(pending, root->root_path, start,
+          W_PENDING_RECURSIVE);
+    } else {
+      w_pending_coll_add(pending, root->root_path, start, 0);
     }
+  }
 
-    // Wait for the notify thread to give us pending items, or for
-    // the settle period to expire
-    w_log(W_LOG_DBG, "poll_events timeout=%dms\n", timeoutms);
-    pinged = w_pending_coll_lock_and_wait(&root->pending, timeoutms);
-    w_log(W_LOG_DBG, " ... wake up (pinged=%s)\n", pinged ? "true" : "false");
-    w_pending_coll_append(&pending, &root->pending);
-    w_pending_coll_unlock(&root->pending);
+  w_pending_coll_lock(&root->pending);
+  w_pending_coll_append(pending, &root->pending);
+  w_pending_coll_unlock(&root->pending);
 
-    if (!pinged && w_pending_coll_size(&pending) == 0) {
-      // No new pending items were given to us, so consider that
-      // we may not be settled.
+  while ((p = w_pending_coll_pop(pending)) != NULL) {
+    // Unlike w_root_process_pending, we may leave items behind
+    w_ht_del(pending->pending_uniq, w_ht_ptr_val(p->path));
+    if (!root->cancelled) {
+      w_root_process_path(root, pending, p->path, p->now, p->flags, NULL);
+      w_metric_inc(&pending_processed);
+    }
+    w_pending_fs_free(p);
+    if (w_metric_now_usec() - slice_start >= CRAWL_SLICE_USEC) {
+      break;
+    }
+  }
 
-      w_root_lock(root);
-      if (!root->done_initial) {
-        // we need to recrawl, stop what we're doing here
-        w_root_unlock(root);
-        continue;
-      }
+  crawl_start = root->crawl_start_usec;
+  if (!pending->pending) {
+    root->done_initial = true;
+    w_journal_checkpoint(root);
+    signal_cookies(root);
+    done = true;
+  }
+  w_root_unlock(root);
+  if (throttle) {
+    w_ioprio_set_normal();
+  }
 
-      process_subscriptions(root);
-      process_triggers(root);
-      if (consider_reap(root)) {
-        w_root_unlock(root);
-        w_root_stop_watch(root);
-        break;
-      }
-      consider_age_out(root);
-      w_root_unlock(root);
+  if (done) {
+    w_metric_observe_since(&crawl_duration, crawl_start);
+    w_log(W_LOG_ERR, "%scrawl complete\n", root->recrawl_count ? "re" : "");
+  }
+  return done;
+}
 
-      timeoutms = MIN(biggest_timeout, timeoutms * 2);
-      continue;
+/* Crawls, processes pending items and, once things have settled,
+ * dispatches subscriptions and triggers.  Runs on the shared pool; it is
+ * kicked whenever root->pending is pinged and otherwise reschedules
+ * itself after the settle period, backing off while idle */
+static bool io_job(void *arg, bool kicked)
+{
+  w_root_t *root = arg;
+  struct watchman_pending_collection *pending = &root->io_pending;
+
+  if (root->cancelled) {
+    return false;
+  }
+
+  if (!root->done_initial) {
+    /* first order of business is to find all the files under our root */
+    if (!crawl_slice(root, pending)) {
+      // Let other jobs have a turn before we crawl some more
+      w_pool_job_kick(root->io_job);
+      return true;
     }
+    root->io_timeoutms = root->config.trigger_settle;
+  }
 
-    // Otherwise we have pending items to stat and crawl
+  // Pick up whatever the notify side has given us
+  w_log(W_LOG_DBG, "io job wake up (kicked=%s)\n", kicked ? "true" : "false");
+  w_pending_coll_lock(&root->pending);
+  root->pending.pinged = false;
+  w_pending_coll_append(pending, &root->pending);
+  w_pending_coll_unlock(&root->pending);
 
-    // We are now, by definition, unsettled, so reduce sleep timeout
-    // to the settle duration ready for the next loop through
-    timeoutms = root->trigger_settle;
+  if (!kicked && w_pending_coll_size(pending) == 0) {
+    // No new pending items were given to us during the settle
+    // period, so consider that we may now be settled.
 
     w_root_lock(root);
     if (!root->done_initial) {
-      // we need to recrawl.  Discard these notifications
-      w_pending_coll_drain(&pending);
+      // we need to recrawl, stop what we're doing here
       w_root_unlock(root);
-      continue;
+      w_pool_job_kick(root->io_job);
+      return true;
     }
 
-    root->ticks++;
-    // If we're not settled, we need an opportunity to age out
-    // dead file nodes.  This happens in the test harness.
+    process_subscriptions(root);
+    process_triggers(root);
+    if (consider_reap(root)) {
+      w_root_unlock(root);
+      w_root_stop_watch(root);
+      return false;
+    }
     consider_age_out(root);
+    w_root_unlock(root);
 
-    while (w_root_process_pending(root, &pending, false)) {
-      ;
-    }
+    root->io_timeoutms = MIN(io_max_timeout(root), root->io_timeoutms * 2);
+    w_log(W_LOG_DBG, "io job sleeping for %dms\n", root->io_timeoutms);
+    w_pool_job_run_after(root->io_job, root->io_timeoutms);
+    return true;
+  }
+
+  // Otherwise we have pending items to stat and crawl
 
+  // We are now, by definition, unsettled, so reduce sleep timeout
+  // to the settle duration ready for the next run
+  root->io_timeoutms = root->config.trigger_settle;
+
+  w_root_lock(root);
+  if (!root->done_initial) {
+    // we need to recrawl.  Discard these notifications
+    w_pending_coll_drain(pending);
     w_root_unlock(root);
+    w_pool_job_kick(root->io_job);
+    return true;
   }
 
-  w_pending_coll_destroy(&pending);
+  if (w_root_defer_pending(root, pending)) {
+    // The tree is evicted; these will be processed when it's reloaded
+    w_root_unlock(root);
+    w_pool_job_run_after(root->io_job, root->io_timeoutms);
+    return true;
+  }
+
+  root->ticks++;
+  // If we're not settled, we need an opportunity to age out
+  // dead file nodes.  This happens in the test harness.
+  consider_age_out(root);
+
+  while (w_root_process_pending(root, pending, false)) {
+    ;
+  }
+  w_journal_flush(root);
+
+  w_root_unlock(root);
+
+  w_evict_check();
+  w_pool_job_run_after(root->io_job, root->io_timeoutms);
+  return true;
 }
 
 /* This function always returns a buffer that needs to
@@ -1953,32 +2523,49 @@ void w_root_addref(w_root_t *root)
   w_refcnt_add(&root->refcnt);
 }
 
-static void w_root_teardown(w_root_t *root)
+// Frees the in-memory view of the tree
+static void free_tree(w_root_t *root)
 {
   struct watchman_file *file;
 
-  watcher_ops->root_dtor(watcher, root);
-
   if (root->dirname_to_dir) {
     w_ht_free(root->dirname_to_dir);
     root->dirname_to_dir = NULL;
   }
-  w_pending_coll_drain(&root->pending);
 
+  w_root_free_indexes(root, W_INDEX_ALL);
   while (root->latest_file) {
     file = root->latest_file;
     root->latest_file = file->next;
-    free_file_node(file);
+    free_file_node(root, file);
   }
 
+  w_root_free_suffix_index(root);
+}
+
+/* Discards the tree, leaving only the root dir.  The watches are not
+ * touched, so this is only safe for watchers that keep no state in the
+ * file and dir nodes (WATCHER_TREE_EVICTABLE).
+ * Must be called with the root locked */
+void w_root_reset_tree(w_root_t *root)
+{
+  free_tree(root);
+  init_tree(root);
+}
+
+static void w_root_teardown(w_root_t *root)
+{
+  root->watcher_ops->root_dtor(root->watcher, root);
+
+  free_tree(root);
+  w_pending_coll_drain(&root->pending);
+  w_root_discard_snapshot(root);
+  w_journal_close(root);
+
   if (root->cursors) {
     w_ht_free(root->cursors);
     root->cursors = NULL;
   }
-  if (root->suffixes) {
-    w_ht_free(root->suffixes);
-    root->suffixes = NULL;
-  }
 }
 
 void w_root_delref(w_root_t *root)
@@ -1992,8 +2579,7 @@ void w_root_delref(w_root_t *root)
 
   pthread_mutex_destroy(&root->lock);
   w_string_delref(root->root_path);
-  w_ht_free(root->ignore_vcs);
-  w_ht_free(root->ignore_dirs);
+  w_ignore_destroy(&root->ignore);
   w_ht_free(root->commands);
   w_ht_free(root->query_cookies);
 
@@ -2018,6 +2604,15 @@ void w_root_delref(w_root_t *root)
     w_string_delref(root->query_cookie_prefix);
   }
   w_pending_coll_destroy(&root->pending);
+  w_pending_coll_destroy(&root->notify_pending);
+  w_pending_coll_destroy(&root->io_pending);
+  w_pending_coll_destroy(&root->evicted_pending);
+  if (root->notify_job) {
+    w_pool_job_free(root->notify_job);
+  }
+  if (root->io_job) {
+    w_pool_job_free(root->io_job);
+  }
 
   free(root);
   w_refcnt_del(&live_roots);
@@ -2052,30 +2647,36 @@ void watchman_watcher_init(void) {
   watched_roots = w_ht_new(4, &root_funcs);
 
 #if HAVE_FSEVENTS
-  watcher_ops = &fsevents_watcher;
+  default_ops = &fsevents_watcher;
 #elif defined(HAVE_PORT_CREATE)
   // We prefer portfs if you have both portfs and inotify on the assumption
   // that this is an Illumos based system with both and that the native
   // mechanism will yield more correct behavior.
   // https://github.com/facebook/watchman/issues/84
-  watcher_ops = &portfs_watcher;
+  default_ops = &portfs_watcher;
 #elif defined(HAVE_INOTIFY_INIT)
-  watcher_ops = &inotify_watcher;
+  default_ops = &inotify_watcher;
 #elif defined(HAVE_KQUEUE)
-  watcher_ops = &kqueue_watcher;
+  default_ops = &kqueue_watcher;
 #elif defined(_WIN32)
-  watcher_ops = &win32_watcher;
+  default_ops = &win32_watcher;
 #else
-# error you need to assign watcher_ops for this system
+# error you need to assign default_ops for this system
 #endif
 
-  watcher = watcher_ops->global_init();
+  default_watcher = default_ops->global_init();
+#ifndef _WIN32
+  poll_global = poll_watcher.global_init();
+#endif
 
-  w_log(W_LOG_ERR, "Using watcher mechanism %s\n", watcher_ops->name);
+  w_log(W_LOG_ERR, "Using watcher mechanism %s\n", default_ops->name);
 }
 
 void watchman_watcher_dtor(void) {
-  watcher_ops->global_dtor(watcher);
+  default_ops->global_dtor(default_watcher);
+#ifndef _WIN32
+  poll_watcher.global_dtor(poll_global);
+#endif
 }
 
 // Must not be called with root->lock held :-/
@@ -2088,6 +2689,7 @@ static bool remove_root_from_watched(w_root_t *root)
   if (w_ht_val_ptr(w_ht_get(watched_roots, w_ht_ptr_val(root->root_path))) ==
       root) {
     w_ht_del(watched_roots, w_ht_ptr_val(root->root_path));
+    w_metric_dec(&roots_watched);
     removed = true;
   }
   pthread_mutex_unlock(&root_lock);
@@ -2147,6 +2749,14 @@ static bool check_allowed_fs(const char *filename, char **errmsg)
   w_log(W_LOG_ERR, "path %s is on filesystem type %.*s\n",
       filename, fs_type->len, fs_type->buf);
 
+#ifndef _WIN32
+  // These are watched by polling rather than refused
+  if (is_fstype_listed(fs_type, "poll_fstypes")) {
+    w_string_delref(fs_type);
+    return true;
+  }
+#endif
+
   illegal_fstypes = cfg_get_json(NULL, "illegal_fstypes");
   if (!illegal_fstypes) {
     w_string_delref(fs_type);
@@ -2400,6 +3010,7 @@ static w_root_t *root_resolve(const char *filename, bool auto_watch,
   } else {
     // adds 1 ref
     w_ht_set(watched_roots, w_ht_ptr_val(root->root_path), w_ht_ptr_val(root));
+    w_metric_inc(&roots_watched);
     *created = true;
   }
   pthread_mutex_unlock(&root_lock);
@@ -2425,16 +3036,25 @@ static void *run_notify_thread(void *arg)
   return 0;
 }
 
-static void *run_io_thread(void *arg)
+static void notify_job_done(void *arg)
 {
   w_root_t *root = arg;
 
-  w_set_thread_name("io %.*s", root->root_path->len, root->root_path->buf);
-  io_thread(root);
-  w_log(W_LOG_DBG, "out of loop\n");
+  w_log(W_LOG_DBG, "notify job for %s done\n", root->root_path->buf);
+
+  /* we'll remove it from watched roots if it isn't
+   * already out of there */
+  remove_root_from_watched(root);
 
   w_root_delref(root);
-  return 0;
+}
+
+static void io_job_done(void *arg)
+{
+  w_root_t *root = arg;
+
+  w_log(W_LOG_DBG, "io job for %s done\n", root->root_path->buf);
+  w_root_delref(root);
 }
 
 static bool start_detached_root_thread(w_root_t *root, char **errmsg,
@@ -2459,22 +3079,48 @@ static bool start_detached_root_thread(w_root_t *root, char **errmsg,
   return false;
 }
 
+/* Roots are serviced by two jobs on the shared pool.  The notify job
+ * drains the watcher's descriptor when the poller sees that it is
+ * readable, and the io job does the crawling and settle handling.
+ * Each job is serialized with respect to itself, but the two can run
+ * concurrently so that a long crawl doesn't hold up draining the
+ * kernel's notification queue */
 static bool root_start(w_root_t *root, char **errmsg)
 {
-  if (!start_detached_root_thread(root, errmsg,
+  int fd = -1;
+
+  root->io_job = w_pool_job_new("io", io_job, io_job_done, root);
+  if (!root->io_job) {
+    ignore_result(asprintf(errmsg, "failed to allocate io job\n"));
+    return false;
+  }
+
+  if (root->watcher_ops->root_notify_fd) {
+    fd = root->watcher_ops->root_notify_fd(root->watcher, root);
+  }
+  if (fd != -1) {
+    root->notify_job = w_pool_job_new("notify", notify_job,
+        notify_job_done, root);
+    if (!root->notify_job) {
+      ignore_result(asprintf(errmsg, "failed to allocate notify job\n"));
+      return false;
+    }
+    // owned by the job until notify_job_done
+    w_root_addref(root);
+    w_pool_job_kick(root->notify_job);
+  } else if (!start_detached_root_thread(root, errmsg,
         run_notify_thread, &root->notify_thread)) {
     return false;
   }
 
   // Wait for it to signal that the watcher has been initialized
   w_pending_coll_lock_and_wait(&root->pending, -1 /* infinite */);
+  root->pending.job = root->io_job;
   w_pending_coll_unlock(&root->pending);
 
-  if (!start_detached_root_thread(root, errmsg,
-        run_io_thread, &root->io_thread)) {
-    w_root_cancel(root);
-    return false;
-  }
+  // owned by the job until io_job_done
+  w_root_addref(root);
+  w_pool_job_kick(root->io_job);
   return true;
 }
 
@@ -2507,13 +3153,16 @@ w_root_t *w_root_resolve_for_client_mode(const char *filename, char **errmsg)
 
 static void signal_root_threads(w_root_t *root)
 {
-  // Send SIGUSR1 to interrupt blocking syscalls on the
-  // worker threads.  They'll self-terminate.
-  if (!pthread_equal(root->notify_thread, pthread_self())) {
+  if (root->notify_job) {
+    w_pool_job_kick(root->notify_job);
+  } else if (!pthread_equal(root->notify_thread, pthread_self())) {
+    // Send SIGUSR1 to interrupt blocking syscalls on the
+    // notify thread.  It'll self-terminate.
     pthread_kill(root->notify_thread, SIGUSR1);
   }
+  // Wakes the io job
   w_pending_coll_ping(&root->pending);
-  watcher_ops->root_signal_threads(watcher, root);
+  root->watcher_ops->root_signal_threads(root->watcher, root);
 }
 
 void w_root_schedule_recrawl(w_root_t *root, const char *why)
@@ -2529,6 +3178,7 @@ void w_root_schedule_recrawl(w_root_t *root, const char *why)
 
     w_log(W_LOG_ERR, "%.*s: %s: scheduling a tree recrawl\n",
         root->root_path->len, root->root_path->buf, why);
+    w_metric_inc(&recrawls);
   }
   root->should_recrawl = true;
   signal_root_threads(root);
@@ -2558,7 +3208,10 @@ bool w_root_stop_watch(w_root_t *root)
   bool stopped = remove_root_from_watched(root);
 
   if (stopped) {
+    w_root_lock(root);
     w_root_cancel(root);
+    w_journal_discard(root);
+    w_root_unlock(root);
     w_state_save();
   }
   signal_root_threads(root);
@@ -2589,14 +3242,27 @@ json_t *w_root_stop_watch_all(void)
     w_root_t *root = roots[i];
     w_string_t *path = root->root_path;
     if (w_ht_del(watched_roots, w_ht_ptr_val(path))) {
+      w_metric_dec(&roots_watched);
       w_root_cancel(root);
       json_array_append_new(stopped, w_string_to_json(path));
+    } else {
+      w_root_delref(root);
+      roots[i] = NULL;
     }
-    w_root_delref(root);
   }
-  free(roots);
   pthread_mutex_unlock(&root_lock);
 
+  for (i = 0; i < roots_count; i++) {
+    w_root_t *root = roots[i];
+    if (root) {
+      w_root_lock(root);
+      w_journal_discard(root);
+      w_root_unlock(root);
+      w_root_delref(root);
+    }
+  }
+  free(roots);
+
   w_state_save();
 
   return stopped;
@@ -2635,6 +3301,43 @@ json_t *w_root_trigger_list_to_json(w_root_t *root)
   return arr;
 }
 
+/* Returns the watched roots, each with a reference that the caller
+ * must release, or NULL if there are none */
+w_root_t **w_root_list_watched(uint32_t *num_roots)
+{
+  w_ht_iter_t iter;
+  w_root_t **roots = NULL;
+  uint32_t n = 0;
+
+  pthread_mutex_lock(&root_lock);
+  if (w_ht_size(watched_roots) > 0) {
+    roots = calloc(w_ht_size(watched_roots), sizeof(*roots));
+  }
+  if (roots && w_ht_first(watched_roots, &iter)) do {
+    w_root_t *root = w_ht_val_ptr(iter.value);
+
+    w_root_addref(root);
+    roots[n++] = root;
+  } while (w_ht_next(watched_roots, &iter));
+  pthread_mutex_unlock(&root_lock);
+
+  *num_roots = n;
+  return roots;
+}
+
+// The watcher used by root, for subsystems that depend on its capabilities
+const struct watchman_ops *w_root_watcher_ops(w_root_t *root)
+{
+  return root->watcher_ops;
+}
+
+// Number of file and dir nodes held in memory across all roots
+void w_root_count_nodes(uint64_t *files, uint64_t *dirs)
+{
+  *files = (uint64_t)MAX(files_tracked.value, 0);
+  *dirs = (uint64_t)MAX(dirs_tracked.value, 0);
+}
+
 json_t *w_root_watch_list_to_json(void)
 {
   w_ht_iter_t iter;
@@ -0,0 +1,197 @@
+/* Copyright 2015-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+
+/* An ordered multimap from int64 keys to pointers, as a skip list.
+ * Entries are ordered by key and then by pointer value, so that an
+ * entry can be found again to remove it even when many share a key */
+
+#define SKIPLIST_MAX_LEVEL 16
+
+struct w_skiplist_node {
+  int64_t key;
+  void *val;
+  uint32_t level;
+  struct w_skiplist_node *next[1];
+};
+
+struct w_skiplist {
+  uint32_t size;
+  uint32_t level;
+  uint32_t seed;
+  struct w_skiplist_node *head;
+};
+
+static struct w_skiplist_node *node_new(int64_t key, void *val,
+    uint32_t level)
+{
+  struct w_skiplist_node *node;
+
+  node = calloc(1, sizeof(*node) + (level - 1) * sizeof(node->next[0]));
+  if (!node) {
+    return NULL;
+  }
+  node->key = key;
+  node->val = val;
+  node->level = level;
+  return node;
+}
+
+w_skiplist_t *w_skiplist_new(void)
+{
+  w_skiplist_t *list = calloc(1, sizeof(*list));
+
+  if (!list) {
+    return NULL;
+  }
+  list->head = node_new(0, NULL, SKIPLIST_MAX_LEVEL);
+  if (!list->head) {
+    free(list);
+    return NULL;
+  }
+  list->level = 1;
+  list->seed = 0x9e3779b9;
+  return list;
+}
+
+void w_skiplist_free(w_skiplist_t *list)
+{
+  struct w_skiplist_node *node, *next;
+
+  for (node = list->head; node; node = next) {
+    next = node->next[0];
+    free(node);
+  }
+  free(list);
+}
+
+uint32_t w_skiplist_size(w_skiplist_t *list)
+{
+  return list->size;
+}
+
+// Each level holds about a quarter of the nodes of the one below
+static uint32_t random_level(w_skiplist_t *list)
+{
+  uint32_t level = 1;
+
+  // xorshift32
+  list->seed ^= list->seed << 13;
+  list->seed ^= list->seed >> 17;
+  list->seed ^= list->seed << 5;
+
+  while (level < SKIPLIST_MAX_LEVEL &&
+      (list->seed >> (2 * (level - 1)) & 3) == 0) {
+    level++;
+  }
+  return level;
+}
+
+// Whether the entry in node sorts before (key, val)
+static inline bool node_before(const struct w_skiplist_node *node,
+    int64_t key, void *val)
+{
+  if (node->key != key) {
+    return node->key < key;
+  }
+  return (uintptr_t)node->val < (uintptr_t)val;
+}
+
+/* Fills update with the last node on each level that sorts before
+ * (key, val) */
+static void find_preds(w_skiplist_t *list, int64_t key, void *val,
+    struct w_skiplist_node **update)
+{
+  struct w_skiplist_node *node = list->head;
+  int l;
+
+  for (l = (int)list->level - 1; l >= 0; l--) {
+    while (node->next[l] && node_before(node->next[l], key, val)) {
+      node = node->next[l];
+    }
+    update[l] = node;
+  }
+}
+
+bool w_skiplist_insert(w_skiplist_t *list, int64_t key, void *val)
+{
+  struct w_skiplist_node *update[SKIPLIST_MAX_LEVEL];
+  struct w_skiplist_node *node;
+  uint32_t level, l;
+
+  find_preds(list, key, val, update);
+  level = random_level(list);
+  for (l = list->level; l < level; l++) {
+    update[l] = list->head;
+  }
+  if (level > list->level) {
+    list->level = level;
+  }
+
+  node = node_new(key, val, level);
+  if (!node) {
+    return false;
+  }
+  for (l = 0; l < level; l++) {
+    node->next[l] = update[l]->next[l];
+    update[l]->next[l] = node;
+  }
+  list->size++;
+  return true;
+}
+
+bool w_skiplist_remove(w_skiplist_t *list, int64_t key, void *val)
+{
+  struct w_skiplist_node *update[SKIPLIST_MAX_LEVEL];
+  struct w_skiplist_node *node;
+  uint32_t l;
+
+  find_preds(list, key, val, update);
+  node = update[0]->next[0];
+  if (!node || node->key != key || node->val != val) {
+    return false;
+  }
+
+  for (l = 0; l < node->level; l++) {
+    update[l]->next[l] = node->next[l];
+  }
+  while (list->level > 1 && !list->head->next[list->level - 1]) {
+    list->level--;
+  }
+  free(node);
+  list->size--;
+  return true;
+}
+
+// Returns the first entry whose key is at least key
+struct w_skiplist_node *w_skiplist_seek(w_skiplist_t *list, int64_t key)
+{
+  struct w_skiplist_node *node = list->head;
+  int l;
+
+  for (l = (int)list->level - 1; l >= 0; l--) {
+    while (node->next[l] && node->next[l]->key < key) {
+      node = node->next[l];
+    }
+  }
+  return node->next[0];
+}
+
+struct w_skiplist_node *w_skiplist_next(struct w_skiplist_node *node)
+{
+  return node->next[0];
+}
+
+int64_t w_skiplist_key(struct w_skiplist_node *node)
+{
+  return node->key;
+}
+
+void *w_skiplist_val(struct w_skiplist_node *node)
+{
+  return node->val;
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -0,0 +1,374 @@
+/* Copyright 2015-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+
+/* Tree snapshots.
+ *
+ * A snapshot is a compact binary image of a root's in-memory tree:
+ * a header, the relative path of each dir, and then each file node
+ * in order of observation (oldest first), followed by a trailer that
+ * repeats the counts from the header so that a truncated snapshot is
+ * detected.  Loading a snapshot rebuilds the file list, dir map and
+ * suffix index exactly as they were, including the observed and
+ * created clocks of each file.
+ *
+ * The records hold struct watchman_stat verbatim, so a snapshot is
+ * only meaningful to a build of watchman with the same layout; the
+ * header records the record size to catch mismatches. */
+
+#define SNAPSHOT_MAGIC "WMSNAP01"
+#define SNAPSHOT_TRAILER "WMSNEND1"
+
+struct snapshot_header {
+  char magic[8];
+  uint32_t record_size;
+  uint32_t root_number;
+  uint32_t ticks;
+  uint32_t num_dirs;
+  uint32_t num_files;
+};
+
+struct snapshot_file {
+  uint32_t otime_ticks;
+  uint32_t ctime_ticks;
+  int64_t otime_sec;
+  int64_t otime_usec;
+  int64_t ctime_sec;
+  int64_t ctime_usec;
+  uint8_t exists;
+  uint8_t maybe_deleted;
+  struct watchman_stat stat;
+};
+
+struct snapshot_trailer {
+  char magic[8];
+  uint32_t num_dirs;
+  uint32_t num_files;
+};
+
+// Returns the part of path below the root, or "" for the root itself
+static void relative_path(w_root_t *root, w_string_t *path,
+    const char **buf, uint32_t *len)
+{
+  if (path->len <= root->root_path->len) {
+    *buf = "";
+    *len = 0;
+    return;
+  }
+  *buf = path->buf + root->root_path->len + 1;
+  *len = path->len - (root->root_path->len + 1);
+}
+
+static bool write_str(FILE *f, const char *buf, uint32_t len)
+{
+  return fwrite(&len, sizeof(len), 1, f) == 1 &&
+    (len == 0 || fwrite(buf, len, 1, f) == 1);
+}
+
+/* Writes the record for a single file node.  The file section of a
+ * snapshot is a sequence of these; the change journal appends them too */
+bool w_snapshot_write_file(w_root_t *root, FILE *f,
+    struct watchman_file *file)
+{
+  struct snapshot_file rec;
+  const char *buf;
+  uint32_t len;
+
+  memset(&rec, 0, sizeof(rec));
+  rec.otime_ticks = file->otime.ticks;
+  rec.ctime_ticks = file->ctime.ticks;
+  rec.otime_sec = file->otime.tv.tv_sec;
+  rec.otime_usec = file->otime.tv.tv_usec;
+  rec.ctime_sec = file->ctime.tv.tv_sec;
+  rec.ctime_usec = file->ctime.tv.tv_usec;
+  rec.exists = file->exists;
+  rec.maybe_deleted = file->maybe_deleted;
+  memcpy(&rec.stat, &file->stat, sizeof(rec.stat));
+
+  relative_path(root, file->parent->path, &buf, &len);
+  return write_str(f, buf, len) &&
+    write_str(f, file->name->buf, file->name->len) &&
+    fwrite(&rec, sizeof(rec), 1, f) == 1;
+}
+
+static bool write_records(w_root_t *root, FILE *f, uint32_t *ndirs,
+    uint32_t *nfiles)
+{
+  struct watchman_file *file, *oldest = NULL;
+  w_ht_iter_t iter;
+  const char *buf;
+  uint32_t len;
+
+  if (w_ht_first(root->dirname_to_dir, &iter)) do {
+    struct watchman_dir *dir = w_ht_val_ptr(iter.value);
+
+    if (w_string_equal(dir->path, root->root_path)) {
+      continue;
+    }
+    relative_path(root, dir->path, &buf, &len);
+    if (!write_str(f, buf, len)) {
+      return false;
+    }
+    (*ndirs)++;
+  } while (w_ht_next(root->dirname_to_dir, &iter));
+
+  for (file = root->latest_file; file; file = file->next) {
+    oldest = file;
+  }
+
+  // Oldest first, so that the loader can push each onto the head
+  for (file = oldest; file; file = file->prev) {
+    if (!w_snapshot_write_file(root, f, file)) {
+      return false;
+    }
+    (*nfiles)++;
+  }
+  return true;
+}
+
+/* Writes the tree of root to path.  The snapshot is written to a
+ * temporary file that is renamed into place, so an existing snapshot
+ * at path is replaced atomically.
+ * Must be called with the root locked */
+bool w_root_snapshot_write(w_root_t *root, const char *path, char **errmsg)
+{
+  struct snapshot_header hdr;
+  struct snapshot_trailer trailer;
+  char *tmp = NULL;
+  FILE *f = NULL;
+  int fd;
+
+  ignore_result(asprintf(&tmp, "%s.XXXXXX", path));
+  if (!tmp) {
+    ignore_result(asprintf(errmsg, "snapshot: out of memory"));
+    return false;
+  }
+  fd = mkstemp(tmp);
+  if (fd == -1 || (f = fdopen(fd, "wb")) == NULL) {
+    ignore_result(asprintf(errmsg, "snapshot: unable to create %s: %s",
+          tmp, strerror(errno)));
+    if (fd != -1) {
+      close(fd);
+      unlink(tmp);
+    }
+    free(tmp);
+    return false;
+  }
+  w_set_cloexec(fd);
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+  hdr.record_size = sizeof(struct snapshot_file);
+  hdr.root_number = root->number;
+  hdr.ticks = root->ticks;
+
+  memset(&trailer, 0, sizeof(trailer));
+  memcpy(trailer.magic, SNAPSHOT_TRAILER, sizeof(trailer.magic));
+
+  // The counts are only known once the records are written, so the
+  // header is rewritten at the end
+  if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+      !write_records(root, f, &trailer.num_dirs, &trailer.num_files) ||
+      fwrite(&trailer, sizeof(trailer), 1, f) != 1) {
+    goto fail;
+  }
+  hdr.num_dirs = trailer.num_dirs;
+  hdr.num_files = trailer.num_files;
+  if (fseek(f, 0, SEEK_SET) != 0 ||
+      fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+      fflush(f) != 0) {
+    goto fail;
+  }
+  if (fclose(f) != 0) {
+    f = NULL;
+    goto fail;
+  }
+  f = NULL;
+
+  if (rename(tmp, path) != 0) {
+    goto fail;
+  }
+  free(tmp);
+  return true;
+
+fail:
+  ignore_result(asprintf(errmsg, "snapshot: failed to write %s: %s",
+        tmp, strerror(errno)));
+  if (f) {
+    fclose(f);
+  }
+  unlink(tmp);
+  free(tmp);
+  return false;
+}
+
+// Reads a length-prefixed relative path and makes it absolute
+static w_string_t *read_path(w_root_t *root, FILE *f, char *buf,
+    uint32_t bufsize)
+{
+  uint32_t len;
+
+  if (fread(&len, sizeof(len), 1, f) != 1 || len >= bufsize ||
+      (len && fread(buf, len, 1, f) != 1)) {
+    return NULL;
+  }
+  if (len == 0) {
+    w_string_addref(root->root_path);
+    return root->root_path;
+  }
+  return w_string_make_printf("%.*s%c%.*s",
+      root->root_path->len, root->root_path->buf,
+      WATCHMAN_DIR_SEP, (int)len, buf);
+}
+
+static bool read_name(FILE *f, char *buf, uint32_t bufsize,
+    w_string_t **name)
+{
+  uint32_t len;
+
+  if (fread(&len, sizeof(len), 1, f) != 1 || len == 0 || len >= bufsize ||
+      fread(buf, len, 1, f) != 1) {
+    return false;
+  }
+  buf[len] = '\0';
+  *name = w_string_new(buf);
+  return true;
+}
+
+static struct watchman_file *load_file(w_root_t *root, FILE *f, char *buf,
+    uint32_t bufsize)
+{
+  struct snapshot_file rec;
+  struct watchman_file *file;
+  struct watchman_dir *dir;
+  w_string_t *dir_name, *name = NULL;
+  struct timeval now;
+
+  dir_name = read_path(root, f, buf, bufsize);
+  if (!dir_name) {
+    return NULL;
+  }
+  dir = w_root_resolve_dir(root, dir_name, true);
+  w_string_delref(dir_name);
+
+  if (!read_name(f, buf, bufsize, &name) ||
+      fread(&rec, sizeof(rec), 1, f) != 1) {
+    if (name) {
+      w_string_delref(name);
+    }
+    return NULL;
+  }
+
+  gettimeofday(&now, NULL);
+  file = w_root_resolve_file(root, dir, name, now);
+  w_string_delref(name);
+
+  file->otime.ticks = rec.otime_ticks;
+  file->otime.tv.tv_sec = rec.otime_sec;
+  file->otime.tv.tv_usec = rec.otime_usec;
+  w_root_unindex_file(root, file, W_INDEX_BIT(W_INDEX_CCLOCK));
+  file->ctime.ticks = rec.ctime_ticks;
+  file->ctime.tv.tv_sec = rec.ctime_sec;
+  file->ctime.tv.tv_usec = rec.ctime_usec;
+  file->exists = rec.exists;
+  file->maybe_deleted = rec.maybe_deleted;
+  w_root_index_file(root, file, W_INDEX_BIT(W_INDEX_CCLOCK));
+  w_root_set_file_stat(root, file, &rec.stat);
+
+  if (!root->case_sensitive) {
+    w_string_t *lc_name = w_string_dup_lower(file->name);
+
+    if (!dir->lc_files) {
+      dir->lc_files = w_ht_new(2, &w_ht_string_funcs);
+    }
+    w_ht_replace(dir->lc_files, w_ht_ptr_val(lc_name), w_ht_ptr_val(file));
+    w_string_delref(lc_name);
+  }
+
+  // Records are oldest first, so each becomes the latest.  A journal
+  // record may name a file that the snapshot already loaded
+  w_root_make_latest_file(root, file);
+  return file;
+}
+
+/* Reads a record written by w_snapshot_write_file into the tree, making
+ * that file the most recently changed.  Returns NULL at the end of the
+ * stream or if the record is truncated or malformed */
+struct watchman_file *w_snapshot_read_file(w_root_t *root, FILE *f)
+{
+  char buf[WATCHMAN_NAME_MAX];
+
+  return load_file(root, f, buf, sizeof(buf));
+}
+
+/* Loads the snapshot at path into the tree of root, which must hold
+ * only the root dir.  The header is copied to info so that the caller
+ * can decide whether the snapshot is a valid image of this root.  If
+ * this fails the tree may be partially populated and the caller must
+ * reset it.
+ * Must be called with the root locked */
+bool w_root_snapshot_load(w_root_t *root, const char *path,
+    struct w_snapshot_info *info, char **errmsg)
+{
+  struct snapshot_header hdr;
+  struct snapshot_trailer trailer;
+  char buf[WATCHMAN_NAME_MAX];
+  uint32_t i;
+  FILE *f;
+
+  f = fopen(path, "rb");
+  if (!f) {
+    ignore_result(asprintf(errmsg, "snapshot: unable to open %s: %s",
+          path, strerror(errno)));
+    return false;
+  }
+
+  if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+      memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) ||
+      hdr.record_size != sizeof(struct snapshot_file)) {
+    ignore_result(asprintf(errmsg, "snapshot: %s is not a compatible "
+          "snapshot", path));
+    goto fail;
+  }
+  info->root_number = hdr.root_number;
+  info->ticks = hdr.ticks;
+  info->num_dirs = hdr.num_dirs;
+  info->num_files = hdr.num_files;
+
+  for (i = 0; i < hdr.num_dirs; i++) {
+    w_string_t *dir_name = read_path(root, f, buf, sizeof(buf));
+
+    if (!dir_name) {
+      goto truncated;
+    }
+    w_root_resolve_dir(root, dir_name, true);
+    w_string_delref(dir_name);
+  }
+
+  for (i = 0; i < hdr.num_files; i++) {
+    if (!load_file(root, f, buf, sizeof(buf))) {
+      goto truncated;
+    }
+  }
+
+  if (fread(&trailer, sizeof(trailer), 1, f) != 1 ||
+      memcmp(trailer.magic, SNAPSHOT_TRAILER, sizeof(trailer.magic)) ||
+      trailer.num_dirs != hdr.num_dirs ||
+      trailer.num_files != hdr.num_files) {
+    goto truncated;
+  }
+
+  fclose(f);
+  return true;
+
+truncated:
+  ignore_result(asprintf(errmsg, "snapshot: %s is truncated or corrupt",
+        path));
+fail:
+  fclose(f);
+  return false;
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -426,6 +426,11 @@ static bool trigger_generator(
   w_log(W_LOG_DBG, "assessing trigger %s %p\n",
       cmd->triggername->buf, cmd);
 
+  if (!ctx->since.is_timestamp && query->relative_root) {
+    return w_query_process_relative_root_changes(query, root, ctx,
+        ctx->since.clock.ticks + 1);
+  }
+
   // Walk back in time until we hit the boundary
   for (f = root->latest_file; f; f = f->next) {
     if (ctx->since.is_timestamp &&
@@ -484,7 +489,10 @@ void w_assess_trigger(w_root_t *root, struct watchman_trigger_command *cmd)
       cmd->triggername->buf, res.ticks);
 
   if (res.num_results) {
+    uint64_t span = w_trace_begin();
+
     spawn_command(root, cmd, &res, since_spec);
+    w_trace_end("trigger", "spawn_command", span, cmd->triggername->buf);
   }
 
   if (since_spec) {
@@ -71,59 +71,188 @@ w_stm_t w_mkstemp(char *templ)
 #endif
 }
 
-bool w_state_save(void)
+/* State persistence.
+ *
+ * Anything that changes the set of watches or triggers calls
+ * w_state_save, which only marks the state as dirty and schedules the
+ * "state" pool job a short while later, so that a burst of changes,
+ * such as a build tool registering dozens of triggers, is written once.
+ * The job serializes the state compactly and skips the write if it is
+ * identical to what it last wrote; otherwise it writes a temporary file
+ * and renames it over the state file, so that a crash mid-write can't
+ * leave a truncated state file behind. */
+
+// How long a change may wait for its write, to coalesce with others
+#define STATE_SAVE_DELAY_MS 100
+
+W_METRIC_COUNTER(state_save_requests, "state_save_requests_total",
+    "Number of changes that required the state to be saved");
+W_METRIC_COUNTER(state_writes, "state_writes_total",
+    "Number of times the state file was written");
+W_METRIC_HISTOGRAM(state_write_duration, "state_write_duration_usec",
+    "Time taken to serialize and write the state file", "usec");
+
+static pthread_once_t state_once = PTHREAD_ONCE_INIT;
+static struct w_pool_job *state_job = NULL;
+// Protects save_pending; never held while taking any other lock
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool save_pending = false;
+// What was last written to the state file; protected by state_lock
+static char *last_saved = NULL;
+
+static bool write_all(w_stm_t file, const char *buf, size_t len)
 {
-  json_t *state;
-  w_jbuffer_t buffer;
-  w_stm_t file = NULL;
-  bool result = false;
+  while (len > 0) {
+    int res = w_stm_write(file, buf, (int)MIN(len, INT_MAX));
 
-  if (dont_save_state) {
-    return true;
+    if (res <= 0) {
+      return false;
+    }
+    buf += res;
+    len -= res;
   }
+  return true;
+}
 
-  pthread_mutex_lock(&state_lock);
+/* Writes the current state to the state file, unless it is unchanged.
+ * Must be called with state_lock held */
+static bool write_state(void)
+{
+  uint64_t start = w_metric_now_usec();
+  json_t *state;
+  char *str = NULL;
+  char *tmp = NULL;
+  w_stm_t file = NULL;
+  bool result = false;
 
   state = json_object();
+  json_object_set_new(state, "version", json_string(PACKAGE_VERSION));
+
+  /* now ask the different subsystems to fill out the state */
+  if (!w_root_save_state(state)) {
+    goto out;
+  }
 
-  if (!w_json_buffer_init(&buffer)) {
-    w_log(W_LOG_ERR, "save_state: failed to init json buffer\n");
+  str = json_dumps(state, JSON_COMPACT);
+  if (!str) {
+    w_log(W_LOG_ERR, "save_state: failed to serialize state\n");
+    goto out;
+  }
+  if (last_saved && !strcmp(last_saved, str)) {
+    result = true;
     goto out;
   }
 
-  file = w_stm_open(watchman_state_file, O_WRONLY|O_TRUNC|O_CREAT, 0600);
+  ignore_result(asprintf(&tmp, "%s.XXXXXX", watchman_state_file));
+  if (!tmp) {
+    w_log(W_LOG_ERR, "save_state: out of memory\n");
+    goto out;
+  }
+  file = w_mkstemp(tmp);
   if (!file) {
-    w_log(W_LOG_ERR, "save_state: unable to open %s for write: %s\n",
-        watchman_state_file,
-        strerror(errno));
+    w_log(W_LOG_ERR, "save_state: unable to create %s: %s\n",
+        tmp, strerror(errno));
     goto out;
   }
 
-  json_object_set_new(state, "version", json_string(PACKAGE_VERSION));
+  if (!write_all(file, str, strlen(str)) || !write_all(file, "\n", 1)) {
+    w_log(W_LOG_ERR, "save_state: failed to write %s: %s\n",
+        tmp, strerror(errno));
+    w_stm_close(file);
+    unlink(tmp);
+    goto out;
+  }
+  w_stm_close(file);
 
-  /* now ask the different subsystems to fill out the state */
-  if (!w_root_save_state(state)) {
+  if (rename(tmp, watchman_state_file) != 0) {
+    w_log(W_LOG_ERR, "save_state: unable to rename %s to %s: %s\n",
+        tmp, watchman_state_file, strerror(errno));
+    unlink(tmp);
     goto out;
   }
 
-  /* we've prepared what we're going to save, so write it out */
-  w_json_buffer_write(&buffer, file, state, JSON_INDENT(4));
-  w_stm_close(file);
-  file = NULL;
+  free(last_saved);
+  last_saved = str;
+  str = NULL;
+  w_metric_inc(&state_writes);
+  w_metric_observe_since(&state_write_duration, start);
   result = true;
 
 out:
-  if (file) {
-    w_stm_close(file);
+  free(str);
+  free(tmp);
+  json_decref(state);
+  return result;
+}
+
+// Writes the state if a save is pending
+static bool flush_state(void)
+{
+  bool pending, result = true;
+
+  pthread_mutex_lock(&pending_lock);
+  pending = save_pending;
+  save_pending = false;
+  pthread_mutex_unlock(&pending_lock);
+
+  if (pending) {
+    pthread_mutex_lock(&state_lock);
+    result = write_state();
+    pthread_mutex_unlock(&state_lock);
   }
-  if (state) {
-    json_decref(state);
+  return result;
+}
+
+static bool state_job_run(void *arg, bool kicked)
+{
+  unused_parameter(arg);
+  unused_parameter(kicked);
+
+  flush_state();
+  return true;
+}
+
+static void start_state_job(void)
+{
+  state_job = w_pool_job_new("state", state_job_run, NULL, NULL);
+}
+
+/* Requests that the state be saved.  This doesn't block on the write,
+ * so it may be called with a root locked. */
+bool w_state_save(void)
+{
+  bool schedule;
+
+  if (dont_save_state) {
+    return true;
   }
-  w_json_buffer_free(&buffer);
 
-  pthread_mutex_unlock(&state_lock);
+  w_metric_inc(&state_save_requests);
+  pthread_once(&state_once, start_state_job);
 
-  return result;
+  pthread_mutex_lock(&pending_lock);
+  schedule = !save_pending;
+  save_pending = true;
+  pthread_mutex_unlock(&pending_lock);
+
+  if (!state_job) {
+    return flush_state();
+  }
+  // Any change made before the job runs is picked up by the same write
+  if (schedule) {
+    w_pool_job_run_after(state_job, STATE_SAVE_DELAY_MS);
+  }
+  return true;
+}
+
+/* Synchronously writes out a save that has been requested but not yet
+ * performed, so that nothing is lost when we shut down */
+bool w_state_flush(void)
+{
+  if (dont_save_state) {
+    return true;
+  }
+  return flush_state();
 }
 
 /* vim:ts=2:sw=2:et:
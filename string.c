@@ -37,6 +37,18 @@ w_string_t *w_string_slice(w_string_t *str, uint32_t start, uint32_t len)
   return slice;
 }
 
+/* Makes str, which is typically on the stack, refer to the len bytes at
+ * buf, so that they can be looked up in a hash table without being
+ * copied.  str must not be addref'd, nor be used once buf is gone */
+void w_string_init_borrowed(w_string_t *str, const char *buf, uint32_t len)
+{
+  str->refcnt = 1;
+  str->len = len;
+  str->buf = buf;
+  str->slice = NULL;
+  str->hval = w_hash_bytes(buf, len, 0);
+}
+
 uint32_t u32_strlen(const char *str) {
   size_t slen = strlen(str);
   if (slen > UINT32_MAX) {
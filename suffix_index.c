@@ -0,0 +1,261 @@
+/* Copyright 2015-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+
+/* The suffix index.
+ *
+ * Every file node is filed in the bucket of the lower case text after
+ * the last dot of its name, and, if it ends in one of the multi-part
+ * suffixes listed by the indexed_suffixes option, such as "d.ts", in
+ * the bucket of the longest of those too.  A bucket is an array of
+ * file nodes, so that the suffix generator reads it in one sequential
+ * pass.  When a node goes away its entry is left as a NULL tombstone,
+ * and the array is compacted once tombstones make up half of it; each
+ * node records its position so that it can be found again */
+
+W_METRIC_COUNTER(suffix_compactions, "suffix_index_compactions_total",
+    "Number of times a suffix index bucket was compacted");
+
+// Don't bother compacting buckets with fewer tombstones than this
+#define MIN_COMPACT_DEAD 16
+
+static void delete_bucket(w_ht_val_t val)
+{
+  struct w_suffix_bucket *bucket = w_ht_val_ptr(val);
+
+  free(bucket->files);
+  free(bucket);
+}
+
+static const struct watchman_hash_funcs bucket_hash_funcs = {
+  w_ht_string_copy,
+  w_ht_string_del,
+  w_ht_string_equal,
+  w_ht_string_hash,
+  NULL,
+  delete_bucket
+};
+
+static int compare_longest_first(const void *a, const void *b)
+{
+  w_string_t *x = *(w_string_t *const *)a;
+  w_string_t *y = *(w_string_t *const *)b;
+
+  if (x->len != y->len) {
+    return x->len > y->len ? -1 : 1;
+  }
+  return w_string_compare(x, y);
+}
+
+/* Sets up an empty index, with the multi-part suffixes listed by the
+ * indexed_suffixes option */
+void w_root_init_suffix_index(w_root_t *root)
+{
+  json_t *list = cfg_get_json(root, "indexed_suffixes");
+  uint32_t i;
+
+  root->suffixes = w_ht_new(2, &bucket_hash_funcs);
+  root->compound_suffixes = NULL;
+  root->num_compound_suffixes = 0;
+
+  if (!list) {
+    return;
+  }
+  if (!json_is_array(list)) {
+    w_log(W_LOG_ERR, "indexed_suffixes must be an array of strings\n");
+    return;
+  }
+
+  root->compound_suffixes = calloc(json_array_size(list),
+      sizeof(w_string_t *));
+  if (!root->compound_suffixes) {
+    return;
+  }
+  for (i = 0; i < json_array_size(list); i++) {
+    const char *suffix = json_string_value(json_array_get(list, i));
+
+    if (!suffix) {
+      w_log(W_LOG_ERR, "indexed_suffixes must be an array of strings\n");
+      continue;
+    }
+    if (suffix[0] == '.') {
+      suffix++;
+    }
+    // Suffixes without a dot in them are always indexed
+    if (!strchr(suffix, '.')) {
+      continue;
+    }
+    root->compound_suffixes[root->num_compound_suffixes++] =
+      w_string_new_lower(suffix);
+  }
+  qsort(root->compound_suffixes, root->num_compound_suffixes,
+      sizeof(w_string_t *), compare_longest_first);
+}
+
+void w_root_free_suffix_index(w_root_t *root)
+{
+  uint32_t i;
+
+  if (root->suffixes) {
+    w_ht_free(root->suffixes);
+    root->suffixes = NULL;
+  }
+  for (i = 0; i < root->num_compound_suffixes; i++) {
+    w_string_delref(root->compound_suffixes[i]);
+  }
+  free(root->compound_suffixes);
+  root->compound_suffixes = NULL;
+  root->num_compound_suffixes = 0;
+}
+
+/* Files every node again, after the indexed_suffixes option changed.
+ * Must be called with the root locked */
+void w_root_rebuild_suffix_index(w_root_t *root)
+{
+  struct watchman_file *file;
+
+  w_root_free_suffix_index(root);
+  w_root_init_suffix_index(root);
+  for (file = root->latest_file; file; file = file->next) {
+    w_root_index_suffix(root, file);
+  }
+}
+
+// The longest indexed multi-part suffix of the name of file, if any
+static w_string_t *compound_suffix(w_root_t *root, struct watchman_file *file)
+{
+  uint32_t i;
+
+  for (i = 0; i < root->num_compound_suffixes; i++) {
+    if (w_string_suffix_match(file->name, root->compound_suffixes[i])) {
+      return root->compound_suffixes[i];
+    }
+  }
+  return NULL;
+}
+
+struct w_suffix_bucket *w_root_suffix_bucket(w_root_t *root,
+    w_string_t *suffix)
+{
+  return w_ht_val_ptr(w_ht_get(root->suffixes, w_ht_ptr_val(suffix)));
+}
+
+static void add_to_bucket(w_root_t *root, w_string_t *suffix,
+    bool compound, struct watchman_file *file)
+{
+  struct w_suffix_bucket *bucket = w_root_suffix_bucket(root, suffix);
+
+  if (!bucket) {
+    bucket = calloc(1, sizeof(*bucket));
+    if (!bucket) {
+      return;
+    }
+    bucket->compound = compound;
+    w_ht_set(root->suffixes, w_ht_ptr_val(suffix), w_ht_ptr_val(bucket));
+  }
+
+  if (bucket->len == bucket->alloc) {
+    uint32_t alloc = bucket->alloc ? bucket->alloc * 2 : 4;
+    struct watchman_file **files;
+
+    files = realloc(bucket->files, alloc * sizeof(*files));
+    if (!files) {
+      w_log(W_LOG_FATAL, "out of memory growing the suffix index\n");
+    }
+    bucket->files = files;
+    bucket->alloc = alloc;
+  }
+
+  if (compound) {
+    file->compound_slot = bucket->len;
+  } else {
+    file->suffix_slot = bucket->len;
+  }
+  bucket->files[bucket->len++] = file;
+}
+
+// Squeezes the tombstones out of bucket
+static void compact_bucket(struct w_suffix_bucket *bucket)
+{
+  uint32_t i, len = 0;
+
+  for (i = 0; i < bucket->len; i++) {
+    struct watchman_file *file = bucket->files[i];
+
+    if (!file) {
+      continue;
+    }
+    if (bucket->compound) {
+      file->compound_slot = len;
+    } else {
+      file->suffix_slot = len;
+    }
+    bucket->files[len++] = file;
+  }
+  bucket->len = len;
+  bucket->dead = 0;
+
+  if (bucket->alloc > 16 && len < bucket->alloc / 4) {
+    struct watchman_file **files;
+
+    files = realloc(bucket->files, bucket->alloc / 2 * sizeof(*files));
+    if (files) {
+      bucket->files = files;
+      bucket->alloc /= 2;
+    }
+  }
+  w_metric_inc(&suffix_compactions);
+}
+
+static void remove_from_bucket(w_root_t *root, w_string_t *suffix,
+    uint32_t slot, struct watchman_file *file)
+{
+  struct w_suffix_bucket *bucket = w_root_suffix_bucket(root, suffix);
+
+  if (!bucket || slot >= bucket->len || bucket->files[slot] != file) {
+    return;
+  }
+  bucket->files[slot] = NULL;
+  bucket->dead++;
+
+  if (bucket->dead == bucket->len) {
+    w_ht_del(root->suffixes, w_ht_ptr_val(suffix));
+  } else if (bucket->dead >= MIN_COMPACT_DEAD &&
+      bucket->dead * 2 >= bucket->len) {
+    compact_bucket(bucket);
+  }
+}
+
+void w_root_index_suffix(w_root_t *root, struct watchman_file *file)
+{
+  w_string_t *suffix = w_string_suffix(file->name);
+  w_string_t *compound;
+
+  if (suffix) {
+    add_to_bucket(root, suffix, false, file);
+    w_string_delref(suffix);
+  }
+  compound = compound_suffix(root, file);
+  if (compound) {
+    add_to_bucket(root, compound, true, file);
+  }
+}
+
+void w_root_unindex_suffix(w_root_t *root, struct watchman_file *file)
+{
+  w_string_t *suffix = w_string_suffix(file->name);
+  w_string_t *compound;
+
+  if (suffix) {
+    remove_from_bucket(root, suffix, file->suffix_slot, file);
+    w_string_delref(suffix);
+  }
+  compound = compound_suffix(root, file);
+  if (compound) {
+    remove_from_bucket(root, compound, file->compound_slot, file);
+  }
+}
+
+/* vim:ts=2:sw=2:et:
+ */
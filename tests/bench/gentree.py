@@ -0,0 +1,156 @@
+#!/usr/bin/env python
+# vim:ts=4:sw=4:et:
+# Copyright 2012-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+"""Deterministic synthetic source tree generator.
+
+Given the same parameters and seed this always produces the same set of
+directory and file names, so benchmark runs on different builds or
+machines operate on identical trees.
+"""
+import argparse
+import os
+import os.path
+import random
+import string
+
+NAME_CHARS = string.ascii_lowercase + string.digits + '_-'
+
+# Weighted so that the tree looks vaguely like a real source repo
+DEFAULT_SUFFIXES = [
+    ('c', 20), ('h', 15), ('py', 15), ('js', 15), ('txt', 5),
+    ('json', 5), ('md', 5), ('o', 10), ('', 10)]
+
+
+class TreeSpec(object):
+
+    def __init__(self, depth=3, dirs_per_dir=4, files_per_dir=16,
+                 name_len=(4, 16), name_dist='uniform', seed=1,
+                 suffixes=None):
+        self.depth = depth
+        self.dirs_per_dir = dirs_per_dir
+        self.files_per_dir = files_per_dir
+        self.name_len = name_len
+        self.name_dist = name_dist
+        self.seed = seed
+        self.suffixes = suffixes or DEFAULT_SUFFIXES
+
+    def to_json(self):
+        return {
+            'depth': self.depth,
+            'dirs_per_dir': self.dirs_per_dir,
+            'files_per_dir': self.files_per_dir,
+            'name_len': list(self.name_len),
+            'name_dist': self.name_dist,
+            'seed': self.seed,
+        }
+
+
+class NameSource(object):
+    # Produces unique (per directory) names with lengths drawn from
+    # the configured distribution
+
+    def __init__(self, spec):
+        self.spec = spec
+        self.rand = random.Random(spec.seed)
+        total = sum(w for _, w in spec.suffixes)
+        self.suffix_cdf = []
+        acc = 0
+        for suffix, weight in spec.suffixes:
+            acc += weight
+            self.suffix_cdf.append((float(acc) / total, suffix))
+
+    def length(self):
+        lo, hi = self.spec.name_len
+        if self.spec.name_dist == 'lognormal':
+            # Most names are short, with a long tail
+            mid = (lo + hi) / 2.0
+            n = int(round(self.rand.lognormvariate(0, 0.5) * mid / 1.5))
+            return max(lo, min(hi, n))
+        return self.rand.randint(lo, hi)
+
+    def suffix(self):
+        r = self.rand.random()
+        for edge, suffix in self.suffix_cdf:
+            if r <= edge:
+                return suffix
+        return self.suffix_cdf[-1][1]
+
+    def name(self, used, suffix=None):
+        while True:
+            base = ''.join(self.rand.choice(NAME_CHARS)
+                           for _ in range(self.length()))
+            if suffix:
+                base = '%s.%s' % (base, suffix)
+            if base not in used:
+                used.add(base)
+                return base
+
+
+def plan(spec):
+    """ Returns (dirs, files): lists of paths relative to the root, in
+    creation order """
+    names = NameSource(spec)
+    dirs = []
+    files = []
+
+    def fill(rel, level):
+        used = set()
+        for _ in range(spec.files_per_dir):
+            files.append(os.path.join(rel, names.name(used, names.suffix())))
+        if level >= spec.depth:
+            return
+        for _ in range(spec.dirs_per_dir):
+            sub = os.path.join(rel, names.name(used))
+            dirs.append(sub)
+            fill(sub, level + 1)
+
+    fill('', 0)
+    return dirs, files
+
+
+def generate(root, spec):
+    """ Materializes the tree described by spec under root.
+    Returns (dirs, files) as produced by plan() """
+    dirs, files = plan(spec)
+    for d in dirs:
+        os.mkdir(os.path.join(root, d))
+    for f in files:
+        open(os.path.join(root, f), 'w').close()
+    return dirs, files
+
+
+def add_arguments(parser):
+    parser.add_argument('--depth', type=int, default=3,
+                        help='how many levels of directories to create')
+    parser.add_argument('--dirs', type=int, default=4,
+                        help='number of subdirectories in each directory')
+    parser.add_argument('--files', type=int, default=16,
+                        help='number of files in each directory')
+    parser.add_argument('--name-len', default='4:16',
+                        help='MIN:MAX length of generated names')
+    parser.add_argument('--name-dist', default='uniform',
+                        choices=['uniform', 'lognormal'],
+                        help='distribution of name lengths')
+    parser.add_argument('--seed', type=int, default=1,
+                        help='seed for the name generator')
+
+
+def spec_from_args(args):
+    lo, hi = [int(x) for x in args.name_len.split(':')]
+    return TreeSpec(depth=args.depth, dirs_per_dir=args.dirs,
+                    files_per_dir=args.files, name_len=(lo, hi),
+                    name_dist=args.name_dist, seed=args.seed)
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(
+        description='Generate a deterministic synthetic tree')
+    parser.add_argument('root', help='directory to populate')
+    add_arguments(parser)
+    args = parser.parse_args()
+    if not os.path.isdir(args.root):
+        os.makedirs(args.root)
+    dirs, files = generate(args.root, spec_from_args(args))
+    print('created %d dirs and %d files under %s' % (
+        len(dirs), len(files), args.root))
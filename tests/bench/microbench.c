@@ -0,0 +1,626 @@
+/* Copyright 2015-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+/* Microbenchmarks for the core data structures.
+ * Each benchmark prints one JSON object per line reporting the time and
+ * number of heap allocations per operation.  Pass a substring as the
+ * first argument to run only the matching benchmarks. */
+
+#include "watchman.h"
+
+/* Allocation counting.  glibc lets us interpose the allocator from the
+ * executable and forward to its internal entry points; elsewhere we
+ * simply report that the count is unavailable */
+#ifdef __GLIBC__
+# define COUNT_ALLOCS 1
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static uint64_t num_allocs = 0;
+
+void *malloc(size_t size) {
+  num_allocs++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  num_allocs++;
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  num_allocs++;
+  return __libc_realloc(ptr, size);
+}
+#endif
+
+/* Stubs for symbols that live in the daemon proper */
+bool w_should_log_to_clients(int level)
+{
+  unused_parameter(level);
+  return false;
+}
+
+void w_log_to_clients(int level, const char *buf)
+{
+  unused_parameter(level);
+  unused_parameter(buf);
+}
+
+void w_timeoutms_to_abs_timespec(int timeoutms, struct timespec *deadline) {
+  unused_parameter(timeoutms);
+  memset(deadline, 0, sizeof(*deadline));
+}
+
+void w_metric_register(struct watchman_metric *metric) {
+  unused_parameter(metric);
+}
+
+void w_pool_job_kick(struct w_pool_job *job) {
+  unused_parameter(job);
+}
+
+uint64_t w_metric_now_usec(void) {
+  return 0;
+}
+
+bool w_lockprof_enabled = false;
+struct w_lock_class w_lock_class_pending;
+
+void w_lockprof_acquired(struct w_lock_class *cls, struct w_lock_hold *hold,
+    const char *site, uint64_t wait_start) {
+  unused_parameter(cls);
+  unused_parameter(hold);
+  unused_parameter(site);
+  unused_parameter(wait_start);
+}
+
+void w_lockprof_released(struct w_lock_class *cls, struct w_lock_hold *hold) {
+  unused_parameter(cls);
+  unused_parameter(hold);
+}
+
+struct bench_def {
+  const char *name;
+  // Run the operation under test n times.  Returns the number of
+  // operations actually performed, which lets a benchmark that does
+  // batched work report per-item costs
+  uint64_t (*run)(void *arg, uint64_t n);
+  void *arg;
+  // Optional per-run setup/teardown, excluded from the measurement
+  void *(*setup)(void *arg, uint64_t n);
+  void (*teardown)(void *state);
+};
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * WATCHMAN_NSEC_IN_SEC) + ts.tv_nsec;
+}
+
+/* Benchmarks can exclude per-iteration preparation from the measurement
+ * by bracketing it with bench_pause()/bench_resume() */
+static uint64_t paused_ns = 0;
+static uint64_t paused_allocs = 0;
+static uint64_t pause_start = 0;
+static uint64_t pause_allocs = 0;
+
+static void bench_pause(void) {
+  pause_start = now_ns();
+#ifdef COUNT_ALLOCS
+  pause_allocs = num_allocs;
+#endif
+}
+
+static void bench_resume(void) {
+  paused_ns += now_ns() - pause_start;
+#ifdef COUNT_ALLOCS
+  paused_allocs += num_allocs - pause_allocs;
+#endif
+}
+
+// Deterministic names so that runs are comparable
+static w_string_t **make_names(uint32_t n, const char *prefix) {
+  w_string_t **names = calloc(n, sizeof(*names));
+  uint32_t i;
+
+  for (i = 0; i < n; i++) {
+    names[i] = w_string_make_printf("%s/dir%u/SubDir%u/File%u.c",
+        prefix, i % 97, i % 13, i);
+  }
+  return names;
+}
+
+static void free_names(w_string_t **names, uint32_t n) {
+  uint32_t i;
+
+  for (i = 0; i < n; i++) {
+    w_string_delref(names[i]);
+  }
+  free(names);
+}
+
+/* ---- hash table ---- */
+
+struct ht_state {
+  uint32_t size;
+  uint32_t hint;
+  w_string_t **names;
+  w_string_t **misses;
+  w_ht_t *ht;
+};
+
+struct ht_params {
+  uint32_t size;
+  // size_hint passed to w_ht_new, as a percentage of size.  Small
+  // values make the table grow and rehash while it is filled
+  uint32_t hint_pct;
+  bool prefill;
+};
+
+static void *ht_setup(void *arg, uint64_t n) {
+  struct ht_params *p = arg;
+  struct ht_state *s = calloc(1, sizeof(*s));
+  uint32_t i;
+
+  unused_parameter(n);
+  s->size = p->size;
+  s->hint = (uint32_t)(((uint64_t)p->size * p->hint_pct) / 100);
+  s->names = make_names(s->size, "/hit");
+  s->misses = make_names(s->size, "/miss");
+  if (p->prefill) {
+    s->ht = w_ht_new(s->hint, &w_ht_string_funcs);
+    for (i = 0; i < s->size; i++) {
+      w_ht_set(s->ht, w_ht_ptr_val(s->names[i]), i);
+    }
+  }
+  return s;
+}
+
+static void ht_teardown(void *state) {
+  struct ht_state *s = state;
+
+  if (s->ht) {
+    w_ht_free(s->ht);
+  }
+  free_names(s->names, s->size);
+  free_names(s->misses, s->size);
+  free(s);
+}
+
+static uint64_t bench_ht_insert(void *state, uint64_t n) {
+  struct ht_state *s = state;
+  uint64_t ops = 0;
+
+  while (ops < n) {
+    uint32_t i;
+    w_ht_t *ht = w_ht_new(s->hint, &w_ht_string_funcs);
+
+    for (i = 0; i < s->size; i++) {
+      w_ht_set(ht, w_ht_ptr_val(s->names[i]), i);
+    }
+    w_ht_free(ht);
+    ops += s->size;
+  }
+  return ops;
+}
+
+static uint64_t bench_ht_get_hit(void *state, uint64_t n) {
+  struct ht_state *s = state;
+  uint64_t i;
+
+  for (i = 0; i < n; i++) {
+    w_ht_get(s->ht, w_ht_ptr_val(s->names[i % s->size]));
+  }
+  return n;
+}
+
+static uint64_t bench_ht_get_miss(void *state, uint64_t n) {
+  struct ht_state *s = state;
+  uint64_t i;
+
+  for (i = 0; i < n; i++) {
+    w_ht_get(s->ht, w_ht_ptr_val(s->misses[i % s->size]));
+  }
+  return n;
+}
+
+static uint64_t bench_ht_iterate(void *state, uint64_t n) {
+  struct ht_state *s = state;
+  uint64_t ops = 0;
+  w_ht_iter_t iter;
+
+  while (ops < n) {
+    if (w_ht_first(s->ht, &iter)) do {
+      ops++;
+    } while (w_ht_next(s->ht, &iter));
+  }
+  return ops;
+}
+
+static uint64_t bench_ht_del_insert(void *state, uint64_t n) {
+  struct ht_state *s = state;
+  uint64_t i;
+
+  for (i = 0; i < n; i++) {
+    w_string_t *name = s->names[i % s->size];
+    w_ht_del(s->ht, w_ht_ptr_val(name));
+    w_ht_set(s->ht, w_ht_ptr_val(name), i);
+  }
+  return n;
+}
+
+static struct ht_params ht_small = { 1024, 100, true };
+static struct ht_params ht_medium = { 64 * 1024, 100, true };
+static struct ht_params ht_large = { 1024 * 1024, 100, true };
+static struct ht_params ht_grow_small = { 1024, 1, false };
+static struct ht_params ht_grow_large = { 1024 * 1024, 1, false };
+static struct ht_params ht_presized_large = { 1024 * 1024, 100, false };
+
+/* ---- strings ---- */
+
+struct str_state {
+  w_string_t **names;
+  uint32_t size;
+};
+
+#define STR_NAMES 4096
+
+static void *str_setup(void *arg, uint64_t n) {
+  struct str_state *s = calloc(1, sizeof(*s));
+
+  unused_parameter(arg);
+  unused_parameter(n);
+  s->size = STR_NAMES;
+  s->names = make_names(s->size, "/some/project/root");
+  return s;
+}
+
+static void str_teardown(void *state) {
+  struct str_state *s = state;
+
+  free_names(s->names, s->size);
+  free(s);
+}
+
+static uint64_t bench_string_new(void *state, uint64_t n) {
+  struct str_state *s = state;
+  uint64_t i;
+
+  for (i = 0; i < n; i++) {
+    w_string_delref(w_string_new(s->names[i % s->size]->buf));
+  }
+  return n;
+}
+
+static uint64_t bench_string_path_cat(void *state, uint64_t n) {
+  struct str_state *s = state;
+  uint64_t i;
+
+  for (i = 0; i < n; i++) {
+    w_string_t *dir = s->names[i % s->size];
+    w_string_delref(w_string_path_cat_cstr(dir, "child.txt"));
+  }
+  return n;
+}
+
+static uint64_t bench_string_dirname(void *state, uint64_t n) {
+  struct str_state *s = state;
+  uint64_t i;
+
+  for (i = 0; i < n; i++) {
+    w_string_delref(w_string_dirname(s->names[i % s->size]));
+  }
+  return n;
+}
+
+static uint64_t bench_string_basename(void *state, uint64_t n) {
+  struct str_state *s = state;
+  uint64_t i;
+
+  for (i = 0; i < n; i++) {
+    w_string_delref(w_string_basename(s->names[i % s->size]));
+  }
+  return n;
+}
+
+static uint64_t bench_string_dup_lower(void *state, uint64_t n) {
+  struct str_state *s = state;
+  uint64_t i;
+
+  for (i = 0; i < n; i++) {
+    w_string_delref(w_string_dup_lower(s->names[i % s->size]));
+  }
+  return n;
+}
+
+static uint64_t bench_string_suffix(void *state, uint64_t n) {
+  struct str_state *s = state;
+  uint64_t i;
+
+  for (i = 0; i < n; i++) {
+    w_string_t *suffix = w_string_suffix(s->names[i % s->size]);
+    if (suffix) {
+      w_string_delref(suffix);
+    }
+  }
+  return n;
+}
+
+/* ---- bser ---- */
+
+struct bser_state {
+  uint32_t rows;
+  json_t *results;
+  char *buf;
+  size_t len;
+  size_t alloc;
+};
+
+static int dump_to_buf(const char *buffer, size_t size, void *data) {
+  struct bser_state *s = data;
+
+  if (s->len + size > s->alloc) {
+    s->alloc = (s->len + size) * 2;
+    s->buf = realloc(s->buf, s->alloc);
+  }
+  memcpy(s->buf + s->len, buffer, size);
+  s->len += size;
+  return 0;
+}
+
+// Shaped like a query response using the default field list
+static void *bser_setup(void *arg, uint64_t n) {
+  struct bser_state *s = calloc(1, sizeof(*s));
+  json_t *files;
+  uint32_t i;
+
+  unused_parameter(n);
+  s->rows = (uint32_t)(intptr_t)arg;
+  files = json_array_of_size(s->rows);
+  json_array_set_template_new(files,
+      json_pack("[sssss]", "name", "exists", "new", "size", "mode"));
+  for (i = 0; i < s->rows; i++) {
+    char name[64];
+    snprintf(name, sizeof(name), "dir%u/SubDir%u/File%u.c",
+        i % 97, i % 13, i);
+    json_array_append_new(files, json_pack("{s:s, s:b, s:b, s:I, s:i}",
+          "name", name, "exists", 1, "new", i % 7 == 0,
+          "size", (json_int_t)(i * 37), "mode", 0100644));
+  }
+  s->results = json_pack("{s:s, s:s, s:b, s:o}",
+      "version", PACKAGE_VERSION, "clock", "c:1234:5678:1:42",
+      "is_fresh_instance", 0, "files", files);
+
+  // Prime the buffer so that the decode benchmark has input and the
+  // encode benchmark does not measure buffer growth
+  w_bser_write_pdu(s->results, dump_to_buf, s);
+  return s;
+}
+
+static void bser_teardown(void *state) {
+  struct bser_state *s = state;
+
+  json_decref(s->results);
+  free(s->buf);
+  free(s);
+}
+
+static uint64_t bench_bser_dump(void *state, uint64_t n) {
+  struct bser_state *s = state;
+  uint64_t i;
+
+  for (i = 0; i < n; i++) {
+    s->len = 0;
+    w_bser_write_pdu(s->results, dump_to_buf, s);
+  }
+  return n;
+}
+
+static uint64_t bench_bser_load(void *state, uint64_t n) {
+  struct bser_state *s = state;
+  uint64_t i;
+  // Skip the magic and the PDU length
+  json_int_t pdu_len;
+  json_int_t needed;
+  json_error_t jerr;
+  const char *start;
+
+  bunser_int(s->buf + 2, s->len - 2, &needed, &pdu_len);
+  start = s->buf + 2 + needed;
+
+  for (i = 0; i < n; i++) {
+    json_t *res = bunser(start, start + pdu_len, &needed, &jerr);
+    json_decref(res);
+  }
+  return n;
+}
+
+/* ---- pending collections ---- */
+
+struct pending_state {
+  w_string_t **names;
+  uint32_t size;
+  struct watchman_pending_collection a, b;
+};
+
+static void *pending_setup(void *arg, uint64_t n) {
+  struct pending_state *s = calloc(1, sizeof(*s));
+
+  unused_parameter(n);
+  s->size = (uint32_t)(intptr_t)arg;
+  s->names = make_names(s->size, "/some/project/root");
+  w_pending_coll_init(&s->a);
+  w_pending_coll_init(&s->b);
+  return s;
+}
+
+static void pending_teardown(void *state) {
+  struct pending_state *s = state;
+
+  w_pending_coll_destroy(&s->a);
+  w_pending_coll_destroy(&s->b);
+  free_names(s->names, s->size);
+  free(s);
+}
+
+static uint64_t bench_pending_add(void *state, uint64_t n) {
+  struct pending_state *s = state;
+  struct timeval now = { 0, 0 };
+  uint64_t ops = 0;
+
+  while (ops < n) {
+    uint32_t i;
+
+    for (i = 0; i < s->size; i++) {
+      w_pending_coll_add(&s->a, s->names[i], now, 0);
+    }
+    w_pending_coll_drain(&s->a);
+    ops += s->size;
+  }
+  return ops;
+}
+
+// Adding names that are already present exercises consolidation
+static uint64_t bench_pending_add_dup(void *state, uint64_t n) {
+  struct pending_state *s = state;
+  struct timeval now = { 0, 0 };
+  uint64_t i;
+
+  for (i = 0; i < n; i++) {
+    w_pending_coll_add(&s->a, s->names[i % s->size], now, 0);
+  }
+  w_pending_coll_drain(&s->a);
+  return n;
+}
+
+static uint64_t bench_pending_append(void *state, uint64_t n) {
+  struct pending_state *s = state;
+  struct timeval now = { 0, 0 };
+  uint64_t ops = 0;
+
+  while (ops < n) {
+    uint32_t i;
+
+    bench_pause();
+    for (i = 0; i < s->size; i++) {
+      w_pending_coll_add(&s->b, s->names[i], now, 0);
+    }
+    // Half of the entries collide with the target
+    for (i = 0; i < s->size; i += 2) {
+      w_pending_coll_add(&s->a, s->names[i], now, 0);
+    }
+    bench_resume();
+    w_pending_coll_append(&s->a, &s->b);
+    w_pending_coll_drain(&s->a);
+    ops += s->size;
+  }
+  return ops;
+}
+
+static struct bench_def benches[] = {
+  { "ht_insert_1k", bench_ht_insert, &ht_grow_small, ht_setup, ht_teardown },
+  { "ht_insert_grow_1m", bench_ht_insert, &ht_grow_large,
+    ht_setup, ht_teardown },
+  { "ht_insert_presized_1m", bench_ht_insert, &ht_presized_large,
+    ht_setup, ht_teardown },
+  { "ht_get_hit_1k", bench_ht_get_hit, &ht_small, ht_setup, ht_teardown },
+  { "ht_get_hit_64k", bench_ht_get_hit, &ht_medium, ht_setup, ht_teardown },
+  { "ht_get_hit_1m", bench_ht_get_hit, &ht_large, ht_setup, ht_teardown },
+  { "ht_get_miss_64k", bench_ht_get_miss, &ht_medium,
+    ht_setup, ht_teardown },
+  { "ht_iterate_64k", bench_ht_iterate, &ht_medium, ht_setup, ht_teardown },
+  { "ht_del_insert_64k", bench_ht_del_insert, &ht_medium,
+    ht_setup, ht_teardown },
+  { "string_new", bench_string_new, NULL, str_setup, str_teardown },
+  { "string_path_cat", bench_string_path_cat, NULL,
+    str_setup, str_teardown },
+  { "string_dirname", bench_string_dirname, NULL, str_setup, str_teardown },
+  { "string_basename", bench_string_basename, NULL,
+    str_setup, str_teardown },
+  { "string_dup_lower", bench_string_dup_lower, NULL,
+    str_setup, str_teardown },
+  { "string_suffix", bench_string_suffix, NULL, str_setup, str_teardown },
+  { "bser_dump_100", bench_bser_dump, (void*)100,
+    bser_setup, bser_teardown },
+  { "bser_dump_10k", bench_bser_dump, (void*)10000,
+    bser_setup, bser_teardown },
+  { "bser_load_100", bench_bser_load, (void*)100,
+    bser_setup, bser_teardown },
+  { "bser_load_10k", bench_bser_load, (void*)10000,
+    bser_setup, bser_teardown },
+  { "pending_add_4k", bench_pending_add, (void*)4096,
+    pending_setup, pending_teardown },
+  { "pending_add_dup_4k", bench_pending_add_dup, (void*)4096,
+    pending_setup, pending_teardown },
+  { "pending_append_4k", bench_pending_append, (void*)4096,
+    pending_setup, pending_teardown },
+  { NULL, NULL, NULL, NULL, NULL }
+};
+
+// Each benchmark runs for at least this long
+#define MIN_RUN_NS (200 * 1000 * 1000)
+
+static void run_bench(struct bench_def *def) {
+  uint64_t n = 1;
+  uint64_t ops, elapsed, allocs = 0;
+  void *state;
+
+  for (;;) {
+    uint64_t start;
+
+    state = def->setup ? def->setup(def->arg, n) : def->arg;
+#ifdef COUNT_ALLOCS
+    allocs = num_allocs;
+#endif
+    paused_ns = 0;
+    paused_allocs = 0;
+    start = now_ns();
+    ops = def->run(state, n);
+    elapsed = now_ns() - start - paused_ns;
+#ifdef COUNT_ALLOCS
+    allocs = num_allocs - allocs - paused_allocs;
+#endif
+    if (def->teardown) {
+      def->teardown(state);
+    }
+
+    if (elapsed >= MIN_RUN_NS || n >= (UINT64_C(1) << 40)) {
+      break;
+    }
+    // Scale up towards the target run time, but don't overshoot wildly
+    if (elapsed < MIN_RUN_NS / 100) {
+      n *= 100;
+    } else {
+      n = (n * MIN_RUN_NS * 12) / (elapsed * 10) + 1;
+    }
+  }
+
+  printf("{\"bench\": \"%s\", \"iterations\": %" PRIu64
+      ", \"ns_per_op\": %.2f, \"allocs_per_op\": ",
+      def->name, ops, (double)elapsed / ops);
+#ifdef COUNT_ALLOCS
+  printf("%.3f}\n", (double)allocs / ops);
+#else
+  unused_parameter(allocs);
+  printf("null}\n");
+#endif
+  fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+  struct bench_def *def;
+  const char *filter = argc > 1 ? argv[1] : NULL;
+
+  for (def = benches; def->name; def++) {
+    if (filter && !strstr(def->name, filter)) {
+      continue;
+    }
+    run_bench(def);
+  }
+  return 0;
+}
+
+/* vim:ts=2:sw=2:et:
+ */
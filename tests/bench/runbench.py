@@ -0,0 +1,353 @@
+#!/usr/bin/env python
+# vim:ts=4:sw=4:et:
+# Copyright 2012-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+"""Scripted end-to-end benchmarks for the watchman service.
+
+Starts a private watchman instance, generates a deterministic tree with
+gentree.py and runs a series of scenarios against it.  Each scenario
+emits one JSON object per line, so the output of two runs can be
+compared with --compare.
+"""
+import argparse
+import json
+import os
+import os.path
+import platform
+import shutil
+import sys
+import tempfile
+import time
+
+here = os.path.dirname(os.path.abspath(__file__))
+top = os.path.normpath(os.path.join(here, '..', '..'))
+sys.path.insert(0, os.path.join(top, 'python'))
+sys.path.insert(0, os.path.join(top, 'tests', 'integration'))
+import pywatchman
+import WatchmanInstance
+import gentree
+
+ALL_SCENARIOS = [
+    'crawl', 'fresh_query', 'incremental_query', 'subscriptions',
+    'mass_touch', 'churn', 'mass_delete']
+
+
+def now():
+    return time.time()
+
+
+def stats(samples):
+    samples = sorted(samples)
+    n = len(samples)
+    return {
+        'n': n,
+        'min': samples[0],
+        'median': samples[n // 2],
+        'p90': samples[min(n - 1, int(n * 0.9))],
+        'max': samples[-1],
+    }
+
+
+class Bench(object):
+
+    def __init__(self, args):
+        self.args = args
+        self.spec = gentree.spec_from_args(args)
+        self.tmp = tempfile.mkdtemp(prefix='watchmanbench')
+        self.root = os.path.join(self.tmp, 'root')
+        os.mkdir(self.root)
+        self.inst = WatchmanInstance.Instance()
+        self.inst.start()
+        self.client = self.connect()
+        self.dirs = []
+        self.files = []
+
+    def connect(self):
+        return pywatchman.client(sockpath=self.inst.getSockPath(),
+                                 timeout=self.args.timeout)
+
+    def close(self):
+        self.client.close()
+        self.inst.stop()
+        if not self.args.keep:
+            shutil.rmtree(self.tmp, ignore_errors=True)
+
+    def rss(self):
+        # Resident set size of the service in bytes, where available
+        try:
+            with open('/proc/%d/status' % self.inst.pid) as f:
+                for line in f:
+                    if line.startswith('VmRSS:'):
+                        return int(line.split()[1]) * 1024
+        except (IOError, OSError):
+            pass
+        return None
+
+    def sync_query(self, expr=None, since=None, fields=None):
+        q = {'fields': fields or ['name']}
+        if expr:
+            q['expression'] = expr
+        if since:
+            q['since'] = since
+        return self.client.query('query', self.root, q)
+
+    def clock(self):
+        return self.client.query('clock', self.root)['clock']
+
+    def abspath(self, rel):
+        return os.path.join(self.root, rel)
+
+    def timed_sync(self, since):
+        # Time until the service reports the changes made since `since`
+        t0 = now()
+        res = self.sync_query(since=since)
+        return now() - t0, len(res['files'])
+
+    # Scenarios; each returns a dict of metrics
+
+    def crawl(self):
+        t0 = now()
+        self.dirs, self.files = gentree.generate(self.root, self.spec)
+        gen = now() - t0
+        rss0 = self.rss()
+        t0 = now()
+        self.client.query('watch', self.root)
+        res = self.sync_query(expr=['exists'])
+        elapsed = now() - t0
+        rss1 = self.rss()
+        nodes = len(self.dirs) + len(self.files)
+        m = {
+            'generate_seconds': gen,
+            'seconds': elapsed,
+            'nodes': nodes,
+            'observed': len(res['files']),
+            'nodes_per_second': nodes / elapsed,
+        }
+        if rss0 is not None and rss1 is not None:
+            m['rss_bytes'] = rss1
+            m['rss_bytes_per_node'] = float(rss1 - rss0) / nodes
+        return m
+
+    def fresh_query(self):
+        m = {}
+        queries = {
+            'all': None,
+            'suffix': ['suffix', 'c'],
+            'match': ['match', '*.py'],
+            'anyof_type': ['anyof', ['type', 'd'], ['suffix', 'h']],
+        }
+        for name, expr in queries.items():
+            samples = []
+            for _ in range(self.args.iterations):
+                t0 = now()
+                self.sync_query(expr=expr,
+                                fields=['name', 'size', 'mtime_ms'])
+                samples.append(now() - t0)
+            m[name] = stats(samples)
+        return m
+
+    def incremental_query(self):
+        samples = []
+        k = min(self.args.touch_count, len(self.files))
+        for i in range(self.args.iterations):
+            clock = self.clock()
+            start = (i * k) % len(self.files)
+            for f in self.files[start:start + k]:
+                os.utime(self.abspath(f), None)
+            t0 = now()
+            self.sync_query(since=clock)
+            samples.append(now() - t0)
+        return {'touched': k, 'latency': stats(samples)}
+
+    def subscriptions(self):
+        n = self.args.subscriptions
+        client = self.connect()
+        try:
+            for i in range(n):
+                client.query('subscribe', self.root, 'sub%d' % i, {
+                    'fields': ['name'], 'expression': ['type', 'f']})
+            # Drain the initial results
+            for i in range(n):
+                while not client.getSubscription('sub%d' % i):
+                    client.receive()
+
+            samples = []
+            for it in range(self.args.iterations):
+                target = self.files[it % len(self.files)]
+                t0 = now()
+                os.utime(self.abspath(target), None)
+                pending = set('sub%d' % i for i in range(n))
+                while pending:
+                    for name in list(pending):
+                        if client.getSubscription(name):
+                            pending.discard(name)
+                    if pending:
+                        client.receive()
+                samples.append(now() - t0)
+            for i in range(n):
+                client.query('unsubscribe', self.root, 'sub%d' % i)
+        finally:
+            client.close()
+        return {'subscriptions': n, 'notify_latency': stats(samples)}
+
+    def mass_touch(self):
+        clock = self.clock()
+        t0 = now()
+        for f in self.files:
+            os.utime(self.abspath(f), None)
+        touched = now() - t0
+        elapsed, changed = self.timed_sync(clock)
+        return {
+            'touched': len(self.files),
+            'touch_seconds': touched,
+            'sync_seconds': elapsed,
+            'observed': changed,
+            'events_per_second': len(self.files) / (touched + elapsed),
+        }
+
+    def churn(self):
+        # Looks like a source control checkout: some files are
+        # deleted, some created and some modified
+        n = max(1, len(self.files) * self.args.churn_percent // 100)
+        deleted = self.files[0:n]
+        modified = self.files[n:2 * n]
+        names = gentree.NameSource(self.spec)
+        used = set(os.path.basename(f) for f in self.files)
+        created = []
+        for i in range(n):
+            parent = self.dirs[i % len(self.dirs)] if self.dirs else ''
+            created.append(os.path.join(parent, names.name(used, 'new')))
+
+        clock = self.clock()
+        t0 = now()
+        for f in deleted:
+            os.unlink(self.abspath(f))
+        for f in modified:
+            with open(self.abspath(f), 'a') as fh:
+                fh.write('x')
+        for f in created:
+            open(self.abspath(f), 'w').close()
+        io = now() - t0
+        elapsed, changed = self.timed_sync(clock)
+        self.files = self.files[n:] + created
+        return {
+            'deleted': len(deleted),
+            'modified': len(modified),
+            'created': len(created),
+            'io_seconds': io,
+            'sync_seconds': elapsed,
+            'observed': changed,
+        }
+
+    def mass_delete(self):
+        clock = self.clock()
+        t0 = now()
+        for name in os.listdir(self.root):
+            p = self.abspath(name)
+            if os.path.isdir(p):
+                shutil.rmtree(p)
+            else:
+                os.unlink(p)
+        io = now() - t0
+        elapsed, changed = self.timed_sync(clock)
+        return {
+            'io_seconds': io,
+            'sync_seconds': elapsed,
+            'observed': changed,
+        }
+
+
+def flatten(prefix, value, out):
+    if isinstance(value, dict):
+        for k, v in value.items():
+            flatten('%s.%s' % (prefix, k) if prefix else k, v, out)
+    elif isinstance(value, (int, long, float)) and \
+            not isinstance(value, bool):
+        out[prefix] = value
+    return out
+
+
+def load_results(fname):
+    res = {}
+    with open(fname) as f:
+        for line in f:
+            rec = json.loads(line)
+            if 'scenario' in rec:
+                flatten(rec['scenario'], rec['metrics'], res)
+    return res
+
+
+def compare(baseline, current):
+    old = load_results(baseline)
+    new = load_results(current)
+    for key in sorted(set(old) & set(new)):
+        o, n = old[key], new[key]
+        ratio = (float(n) / o) if o else float('nan')
+        print('%-50s %14.6g %14.6g %8.3fx' % (key, o, n, ratio))
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Run the watchman end-to-end benchmarks')
+    gentree.add_arguments(parser)
+    parser.add_argument('--iterations', type=int, default=10,
+                        help='repetitions of the latency scenarios')
+    parser.add_argument('--touch-count', type=int, default=100,
+                        help='files changed per incremental query')
+    parser.add_argument('--subscriptions', type=int, default=16,
+                        help='number of concurrent subscriptions')
+    parser.add_argument('--churn-percent', type=int, default=10,
+                        help='percentage of files changed by churn')
+    parser.add_argument('--timeout', type=float, default=120,
+                        help='client timeout in seconds')
+    parser.add_argument('--scenario', action='append',
+                        choices=ALL_SCENARIOS,
+                        help='run only these scenarios (crawl always runs)')
+    parser.add_argument('--output', help='also write results to this file')
+    parser.add_argument('--compare', nargs=2,
+                        metavar=('BASELINE', 'CURRENT'),
+                        help='compare two result files and exit')
+    parser.add_argument('--keep', action='store_true',
+                        help='preserve the generated tree')
+    args = parser.parse_args()
+
+    if args.compare:
+        compare(*args.compare)
+        return
+
+    # Ensure that we find the watchman we built
+    os.environ['PATH'] = '%s%s%s' % (top, os.pathsep, os.environ['PATH'])
+
+    wanted = args.scenario or ALL_SCENARIOS
+    out = open(args.output, 'w') if args.output else None
+
+    def emit(rec):
+        line = json.dumps(rec, sort_keys=True)
+        print(line)
+        sys.stdout.flush()
+        if out:
+            out.write(line + '\n')
+
+    bench = Bench(args)
+    try:
+        version = bench.client.query('version')['version']
+        emit({'meta': {
+            'version': version,
+            'platform': platform.platform(),
+            'tree': bench.spec.to_json(),
+            'iterations': args.iterations,
+            'time': int(time.time()),
+        }})
+        for name in ALL_SCENARIOS:
+            if name != 'crawl' and name not in wanted:
+                continue
+            metrics = getattr(bench, name)()
+            emit({'scenario': name, 'metrics': metrics})
+    finally:
+        bench.close()
+        if out:
+            out.close()
+
+
+if __name__ == '__main__':
+    main()
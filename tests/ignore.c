@@ -0,0 +1,70 @@
+/* Copyright 2015-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+#include "thirdparty/tap.h"
+
+static w_string_t root_path = { 1, 0, 5, NULL, "/root" };
+
+static enum w_ignore_result check(struct watchman_ignore *ign,
+    const char *path)
+{
+  return w_ignore_check(ign, &root_path, path, (uint32_t)strlen(path));
+}
+
+int main(int argc, char **argv)
+{
+  struct watchman_ignore ign;
+  (void)argc;
+  (void)argv;
+
+  plan_tests(27);
+
+  ok(w_ignore_init(&ign), "init");
+  ok(w_ignore_add(&ign, ".git", true), "add vcs dir");
+  ok(w_ignore_add(&ign, "build", false), "add dir");
+  ok(w_ignore_add(&ign, "a/b/c", false), "add nested dir");
+  ok(w_ignore_add(&ign, "**/node_modules", false), "add glob");
+  ok(w_ignore_add(&ign, "out/*/gen", false), "add anchored glob");
+  ok(w_ignore_add(&ign, "lit\\[1\\]", false), "add escaped entry");
+  ok(!w_ignore_add(&ign, "/", false), "can't ignore the root");
+
+  ok(check(&ign, "/root") == W_IGNORE_NONE, "root is tracked");
+  ok(check(&ign, "/root/src/main.c") == W_IGNORE_NONE, "file is tracked");
+  ok(check(&ign, "/root/build") == W_IGNORE_SELF, "ignored dir");
+  ok(check(&ign, "/root/build/out/x.o") == W_IGNORE_SELF,
+      "below ignored dir");
+  ok(check(&ign, "/root/builder") == W_IGNORE_NONE,
+      "sibling with a common prefix is tracked");
+  ok(check(&ign, "/root/a/b") == W_IGNORE_NONE, "ancestor is tracked");
+  ok(check(&ign, "/root/a/b/c/d") == W_IGNORE_SELF, "below nested dir");
+  ok(check(&ign, "/root/.git") == W_IGNORE_NONE, "vcs dir is tracked");
+  ok(check(&ign, "/root/.git/objects") == W_IGNORE_CONTENTS,
+      "child of vcs dir is tracked but not its contents");
+  ok(check(&ign, "/root/.git/objects/ab") == W_IGNORE_SELF,
+      "grandchild of vcs dir");
+  ok(check(&ign, "/root/web/node_modules/left-pad") == W_IGNORE_SELF,
+      "below glob match");
+  ok(check(&ign, "/root/out/x/gen/y") == W_IGNORE_SELF,
+      "below anchored glob match");
+  ok(check(&ign, "/root/out/x") == W_IGNORE_NONE,
+      "ancestor of anchored glob match is tracked");
+  ok(check(&ign, "/root/out/x/y/gen") == W_IGNORE_NONE,
+      "star doesn't match across a slash");
+  ok(check(&ign, "/root/src/out/x/gen") == W_IGNORE_NONE,
+      "anchored glob doesn't match below another dir");
+  ok(check(&ign, "/root/lit[1]/x") == W_IGNORE_SELF,
+      "escaped entry is a literal dir");
+  ok(check(&ign, "/root/lit1") == W_IGNORE_NONE,
+      "escaped entry is not a glob");
+  ok(!w_ignore_is_glob("a\\*b"), "escaped star is not a glob");
+  ok(check(&ign, "/rootless/build") == W_IGNORE_NONE,
+      "outside of the root");
+
+  w_ignore_destroy(&ign);
+
+  return exit_status();
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -51,6 +51,13 @@ class Instance(object):
             self.proc = None
         self.log_file.close()
 
+    def restart(self):
+        # Kill it and start a new one with the same state and config,
+        # as though it had crashed
+        self.stop()
+        self.log_file = open(self.log_file_name, 'a+')
+        self.start()
+
     def start(self):
         args = [
             'watchman',
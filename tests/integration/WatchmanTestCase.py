@@ -10,6 +10,7 @@ import os.path
 import os
 import WatchmanInstance
 import copy
+import json
 import sys
 
 def norm_path(name):
@@ -97,6 +98,13 @@ class WatchmanTestCase(unittest.TestCase):
         fname = os.path.join(base, *fname)
         self.touch(fname, None)
 
+    def writeFile(self, root, name, content):
+        with open(os.path.join(root, name), 'w') as f:
+            f.write(content)
+
+    def writeConfig(self, root, config):
+        self.writeFile(root, '.watchmanconfig', json.dumps(config))
+
     def __clearWatches(self):
         if hasattr(self, 'client'):
             try:
@@ -110,6 +118,18 @@ class WatchmanTestCase(unittest.TestCase):
     def watchmanCommand(self, *args):
         return self.getClient().query(*args)
 
+    # Returns the current value of a counter or gauge from debug-metrics
+    def metric(self, name):
+        metrics = self.watchmanCommand('debug-metrics')['metrics']
+        return metrics[name]['value']
+
+    # Returns the sorted names of the files that changed since clock
+    def getChangedFiles(self, root, clock):
+        res = self.watchmanCommand('query', root, {
+            'since': clock,
+            'fields': ['name']})
+        return sorted(res['files'])
+
     # Continually invoke `cond` until it returns true or timeout
     # is reached.  Returns a tuple of [bool, result] where the
     # first element of the tuple indicates success/failure and
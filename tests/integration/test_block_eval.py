@@ -0,0 +1,110 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2015-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+import WatchmanTestCase
+import os
+
+
+class TestBlockEval(WatchmanTestCase.WatchmanTestCase):
+
+    def fileName(self, i):
+        return 'f%d.%s' % (i, ['c', 'h', 'txt'][i % 3])
+
+    def query(self, root, expr):
+        res = self.watchmanCommand('query', root, {
+            'expression': expr,
+            'fields': ['name']})
+        return sorted(res['files'])
+
+    def expected(self, pred):
+        return sorted('sub/' + self.fileName(i)
+                      for i in range(600) if pred(i))
+
+    def test_simpleTerms(self):
+        root = self.mkdtemp()
+        os.mkdir(os.path.join(root, 'sub'))
+        os.mkdir(os.path.join(root, 'empty'))
+        # Enough files to fill a few blocks of candidates, with a mix of
+        # types, sizes and suffixes
+        for i in range(600):
+            with open(os.path.join(root, 'sub', self.fileName(i)), 'w') as f:
+                f.write('x' * (i % 7))
+        self.watchmanCommand('watch', root)
+        self.assertWaitFor(
+            lambda: len(self.query(root, ['type', 'f'])) == 600)
+
+        blocks = self.metric('query_blocks_total')
+        fallbacks = self.metric('query_block_fallbacks_total')
+
+        self.assertEqual(
+            self.query(root, ['allof', ['type', 'f'], ['size', 'gt', 4],
+                              ['suffix', 'c']]),
+            self.expected(lambda i: i % 7 > 4 and i % 3 == 0))
+        self.assertEqual(
+            self.query(root, ['allof', ['type', 'f'],
+                              ['anyof', ['empty'], ['size', 'eq', 3]]]),
+            self.expected(lambda i: i % 7 in (0, 3)))
+        self.assertEqual(
+            self.query(root, ['allof', ['exists'],
+                              ['not', ['anyof', ['type', 'd'],
+                                       ['size', 'le', 5]]]]),
+            self.expected(lambda i: i % 7 == 6))
+        self.assertEqual(self.query(root, ['false']), [])
+        self.assertEqual(self.query(root, ['type', 'd']), ['empty', 'sub'])
+
+        self.assertGreater(self.metric('query_blocks_total'), blocks)
+        self.assertEqual(self.metric('query_block_fallbacks_total'),
+                         fallbacks)
+
+    def test_mixedTerms(self):
+        root = self.mkdtemp()
+        os.mkdir(os.path.join(root, 'sub'))
+        os.mkdir(os.path.join(root, 'empty'))
+        for i in range(600):
+            with open(os.path.join(root, 'sub', self.fileName(i)), 'w') as f:
+                f.write('x' * (i % 7))
+        self.watchmanCommand('watch', root)
+        self.assertWaitFor(
+            lambda: len(self.query(root, ['type', 'f'])) == 600)
+
+        fallbacks = self.metric('query_block_fallbacks_total')
+        self.assertEqual(
+            self.query(root, ['allof', ['size', 'eq', 2],
+                              ['match', 'f1*', 'basename']]),
+            self.expected(lambda i: i % 7 == 2 and str(i).startswith('1')))
+        self.assertEqual(
+            self.query(root, ['anyof', ['name', 'f7.h'],
+                              ['allof', ['suffix', 'h'],
+                                    ['size', 'eq', 6]]]),
+            self.expected(lambda i: i == 7 or (i % 3 == 1 and i % 7 == 6)))
+        self.assertGreater(self.metric('query_block_fallbacks_total'),
+                           fallbacks)
+
+    def test_removedFiles(self):
+        root = self.mkdtemp()
+        os.mkdir(os.path.join(root, 'sub'))
+        os.mkdir(os.path.join(root, 'empty'))
+        for i in range(600):
+            with open(os.path.join(root, 'sub', self.fileName(i)), 'w') as f:
+                f.write('x' * (i % 7))
+        self.watchmanCommand('watch', root)
+        self.assertWaitFor(
+            lambda: len(self.query(root, ['type', 'f'])) == 600)
+        clock = self.watchmanCommand('clock', root)['clock']
+
+        for i in range(0, 600, 2):
+            os.unlink(os.path.join(root, 'sub', self.fileName(i)))
+
+        def removed():
+            res = self.watchmanCommand('query', root, {
+                'since': clock,
+                'expression': ['allof', ['type', 'f'],
+                               ['not', 'exists']],
+                'fields': ['name']})
+            return sorted(res['files'])
+
+        self.assertWaitFor(
+            lambda: removed() == self.expected(lambda i: i % 2 == 0))
+        self.assertEqual(
+            self.query(root, ['size', 'ge', 0]),
+            ['empty', 'sub'] + self.expected(lambda i: i % 2 == 1))
@@ -0,0 +1,74 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2015-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+import WatchmanTestCase
+import os
+
+
+class TestBloom(WatchmanTestCase.WatchmanTestCase):
+
+    def pathQuery(self, root, expr):
+        res = self.watchmanCommand('query', root, {
+            'path': [''],
+            'expression': expr,
+            'fields': ['name']})
+        return sorted(res['files'])
+
+    def test_pruneSubtrees(self):
+        root = self.mkdtemp()
+        self.writeConfig(root, {'bloom_bits_per_file': 16})
+        for d in ['docs', 'src', 'src/lib', 'assets']:
+            os.makedirs(os.path.join(root, d))
+        for i in range(20):
+            self.touchRelative(root, 'docs', 'page%d.md' % i)
+            self.touchRelative(root, 'assets', 'img%d.png' % i)
+        self.touchRelative(root, 'src', 'main.c')
+        self.touchRelative(root, 'src', 'Makefile')
+        self.touchRelative(root, 'src', 'lib', 'util.tar.gz')
+        self.watchmanCommand('watch', root)
+        self.assertFileList(root, sorted(
+            ['.watchmanconfig', 'assets', 'docs', 'src', 'src/lib',
+             'src/Makefile', 'src/main.c', 'src/lib/util.tar.gz'] +
+            ['docs/page%d.md' % i for i in range(20)] +
+            ['assets/img%d.png' % i for i in range(20)]))
+
+        skips = self.metric('bloom_skips_total')
+        self.assertEqual(self.pathQuery(root, ['suffix', 'c']),
+                         ['src/main.c'])
+        self.assertGreater(self.metric('bloom_skips_total'), skips)
+
+        self.assertEqual(
+            self.pathQuery(root, ['allof', ['type', 'f'],
+                                  ['iname', 'makefile']]),
+            ['src/Makefile'])
+        self.assertEqual(
+            self.pathQuery(root, ['anyof', ['suffix', 'tar.gz'],
+                                  ['name', 'src/main.c', 'wholename']]),
+            ['src/lib/util.tar.gz', 'src/main.c'])
+        self.assertEqual(self.pathQuery(root, ['suffix', 'GZ']),
+                         ['src/lib/util.tar.gz'])
+        self.assertEqual(self.pathQuery(root, ['name', 'nope']), [])
+
+    def test_newFilesAreFound(self):
+        root = self.mkdtemp()
+        self.writeConfig(root, {'bloom_bits_per_file': 16})
+        for d in ['docs', 'src', 'assets']:
+            os.mkdir(os.path.join(root, d))
+        self.touchRelative(root, 'docs', 'page.md')
+        self.touchRelative(root, 'assets', 'img.png')
+        self.touchRelative(root, 'src', 'main.c')
+        self.watchmanCommand('watch', root)
+        self.assertFileList(root, [
+            '.watchmanconfig', 'assets', 'assets/img.png', 'docs',
+            'docs/page.md', 'src', 'src/main.c'])
+
+        # Builds the filters
+        self.assertEqual(self.pathQuery(root, ['suffix', 'c']),
+                         ['src/main.c'])
+
+        self.touchRelative(root, 'docs', 'example.c')
+        os.mkdir(os.path.join(root, 'assets', 'more'))
+        self.touchRelative(root, 'assets', 'more', 'gen.c')
+        self.assertWaitFor(
+            lambda: self.pathQuery(root, ['suffix', 'c']) ==
+            ['assets/more/gen.c', 'docs/example.c', 'src/main.c'])
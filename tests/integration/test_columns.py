@@ -0,0 +1,61 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2012-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+import WatchmanTestCase
+import pywatchman
+import os
+import os.path
+
+
+class TestColumns(WatchmanTestCase.WatchmanTestCase):
+
+    def test_columns(self):
+        root = self.mkdtemp()
+        with open(os.path.join(root, 'a'), 'w') as f:
+            f.write('hello')
+        self.touchRelative(root, 'b')
+        os.mkdir(os.path.join(root, 'c'))
+
+        self.watchmanCommand('watch', root)
+        self.assertFileList(root, ['a', 'b', 'c'])
+
+        res = self.watchmanCommand('query', root, {
+            'fields': ['name', 'size', 'type', 'exists'],
+            'result_format': 'columns'})
+        files = res['files']
+        self.assertEqual(sorted(files.keys()),
+                         ['exists', 'name', 'size', 'type'])
+        for col in files.values():
+            if isinstance(col, dict):
+                col = col['index']
+            self.assertEqual(len(col), 3)
+
+        self.assertEqual(sorted(files['type'].keys()), ['index', 'strings'])
+        self.assertEqual(sorted(files['type']['strings']), ['d', 'f'])
+        self.assertEqual(len(files['name']['strings']), 3)
+
+        cols = pywatchman.columns_to_arrays(files)
+        rows = dict(zip(cols['name'],
+                        zip(cols['size'], cols['type'], cols['exists'])))
+        self.assertEqual(rows['a'], (5, 'f', True))
+        self.assertEqual(rows['b'], (0, 'f', True))
+        self.assertEqual(rows['c'][1], 'd')
+        if pywatchman.int64_typecode is not None:
+            self.assertEqual(cols['size'].itemsize, 8)
+        self.assertEqual(list(cols['size']), list(files['size']))
+
+        # A single field still yields an object of columns
+        res = self.watchmanCommand('query', root, {
+            'fields': ['name'],
+            'expression': ['name', 'zzz'],
+            'result_format': 'columns'})
+        self.assertEqual(res['files'],
+                         {'name': {'strings': [], 'index': []}})
+
+    def test_invalidFormat(self):
+        root = self.mkdtemp()
+        self.watchmanCommand('watch', root)
+        with self.assertRaises(pywatchman.WatchmanError) as ctx:
+            self.watchmanCommand('query', root, {
+                'result_format': 'sideways'})
+        self.assertIn('result_format', str(ctx.exception))
@@ -0,0 +1,50 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2015-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+import WatchmanTestCase
+import os
+import sys
+import unittest
+
+
+@unittest.skipIf(not sys.platform.startswith('linux') and
+                 sys.platform != 'darwin', 'needs per-file notifications')
+class TestConfigReload(WatchmanTestCase.WatchmanTestCase):
+
+    def getConfig(self, root):
+        return self.watchmanCommand('get-config', root)['config']
+
+    def test_reloadOnChange(self):
+        root = self.mkdtemp()
+        self.writeConfig(root, {'settle': 20})
+        self.watchmanCommand('watch', root)
+        self.assertEqual(self.getConfig(root), {'settle': 20})
+
+        self.writeConfig(root, {'settle': 30, 'gc_age_seconds': 60})
+        self.assertWaitFor(lambda: self.getConfig(root) ==
+                           {'settle': 30, 'gc_age_seconds': 60})
+
+        os.unlink(os.path.join(root, '.watchmanconfig'))
+        self.assertWaitFor(lambda: self.getConfig(root) == {})
+
+    def test_ignoreChangesWaitForRewatch(self):
+        root = self.mkdtemp()
+        self.writeConfig(root, {'settle': 20})
+        self.watchmanCommand('watch', root)
+
+        os.mkdir(os.path.join(root, 'build'))
+        self.touchRelative(root, 'build', 'a')
+        self.assertFileList(root, ['.watchmanconfig', 'build', 'build/a'])
+
+        # The other options apply at once, and so do later edits, but the
+        # ignore rules from watch time stay in force
+        self.writeConfig(root, {'settle': 30, 'ignore_dirs': ['build']})
+        self.assertWaitFor(lambda: self.getConfig(root) ==
+                           {'settle': 30, 'ignore_dirs': ['build']})
+        self.writeConfig(root, {'settle': 40, 'ignore_dirs': ['build']})
+        self.assertWaitFor(lambda: self.getConfig(root) ==
+                           {'settle': 40, 'ignore_dirs': ['build']})
+
+        self.touchRelative(root, 'build', 'b')
+        self.assertFileList(root, ['.watchmanconfig', 'build', 'build/a',
+                                   'build/b'])
@@ -0,0 +1,44 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2015-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+import WatchmanTestCase
+import os
+import pywatchman
+
+
+class TestDu(WatchmanTestCase.WatchmanTestCase):
+
+    def totals(self, entry):
+        return (entry['name'], entry['files'], entry['dirs'], entry['bytes'])
+
+    def test_du(self):
+        root = self.mkdtemp()
+        os.makedirs(os.path.join(root, 'a', 'b'))
+        os.mkdir(os.path.join(root, 'c'))
+        self.writeFile(root, 'a/x', 'hello')
+        self.writeFile(root, 'a/b/y', 'abc')
+        self.writeFile(root, 'z', '1')
+        self.watchmanCommand('watch', root)
+        self.assertFileList(root, ['a', 'a/b', 'a/b/y', 'a/x', 'c', 'z'])
+
+        res = self.watchmanCommand('du', root)
+        self.assertEqual(self.totals(res['summary']), ('', 3, 3, 9))
+        self.assertEqual([self.totals(c) for c in res['children']],
+                         [('a', 2, 1, 8), ('c', 0, 0, 0)])
+
+        os.unlink(os.path.join(root, 'a', 'b', 'y'))
+        self.writeFile(root, 'a/x', 'hello world')
+        self.assertWaitFor(lambda: self.totals(
+            self.watchmanCommand('du', root, 'a')['summary']) ==
+            ('a', 1, 1, 11))
+
+        # The latest change was below a, and there has never been
+        # anything below c
+        res = self.watchmanCommand('du', root)
+        children = dict((c['name'], c) for c in res['children'])
+        self.assertEqual(res['summary']['last_change'],
+                         children['a']['last_change'])
+        self.assertNotIn('last_change', children['c'])
+
+        with self.assertRaises(pywatchman.WatchmanError):
+            self.watchmanCommand('du', root, 'nope')
@@ -0,0 +1,55 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2015-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+import WatchmanTestCase
+import os
+
+
+class TestEvict(WatchmanTestCase.WatchmanTestCase):
+
+    def names(self, res):
+        return self.normFileList(res['files'])
+
+    def test_evictAndRehydrate(self):
+        root = self.mkdtemp()
+        os.mkdir(os.path.join(root, 'dir'))
+        self.touchRelative(root, 'a')
+        self.touchRelative(root, 'dir', 'b')
+        self.watchmanCommand('watch', root)
+        self.assertFileList(root, ['a', 'dir', 'dir/b'])
+        clock = self.watchmanCommand('clock', root)['clock']
+        rehydrations = self.metric('rehydrations_total')
+
+        res = self.watchmanCommand('debug-evict', root)
+        self.assertTrue(res['evicted'])
+        self.assertGreater(res['estimated_bytes'], 0)
+        self.assertGreaterEqual(self.metric('roots_evicted'), 1)
+
+        # Changes made while evicted are replayed on rehydration
+        self.touchRelative(root, 'dir', 'c')
+        os.unlink(os.path.join(root, 'a'))
+
+        res = self.watchmanCommand('query', root, {
+            'since': clock,
+            'expression': ['exists'],
+            'fields': ['name']})
+        self.assertFalse(res['is_fresh_instance'])
+        self.assertEqual(self.names(res), ['dir', 'dir/c'])
+
+        res = self.watchmanCommand('query', root, {
+            'expression': ['exists'],
+            'fields': ['name']})
+        self.assertEqual(self.names(res), ['dir', 'dir/b', 'dir/c'])
+
+        self.assertGreater(self.metric('rehydrations_total'), rehydrations)
+
+    def test_evictRefusedWithTrigger(self):
+        root = self.mkdtemp()
+        self.watchmanCommand('watch', root)
+        self.assertFileList(root, [])
+        self.watchmanCommand('trigger', root, {
+            'name': 'cat', 'command': ['cat']})
+
+        with self.assertRaises(Exception) as ctx:
+            self.watchmanCommand('debug-evict', root)
+        self.assertIn('triggers or subscriptions', str(ctx.exception))
@@ -0,0 +1,47 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2015-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+import WatchmanTestCase
+import os
+
+
+class TestIgnoreGlob(WatchmanTestCase.WatchmanTestCase):
+
+    def test_ignoreGlobs(self):
+        root = self.mkdtemp()
+        self.writeConfig(root, {
+            'ignore_dirs': ['build-*', '**/node_modules']})
+
+        for d in ['build-debug', 'builder', 'web/node_modules/pkg', 'web/src']:
+            os.makedirs(os.path.join(root, d))
+            self.touchRelative(root, d, 'f')
+
+        self.watchmanCommand('watch', root)
+        self.assertFileList(root, [
+            '.watchmanconfig',
+            'builder', 'builder/f',
+            'web', 'web/src', 'web/src/f'])
+
+        # Changes below ignored dirs are not picked up
+        self.touchRelative(root, 'build-debug', 'g')
+        self.touchRelative(root, 'web', 'node_modules', 'pkg', 'g')
+        self.touchRelative(root, 'web', 'src', 'g')
+        self.assertFileList(root, [
+            '.watchmanconfig',
+            'builder', 'builder/f',
+            'web', 'web/src', 'web/src/f', 'web/src/g'])
+
+    def test_escapedEntryIsLiteral(self):
+        root = self.mkdtemp()
+        self.writeConfig(root, {
+            'ignore_dirs': ['out/*/gen', 'lit\\[1\\]']})
+
+        for d in ['lit[1]', 'lit1', 'out/x/gen', 'out/x/src']:
+            os.makedirs(os.path.join(root, d))
+            self.touchRelative(root, d, 'f')
+
+        self.watchmanCommand('watch', root)
+        self.assertFileList(root, [
+            '.watchmanconfig',
+            'lit1', 'lit1/f',
+            'out', 'out/x', 'out/x/src', 'out/x/src/f'])
@@ -0,0 +1,97 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2015-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+import WatchmanTestCase
+import os
+import sys
+import time
+import unittest
+
+
+@unittest.skipIf(not sys.platform.startswith('linux'), 'inotify only')
+class TestInotifyBudget(WatchmanTestCase.WatchmanTestCase):
+
+    def test_shortOfWatches(self):
+        before = self.metric('inotify_demotions_total')
+        root = self.mkdtemp()
+        self.writeConfig(root, {
+            'inotify_watch_limit': 4,
+            'poll_min_interval_ms': 50,
+            'poll_max_interval_ms': 200})
+        for i in range(10):
+            os.mkdir(os.path.join(root, 'd%d' % i))
+            self.touchRelative(root, 'd%d' % i, 'f')
+        res = self.watchmanCommand('watch', root)
+        self.assertEqual(res['watcher'], 'inotify')
+        expect = ['.watchmanconfig'] + ['d%d' % i for i in range(10)] + \
+            ['d%d/f' % i for i in range(10)]
+        self.assertFileList(root, sorted(expect))
+        self.assertGreater(self.metric('inotify_demotions_total'), before)
+
+        # Changes are seen whether the dir is watched or polled
+        clock = self.watchmanCommand('clock', root,
+                                     {'sync_timeout': 2000})['clock']
+        for i in range(10):
+            with open(os.path.join(root, 'd%d' % i, 'f'), 'a') as f:
+                f.write('more')
+        self.touchRelative(root, 'd9', 'new')
+        expect = sorted(['d%d/f' % i for i in range(10)] + ['d9', 'd9/new'])
+        self.assertWaitFor(
+            lambda: [f for f in self.getChangedFiles(root, clock)
+                     if f in expect] == expect)
+
+    def test_syncChecksPolledDirs(self):
+        root = self.mkdtemp()
+        self.writeConfig(root, {
+            'inotify_watch_limit': 4,
+            'poll_min_interval_ms': 50,
+            'poll_max_interval_ms': 60000})
+        for i in range(10):
+            os.mkdir(os.path.join(root, 'd%d' % i))
+            self.touchRelative(root, 'd%d' % i, 'f')
+        self.watchmanCommand('watch', root)
+        self.assertFileList(root, sorted(
+            ['.watchmanconfig'] + ['d%d' % i for i in range(10)] +
+            ['d%d/f' % i for i in range(10)]))
+        # Let the polled dirs back off well past the min interval
+        time.sleep(2)
+
+        clock = self.watchmanCommand('clock', root,
+                                     {'sync_timeout': 2000})['clock']
+        for i in range(10):
+            with open(os.path.join(root, 'd%d' % i, 'f'), 'a') as f:
+                f.write('more')
+        res = self.watchmanCommand('query', root, {
+            'since': clock,
+            'fields': ['name'],
+            'expression': ['type', 'f']})
+        self.assertNotIn('partial_sync', res)
+        self.assertEqual(sorted(res['files']),
+                         ['d%d/f' % i for i in range(10)])
+
+    def test_activeDirIsWatchedAgain(self):
+        root = self.mkdtemp()
+        self.writeConfig(root, {
+            'inotify_watch_limit': 4,
+            'poll_min_interval_ms': 50,
+            'poll_max_interval_ms': 200})
+        for i in range(10):
+            os.mkdir(os.path.join(root, 'd%d' % i))
+            self.touchRelative(root, 'd%d' % i, 'f')
+        self.watchmanCommand('watch', root)
+        self.assertFileList(root, sorted(
+            ['.watchmanconfig'] + ['d%d' % i for i in range(10)] +
+            ['d%d/f' % i for i in range(10)]))
+
+        before = self.metric('inotify_promotions_total')
+        counter = [0]
+
+        def churn():
+            # Keep every dir busy until one of the polled ones is
+            # found to be active
+            counter[0] += 1
+            for i in range(10):
+                self.touchRelative(root, 'd%d' % i, 'c%d' % counter[0])
+            return self.metric('inotify_promotions_total') > before
+
+        self.assertWaitFor(churn)
@@ -0,0 +1,57 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2012-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+import WatchmanTestCase
+import os
+import os.path
+import sys
+import time
+import unittest
+
+
+class TestInotifyReplay(WatchmanTestCase.WatchmanTestCase):
+
+    def namesNoSync(self, root):
+        # replayed roots have no live notifications, so they cannot
+        # observe sync cookies; query without syncing
+        res = self.watchmanCommand('query', root, {
+            'fields': ['name'],
+            'expression': ['not', ['name', '.watchmanconfig']],
+            'sync_timeout': 0})
+        return sorted(res['files'])
+
+    @unittest.skipIf(not sys.platform.startswith('linux'), 'inotify only')
+    def test_recordAndReplay(self):
+        recording = self.mktemp(prefix='inotify-rec')
+        os.unlink(recording)
+
+        # Record a stream of events on one tree
+        src = self.mkdtemp()
+        os.mkdir(os.path.join(src, 'dir'))
+        self.writeConfig(src, {'inotify_record_file': recording})
+        self.watchmanCommand('watch', src)
+        self.assertFileList(src, ['.watchmanconfig', 'dir'])
+        # leave a gap so that the replay has time to get going
+        time.sleep(1)
+        self.touchRelative(src, 'dir', 'foo')
+        self.touchRelative(src, 'bar')
+        self.assertFileList(src, ['.watchmanconfig', 'bar', 'dir', 'dir/foo'])
+        self.watchmanCommand('watch-del', src)
+
+        with open(recording, 'rb') as f:
+            self.assertEqual(f.read(8), b'WMINREC1')
+
+        # Replay it against a tree with the same shape; the new files
+        # are only noticed via the replayed events
+        dest = self.mkdtemp()
+        os.mkdir(os.path.join(dest, 'dir'))
+        self.writeConfig(dest, {
+            'inotify_replay_file': recording,
+            'inotify_replay_speed': 1})
+        self.watchmanCommand('watch', dest)
+        self.touchRelative(dest, 'dir', 'foo')
+        self.touchRelative(dest, 'bar')
+
+        self.assertWaitFor(
+            lambda: self.namesNoSync(dest) == ['bar', 'dir', 'dir/foo'],
+            message='replayed events should reveal the new files')
@@ -0,0 +1,204 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2015-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+import WatchmanInstance
+import WatchmanTestCase
+import json
+import os
+import pywatchman
+import socket
+import sys
+import unittest
+
+
+@unittest.skipIf(not sys.platform.startswith('linux') and
+                 sys.platform != 'darwin', 'needs inotify or fsevents')
+class TestJournal(WatchmanTestCase.WatchmanTestCase):
+
+    def setUp(self):
+        self.inst = WatchmanInstance.Instance({'persistent_journal': True})
+        self.inst.start()
+        self.client = None
+
+    def tearDown(self):
+        if self.client:
+            self.client.close()
+        self.inst.stop()
+
+    def cmd(self, *args):
+        if not self.client:
+            self.client = pywatchman.client(
+                sockpath=self.inst.getSockPath())
+        return self.client.query(*args)
+
+    def restart(self, while_down=None):
+        self.client.close()
+        self.client = None
+        self.inst.stop()
+        if while_down:
+            while_down()
+        self.inst.restart()
+
+    def waitForState(self, root):
+        # The state is saved asynchronously, and restart() kills the
+        # daemon without giving it a chance to flush
+        def saved():
+            try:
+                with open(self.inst.state_file) as f:
+                    return root in f.read()
+            except IOError:
+                return False
+        self.assertWaitFor(saved, message='state file lists ' + root)
+
+    def since(self, root, clock):
+        res = self.cmd('query', root, {'since': clock, 'fields': ['name']})
+        return res['is_fresh_instance'], self.normFileList(res['files'])
+
+    def test_clocksSurviveRestart(self):
+        root = self.mkdtemp()
+        os.mkdir(os.path.join(root, 'dir'))
+        self.touchRelative(root, 'a')
+        self.touchRelative(root, 'dir', 'b')
+        self.cmd('watch', root)
+        self.waitForState(root)
+        first = self.cmd('clock', root, {'sync_timeout': 2000})['clock']
+
+        self.touchRelative(root, 'c')
+        fresh, files = self.since(root, first)
+        self.assertFalse(fresh)
+        self.assertEqual(files, ['c'])
+        second = self.cmd('clock', root, {'sync_timeout': 2000})['clock']
+
+        # Changes made while the daemon is down are found by the crawl
+        def change():
+            self.touchRelative(root, 'dir', 'd')
+            os.unlink(os.path.join(root, 'a'))
+        self.restart(change)
+
+        fresh, files = self.since(root, second)
+        self.assertFalse(fresh)
+        self.assertEqual(files, ['a', 'dir', 'dir/d'])
+
+        fresh, files = self.since(root, first)
+        self.assertFalse(fresh)
+        self.assertEqual(files, ['a', 'c', 'dir', 'dir/d'])
+
+        # Clocks from this incarnation work too, and carry on working
+        # after another restart
+        third = self.cmd('clock', root, {'sync_timeout': 2000})['clock']
+        self.touchRelative(root, 'e')
+        self.assertEqual(self.since(root, third), (False, ['e']))
+        self.restart()
+        self.assertEqual(self.since(root, third), (False, ['e']))
+        self.assertFalse(self.since(root, first)[0])
+
+        metrics = self.cmd('debug-metrics')['metrics']
+        self.assertEqual(metrics['journal_restores_total']['value'], 1)
+
+    def test_changedFilesSurviveRestart(self):
+        root = self.mkdtemp()
+        names = ['f%d' % i for i in range(10)]
+        for name in names:
+            self.touchRelative(root, name)
+        self.cmd('watch', root)
+        self.waitForState(root)
+        clock = self.cmd('clock', root, {'sync_timeout': 2000})['clock']
+
+        # Replaying the journal finds these already in the tree
+        for name in names[:5]:
+            with open(os.path.join(root, name), 'a') as f:
+                f.write('more')
+        self.assertEqual(self.since(root, clock), (False, names[:5]))
+        self.restart()
+
+        self.assertEqual(self.since(root, clock), (False, names[:5]))
+        self.touchRelative(root, 'g')
+        self.assertEqual(self.since(root, clock),
+                         (False, names[:5] + ['g']))
+
+    def test_unwatchForgetsJournal(self):
+        root = self.mkdtemp()
+        self.touchRelative(root, 'a')
+        self.cmd('watch', root)
+        clock = self.cmd('clock', root, {'sync_timeout': 2000})['clock']
+        self.cmd('watch-del', root)
+        self.cmd('watch', root)
+
+        fresh, files = self.since(root, clock)
+        self.assertTrue(fresh)
+        self.assertEqual(files, ['a'])
+
+    def test_cursorsSurviveRestart(self):
+        root = self.mkdtemp()
+        self.touchRelative(root, 'a')
+        self.cmd('watch', root)
+        self.waitForState(root)
+        self.assertEqual(self.since(root, 'n:c'), (True, ['a']))
+
+        self.touchRelative(root, 'b')
+        self.restart(lambda: self.touchRelative(root, 'c'))
+
+        self.assertEqual(self.since(root, 'n:c'), (False, ['b', 'c']))
+        self.assertEqual(self.since(root, 'n:c'), (False, []))
+
+    def waitForSub(self, name):
+        for _ in range(20):
+            data = self.client.getSubscription(name)
+            if data:
+                return [self.normFileList(d['files']) for d in data]
+            try:
+                self.client.receive()
+            except pywatchman.SocketTimeout:
+                pass
+        self.fail('no results for subscription ' + name)
+
+    def test_subscriptionResumesFromCursor(self):
+        root = self.mkdtemp()
+        self.touchRelative(root, 'a')
+        self.cmd('watch', root)
+        self.waitForState(root)
+
+        query = {'since': 'n:sub', 'fields': ['name'],
+                 'expression': ['type', 'f']}
+        self.cmd('subscribe', root, 'sub', query)
+        self.assertEqual(self.waitForSub('sub'), [['a']])
+        self.touchRelative(root, 'b')
+        self.assertEqual(self.waitForSub('sub'), [['b']])
+        # The cursor moves after the results are written; a round trip on
+        # the same connection orders us behind that
+        self.cmd('version')
+
+        # Only what we didn't deliver is delivered after a restart
+        self.restart(lambda: self.touchRelative(root, 'c'))
+        self.cmd('subscribe', root, 'sub', query)
+        self.assertEqual(self.waitForSub('sub'), [['c']])
+
+    def test_droppedResultsLeaveCursor(self):
+        root = self.mkdtemp()
+        self.touchRelative(root, 'a')
+        self.cmd('watch', root)
+        self.cmd('log-level', 'error')
+
+        # Subscribe and hang up without reading.  The synced clock ahead
+        # of the subscribe gives us time to hang up before the results
+        # are written, and the log afterwards tells us they were dropped
+        query = {'since': 'n:dropped', 'fields': ['name'],
+                 'expression': ['type', 'f']}
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        sock.connect(self.inst.getSockPath())
+        sock.sendall(''.join(json.dumps(cmd) + '\n' for cmd in [
+            ['clock', root, {'sync_timeout': 2000}],
+            ['subscribe', root, 'sub', query],
+            ['log', 'error', 'dropped-subscription']]))
+        sock.close()
+
+        def logged():
+            try:
+                self.client.receive()
+            except pywatchman.SocketTimeout:
+                pass
+            return any('dropped-subscription' in line
+                       for line in self.client.getLog(remove=False))
+        self.assertWaitFor(logged)
+
+        self.assertEqual(self.since(root, 'n:dropped'), (True, ['a']))
@@ -0,0 +1,49 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2015-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+import WatchmanTestCase
+import os
+
+
+class TestLockProfile(WatchmanTestCase.WatchmanTestCase):
+
+    def test_lockProfile(self):
+        root = self.mkdtemp()
+        self.touchRelative(root, 'a')
+        self.watchmanCommand('watch', root)
+        self.assertFileList(root, ['a'])
+
+        res = self.watchmanCommand('debug-lock-profile', 'start')
+        self.assertTrue(res['enabled'])
+        self.touchRelative(root, 'b')
+        self.assertFileList(root, ['a', 'b'])
+        self.watchmanCommand('query', root, {'fields': ['name']})
+        res = self.watchmanCommand('debug-lock-profile', 'stop')
+        self.assertFalse(res['enabled'])
+
+        for name in ('root', 'clients', 'pending'):
+            self.assertIn(name, res['locks'])
+            self.assertEqual(res['locks'][name]['wait']['unit'], 'usec')
+
+        root_lock = res['locks']['root']
+        self.assertGreater(root_lock['wait']['count'], 0)
+        self.assertGreater(root_lock['hold']['count'], 0)
+
+        sites = res['top_sites']
+        self.assertGreater(len(sites), 0)
+        self.assertIn('root', [s['lock'] for s in sites])
+        for s in sites:
+            self.assertRegexpMatches(s['site'], r'\.c:\d+$')
+        holds = [s['hold_usec'] for s in sites]
+        self.assertEqual(holds, sorted(holds, reverse=True))
+
+        # Profiling is off, so nothing more is collected
+        count = root_lock['hold']['count']
+        self.watchmanCommand('query', root, {'fields': ['name']})
+        res = self.watchmanCommand('debug-lock-profile')
+        self.assertEqual(res['locks']['root']['hold']['count'], count)
+
+    def test_lockProfileBadArgs(self):
+        with self.assertRaises(Exception) as ctx:
+            self.watchmanCommand('debug-lock-profile', 'bogus')
+        self.assertIn('unknown', str(ctx.exception))
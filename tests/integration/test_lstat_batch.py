@@ -0,0 +1,125 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2015-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+import WatchmanTestCase
+import os
+
+
+class TestLstatBatch(WatchmanTestCase.WatchmanTestCase):
+
+    def assertMatchesLstat(self, root, res, i, path):
+        st = os.lstat(os.path.join(root, path))
+        self.assertEqual(res['mode'][i], st.st_mode)
+        self.assertEqual(res['size'][i], st.st_size)
+        self.assertEqual(res['ino'][i], st.st_ino)
+        self.assertEqual(res['mtime_ns'][i] // 1000000000, int(st.st_mtime))
+
+    def test_lookups(self):
+        root = self.mkdtemp()
+        self.writeConfig(root, {'ignore_dirs': ['out']})
+        os.makedirs(os.path.join(root, 'src', 'lib'))
+        os.mkdir(os.path.join(root, 'out'))
+        with open(os.path.join(root, 'src', 'main.c'), 'w') as f:
+            f.write('int main() {}\n')
+        self.touchRelative(root, 'src', 'lib', 'util.c')
+        self.touchRelative(root, 'out', 'main.o')
+        self.touchRelative(root, 'gone')
+        self.watchmanCommand('watch', root)
+        self.assertFileList(root, ['.watchmanconfig', 'gone', 'src',
+                                   'src/lib', 'src/lib/util.c',
+                                   'src/main.c'])
+        os.unlink(os.path.join(root, 'gone'))
+
+        paths = ['src/main.c', 'src/lib', 'nope', 'src/lib/util.c', 'gone',
+                 'out/main.o', 'src/nope/deeper', 'src/']
+        res = self.watchmanCommand('lstat-batch', root, {'paths': paths})
+        self.assertTrue(res['clock'].startswith('c:'))
+        for col in ['mode', 'size', 'mtime_ns', 'ino']:
+            self.assertEqual(len(res[col]), len(paths))
+
+        self.assertMatchesLstat(root, res, 0, 'src/main.c')
+        self.assertEqual(res['size'][0], 14)
+        self.assertMatchesLstat(root, res, 1, 'src/lib')
+        self.assertMatchesLstat(root, res, 3, 'src/lib/util.c')
+        self.assertMatchesLstat(root, res, 7, 'src')
+        # Missing and deleted paths, and ignored ones that watchman
+        # can't know about
+        for i in [2, 4, 5, 6]:
+            self.assertEqual(res['mode'][i], 0)
+        self.assertEqual(res['untracked'], [5])
+
+    def test_packedPaths(self):
+        root = self.mkdtemp()
+        os.makedirs(os.path.join(root, 'src', 'lib'))
+        self.touchRelative(root, 'src', 'main.c')
+        self.touchRelative(root, 'src', 'lib', 'util.c')
+        self.watchmanCommand('watch', root)
+        self.assertFileList(root, ['src', 'src/lib', 'src/lib/util.c',
+                                   'src/main.c'])
+        res = self.watchmanCommand('lstat-batch', root, {
+            'paths': 'src/main.c\nnope\nsrc/lib/util.c\n'})
+        self.assertEqual(len(res['mode']), 3)
+        self.assertMatchesLstat(root, res, 0, 'src/main.c')
+        self.assertEqual(res['mode'][1], 0)
+        self.assertMatchesLstat(root, res, 2, 'src/lib/util.c')
+
+        res = self.watchmanCommand('lstat-batch', root, {'paths': []})
+        self.assertEqual(res['mode'], [])
+
+    def test_seesChanges(self):
+        root = self.mkdtemp()
+        os.mkdir(os.path.join(root, 'src'))
+        with open(os.path.join(root, 'src', 'main.c'), 'w') as f:
+            f.write('int main() {}\n')
+        self.watchmanCommand('watch', root)
+        self.assertFileList(root, ['src', 'src/main.c'])
+        with open(os.path.join(root, 'src', 'main.c'), 'a') as f:
+            f.write('// more\n')
+        self.touchRelative(root, 'src', 'new.c')
+        res = self.watchmanCommand('lstat-batch', root, {
+            'paths': ['src/main.c', 'src/new.c']})
+        self.assertEqual(res['size'][0], 22)
+        self.assertMatchesLstat(root, res, 1, 'src/new.c')
+
+    def test_nonCanonicalPaths(self):
+        root = self.mkdtemp()
+        os.makedirs(os.path.join(root, 'a', 'b'))
+        self.touchRelative(root, 'a', 'b', 'c')
+        root = self.watchmanCommand('watch', root)['watch']
+        self.assertFileList(root, ['a', 'a/b', 'a/b/c'])
+
+        paths = ['./a', 'a//b', 'a/../a/b/c', 'a/b/./c/', '.', '',
+                 os.path.join(root, 'a', 'b'), root, 'a/b/../nope',
+                 os.path.join(root, 'a', 'nope')]
+        res = self.watchmanCommand('lstat-batch', root, {'paths': paths})
+        self.assertMatchesLstat(root, res, 0, 'a')
+        self.assertMatchesLstat(root, res, 1, 'a/b')
+        self.assertMatchesLstat(root, res, 2, 'a/b/c')
+        self.assertMatchesLstat(root, res, 3, 'a/b/c')
+        self.assertMatchesLstat(root, res, 6, 'a/b')
+        for i in [4, 5, 7, 8, 9]:
+            self.assertEqual(res['mode'][i], 0)
+        # The root itself is left to the caller
+        self.assertEqual(res['untracked'], [4, 5, 7])
+
+    def test_pathsOutsideRoot(self):
+        root = self.mkdtemp()
+        self.touchRelative(root, 'a')
+        root = self.watchmanCommand('watch', root)['watch']
+        self.assertFileList(root, ['a'])
+
+        for path in ['..', 'a/../..', '../' + os.path.basename(root) + '/a',
+                     os.path.dirname(root), root + 'x/a', '/']:
+            with self.assertRaises(Exception) as ctx:
+                self.watchmanCommand('lstat-batch', root,
+                                     {'paths': ['a', path]})
+            self.assertIn('outside of the root', str(ctx.exception))
+
+    def test_badArgs(self):
+        root = self.mkdtemp()
+        self.watchmanCommand('watch', root)
+        self.assertFileList(root, [])
+        for args in [[], [{'paths': 7}], [{'paths': ['a', 1]}],
+                     [{'paths': [], 'sync_timeout': -1}], ['a']]:
+            with self.assertRaises(Exception):
+                self.watchmanCommand('lstat-batch', root, *args)
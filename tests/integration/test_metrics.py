@@ -0,0 +1,104 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2015-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+import WatchmanInstance
+import WatchmanTestCase
+import json
+import os
+import socket
+import stat
+import sys
+import unittest
+
+
+class TestMetrics(WatchmanTestCase.WatchmanTestCase):
+
+    def test_debugMetrics(self):
+        root = self.mkdtemp()
+        self.touchRelative(root, 'a')
+        self.watchmanCommand('watch', root)
+        self.assertFileList(root, ['a'])
+        self.watchmanCommand('query', root, {'fields': ['name']})
+
+        metrics = self.watchmanCommand('debug-metrics')['metrics']
+
+        self.assertEqual(metrics['commands_total']['type'], 'counter')
+        self.assertGreater(metrics['commands_total']['value'], 0)
+        self.assertGreater(metrics['roots_watched']['value'], 0)
+        self.assertGreater(metrics['clients_connected']['value'], 0)
+
+        # roots are serviced by the shared pool
+        self.assertGreaterEqual(metrics['pool_threads']['value'], 2)
+        self.assertGreater(metrics['pool_job_runs_total']['value'], 0)
+
+        qd = metrics['query_duration_usec']
+        self.assertEqual(qd['type'], 'histogram')
+        self.assertEqual(qd['unit'], 'usec')
+        self.assertGreater(qd['count'], 0)
+        self.assertLessEqual(qd['p50'], qd['p99'])
+        self.assertLessEqual(qd['p99'], qd['max'])
+
+    def test_syncWaitsForSlicedCrawl(self):
+        root = self.mkdtemp()
+        for i in range(2000):
+            self.touchRelative(root, 'f%d' % i)
+            os.mkdir(os.path.join(root, 'd%d' % i))
+        slices = self.metric('crawl_slices_total')
+        self.watchmanCommand('watch', root)
+
+        # The crawl gives up the root between slices, but a synced query
+        # still sees all of it
+        res = self.watchmanCommand('query', root, {'fields': ['name']})
+        self.assertEqual(len(res['files']), 4000)
+        self.assertGreater(self.metric('crawl_slices_total'), slices)
+
+    def test_debugMetricsArgs(self):
+        with self.assertRaises(Exception) as ctx:
+            self.watchmanCommand('debug-metrics', 'extra')
+        self.assertIn('wrong number of arguments', str(ctx.exception))
+
+    def makeInstance(self):
+        # Unix socket paths are short, so keep the exporter's socket in
+        # the instance's own directory rather than under a test root
+        inst = WatchmanInstance.Instance()
+        path = os.path.join(inst.base_dir, 'metrics')
+        with open(inst.cfg_file, 'w') as f:
+            f.write(json.dumps({'metrics_socket': path}))
+        return inst, path
+
+    @unittest.skipIf(sys.platform == 'win32', 'needs unix sockets')
+    def test_metricsSocket(self):
+        inst, path = self.makeInstance()
+        # A socket left behind by an earlier run is replaced
+        stale = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        stale.bind(path)
+        stale.close()
+        inst.start()
+        self.addCleanup(inst.stop)
+
+        self.assertEqual(stat.S_IMODE(os.lstat(path).st_mode), 0o600)
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        sock.connect(path)
+        sock.sendall(b'GET /metrics HTTP/1.0\r\n\r\n')
+        data = b''
+        while True:
+            chunk = sock.recv(65536)
+            if not chunk:
+                break
+            data += chunk
+        sock.close()
+        self.assertTrue(data.startswith(b'HTTP/1.0 200 OK'))
+        self.assertIn(b'watchman_commands_total', data)
+
+    @unittest.skipIf(sys.platform == 'win32', 'needs unix sockets')
+    def test_metricsSocketKeepsOtherFiles(self):
+        inst, path = self.makeInstance()
+        with open(path, 'w') as f:
+            f.write('precious')
+        inst.start()
+        self.addCleanup(inst.stop)
+
+        with open(path) as f:
+            self.assertEqual(f.read(), 'precious')
+        with open(inst.log_file_name) as f:
+            self.assertIn('exists and is not a socket', f.read())
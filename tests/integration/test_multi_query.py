@@ -0,0 +1,61 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2015-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+import WatchmanTestCase
+
+
+class TestMultiQuery(WatchmanTestCase.WatchmanTestCase):
+
+    def names(self, result):
+        return self.normFileList(result['files'])
+
+    def test_multiQuery(self):
+        a = self.mkdtemp()
+        b = self.mkdtemp()
+        self.touchRelative(a, 'old_a')
+        self.touchRelative(b, 'old_b')
+        self.watchmanCommand('watch', a)
+        self.watchmanCommand('watch', b)
+        self.assertFileList(a, ['old_a'])
+        self.assertFileList(b, ['old_b'])
+
+        clock_a = self.watchmanCommand('clock', a)['clock']
+        clock_b = self.watchmanCommand('clock', b)['clock']
+
+        self.touchRelative(a, 'new_a')
+        self.touchRelative(b, 'new_b')
+        self.touchRelative(b, 'new_b.txt')
+
+        # the queries sync, so the new files are seen without waiting
+        res = self.watchmanCommand('multi-query', {
+            a: clock_a,
+            b: {'since': clock_b, 'expression': ['suffix', 'txt']},
+        }, {'fields': ['name']})['results']
+
+        self.assertEqual(self.names(res[a]), ['new_a'])
+        self.assertFalse(res[a]['is_fresh_instance'])
+        self.assertEqual(self.names(res[b]), ['new_b.txt'])
+        self.assertNotEqual(res[b]['clock'], clock_b)
+
+        # A null entry runs the shared query as-is
+        res = self.watchmanCommand('multi-query', {a: None},
+                                   {'fields': ['name']})['results']
+        self.assertEqual(self.names(res[a]), ['new_a', 'old_a'])
+
+    def test_multiQueryErrors(self):
+        a = self.mkdtemp()
+        unwatched = self.mkdtemp()
+        self.watchmanCommand('watch', a)
+        self.assertFileList(a, [])
+
+        res = self.watchmanCommand('multi-query', {
+            a: None,
+            unwatched: None,
+        }, {'fields': ['name']})['results']
+
+        self.assertEqual(res[a]['files'], [])
+        self.assertIn('unable to resolve root', res[unwatched]['error'])
+
+        with self.assertRaises(Exception) as ctx:
+            self.watchmanCommand('multi-query', {}, {})
+        self.assertIn('non-empty object', str(ctx.exception))
@@ -0,0 +1,81 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2015-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+import WatchmanTestCase
+import os
+import time
+
+
+class TestOrderLimit(WatchmanTestCase.WatchmanTestCase):
+
+    def query(self, root, **kw):
+        spec = {'expression': ['type', 'f'], 'fields': ['name']}
+        spec.update(kw)
+        return self.watchmanCommand('query', root, spec)['files']
+
+    def sizeOf(self, name):
+        return (int(name[-3:]) * 37) % 300
+
+    def test_orderAndLimit(self):
+        root = self.mkdtemp()
+        os.mkdir(os.path.join(root, 'src'))
+        names = ['src/f%03d' % i for i in range(300)]
+        for name in names:
+            with open(os.path.join(root, name), 'w') as f:
+                f.write('x' * self.sizeOf(name))
+        self.watchmanCommand('watch', root)
+        self.assertFileList(root, ['src'] + names)
+
+        self.assertEqual(self.query(root, order_by='name'), names)
+        self.assertEqual(self.query(root, order_by=['name', 'desc']),
+                         list(reversed(names)))
+        self.assertEqual(self.query(root, order_by='name', limit=5),
+                         names[:5])
+
+        largest = self.query(root, order_by=['size', 'desc'], limit=10)
+        self.assertEqual([self.sizeOf(n) for n in largest],
+                         sorted([self.sizeOf(n) for n in names],
+                                reverse=True)[:10])
+        smallest = self.query(root, order_by='size', limit=3)
+        self.assertEqual([self.sizeOf(n) for n in smallest], [0, 1, 2])
+
+        self.assertEqual(len(self.query(root, limit=7)), 7)
+
+    def test_latestChanged(self):
+        root = self.mkdtemp()
+        os.mkdir(os.path.join(root, 'src'))
+        for i in range(0, 100, 10):
+            self.touchRelative(root, 'src', 'f%03d' % i)
+        self.watchmanCommand('watch', root)
+        self.assertFileList(root, ['src'] +
+                            ['src/f%03d' % i for i in range(0, 100, 10)])
+        # Make sure that the changes below land on later ticks
+        time.sleep(1)
+        for name in ['f010', 'f020', 'f030']:
+            self.touchRelative(root, 'src', name)
+            self.watchmanCommand('query', root, {'fields': ['name']})
+
+        stops = self.metric('query_limit_stops_total')
+        self.assertEqual(
+            self.query(root, order_by=['otime', 'desc'], limit=3),
+            ['src/f030', 'src/f020', 'src/f010'])
+        self.assertGreater(self.metric('query_limit_stops_total'), stops)
+
+        self.assertEqual(
+            self.query(root, order_by=['otime', 'desc'], limit=2,
+                       relative_root='src', path=['']),
+            ['f030', 'f020'])
+
+    def test_badOptions(self):
+        root = self.mkdtemp()
+        self.touchRelative(root, 'a')
+        self.watchmanCommand('watch', root)
+        self.assertFileList(root, ['a'])
+        for spec in [{'order_by': 'color'},
+                     {'order_by': ['size', 'sideways']},
+                     {'order_by': 7},
+                     {'limit': 0},
+                     {'limit': -1},
+                     {'limit': 'lots'}]:
+            with self.assertRaises(Exception):
+                self.watchmanCommand('query', root, spec)
@@ -0,0 +1,72 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2015-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+import WatchmanTestCase
+import os
+
+
+class TestOrderedIndex(WatchmanTestCase.WatchmanTestCase):
+
+    def bigFiles(self, root, **kw):
+        return self.query(root, ['allof', ['size', 'gt', 900], ['type', 'f']],
+                          **kw)
+
+    def query(self, root, expr, **kw):
+        q = {'expression': expr, 'fields': ['name']}
+        q.update(kw)
+        return sorted(self.watchmanCommand('query', root, q)['files'])
+
+    def test_sizeRange(self):
+        root = self.mkdtemp()
+        self.writeConfig(root, {
+            'ordered_indexes': ['size', 'mtime', 'cclock']})
+        os.mkdir(os.path.join(root, 'sub'))
+        for i in range(10):
+            self.writeFile(root, 'f%d' % i, 'x' * i * 100)
+        self.writeFile(root, 'sub/big', 'x' * 5000)
+        self.watchmanCommand('watch', root)
+        self.assertFileList(root, ['.watchmanconfig', 'sub', 'sub/big'] +
+                            ['f%d' % i for i in range(10)])
+        scans = self.metric('query_index_scans_total')
+        self.assertEqual(
+            self.query(root, ['allof', ['size', 'ge', 300],
+                              ['size', 'lt', 600], ['type', 'f']]),
+            ['f3', 'f4', 'f5'])
+        self.assertEqual(self.bigFiles(root), ['sub/big'])
+        self.assertEqual(self.bigFiles(root, relative_root='sub'), ['big'])
+        self.assertGreater(self.metric('query_index_scans_total'), scans)
+
+        # The index follows changes and deletions
+        self.writeFile(root, 'f1', 'x' * 1000)
+        os.unlink(os.path.join(root, 'sub', 'big'))
+        self.assertWaitFor(
+            lambda: self.bigFiles(root) == ['f1'])
+
+    def test_createdSince(self):
+        root = self.mkdtemp()
+        self.writeConfig(root, {'ordered_indexes': ['cclock']})
+        self.writeFile(root, 'f2', 'x' * 200)
+        self.watchmanCommand('watch', root)
+        self.assertFileList(root, ['.watchmanconfig', 'f2'])
+        clock = self.watchmanCommand('clock', root,
+                                     {'sync_timeout': 2000})['clock']
+        self.assertEqual(self.query(root, ['since', clock, 'cclock']), [])
+        self.writeFile(root, 'new', 'x')
+        self.writeFile(root, 'f2', 'x')
+        self.assertWaitFor(
+            lambda: self.query(root, ['since', clock, 'cclock']) == ['new'])
+
+    def test_mtimeRange(self):
+        root = self.mkdtemp()
+        self.writeConfig(root, {'ordered_indexes': ['mtime']})
+        self.writeFile(root, 'f0', '')
+        self.writeFile(root, 'f1', 'x' * 100)
+        self.watchmanCommand('watch', root)
+        self.assertFileList(root, ['.watchmanconfig', 'f0', 'f1'])
+        old = os.path.join(root, 'f0')
+        os.utime(old, (1000000000, 1000000000))
+        self.assertWaitFor(lambda: 'f0' not in self.query(
+            root, ['since', 1400000000, 'mtime']))
+        self.assertEqual(
+            self.query(root, ['not', ['since', 1000000000, 'mtime']]),
+            ['f0'])
@@ -0,0 +1,60 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2015-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+import WatchmanTestCase
+import os
+import sys
+import unittest
+
+
+@unittest.skipIf(sys.platform == 'win32', 'no poll watcher on windows')
+class TestPoll(WatchmanTestCase.WatchmanTestCase):
+
+    def test_pollSeesChanges(self):
+        root = self.mkdtemp()
+        self.writeConfig(root, {'watcher': 'poll',
+                                'poll_min_interval_ms': 50})
+        os.makedirs(os.path.join(root, 'a', 'b'))
+        self.touchRelative(root, 'a', 'b', 'old')
+        self.touchRelative(root, 'gone')
+        res = self.watchmanCommand('watch', root)
+        self.assertEqual(res['watcher'], 'poll')
+        self.assertFileList(root, [
+            '.watchmanconfig', 'a', 'a/b', 'a/b/old', 'gone'])
+
+        before = self.metric('poll_dir_checks_total')
+        os.makedirs(os.path.join(root, 'a', 'b', 'c'))
+        self.touchRelative(root, 'a', 'b', 'c', 'new')
+        os.unlink(os.path.join(root, 'gone'))
+        self.assertFileList(root, [
+            '.watchmanconfig', 'a', 'a/b', 'a/b/c', 'a/b/c/new', 'a/b/old'])
+        self.assertGreater(self.metric('poll_dir_checks_total'), before)
+
+        # An in-place modification doesn't change the dir; the poller
+        # must find it by comparing the entries
+        clock = self.watchmanCommand('clock', root,
+                                     {'sync_timeout': 2000})['clock']
+        with open(os.path.join(root, 'a', 'b', 'old'), 'a') as f:
+            f.write('more')
+        self.assertWaitFor(lambda: self.getChangedFiles(root, clock) ==
+                           ['a/b/old'])
+
+    def test_syncIsPrompt(self):
+        # With a long interval, only the checks that the sync brings
+        # forward can notice the change in time.  The change is made in a
+        # subdir, as the root holds the cookie and is always checked
+        root = self.mkdtemp()
+        self.writeConfig(root, {'watcher': 'poll',
+                                'poll_min_interval_ms': 60000,
+                                'poll_max_interval_ms': 60000})
+        os.mkdir(os.path.join(root, 'sub'))
+        self.watchmanCommand('watch', root)
+        self.assertFileList(root, ['.watchmanconfig', 'sub'])
+
+        self.touchRelative(root, 'sub', 'hello')
+        res = self.watchmanCommand('query', root, {
+            'expression': ['name', 'hello'],
+            'fields': ['name'],
+            'sync_timeout': 10000})
+        self.assertEqual(res['files'], ['sub/hello'])
+        self.assertNotIn('partial_sync', res)
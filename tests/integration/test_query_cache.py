@@ -0,0 +1,95 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2015-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+import WatchmanTestCase
+import os
+from collections import OrderedDict
+
+
+class TestQueryCache(WatchmanTestCase.WatchmanTestCase):
+
+    def query(self, root, spec):
+        res = self.watchmanCommand('query', root, spec)
+        return sorted(res['files'])
+
+    def test_reuseAcrossClocks(self):
+        root = self.mkdtemp()
+        for name in ['a.c', 'b.c', 'c.h']:
+            self.touchRelative(root, name)
+        self.watchmanCommand('watch', root)
+        self.assertFileList(root, ['a.c', 'b.c', 'c.h'])
+        spec = {'expression': ['match', '*.c'], 'fields': ['name']}
+
+        misses = self.metric('query_cache_misses_total')
+        self.assertEqual(self.query(root, spec), ['a.c', 'b.c'])
+        self.assertGreater(self.metric('query_cache_misses_total'), misses)
+
+        clock = self.watchmanCommand('clock', root)['clock']
+        self.touchRelative(root, 'd.c')
+        self.touchRelative(root, 'e.h')
+
+        hits = self.metric('query_cache_hits_total')
+        spec['since'] = clock
+        self.assertWaitFor(lambda: self.query(root, spec) == ['d.c'])
+        self.assertGreater(self.metric('query_cache_hits_total'), hits)
+
+        # The cached query is not tied to the clock that it was first
+        # used with
+        del spec['since']
+        self.assertEqual(self.query(root, spec), ['a.c', 'b.c', 'd.c'])
+
+        # Key order doesn't matter
+        hits = self.metric('query_cache_hits_total')
+        self.query(root, OrderedDict([('fields', ['name']),
+                                      ('expression', ['match', '*.c'])]))
+        self.assertGreater(self.metric('query_cache_hits_total'), hits)
+
+        # A different expression is a different query
+        misses = self.metric('query_cache_misses_total')
+        self.assertEqual(self.query(root, {'expression': ['suffix', 'h'],
+                                           'fields': ['name']}),
+                         ['c.h', 'e.h'])
+        self.assertGreater(self.metric('query_cache_misses_total'), misses)
+
+    def test_namedCursors(self):
+        root = self.mkdtemp()
+        self.touchRelative(root, 'a.c')
+        self.touchRelative(root, 'b.c')
+        self.watchmanCommand('watch', root)
+        self.assertFileList(root, ['a.c', 'b.c'])
+        spec = {'since': 'n:cache', 'expression': ['suffix', 'c'],
+                'fields': ['name']}
+        self.assertEqual(self.query(root, spec), ['a.c', 'b.c'])
+        self.assertEqual(self.query(root, spec), [])
+        self.touchRelative(root, 'f.c')
+        self.assertWaitFor(lambda: self.query(root, spec) == ['f.c'])
+
+    def test_badSince(self):
+        root = self.mkdtemp()
+        self.touchRelative(root, 'a.c')
+        self.watchmanCommand('watch', root)
+        self.assertFileList(root, ['a.c'])
+        spec = {'expression': ['suffix', 'c'], 'fields': ['name']}
+        self.assertEqual(self.query(root, spec), ['a.c'])
+        spec['since'] = []
+        with self.assertRaises(Exception):
+            self.query(root, spec)
+
+    def test_perRoot(self):
+        root1 = self.mkdtemp()
+        self.touchRelative(root1, 'a.c')
+        self.touchRelative(root1, 'b.c')
+        self.watchmanCommand('watch', root1)
+        self.assertFileList(root1, ['a.c', 'b.c'])
+
+        root2 = self.mkdtemp()
+        os.mkdir(os.path.join(root2, 'sub'))
+        self.touchRelative(root2, 'sub', 'x.c')
+        self.watchmanCommand('watch', root2)
+        self.assertFileList(root2, ['sub', 'sub/x.c'])
+
+        spec = {'expression': ['suffix', 'c'], 'fields': ['name']}
+        self.assertEqual(self.query(root1, spec), ['a.c', 'b.c'])
+        self.assertEqual(self.query(root2, spec), ['sub/x.c'])
+        spec['relative_root'] = 'sub'
+        self.assertEqual(self.query(root2, spec), ['x.c'])
@@ -0,0 +1,74 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2015-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+import WatchmanInstance
+import WatchmanTestCase
+import json
+import os
+import pywatchman
+
+
+class TestState(WatchmanTestCase.WatchmanTestCase):
+
+    def setUp(self):
+        self.inst = WatchmanInstance.Instance()
+        self.inst.start()
+        self.client = pywatchman.client(sockpath=self.inst.getSockPath())
+
+    def tearDown(self):
+        self.client.close()
+        self.inst.stop()
+
+    def readState(self):
+        try:
+            with open(self.inst.state_file) as f:
+                return f.read()
+        except IOError:
+            return ''
+
+    def triggerNames(self, root):
+        content = self.readState()
+        if not content:
+            return []
+        for watched in json.loads(content)['watched']:
+            if watched['path'] == root:
+                return sorted(t['name'] for t in watched['triggers'])
+        return []
+
+    def test_burstIsCoalesced(self):
+        root = self.mkdtemp()
+        self.client.query('watch', root)
+        before = self.client.query('debug-metrics')['metrics']
+
+        names = sorted('t%02d' % i for i in range(20))
+        for name in names:
+            self.client.query('trigger', root, {
+                'name': name,
+                'command': ['true'],
+                'expression': ['suffix', 'nomatch']})
+
+        self.assertWaitFor(lambda: self.triggerNames(root) == names)
+
+        after = self.client.query('debug-metrics')['metrics']
+        requests = after['state_save_requests_total']['value'] - \
+            before['state_save_requests_total']['value']
+        writes = after['state_writes_total']['value'] - \
+            before['state_writes_total']['value']
+        self.assertEqual(requests, 20)
+        self.assertLess(writes, requests)
+
+        # Written compactly, and nothing is left behind by the renames
+        self.assertEqual(self.readState().count('\n'), 1)
+        leftovers = [f for f in os.listdir(self.inst.base_dir)
+                     if f.startswith('state.')]
+        self.assertEqual(leftovers, [])
+
+    def test_shutdownFlushes(self):
+        root = self.mkdtemp()
+        self.client.query('watch', root)
+        self.client.query('trigger', root, {
+            'name': 'last',
+            'command': ['true'],
+            'expression': ['suffix', 'nomatch']})
+        self.client.query('shutdown-server')
+        self.assertWaitFor(lambda: self.triggerNames(root) == ['last'])
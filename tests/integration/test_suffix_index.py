@@ -0,0 +1,81 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2015-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+import WatchmanTestCase
+import os
+
+
+class TestSuffixIndex(WatchmanTestCase.WatchmanTestCase):
+
+    def suffixQuery(self, root, suffix):
+        res = self.watchmanCommand('query', root, {
+            'suffix': suffix,
+            'fields': ['name']})
+        return sorted(res['files'])
+
+    def checkSuffixes(self, root):
+        self.assertEqual(self.suffixQuery(root, 'ts'),
+                         ['C.D.TS', 'a.ts', 'b.d.ts', 'g.x.d.ts'])
+        self.assertEqual(self.suffixQuery(root, 'd.ts'),
+                         ['C.D.TS', 'b.d.ts', 'g.x.d.ts'])
+        self.assertEqual(self.suffixQuery(root, '.x.D.ts'), [])
+        self.assertEqual(self.suffixQuery(root, 'x.d.ts'), ['g.x.d.ts'])
+        self.assertEqual(self.suffixQuery(root, ['min.js', 'tar.gz']),
+                         ['e.min.js', 'h.tar.gz'])
+        self.assertEqual(self.suffixQuery(root, 'js'), ['e.min.js', 'f.js'])
+
+    def test_unindexedCompound(self):
+        root = self.mkdtemp()
+        self.writeConfig(root, {})
+        for name in ['a.ts', 'b.d.ts', 'C.D.TS', 'e.min.js', 'f.js',
+                     'g.x.d.ts', 'h.tar.gz']:
+            self.touchRelative(root, name)
+        self.watchmanCommand('watch', root)
+        self.assertFileList(root, [
+            '.watchmanconfig', 'C.D.TS', 'a.ts', 'b.d.ts', 'e.min.js',
+            'f.js', 'g.x.d.ts', 'h.tar.gz'])
+        self.checkSuffixes(root)
+
+    def test_indexedCompound(self):
+        root = self.mkdtemp()
+        self.writeConfig(root, {'indexed_suffixes': ['.d.ts', 'x.d.ts',
+                                      'min.js', 'js']})
+        for name in ['a.ts', 'b.d.ts', 'C.D.TS', 'e.min.js', 'f.js',
+                     'g.x.d.ts', 'h.tar.gz']:
+            self.touchRelative(root, name)
+        self.watchmanCommand('watch', root)
+        self.assertFileList(root, [
+            '.watchmanconfig', 'C.D.TS', 'a.ts', 'b.d.ts', 'e.min.js',
+            'f.js', 'g.x.d.ts', 'h.tar.gz'])
+        self.checkSuffixes(root)
+
+        # Changing the list re-indexes the tree
+        self.writeConfig(root, {'indexed_suffixes': ['tar.gz']})
+        self.assertWaitFor(
+            lambda: self.suffixQuery(root, 'tar.gz') == ['h.tar.gz'])
+        self.checkSuffixes(root)
+
+    def test_removals(self):
+        root = self.mkdtemp()
+        self.writeConfig(root, {'indexed_suffixes': ['d.ts']})
+        for name in ['a.ts', 'b.d.ts', 'C.D.TS', 'g.x.d.ts']:
+            self.touchRelative(root, name)
+        self.watchmanCommand('watch', root)
+        self.assertFileList(root, [
+            '.watchmanconfig', 'C.D.TS', 'a.ts', 'b.d.ts', 'g.x.d.ts'])
+        for i in range(40):
+            self.touchRelative(root, 'tmp%d.d.ts' % i)
+        self.assertWaitFor(lambda: len(self.suffixQuery(root, 'd.ts')) == 43)
+        for i in range(40):
+            os.unlink(os.path.join(root, 'tmp%d.d.ts' % i))
+        self.assertWaitFor(lambda: len(self.suffixQuery(root, 'd.ts')) == 3)
+
+        compactions = self.metric('suffix_index_compactions_total')
+        # Pruning the deleted nodes leaves tombstones that get compacted
+        self.watchmanCommand('debug-ageout', root, 0)
+        self.assertEqual(self.suffixQuery(root, 'd.ts'),
+                         ['C.D.TS', 'b.d.ts', 'g.x.d.ts'])
+        self.assertEqual(self.suffixQuery(root, 'ts'),
+                         ['C.D.TS', 'a.ts', 'b.d.ts', 'g.x.d.ts'])
+        self.assertGreater(self.metric('suffix_index_compactions_total'),
+                           compactions)
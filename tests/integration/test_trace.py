@@ -0,0 +1,57 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2015-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+import WatchmanTestCase
+import json
+import os
+
+
+class TestTrace(WatchmanTestCase.WatchmanTestCase):
+
+    def test_traceQuery(self):
+        root = self.mkdtemp()
+        self.touchRelative(root, 'a')
+        self.watchmanCommand('watch', root)
+        self.assertFileList(root, ['a'])
+
+        res = self.watchmanCommand('debug-trace', 'start')
+        self.assertTrue(res['tracing'])
+        self.watchmanCommand('query', root, {'fields': ['name']})
+        res = self.watchmanCommand('debug-trace', 'stop')
+        self.assertFalse(res['tracing'])
+
+        dump = self.watchmanCommand('debug-trace', 'dump')
+        names = set(ev['name'] for ev in dump['traceEvents'])
+        for name in ('query_execute', 'sync_to_now', 'lock_wait',
+                     'generate', 'render_results'):
+            self.assertIn(name, names)
+
+        for ev in dump['traceEvents']:
+            if ev['ph'] == 'X':
+                self.assertGreaterEqual(ev['dur'], 0)
+                self.assertIn('tid', ev)
+
+        # Restarting discards the old spans
+        self.watchmanCommand('debug-trace', 'start')
+        self.watchmanCommand('debug-trace', 'stop')
+        dump = self.watchmanCommand('debug-trace', 'dump')
+        self.assertNotIn('query_execute',
+                         [ev['name'] for ev in dump['traceEvents']])
+
+    def test_traceDumpToFile(self):
+        path = os.path.join(self.mkdtemp(), 'trace.json')
+        self.watchmanCommand('debug-trace', 'start')
+        self.watchmanCommand('debug-trace', 'stop')
+        res = self.watchmanCommand('debug-trace', 'dump', path)
+        self.assertEqual(res['path'], path)
+        with open(path) as f:
+            trace = json.load(f)
+        self.assertEqual(len(trace['traceEvents']), res['num_events'])
+
+    def test_traceBadArgs(self):
+        with self.assertRaises(Exception) as ctx:
+            self.watchmanCommand('debug-trace', 'bogus')
+        self.assertIn('unknown', str(ctx.exception))
+        with self.assertRaises(Exception) as ctx:
+            self.watchmanCommand('debug-trace', 'start', '/tmp/foo')
+        self.assertIn('path argument', str(ctx.exception))
@@ -0,0 +1,88 @@
+/* Copyright 2015-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+#include "thirdparty/tap.h"
+
+#define NUM_ITEMS 1000
+
+static int items[NUM_ITEMS];
+
+// Whether the list holds the keys [lo, hi) of items, in order
+static bool holds_range(w_skiplist_t *list, int64_t lo, int64_t hi)
+{
+  struct w_skiplist_node *node = w_skiplist_seek(list, INT64_MIN);
+  int64_t expect;
+
+  for (expect = lo; expect < hi; expect++) {
+    if (!node || w_skiplist_key(node) != expect ||
+        w_skiplist_val(node) != &items[expect]) {
+      return false;
+    }
+    node = w_skiplist_next(node);
+  }
+  return node == NULL;
+}
+
+int main(int argc, char **argv)
+{
+  w_skiplist_t *list;
+  struct w_skiplist_node *node;
+  int i, dups;
+  bool ok_all;
+  (void)argc;
+  (void)argv;
+
+  plan_tests(12);
+
+  list = w_skiplist_new();
+  ok(list != NULL, "new");
+  ok(w_skiplist_seek(list, 0) == NULL, "empty list has nothing to seek");
+
+  // Insert in a scrambled order
+  ok_all = true;
+  for (i = 0; i < NUM_ITEMS; i++) {
+    int k = (i * 7919) % NUM_ITEMS;
+
+    ok_all &= w_skiplist_insert(list, k, &items[k]);
+  }
+  ok(ok_all, "inserted");
+  ok(w_skiplist_size(list) == NUM_ITEMS, "size");
+  ok(holds_range(list, 0, NUM_ITEMS), "iterates in key order");
+
+  node = w_skiplist_seek(list, 500);
+  ok(node && w_skiplist_key(node) == 500, "seek to existing key");
+
+  ok(!w_skiplist_remove(list, 10, &items[11]), "remove needs the value too");
+  ok_all = true;
+  for (i = 0; i < NUM_ITEMS / 2; i++) {
+    ok_all &= w_skiplist_remove(list, i, &items[i]);
+  }
+  ok(ok_all && holds_range(list, NUM_ITEMS / 2, NUM_ITEMS), "removed");
+
+  node = w_skiplist_seek(list, 0);
+  ok(node && w_skiplist_key(node) == NUM_ITEMS / 2,
+      "seek before the first key");
+  ok(w_skiplist_seek(list, NUM_ITEMS) == NULL, "seek past the last key");
+
+  // Many values under one key
+  for (i = 0; i < 10; i++) {
+    w_skiplist_insert(list, -1, &items[i]);
+  }
+  dups = 0;
+  for (node = w_skiplist_seek(list, -1); node && w_skiplist_key(node) == -1;
+      node = w_skiplist_next(node)) {
+    dups++;
+  }
+  ok(dups == 10, "duplicate keys are kept");
+  ok(w_skiplist_remove(list, -1, &items[3]) &&
+      w_skiplist_size(list) == NUM_ITEMS / 2 + 9,
+      "remove one of a duplicate key");
+
+  w_skiplist_free(list);
+
+  return exit_status();
+}
+
+/* vim:ts=2:sw=2:et:
+ */
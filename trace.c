@@ -0,0 +1,211 @@
+/* Copyright 2015-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+
+bool w_trace_enabled = false;
+
+struct trace_event {
+  const char *cat;
+  const char *name;
+  uint64_t start;
+  uint64_t dur;
+  char *detail;
+};
+
+struct trace_buffer {
+  pthread_mutex_t lock;
+  struct trace_event *events;
+  // index of the next slot to write
+  uint32_t pos;
+  // true once pos has wrapped around at least once
+  bool wrapped;
+  uint32_t tid;
+  char *thread_name;
+  // set when the owning thread has exited
+  bool dead;
+  struct trace_buffer *next;
+};
+
+// Protects buffers and next_tid
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_buffer *buffers = NULL;
+static uint32_t next_tid = 1;
+static pthread_key_t trace_key;
+
+static void thread_exited(void *ptr) {
+  struct trace_buffer *buf = ptr;
+
+  pthread_mutex_lock(&trace_lock);
+  buf->dead = true;
+  pthread_mutex_unlock(&trace_lock);
+}
+
+static w_ctor_fn_type(register_trace_key) {
+  pthread_key_create(&trace_key, thread_exited);
+}
+w_ctor_fn_reg(register_trace_key);
+
+static void reset_buffer(struct trace_buffer *buf) {
+  uint32_t i, n = buf->wrapped ? W_TRACE_EVENTS_PER_THREAD : buf->pos;
+
+  for (i = 0; i < n; i++) {
+    free(buf->events[i].detail);
+    buf->events[i].detail = NULL;
+  }
+  buf->pos = 0;
+  buf->wrapped = false;
+}
+
+static void free_buffer(struct trace_buffer *buf) {
+  reset_buffer(buf);
+  pthread_mutex_destroy(&buf->lock);
+  free(buf->events);
+  free(buf->thread_name);
+  free(buf);
+}
+
+// Buffers are only created while tracing is enabled, so threads that
+// never emit a span while tracing cost nothing
+static struct trace_buffer *get_buffer(void) {
+  struct trace_buffer *buf = pthread_getspecific(trace_key);
+
+  if (buf) {
+    return buf;
+  }
+
+  buf = calloc(1, sizeof(*buf));
+  if (!buf) {
+    return NULL;
+  }
+  buf->events = calloc(W_TRACE_EVENTS_PER_THREAD, sizeof(*buf->events));
+  buf->thread_name = strdup(w_get_thread_name());
+  if (!buf->events || !buf->thread_name) {
+    free(buf->events);
+    free(buf->thread_name);
+    free(buf);
+    return NULL;
+  }
+  pthread_mutex_init(&buf->lock, NULL);
+
+  pthread_mutex_lock(&trace_lock);
+  buf->tid = next_tid++;
+  buf->next = buffers;
+  buffers = buf;
+  pthread_mutex_unlock(&trace_lock);
+
+  pthread_setspecific(trace_key, buf);
+  return buf;
+}
+
+void w_trace_record(const char *cat, const char *name, uint64_t start,
+    const char *detail) {
+  uint64_t now = w_metric_now_usec();
+  struct trace_buffer *buf = get_buffer();
+  struct trace_event *ev;
+
+  if (!buf) {
+    return;
+  }
+
+  pthread_mutex_lock(&buf->lock);
+  ev = &buf->events[buf->pos];
+  free(ev->detail);
+  ev->cat = cat;
+  ev->name = name;
+  ev->start = start;
+  ev->dur = now - start;
+  ev->detail = detail ? strdup(detail) : NULL;
+  if (++buf->pos == W_TRACE_EVENTS_PER_THREAD) {
+    buf->pos = 0;
+    buf->wrapped = true;
+  }
+  pthread_mutex_unlock(&buf->lock);
+}
+
+void w_trace_start(void) {
+  struct trace_buffer *buf, **prev;
+
+  pthread_mutex_lock(&trace_lock);
+  prev = &buffers;
+  while ((buf = *prev) != NULL) {
+    if (buf->dead) {
+      *prev = buf->next;
+      free_buffer(buf);
+      continue;
+    }
+    pthread_mutex_lock(&buf->lock);
+    reset_buffer(buf);
+    pthread_mutex_unlock(&buf->lock);
+    prev = &buf->next;
+  }
+  w_trace_enabled = true;
+  pthread_mutex_unlock(&trace_lock);
+
+  w_log(W_LOG_ERR, "tracing enabled\n");
+}
+
+void w_trace_stop(void) {
+  w_trace_enabled = false;
+  w_log(W_LOG_ERR, "tracing disabled\n");
+}
+
+static json_t *event_to_json(struct trace_event *ev, uint32_t tid, int pid) {
+  json_t *item = json_pack("{s:s, s:s, s:s, s:I, s:I, s:i, s:i}",
+      "name", ev->name,
+      "cat", ev->cat,
+      "ph", "X",
+      "ts", (json_int_t)ev->start,
+      "dur", (json_int_t)ev->dur,
+      "pid", pid,
+      "tid", (int)tid);
+
+  if (ev->detail) {
+    set_prop(item, "args",
+        json_pack("{s:s}", "detail", ev->detail));
+  }
+  return item;
+}
+
+json_t *w_trace_to_json(void) {
+  json_t *events = json_array();
+  struct trace_buffer *buf;
+  int pid = (int)getpid();
+
+  pthread_mutex_lock(&trace_lock);
+  for (buf = buffers; buf; buf = buf->next) {
+    uint32_t i, n, first;
+
+    pthread_mutex_lock(&buf->lock);
+    n = buf->wrapped ? W_TRACE_EVENTS_PER_THREAD : buf->pos;
+    if (n == 0) {
+      pthread_mutex_unlock(&buf->lock);
+      continue;
+    }
+    // Emit oldest first
+    first = buf->wrapped ? buf->pos : 0;
+
+    json_array_append_new(events,
+        json_pack("{s:s, s:s, s:i, s:i, s:{s:s}}",
+          "name", "thread_name",
+          "ph", "M",
+          "pid", pid,
+          "tid", (int)buf->tid,
+          "args", "name", buf->thread_name));
+
+    for (i = 0; i < n; i++) {
+      json_array_append_new(events, event_to_json(
+            &buf->events[(first + i) % W_TRACE_EVENTS_PER_THREAD],
+            buf->tid, pid));
+    }
+    pthread_mutex_unlock(&buf->lock);
+  }
+  pthread_mutex_unlock(&trace_lock);
+
+  return json_pack("{s:o, s:s}",
+      "traceEvents", events,
+      "displayTimeUnit", "ms");
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -489,7 +489,8 @@ static void fsevents_file_free(watchman_global_watcher_t watcher,
 struct watchman_ops fsevents_watcher = {
   "fsevents",
   WATCHER_HAS_PER_FILE_NOTIFICATIONS|
-    WATCHER_COALESCED_RENAME,
+    WATCHER_COALESCED_RENAME|
+    WATCHER_TREE_EVICTABLE,
   fsevents_global_init,
   fsevents_global_dtor,
   fsevents_root_init,
@@ -502,7 +503,10 @@ struct watchman_ops fsevents_watcher = {
   fsevents_root_signal_threads,
   fsevents_root_consume_notify,
   fsevents_root_wait_notify,
-  fsevents_file_free
+  fsevents_file_free,
+  NULL, // root_notify_fd
+  NULL, // root_sync
+  NULL, // root_timer_ms
 };
 #endif // HAVE_FSEVENTS
 
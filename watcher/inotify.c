@@ -38,11 +38,84 @@ static const struct flag_map inflags[] = {
   {0, NULL},
 };
 
+W_METRIC_COUNTER(inotify_events, "inotify_events_total",
+    "Number of inotify events processed");
+W_METRIC_COUNTER(inotify_overflows, "inotify_overflows_total",
+    "Number of times the inotify queue overflowed");
+W_METRIC_GAUGE(inotify_watches, "inotify_watches",
+    "Number of inotify watches held across all roots");
+W_METRIC_GAUGE(inotify_polled_dirs, "inotify_polled_dirs",
+    "Number of dirs polled because inotify watches ran short");
+W_METRIC_COUNTER(inotify_demotions, "inotify_demotions_total",
+    "Number of dirs whose inotify watch was given up for polling");
+W_METRIC_COUNTER(inotify_promotions, "inotify_promotions_total",
+    "Number of polled dirs that became active and were watched again");
+
+/* Running short of watches.
+ *
+ * Each watched dir costs one of the fs.inotify.max_user_watches that
+ * are shared by every process of the user.  Rather than failing when
+ * they run out, we give up the watches on the dirs that have been
+ * quiet the longest and check those dirs with a w_poll_set instead
+ * (see watcher/poll.c).  This happens when inotify_add_watch fails
+ * with ENOSPC, or before that, once our watches reach
+ * inotify_watch_share of max_user_watches, or inotify_watch_limit
+ * for the root.  A polled dir that changes at consecutive checks is
+ * watched again, giving up the quietest watches if need be.  The root
+ * and the query cookie dir are always watched, so that syncs stay
+ * prompt. */
+
+// Give up this fraction of a root's watches at a time, so that making
+// room isn't repeated for each new dir
+#define INOT_DEMOTE_FRACTION 8
+
 struct pending_move {
   time_t created;
   w_string_t *name;
 };
 
+/* Event recording and replay.
+ *
+ * When the inotify_record_file option is set, the raw buffers read from
+ * the inotify descriptor are appended to that file along with the
+ * watch descriptor -> directory mappings needed to interpret them.
+ * When inotify_replay_file is set, the root does not use inotify at all;
+ * the recorded stream is fed back through process_inotify_event with
+ * the original timing (scaled by inotify_replay_speed; 0 means as fast
+ * as possible), which exercises the real pending/stat pipeline against
+ * whatever tree is present at the root.  Paths are recorded relative
+ * to the root, so a recording can be replayed against a different
+ * (synthetic) tree.
+ *
+ * The file starts with INOT_RECORD_MAGIC followed by records, each
+ * a struct inot_record_hdr followed by len bytes of payload.  All
+ * values are in host byte order. */
+#define INOT_RECORD_MAGIC "WMINREC1"
+
+enum inot_record_type {
+  // A new inotify instance was created; all prior wds are invalid
+  INOT_RECORD_RESET = 1,
+  // payload is int32_t wd followed by the dir name relative to the root
+  INOT_RECORD_WATCH = 2,
+  // payload is the raw buffer returned by read(2) on the inotify fd
+  INOT_RECORD_EVENTS = 3,
+};
+
+struct inot_record_hdr {
+  uint32_t type;
+  uint32_t len;
+  // wall clock time of the record in microseconds
+  uint64_t usec;
+};
+
+// Tracks replay progress across recrawls, which tear down and
+// re-initialize the watcher state.  Keyed by root path.
+struct inot_replay_progress {
+  off_t offset;
+  uint64_t first_usec;
+  struct timeval start;
+};
+
 struct inot_root_state {
   /* we use one inotify instance per watched root dir */
   int infd;
@@ -51,14 +124,47 @@ struct inot_root_state {
   w_ht_t *wd_to_name;
   /* map of inotify cookie to corresponding name */
   w_ht_t *move_map;
-  /* lock to protect both of the maps above */
+  /* map of watch descriptor to the time of the latest event for it,
+   * for each watch that we may give up to make room */
+  w_ht_t *wd_activity;
+  /* map of the watch descriptors that we gave up to the names of their
+   * dirs, kept until the kernel confirms the removal with IN_IGNORED so
+   * that events queued before then can still be resolved */
+  w_ht_t *retired;
+  /* the dirs that we poll rather than watch; created on first use */
+  struct w_poll_set *polled;
+  /* lock to protect all of the above */
   pthread_mutex_t lock;
 
+  /* the most watches this root may hold, and the most that all roots
+   * may hold between them before we start making room; 0 if no limit */
+  uint32_t root_watch_limit;
+  int64_t total_watch_limit;
+
+  /* if not -1, all event buffers and wd mappings are recorded here.
+   * Writes are made while holding lock */
+  int record_fd;
+
+  /* if not -1, events are replayed from this descriptor rather
+   * than read from infd */
+  int replay_fd;
+  double replay_speed;
+  // header of the next record, if have_next
+  struct inot_record_hdr next_hdr;
+  bool have_next;
+  bool replay_done;
+  // timestamp of the first record and when we started replaying it
+  uint64_t first_usec;
+  struct timeval replay_start;
+
   // Make the buffer big enough for 16k entries, which
   // happens to be the default fs.inotify.max_queued_events
   char ibuf[WATCHMAN_BATCH_LIMIT * (sizeof(struct inotify_event) + 256)];
 };
 
+static pthread_mutex_t replay_lock = PTHREAD_MUTEX_INITIALIZER;
+static w_ht_t *replay_progress = NULL;
+
 static w_ht_val_t copy_pending(w_ht_val_t key) {
   struct pending_move *src = w_ht_val_ptr(key);
   struct pending_move *dest = malloc(sizeof(*dest));
@@ -84,6 +190,160 @@ static const struct watchman_hash_funcs move_hash_funcs = {
   del_pending   // del_val
 };
 
+static void del_progress(w_ht_val_t key) {
+  free(w_ht_val_ptr(key));
+}
+
+static const struct watchman_hash_funcs progress_hash_funcs = {
+  w_ht_string_copy,
+  w_ht_string_del,
+  w_ht_string_equal,
+  w_ht_string_hash,
+  NULL,
+  del_progress
+};
+
+static uint64_t timeval_to_usec(struct timeval tv) {
+  return ((uint64_t)tv.tv_sec * 1000000) + tv.tv_usec;
+}
+
+static void record_write(struct inot_root_state *state,
+    enum inot_record_type type, const void *a, uint32_t alen,
+    const void *b, uint32_t blen) {
+  struct inot_record_hdr hdr;
+  struct iovec iov[3];
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  hdr.type = type;
+  hdr.len = alen + blen;
+  hdr.usec = timeval_to_usec(now);
+
+  iov[0].iov_base = &hdr;
+  iov[0].iov_len = sizeof(hdr);
+  iov[1].iov_base = (void*)a;
+  iov[1].iov_len = alen;
+  iov[2].iov_base = (void*)b;
+  iov[2].iov_len = blen;
+
+  if (writev(state->record_fd, iov, 3) !=
+      (ssize_t)(sizeof(hdr) + hdr.len)) {
+    w_log(W_LOG_ERR, "inotify record: write failed: %s; "
+        "no longer recording\n", strerror(errno));
+    close(state->record_fd);
+    state->record_fd = -1;
+  }
+}
+
+// Record a wd -> dir mapping.  Caller must hold state->lock
+static void record_watch(w_root_t *root, int wd, w_string_t *dir_name) {
+  struct inot_root_state *state = root->watch;
+  int32_t wd32 = wd;
+  const char *rel = "";
+  uint32_t rel_len = 0;
+
+  if (state->record_fd == -1) {
+    return;
+  }
+
+  if (dir_name->len > root->root_path->len) {
+    rel = dir_name->buf + root->root_path->len + 1;
+    rel_len = dir_name->len - root->root_path->len - 1;
+  }
+  record_write(state, INOT_RECORD_WATCH, &wd32, sizeof(wd32), rel, rel_len);
+}
+
+static bool open_record_file(w_root_t *root, struct inot_root_state *state,
+    const char *path, char **errmsg) {
+  struct stat st;
+
+  state->record_fd = open(path, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0600);
+  if (state->record_fd == -1 || fstat(state->record_fd, &st)) {
+    ignore_result(asprintf(errmsg, "inotify_record_file: open(%s): %s",
+          path, strerror(errno)));
+    return false;
+  }
+  if (st.st_size == 0 && write(state->record_fd, INOT_RECORD_MAGIC,
+        strlen(INOT_RECORD_MAGIC)) != (ssize_t)strlen(INOT_RECORD_MAGIC)) {
+    ignore_result(asprintf(errmsg, "inotify_record_file: write(%s): %s",
+          path, strerror(errno)));
+    return false;
+  }
+  w_log(W_LOG_ERR, "recording inotify events for %.*s to %s\n",
+      root->root_path->len, root->root_path->buf, path);
+  record_write(state, INOT_RECORD_RESET, NULL, 0, NULL, 0);
+  return true;
+}
+
+static bool open_replay_file(w_root_t *root, struct inot_root_state *state,
+    const char *path, char **errmsg) {
+  char magic[sizeof(INOT_RECORD_MAGIC) - 1];
+  struct inot_replay_progress *prog = NULL;
+
+  state->replay_fd = open(path, O_RDONLY|O_CLOEXEC);
+  if (state->replay_fd == -1) {
+    ignore_result(asprintf(errmsg, "inotify_replay_file: open(%s): %s",
+          path, strerror(errno)));
+    return false;
+  }
+  if (read(state->replay_fd, magic, sizeof(magic)) != sizeof(magic) ||
+      memcmp(magic, INOT_RECORD_MAGIC, sizeof(magic))) {
+    ignore_result(asprintf(errmsg,
+          "inotify_replay_file: %s is not an inotify recording", path));
+    return false;
+  }
+  state->replay_speed = cfg_get_double(root, "inotify_replay_speed", 1.0);
+
+  // If we are being re-initialized due to a recrawl, pick up where
+  // we left off rather than replaying the stream from the start
+  pthread_mutex_lock(&replay_lock);
+  if (replay_progress) {
+    prog = w_ht_val_ptr(w_ht_get(replay_progress,
+          w_ht_ptr_val(root->root_path)));
+  }
+  if (prog) {
+    lseek(state->replay_fd, prog->offset, SEEK_SET);
+    state->first_usec = prog->first_usec;
+    state->replay_start = prog->start;
+  }
+  pthread_mutex_unlock(&replay_lock);
+
+  w_log(W_LOG_ERR, "replaying inotify events for %.*s from %s%s\n",
+      root->root_path->len, root->root_path->buf, path,
+      prog ? " (resuming after recrawl)" : "");
+  return true;
+}
+
+static void save_replay_progress(w_root_t *root,
+    struct inot_root_state *state) {
+  struct inot_replay_progress *prog;
+
+  pthread_mutex_lock(&replay_lock);
+  if (root->cancelled) {
+    if (replay_progress) {
+      w_ht_del(replay_progress, w_ht_ptr_val(root->root_path));
+    }
+    pthread_mutex_unlock(&replay_lock);
+    return;
+  }
+
+  if (!replay_progress) {
+    replay_progress = w_ht_new(2, &progress_hash_funcs);
+  }
+  prog = calloc(1, sizeof(*prog));
+  if (prog) {
+    prog->offset = lseek(state->replay_fd, 0, SEEK_CUR);
+    if (state->have_next) {
+      prog->offset -= sizeof(state->next_hdr);
+    }
+    prog->first_usec = state->first_usec;
+    prog->start = state->replay_start;
+    w_ht_replace(replay_progress, w_ht_ptr_val(root->root_path),
+        w_ht_ptr_val(prog));
+  }
+  pthread_mutex_unlock(&replay_lock);
+}
+
 watchman_global_watcher_t inot_global_init(void) {
   return NULL;
 }
@@ -111,9 +371,177 @@ static const char *inot_strerror(int err) {
   }
 }
 
+// Returns fs.inotify.max_user_watches, or 0 if it can't be read
+static int64_t read_max_user_watches(void) {
+  FILE *f = fopen("/proc/sys/fs/inotify/max_user_watches", "r");
+  long long val = 0;
+
+  if (!f) {
+    return 0;
+  }
+  if (fscanf(f, "%lld", &val) != 1) {
+    val = 0;
+  }
+  fclose(f);
+  return val;
+}
+
+static void compute_watch_limits(w_root_t *root,
+    struct inot_root_state *state) {
+  json_int_t limit = cfg_get_int(root, "inotify_watch_limit", 0);
+  double share = cfg_get_double(root, "inotify_watch_share", 0.9);
+
+  if (limit < 0 || limit > UINT32_MAX) {
+    w_log(W_LOG_ERR, "inotify_watch_limit must be between 0 and %" PRIu32
+        ", ignoring it\n", UINT32_MAX);
+    limit = 0;
+  }
+  state->root_watch_limit = (uint32_t)limit;
+
+  if (share <= 0 || share > 1) {
+    w_log(W_LOG_ERR, "inotify_watch_share must be greater than 0 and at "
+        "most 1, using 0.9\n");
+    share = 0.9;
+  }
+  state->total_watch_limit = (int64_t)(read_max_user_watches() * share);
+}
+
+// Caller must hold state->lock
+static bool over_watch_limit(struct inot_root_state *state) {
+  return (state->root_watch_limit &&
+      w_ht_size(state->wd_to_name) >= state->root_watch_limit) ||
+    (state->total_watch_limit &&
+     inotify_watches.value >= state->total_watch_limit);
+}
+
+/* Records that wd watches dir_name.
+ * Caller must hold state->lock */
+static void note_watch(w_root_t *root, int wd, w_string_t *dir_name,
+    time_t now) {
+  struct inot_root_state *state = root->watch;
+
+  if (!w_ht_get(state->wd_to_name, wd)) {
+    w_metric_inc(&inotify_watches);
+  }
+  w_ht_replace(state->wd_to_name, wd, w_ht_ptr_val(dir_name));
+  w_ht_replace(state->wd_activity, wd, now);
+  w_ht_del(state->retired, wd);
+  record_watch(root, wd, dir_name);
+}
+
+/* Forgets wd, after the kernel has removed it.
+ * Caller must hold state->lock */
+static void forget_watch(struct inot_root_state *state, int wd) {
+  if (w_ht_del(state->wd_to_name, wd)) {
+    w_metric_dec(&inotify_watches);
+  }
+  w_ht_del(state->wd_activity, wd);
+}
+
+/* Polls dir_name rather than watching it.
+ * Caller must hold state->lock */
+static bool poll_dir(w_root_t *root, w_string_t *dir_name, uint32_t cost,
+    time_t crawled) {
+  struct inot_root_state *state = root->watch;
+  uint32_t before;
+
+  if (!state->polled) {
+    state->polled = w_poll_set_new(root);
+    if (!state->polled) {
+      return false;
+    }
+  }
+  before = w_poll_set_size(state->polled);
+  if (!w_poll_set_add(state->polled, dir_name, cost, crawled)) {
+    return false;
+  }
+  w_metric_add(&inotify_polled_dirs,
+      (int64_t)w_poll_set_size(state->polled) - before);
+  return true;
+}
+
+struct wd_age {
+  int wd;
+  time_t active;
+};
+
+static int compare_wd_age(const void *a, const void *b) {
+  const struct wd_age *x = a, *y = b;
+
+  if (x->active != y->active) {
+    return x->active < y->active ? -1 : 1;
+  }
+  return x->wd - y->wd;
+}
+
+/* Gives up the watches on the dirs that have been quiet the longest,
+ * polling those dirs instead.  Returns false if there were none to give
+ * up.  Caller must hold state->lock */
+static bool demote_quietest(w_root_t *root, time_t now) {
+  struct inot_root_state *state = root->watch;
+  struct wd_age *ages;
+  uint32_t num = 0, batch, i;
+  w_ht_iter_t iter;
+
+  ages = malloc(MAX(w_ht_size(state->wd_activity), 1) * sizeof(*ages));
+  if (!ages) {
+    return false;
+  }
+  if (w_ht_first(state->wd_activity, &iter)) do {
+    w_string_t *name = w_ht_val_ptr(w_ht_get(state->wd_to_name, iter.key));
+
+    if (!name || w_string_equal(name, root->root_path) ||
+        w_string_equal(name, root->query_cookie_dir)) {
+      continue;
+    }
+    ages[num].wd = (int)iter.key;
+    ages[num].active = (time_t)iter.value;
+    num++;
+  } while (w_ht_next(state->wd_activity, &iter));
+
+  qsort(ages, num, sizeof(*ages), compare_wd_age);
+  batch = MIN(num, MAX(w_ht_size(state->wd_activity) /
+        INOT_DEMOTE_FRACTION, 1));
+
+  for (i = 0; i < batch; i++) {
+    w_string_t *name = w_ht_val_ptr(w_ht_get(state->wd_to_name,
+          ages[i].wd));
+
+    // Changes made from here on are caught by the first check, which
+    // treats anything changed since now as new
+    if (!poll_dir(root, name, 1, now)) {
+      break;
+    }
+    inotify_rm_watch(state->infd, ages[i].wd);
+    // The kernel has already released the watch, so it no longer counts
+    // against the limits
+    w_ht_set(state->retired, ages[i].wd, w_ht_ptr_val(name));
+    forget_watch(state, ages[i].wd);
+    w_metric_inc(&inotify_demotions);
+    w_log(W_LOG_DBG, "inotify: polling %s instead of watching it\n",
+        name->buf);
+  }
+  free(ages);
+
+  if (i > 0) {
+    w_log(W_LOG_ERR, "inotify: short of watches for %.*s, polling "
+        "%" PRIu32 " quiet dirs instead\n",
+        root->root_path->len, root->root_path->buf, i);
+  }
+  return i > 0;
+}
+
+// Wakes the notify job so that it schedules the checks of polled dirs
+static void poll_set_changed(w_root_t *root) {
+  if (root->notify_job) {
+    w_pool_job_kick(root->notify_job);
+  }
+}
+
 bool inot_root_init(watchman_global_watcher_t watcher, w_root_t *root,
     char **errmsg) {
   struct inot_root_state *state;
+  const char *record_file, *replay_file;
   unused_parameter(watcher);
 
   state = calloc(1, sizeof(*state));
@@ -123,6 +551,23 @@ bool inot_root_init(watchman_global_watcher_t watcher, w_root_t *root,
   }
   root->watch = state;
   pthread_mutex_init(&state->lock, NULL);
+  state->record_fd = -1;
+  state->replay_fd = -1;
+  state->infd = -1;
+  state->wd_to_name = w_ht_new(HINT_NUM_DIRS, &w_ht_string_val_funcs);
+  state->move_map = w_ht_new(2, &move_hash_funcs);
+  state->wd_activity = w_ht_new(HINT_NUM_DIRS, NULL);
+  state->retired = w_ht_new(2, &w_ht_string_val_funcs);
+  compute_watch_limits(root, state);
+
+  replay_file = cfg_get_string(root, "inotify_replay_file", NULL);
+  if (replay_file) {
+    if (!open_replay_file(root, state, replay_file, errmsg)) {
+      w_log(W_LOG_ERR, "%s\n", *errmsg);
+      return false;
+    }
+    return true;
+  }
 
 #ifdef HAVE_INOTIFY_INIT1
   state->infd = inotify_init1(IN_CLOEXEC);
@@ -136,8 +581,12 @@ bool inot_root_init(watchman_global_watcher_t watcher, w_root_t *root,
     return false;
   }
   w_set_cloexec(state->infd);
-  state->wd_to_name = w_ht_new(HINT_NUM_DIRS, &w_ht_string_val_funcs);
-  state->move_map = w_ht_new(2, &move_hash_funcs);
+
+  record_file = cfg_get_string(root, "inotify_record_file", NULL);
+  if (record_file && !open_record_file(root, state, record_file, errmsg)) {
+    w_log(W_LOG_ERR, "%s\n", *errmsg);
+    return false;
+  }
 
   return true;
 }
@@ -152,8 +601,29 @@ void inot_root_dtor(watchman_global_watcher_t watcher, w_root_t *root) {
 
   pthread_mutex_destroy(&state->lock);
 
-  close(state->infd);
-  state->infd = -1;
+  if (state->replay_fd == -1 && state->wd_to_name) {
+    // Closing infd drops all of our watches
+    w_metric_add(&inotify_watches, -(int64_t)w_ht_size(state->wd_to_name));
+  }
+  if (state->polled) {
+    w_metric_add(&inotify_polled_dirs,
+        -(int64_t)w_poll_set_size(state->polled));
+    w_poll_set_free(state->polled);
+    state->polled = NULL;
+  }
+  if (state->infd != -1) {
+    close(state->infd);
+    state->infd = -1;
+  }
+  if (state->record_fd != -1) {
+    close(state->record_fd);
+    state->record_fd = -1;
+  }
+  if (state->replay_fd != -1) {
+    save_replay_progress(root, state);
+    close(state->replay_fd);
+    state->replay_fd = -1;
+  }
   if (state->wd_to_name) {
     w_ht_free(state->wd_to_name);
     state->wd_to_name = NULL;
@@ -162,6 +632,14 @@ void inot_root_dtor(watchman_global_watcher_t watcher, w_root_t *root) {
     w_ht_free(state->move_map);
     state->move_map = NULL;
   }
+  if (state->wd_activity) {
+    w_ht_free(state->wd_activity);
+    state->wd_activity = NULL;
+  }
+  if (state->retired) {
+    w_ht_free(state->retired);
+    state->retired = NULL;
+  }
 
   free(state);
   root->watch = NULL;
@@ -202,6 +680,8 @@ static struct watchman_dir_handle *inot_root_start_watch_dir(
   struct inot_root_state *state = root->watch;
   struct watchman_dir_handle *osdir = NULL;
   int newwd, err;
+  uint32_t cost;
+  bool demoted = false;
   unused_parameter(watcher);
 
   // Carry out our very strict opendir first to ensure that we're not
@@ -212,18 +692,54 @@ static struct watchman_dir_handle *inot_root_start_watch_dir(
     return NULL;
   }
 
+  if (state->replay_fd != -1) {
+    // The wd mappings come from the recording
+    return osdir;
+  }
+
+  cost = 1 + (dir->files ? w_ht_size(dir->files) : 0);
+
+  // Hold the lock across the add and the recording of the mapping so
+  // that a recording never contains events for a wd it doesn't know
+  pthread_mutex_lock(&state->lock);
+
+  if (state->polled && w_poll_set_contains(state->polled, dir->path)) {
+    // It stays polled until it proves to be active
+    poll_dir(root, dir->path, cost, now.tv_sec);
+    pthread_mutex_unlock(&state->lock);
+    return osdir;
+  }
+
+  if (over_watch_limit(state) && demote_quietest(root, now.tv_sec)) {
+    demoted = true;
+  }
+
   // The directory might be different since the last time we looked at it, so
   // call inotify_add_watch unconditionally.
   newwd = inotify_add_watch(state->infd, path, WATCHMAN_INOTIFY_MASK);
+  if (newwd == -1 && errno == ENOSPC && !demoted &&
+      demote_quietest(root, now.tv_sec)) {
+    demoted = true;
+    newwd = inotify_add_watch(state->infd, path, WATCHMAN_INOTIFY_MASK);
+  }
   if (newwd == -1) {
     err = errno;
-    if (errno == ENOSPC || errno == ENOMEM) {
-      // Limits exceeded, no recovery from our perspective
-      set_poison_state(root, dir->path, now, "inotify-add-watch", errno,
-          inot_strerror(errno));
+    if ((err == ENOSPC || err == ENOMEM) &&
+        poll_dir(root, dir->path, cost, now.tv_sec)) {
+      // Limits exceeded; better to poll it than to stop working
+      pthread_mutex_unlock(&state->lock);
+      w_log(W_LOG_DBG, "inotify_add_watch(%s): %s; polling it instead\n",
+          path, inot_strerror(err));
+      poll_set_changed(root);
+      return osdir;
+    }
+    pthread_mutex_unlock(&state->lock);
+    if (err == ENOSPC || err == ENOMEM) {
+      set_poison_state(root, dir->path, now, "inotify-add-watch", err,
+          inot_strerror(err));
     } else {
-      handle_open_errno(root, dir, now, "inotify_add_watch", errno,
-          inot_strerror(errno));
+      handle_open_errno(root, dir, now, "inotify_add_watch", err,
+          inot_strerror(err));
     }
     w_dir_close(osdir);
     errno = err;
@@ -231,11 +747,13 @@ static struct watchman_dir_handle *inot_root_start_watch_dir(
   }
 
   // record mapping
-  pthread_mutex_lock(&state->lock);
-  w_ht_replace(state->wd_to_name, newwd, w_ht_ptr_val(dir->path));
+  note_watch(root, newwd, dir->path, now.tv_sec);
   pthread_mutex_unlock(&state->lock);
   w_log(W_LOG_DBG, "adding %d -> %s mapping\n", newwd, path);
 
+  if (demoted) {
+    poll_set_changed(root);
+  }
   return osdir;
 }
 
@@ -243,12 +761,15 @@ static void inot_root_stop_watch_dir(watchman_global_watcher_t watcher,
       w_root_t *root, struct watchman_dir *dir) {
   struct inot_root_state *state = root->watch;
   unused_parameter(watcher);
-  unused_parameter(state);
-  unused_parameter(root);
-  unused_parameter(dir);
 
   // Linux removes watches for us at the appropriate times,
-  // and tells us about it via inotify, so we have nothing to do here
+  // and tells us about it via inotify, so we only need to stop
+  // polling the dir, if we were
+  pthread_mutex_lock(&state->lock);
+  if (state->polled && w_poll_set_remove(state->polled, dir->path)) {
+    w_metric_dec(&inotify_polled_dirs);
+  }
+  pthread_mutex_unlock(&state->lock);
 }
 
 static void process_inotify_event(
@@ -264,8 +785,11 @@ static void process_inotify_event(
   w_log(W_LOG_DBG, "notify: wd=%d mask=0x%x %s %s\n", ine->wd, ine->mask,
       flags_label, ine->len > 0 ? ine->name : "");
 
+  w_metric_inc(&inotify_events);
+
   if (ine->wd == -1 && (ine->mask & IN_Q_OVERFLOW)) {
     /* we missed something, will need to re-crawl */
+    w_metric_inc(&inotify_overflows);
     w_root_schedule_recrawl(root, "IN_Q_OVERFLOW");
   } else if (ine->wd != -1) {
     w_string_t *dir_name = NULL;
@@ -273,9 +797,21 @@ static void process_inotify_event(
     char buf[WATCHMAN_NAME_MAX];
 
     pthread_mutex_lock(&state->lock);
-    dir_name = w_ht_val_ptr(w_ht_get(state->wd_to_name, ine->wd));
+    dir_name = w_ht_val_ptr(w_ht_get(state->retired, ine->wd));
+    if (dir_name && (ine->mask & IN_IGNORED)) {
+      // We gave this one up ourselves; the dir is polled now
+      w_ht_del(state->retired, ine->wd);
+      pthread_mutex_unlock(&state->lock);
+      return;
+    }
+    if (!dir_name) {
+      dir_name = w_ht_val_ptr(w_ht_get(state->wd_to_name, ine->wd));
+    }
     if (dir_name) {
       w_string_addref(dir_name);
+      if (w_ht_get(state->wd_activity, ine->wd)) {
+        w_ht_replace(state->wd_activity, ine->wd, now.tv_sec);
+      }
     }
     pthread_mutex_unlock(&state->lock);
 
@@ -319,12 +855,19 @@ static void process_inotify_event(
 
       pthread_mutex_lock(&state->lock);
       old = w_ht_val_ptr(w_ht_get(state->move_map, ine->cookie));
-      if (old) {
+      if (old && state->replay_fd != -1) {
+        // The recording holds the resulting wd mapping
+        w_log(W_LOG_DBG, "moved %s -> %s\n", old->name->buf, name->buf);
+      } else if (old) {
         int wd = inotify_add_watch(state->infd, name->buf,
                     WATCHMAN_INOTIFY_MASK);
         if (wd == -1) {
-          if (errno == ENOSPC || errno == ENOMEM) {
-            // Limits exceeded, no recovery from our perspective
+          if ((errno == ENOSPC || errno == ENOMEM) &&
+              poll_dir(root, name, 1, now.tv_sec)) {
+            // Limits exceeded; poll it rather than stop working
+            w_log(W_LOG_DBG, "add_watch: %s %s; polling it instead\n",
+                name->buf, inot_strerror(errno));
+          } else if (errno == ENOSPC || errno == ENOMEM) {
             set_poison_state(root, name, now, "inotify-add-watch", errno,
                 inot_strerror(errno));
           } else {
@@ -333,7 +876,7 @@ static void process_inotify_event(
           }
         } else {
           w_log(W_LOG_DBG, "moved %s -> %s\n", old->name->buf, name->buf);
-          w_ht_replace(state->wd_to_name, wd, w_ht_ptr_val(name));
+          note_watch(root, wd, name, now.tv_sec);
         }
       } else {
         w_log(W_LOG_DBG, "move: cookie=%" PRIx32 " not found in move map %s\n",
@@ -377,7 +920,11 @@ static void process_inotify_event(
         w_log(W_LOG_DBG, "mask=%x: remove watch %d %.*s\n", ine->mask,
             ine->wd, dir_name->len, dir_name->buf);
         pthread_mutex_lock(&state->lock);
-        w_ht_del(state->wd_to_name, ine->wd);
+        if (state->replay_fd == -1) {
+          forget_watch(state, ine->wd);
+        } else {
+          w_ht_del(state->wd_to_name, ine->wd);
+        }
         pthread_mutex_unlock(&state->lock);
       }
 
@@ -394,36 +941,22 @@ static void process_inotify_event(
   }
 }
 
-static bool inot_root_consume_notify(watchman_global_watcher_t watcher,
-    w_root_t *root, struct watchman_pending_collection *coll)
+static void process_inotify_buffer(w_root_t *root,
+    struct watchman_pending_collection *coll, char *buf, int n,
+    struct timeval now)
 {
   struct inot_root_state *state = root->watch;
   struct inotify_event *ine;
   char *iptr;
-  int n;
-  struct timeval now;
-  unused_parameter(watcher);
-
-  n = read(state->infd, &state->ibuf, sizeof(state->ibuf));
-  if (n == -1) {
-    if (errno == EINTR) {
-      return false;
-    }
-    w_log(W_LOG_FATAL, "read(%d, %zu): error %s\n",
-        state->infd, sizeof(state->ibuf), strerror(errno));
-  }
-
-  w_log(W_LOG_DBG, "inotify read: returned %d.\n", n);
-  gettimeofday(&now, NULL);
 
-  for (iptr = state->ibuf; iptr < state->ibuf + n;
+  for (iptr = buf; iptr < buf + n;
       iptr = iptr + sizeof(*ine) + ine->len) {
     ine = (struct inotify_event*)iptr;
 
     process_inotify_event(root, coll, ine, now);
 
     if (root->cancelled) {
-      return false;
+      return;
     }
   }
 
@@ -448,23 +981,308 @@ static bool inot_root_consume_notify(watchman_global_watcher_t watcher,
       }
     } while (w_ht_next(state->move_map, &iter));
   }
+}
+
+// Reads the next record header from the replay file, if we don't
+// already have one.  Returns false at the end of the stream
+static bool replay_peek(w_root_t *root, struct inot_root_state *state) {
+  ssize_t r;
+
+  if (state->have_next) {
+    return true;
+  }
+  if (state->replay_done) {
+    return false;
+  }
+
+  r = read(state->replay_fd, &state->next_hdr, sizeof(state->next_hdr));
+  if (r != sizeof(state->next_hdr) ||
+      state->next_hdr.len >= sizeof(state->ibuf)) {
+    if (r != 0) {
+      w_log(W_LOG_ERR, "inotify replay: truncated or corrupt record\n");
+    }
+    w_log(W_LOG_ERR, "inotify replay for %.*s is complete\n",
+        root->root_path->len, root->root_path->buf);
+    state->replay_done = true;
+    return false;
+  }
+  state->have_next = true;
 
+  if (state->first_usec == 0) {
+    state->first_usec = state->next_hdr.usec;
+    gettimeofday(&state->replay_start, NULL);
+  }
   return true;
 }
 
+// How many ms until the next replay record is due; 0 if it is
+// due now, -1 if there is nothing left to replay
+static int replay_due_ms(w_root_t *root, struct inot_root_state *state) {
+  struct timeval now;
+  uint64_t offset, elapsed;
+
+  if (!replay_peek(root, state)) {
+    return -1;
+  }
+  if (state->replay_speed <= 0) {
+    return 0;
+  }
+
+  gettimeofday(&now, NULL);
+  offset = (uint64_t)((state->next_hdr.usec - state->first_usec) /
+      state->replay_speed);
+  elapsed = timeval_to_usec(now) - timeval_to_usec(state->replay_start);
+  if (elapsed >= offset) {
+    return 0;
+  }
+  return (int)((offset - elapsed + 999) / 1000);
+}
+
+static bool replay_consume_notify(w_root_t *root,
+    struct watchman_pending_collection *coll)
+{
+  struct inot_root_state *state = root->watch;
+  uint32_t len;
+  struct timeval now;
+  int32_t wd;
+
+  if (replay_due_ms(root, state) != 0) {
+    return false;
+  }
+
+  len = state->next_hdr.len;
+  state->have_next = false;
+  if (read(state->replay_fd, state->ibuf, len) != (ssize_t)len) {
+    w_log(W_LOG_ERR, "inotify replay: truncated record\n");
+    state->replay_done = true;
+    return false;
+  }
+
+  switch (state->next_hdr.type) {
+    case INOT_RECORD_RESET:
+      pthread_mutex_lock(&state->lock);
+      w_ht_free_entries(state->wd_to_name);
+      pthread_mutex_unlock(&state->lock);
+      break;
+
+    case INOT_RECORD_WATCH:
+    {
+      w_string_t *name;
+
+      memcpy(&wd, state->ibuf, sizeof(wd));
+      if (len > sizeof(wd)) {
+        state->ibuf[len] = '\0';
+        name = w_string_path_cat_cstr(root->root_path,
+            state->ibuf + sizeof(wd));
+      } else {
+        name = root->root_path;
+        w_string_addref(name);
+      }
+      pthread_mutex_lock(&state->lock);
+      w_ht_replace(state->wd_to_name, wd, w_ht_ptr_val(name));
+      pthread_mutex_unlock(&state->lock);
+      w_string_delref(name);
+      break;
+    }
+
+    case INOT_RECORD_EVENTS:
+      gettimeofday(&now, NULL);
+      process_inotify_buffer(root, coll, state->ibuf, len, now);
+      break;
+
+    default:
+      w_log(W_LOG_ERR, "inotify replay: unknown record type %" PRIu32 "\n",
+          state->next_hdr.type);
+  }
+
+  return !root->cancelled;
+}
+
+/* Watches dir_name again, now that it has proven to be active, making
+ * room if need be */
+static void promote_dir(w_root_t *root, w_string_t *dir_name,
+    struct watchman_pending_collection *coll)
+{
+  struct inot_root_state *state = root->watch;
+  struct timeval now;
+  int wd = -1;
+
+  gettimeofday(&now, NULL);
+  pthread_mutex_lock(&state->lock);
+  if (!over_watch_limit(state) || demote_quietest(root, now.tv_sec)) {
+    wd = inotify_add_watch(state->infd, dir_name->buf,
+        WATCHMAN_INOTIFY_MASK);
+  }
+  if (wd != -1) {
+    note_watch(root, wd, dir_name, now.tv_sec);
+    if (w_poll_set_remove(state->polled, dir_name)) {
+      w_metric_dec(&inotify_polled_dirs);
+    }
+    w_metric_inc(&inotify_promotions);
+  }
+  pthread_mutex_unlock(&state->lock);
+
+  if (wd != -1) {
+    w_log(W_LOG_DBG, "inotify: watching %s again\n", dir_name->buf);
+    // Catch anything that changed between its last check and the watch
+    w_pending_coll_add(coll, dir_name, now,
+        W_PENDING_CRAWL_ONLY|W_PENDING_RESCAN);
+  }
+}
+
+// Returns the poll set, if we've needed one yet
+static struct w_poll_set *get_polled(struct inot_root_state *state) {
+  struct w_poll_set *polled;
+
+  pthread_mutex_lock(&state->lock);
+  polled = state->polled;
+  pthread_mutex_unlock(&state->lock);
+  return polled;
+}
+
+static bool inotify_readable(struct inot_root_state *state, int timeoutms) {
+  struct pollfd pfd;
+
+  pfd.fd = state->infd;
+  pfd.events = POLLIN;
+  return poll(&pfd, 1, timeoutms) == 1;
+}
+
+static bool inot_root_consume_notify(watchman_global_watcher_t watcher,
+    w_root_t *root, struct watchman_pending_collection *coll)
+{
+  struct inot_root_state *state = root->watch;
+  struct w_poll_set *polled;
+  int n;
+  struct timeval now;
+  unused_parameter(watcher);
+
+  if (state->replay_fd != -1) {
+    return replay_consume_notify(root, coll);
+  }
+
+  polled = get_polled(state);
+  if (polled) {
+    w_string_t *hot_dir = NULL;
+    bool checked = w_poll_set_check_next(polled, coll, &hot_dir);
+
+    if (hot_dir) {
+      promote_dir(root, hot_dir, coll);
+      w_string_delref(hot_dir);
+    }
+    // We may have been woken by the timer rather than the descriptor,
+    // and the read below would block
+    if (!inotify_readable(state, 0)) {
+      return checked && !root->cancelled;
+    }
+  }
+
+  if (state->record_fd != -1) {
+    pthread_mutex_lock(&state->lock);
+  }
+  n = read(state->infd, &state->ibuf, sizeof(state->ibuf));
+  if (state->record_fd != -1) {
+    if (n > 0) {
+      record_write(state, INOT_RECORD_EVENTS, state->ibuf, n, NULL, 0);
+    }
+    pthread_mutex_unlock(&state->lock);
+  }
+  if (n == -1) {
+    if (errno == EINTR) {
+      return false;
+    }
+    w_log(W_LOG_FATAL, "read(%d, %zu): error %s\n",
+        state->infd, sizeof(state->ibuf), strerror(errno));
+  }
+
+  w_log(W_LOG_DBG, "inotify read: returned %d.\n", n);
+  gettimeofday(&now, NULL);
+
+  process_inotify_buffer(root, coll, state->ibuf, n, now);
+
+  return !root->cancelled;
+}
+
+static int inot_root_timer_ms(watchman_global_watcher_t watcher,
+    w_root_t *root) {
+  struct inot_root_state *state = root->watch;
+  struct w_poll_set *polled = get_polled(state);
+  unused_parameter(watcher);
+
+  return polled ? w_poll_set_next_ms(polled) : -1;
+}
+
+static int inot_root_notify_fd(watchman_global_watcher_t watcher,
+    w_root_t *root) {
+  struct inot_root_state *state = root->watch;
+  unused_parameter(watcher);
+
+  // Replays are paced by timers in wait_notify, so use a thread for them
+  if (state->replay_fd != -1) {
+    return -1;
+  }
+  return state->infd;
+}
+
 static bool inot_root_wait_notify(watchman_global_watcher_t watcher,
     w_root_t *root, int timeoutms) {
   struct inot_root_state *state = root->watch;
+  struct w_poll_set *polled;
   int n;
-  struct pollfd pfd;
   unused_parameter(watcher);
 
-  pfd.fd = state->infd;
-  pfd.events = POLLIN;
+  if (state->replay_fd != -1) {
+    // Don't start the clock until the initial crawl is done, so that
+    // the replayed stream lands on a fully populated view
+    if (!root->done_initial) {
+      n = MIN(timeoutms, 10);
+    } else {
+      n = replay_due_ms(root, state);
+      if (n == 0) {
+        return true;
+      }
+      if (n == -1 || n > timeoutms) {
+        n = timeoutms;
+      }
+    }
+    if (n > 0) {
+      poll(NULL, 0, n);
+    }
+    return root->done_initial && replay_due_ms(root, state) == 0;
+  }
 
-  n = poll(&pfd, 1, timeoutms);
+  polled = get_polled(state);
+  if (polled) {
+    n = w_poll_set_next_ms(polled);
+    if (n == 0) {
+      return true;
+    }
+    if (n > 0 && n < timeoutms) {
+      timeoutms = n;
+    }
+  }
+
+  if (inotify_readable(state, timeoutms)) {
+    return true;
+  }
+  return polled && w_poll_set_next_ms(polled) == 0;
+}
 
-  return n == 1;
+// Called with the root locked.  The cookie is seen through inotify,
+// which is oblivious to the polled dirs, so check them all right now
+static bool inot_root_sync(watchman_global_watcher_t watcher,
+    w_root_t *root, struct watchman_pending_collection *coll) {
+  struct inot_root_state *state = root->watch;
+  struct w_poll_set *polled = get_polled(state);
+  bool complete;
+  unused_parameter(watcher);
+
+  if (!polled) {
+    return true;
+  }
+  complete = w_poll_set_check_all(polled, coll);
+  poll_set_changed(root);
+  return complete;
 }
 
 static void inot_file_free(watchman_global_watcher_t watcher,
@@ -475,7 +1293,8 @@ static void inot_file_free(watchman_global_watcher_t watcher,
 
 struct watchman_ops inotify_watcher = {
   "inotify",
-  WATCHER_HAS_PER_FILE_NOTIFICATIONS,
+  WATCHER_HAS_PER_FILE_NOTIFICATIONS|
+    WATCHER_TREE_EVICTABLE,
   inot_global_init,
   inot_global_dtor,
   inot_root_init,
@@ -488,7 +1307,10 @@ struct watchman_ops inotify_watcher = {
   inot_root_signal_threads,
   inot_root_consume_notify,
   inot_root_wait_notify,
-  inot_file_free
+  inot_file_free,
+  inot_root_notify_fd,
+  inot_root_sync,
+  inot_root_timer_ms,
 };
 
 #endif // HAVE_INOTIFY_INIT
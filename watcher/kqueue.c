@@ -359,7 +359,10 @@ struct watchman_ops kqueue_watcher = {
   kqueue_root_signal_threads,
   kqueue_root_consume_notify,
   kqueue_root_wait_notify,
-  kqueue_file_free
+  kqueue_file_free,
+  NULL, // root_notify_fd
+  NULL, // root_sync
+  NULL, // root_timer_ms
 };
 
 #endif // HAVE_KQUEUE
@@ -0,0 +1,956 @@
+/* Copyright 2015-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+
+#ifndef _WIN32
+
+/* Polling watcher.
+ *
+ * Used for roots on filesystems where the native watcher doesn't see
+ * changes made by other hosts, such as NFS or FUSE mounts: either the
+ * global poll_fstypes option lists the filesystem type, or the root's
+ * .watchmanconfig sets "watcher": "poll".
+ *
+ * Every dir that the crawler visits is scheduled for periodic checks.
+ * A check lists the dir and stats its entries, folding their names and
+ * stat info into a signature; when the signature changes, the dir is
+ * handed to the io job, which rescans it against the tree
+ * (W_PENDING_RESCAN).  Dirs that have changed recently are checked
+ * every poll_min_interval_ms, and the interval doubles with each
+ * unchanged check up to poll_max_interval_ms, so idle parts of the tree
+ * cost little.  A check also compares the mtime of each subdir with the
+ * one seen when that subdir was last checked; a subdir that has gained
+ * or lost entries is brought forward rather than waiting out its
+ * backoff, while unchanged subtrees keep theirs.
+ *
+ * Checks are paid for from a token bucket that is refilled at
+ * poll_io_budget stat calls per second.  A sync brings forward every
+ * dir, ahead of its schedule, so that queries see recent changes
+ * without waiting for the next scheduled check of those dirs; the query
+ * cookie dir goes last.  Recently active dirs are checked for free, and
+ * the rest as far as the budget allows.  If it doesn't stretch to all
+ * of them, the sync is reported as partial.
+ *
+ * The schedule is kept in a w_poll_set, which the inotify watcher also
+ * uses for the dirs that it can't afford to watch. */
+
+W_METRIC_COUNTER(poll_checks, "poll_dir_checks_total",
+    "Number of dirs checked for changes by the poll watcher");
+W_METRIC_COUNTER(poll_changes, "poll_dir_changes_total",
+    "Number of poll watcher checks that found a dir had changed");
+
+// Allowance for the clock of a file server differing from ours when
+// deciding whether an entry changed after its dir was crawled
+#define POLL_CLOCK_SLOP_SEC 2
+
+// Consecutive changed checks after which a dir is reported as hot
+#define POLL_HOT_STREAK 2
+
+struct poll_dir {
+  w_string_t *path;
+  // stat info of the dir itself as of its last check
+  struct timespec mtime, ctime;
+  bool have_stat;
+  // sum of the hashes of the names and stat info of the entries
+  uint64_t sig;
+  bool have_sig;
+  // when the io job last crawled the dir
+  time_t crawled;
+  // number of stat calls that the last check took
+  uint32_t cost;
+  uint32_t interval_ms;
+  uint64_t due_usec;
+  // checked ahead of the budget, for a sync
+  bool forced;
+  // number of consecutive checks that found a change
+  uint32_t streak;
+  uint32_t heap_idx;
+};
+
+struct w_poll_set {
+  // protects everything below; may be acquired while holding the
+  // root lock, but not the other way around
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  // map of dir name to struct poll_dir
+  w_ht_t *dirs;
+  // min-heap of the dirs, ordered by due_usec
+  struct poll_dir **heap;
+  uint32_t heap_size;
+  uint32_t heap_alloc;
+  // the io budget
+  double tokens;
+  uint64_t refilled_usec;
+  uint32_t budget;
+  uint32_t min_interval_ms;
+  uint32_t max_interval_ms;
+  // set by w_poll_set_wake to interrupt w_poll_set_wait
+  bool signalled;
+};
+
+// Result of checking a dir
+struct poll_check {
+  bool gone;
+  bool changed;
+  struct timespec mtime, ctime;
+  bool have_stat;
+  uint64_t sig;
+  uint32_t cost;
+  // names and mtimes of the subdirs
+  w_string_t **subdirs;
+  struct timespec *subdir_mtimes;
+  uint32_t num_subdirs;
+  uint32_t alloc_subdirs;
+};
+
+static void del_poll_dir(w_ht_val_t val)
+{
+  struct poll_dir *pdir = w_ht_val_ptr(val);
+
+  w_string_delref(pdir->path);
+  free(pdir);
+}
+
+static const struct watchman_hash_funcs poll_dir_funcs = {
+  w_ht_string_copy,
+  w_ht_string_del,
+  w_ht_string_equal,
+  w_ht_string_hash,
+  NULL,
+  del_poll_dir
+};
+
+static bool due_before(const struct poll_dir *a, const struct poll_dir *b)
+{
+  return a->due_usec < b->due_usec;
+}
+
+static void heap_set(struct w_poll_set *set, uint32_t idx,
+    struct poll_dir *pdir)
+{
+  set->heap[idx] = pdir;
+  pdir->heap_idx = idx;
+}
+
+static void heap_sift_up(struct w_poll_set *set, uint32_t idx)
+{
+  struct poll_dir *pdir = set->heap[idx];
+
+  while (idx > 0) {
+    uint32_t parent = (idx - 1) / 2;
+
+    if (!due_before(pdir, set->heap[parent])) {
+      break;
+    }
+    heap_set(set, idx, set->heap[parent]);
+    idx = parent;
+  }
+  heap_set(set, idx, pdir);
+}
+
+static void heap_sift_down(struct w_poll_set *set, uint32_t idx)
+{
+  struct poll_dir *pdir = set->heap[idx];
+
+  for (;;) {
+    uint32_t child = (2 * idx) + 1;
+
+    if (child >= set->heap_size) {
+      break;
+    }
+    if (child + 1 < set->heap_size &&
+        due_before(set->heap[child + 1], set->heap[child])) {
+      child++;
+    }
+    if (!due_before(set->heap[child], pdir)) {
+      break;
+    }
+    heap_set(set, idx, set->heap[child]);
+    idx = child;
+  }
+  heap_set(set, idx, pdir);
+}
+
+// Restores the heap order after the due time of pdir has changed
+static void heap_fix(struct w_poll_set *set, struct poll_dir *pdir)
+{
+  heap_sift_up(set, pdir->heap_idx);
+  heap_sift_down(set, pdir->heap_idx);
+}
+
+static bool heap_push(struct w_poll_set *set, struct poll_dir *pdir)
+{
+  if (set->heap_size == set->heap_alloc) {
+    uint32_t alloc = set->heap_alloc ? set->heap_alloc * 2 : 64;
+    struct poll_dir **heap = realloc(set->heap, alloc * sizeof(*heap));
+
+    if (!heap) {
+      return false;
+    }
+    set->heap = heap;
+    set->heap_alloc = alloc;
+  }
+  heap_set(set, set->heap_size++, pdir);
+  heap_sift_up(set, pdir->heap_idx);
+  return true;
+}
+
+static void heap_remove(struct w_poll_set *set, struct poll_dir *pdir)
+{
+  uint32_t idx = pdir->heap_idx;
+
+  set->heap_size--;
+  if (idx != set->heap_size) {
+    heap_set(set, idx, set->heap[set->heap_size]);
+    heap_fix(set, set->heap[idx]);
+  }
+}
+
+// Drops pdir from the schedule and frees it
+static void forget_dir(struct w_poll_set *set, struct poll_dir *pdir)
+{
+  heap_remove(set, pdir);
+  w_ht_del(set->dirs, w_ht_ptr_val(pdir->path));
+}
+
+static struct poll_dir *lookup_dir(struct w_poll_set *set,
+    w_string_t *path)
+{
+  return w_ht_val_ptr(w_ht_get(set->dirs, w_ht_ptr_val(path)));
+}
+
+static void refill_tokens(struct w_poll_set *set, uint64_t now)
+{
+  if (now > set->refilled_usec) {
+    set->tokens += (double)(now - set->refilled_usec) *
+      set->budget / 1000000;
+    if (set->tokens > set->budget) {
+      set->tokens = set->budget;
+    }
+  }
+  set->refilled_usec = now;
+}
+
+/* Returns 0 if the next dir can be checked now, otherwise the number of
+ * milliseconds until it can be, or -1 if there are no dirs */
+static int next_check_ms(struct w_poll_set *set, uint64_t now)
+{
+  struct poll_dir *pdir;
+  double need;
+  uint64_t wait_usec = 0;
+
+  if (set->heap_size == 0) {
+    return -1;
+  }
+  pdir = set->heap[0];
+  if (pdir->due_usec > now) {
+    wait_usec = pdir->due_usec - now;
+  } else if (!pdir->forced) {
+    refill_tokens(set, now);
+    // A single dir bigger than the budget waits for a full bucket
+    need = MIN(pdir->cost, set->budget);
+    if (set->tokens < need) {
+      wait_usec = (uint64_t)((need - set->tokens) * 1000000 /
+          set->budget);
+    }
+  }
+  if (wait_usec == 0) {
+    return 0;
+  }
+  return (int)MIN((wait_usec + 999) / 1000, INT_MAX);
+}
+
+static bool add_subdir(struct poll_check *check, const char *name,
+    const struct timespec *mtime)
+{
+  if (check->num_subdirs == check->alloc_subdirs) {
+    uint32_t alloc = check->alloc_subdirs ? check->alloc_subdirs * 2 : 8;
+    w_string_t **subdirs;
+    struct timespec *mtimes;
+
+    subdirs = realloc(check->subdirs, alloc * sizeof(*subdirs));
+    if (!subdirs) {
+      return false;
+    }
+    check->subdirs = subdirs;
+    mtimes = realloc(check->subdir_mtimes, alloc * sizeof(*mtimes));
+    if (!mtimes) {
+      return false;
+    }
+    check->subdir_mtimes = mtimes;
+    check->alloc_subdirs = alloc;
+  }
+  check->subdirs[check->num_subdirs] = w_string_new(name);
+  check->subdir_mtimes[check->num_subdirs] = *mtime;
+  check->num_subdirs++;
+  return true;
+}
+
+static void free_check(struct poll_check *check)
+{
+  uint32_t i;
+
+  for (i = 0; i < check->num_subdirs; i++) {
+    w_string_delref(check->subdirs[i]);
+  }
+  free(check->subdirs);
+  free(check->subdir_mtimes);
+}
+
+static bool timespec_equal(const struct timespec *a,
+    const struct timespec *b)
+{
+  return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+static uint64_t hash_entry(const char *name, const struct watchman_stat *st)
+{
+  uint64_t info[7];
+
+  info[0] = (uint64_t)st->mtime.tv_sec;
+  info[1] = (uint64_t)st->mtime.tv_nsec;
+  info[2] = (uint64_t)st->ctime.tv_sec;
+  info[3] = (uint64_t)st->ctime.tv_nsec;
+  info[4] = (uint64_t)st->size;
+  info[5] = (uint64_t)st->ino;
+  info[6] = (uint64_t)st->mode;
+
+  return ((uint64_t)w_hash_bytes(name, strlen(name), 0) << 32) |
+    w_hash_bytes(info, sizeof(info), 0);
+}
+
+/* Lists path and stats its entries, without holding any locks.
+ * pdir is a copy of the schedule entry, as of when the check began */
+static void check_dir(const struct poll_dir *pdir, struct poll_check *check)
+{
+  struct watchman_dir_handle *osdir;
+  struct watchman_dir_ent *dirent;
+  struct stat st;
+  int dfd;
+  // Anything that changed after this was missed by the crawl that
+  // established the dir, so there's no baseline to compare against
+  time_t recent = pdir->crawled - POLL_CLOCK_SLOP_SEC;
+
+  memset(check, 0, sizeof(*check));
+  check->cost = 1;
+
+  osdir = w_dir_open(pdir->path->buf);
+  if (!osdir) {
+    if (errno == ENOENT || errno == ENOTDIR) {
+      check->gone = true;
+    } else {
+      w_log(W_LOG_DBG, "poll: opendir(%s): %s\n", pdir->path->buf,
+          strerror(errno));
+    }
+    return;
+  }
+
+  dfd = w_dir_fd(osdir);
+  if ((dfd != -1 && fstat(dfd, &st) == 0) ||
+      (dfd == -1 && lstat(pdir->path->buf, &st) == 0)) {
+    memcpy(&check->mtime, &st.WATCHMAN_ST_TIMESPEC(m), sizeof(check->mtime));
+    memcpy(&check->ctime, &st.WATCHMAN_ST_TIMESPEC(c), sizeof(check->ctime));
+    check->have_stat = true;
+    if (!pdir->have_sig && check->ctime.tv_sec >= recent) {
+      check->changed = true;
+    }
+  }
+
+  while ((dirent = w_dir_read(osdir)) != NULL) {
+    struct watchman_stat wst;
+
+    if (dirent->d_name[0] == '.' && (
+          !strcmp(dirent->d_name, ".") ||
+          !strcmp(dirent->d_name, "..")
+        )) {
+      continue;
+    }
+
+    if (dirent->has_stat) {
+      memcpy(&wst, &dirent->stat, sizeof(wst));
+    } else {
+      check->cost++;
+      if (dfd == -1 ||
+          fstatat(dfd, dirent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        // Most likely it was deleted since we read the dir
+        check->changed = true;
+        continue;
+      }
+      memset(&wst, 0, sizeof(wst));
+      memcpy(&wst.mtime, &st.WATCHMAN_ST_TIMESPEC(m), sizeof(wst.mtime));
+      memcpy(&wst.ctime, &st.WATCHMAN_ST_TIMESPEC(c), sizeof(wst.ctime));
+      wst.size = st.st_size;
+      wst.ino = st.st_ino;
+      wst.mode = st.st_mode;
+    }
+
+    check->sig += hash_entry(dirent->d_name, &wst);
+    if (!pdir->have_sig && wst.ctime.tv_sec >= recent) {
+      check->changed = true;
+    }
+    if (S_ISDIR(wst.mode) &&
+        !add_subdir(check, dirent->d_name, &wst.mtime)) {
+      w_log(W_LOG_ERR, "poll: OOM while checking %s\n", pdir->path->buf);
+    }
+  }
+  w_dir_close(osdir);
+
+  if (pdir->have_sig && check->sig != pdir->sig) {
+    check->changed = true;
+  }
+}
+
+/* Brings forward the checks of subdirs whose mtime differs from the one
+ * recorded when they were last checked.
+ * Must be called with set->lock held */
+static void expedite_subdirs(struct w_poll_set *set,
+    w_string_t *dir_name, struct poll_check *check, uint64_t now)
+{
+  uint32_t i;
+
+  for (i = 0; i < check->num_subdirs; i++) {
+    w_string_t *path = w_string_path_cat(dir_name, check->subdirs[i]);
+    struct poll_dir *child;
+
+    if (!path) {
+      continue;
+    }
+    child = lookup_dir(set, path);
+    w_string_delref(path);
+
+    if (child && child->have_stat &&
+        !timespec_equal(&child->mtime, &check->subdir_mtimes[i]) &&
+        child->due_usec > now) {
+      child->interval_ms = set->min_interval_ms;
+      child->due_usec = now;
+      heap_fix(set, child);
+    }
+  }
+}
+
+static uint32_t poll_cfg_get(w_root_t *root, const char *name,
+    uint32_t defval)
+{
+  json_int_t val = cfg_get_int(root, name, defval);
+
+  if (val < 1 || val > INT_MAX) {
+    w_log(W_LOG_ERR, "%s must be a positive integer, using %" PRIu32 "\n",
+        name, defval);
+    return defval;
+  }
+  return (uint32_t)val;
+}
+
+struct w_poll_set *w_poll_set_new(w_root_t *root)
+{
+  struct w_poll_set *set;
+
+  set = calloc(1, sizeof(*set));
+  if (!set) {
+    return NULL;
+  }
+  set->dirs = w_ht_new(HINT_NUM_DIRS, &poll_dir_funcs);
+  if (!set->dirs) {
+    free(set);
+    return NULL;
+  }
+  pthread_mutex_init(&set->lock, NULL);
+  pthread_cond_init(&set->cond, NULL);
+
+  set->budget = poll_cfg_get(root, "poll_io_budget", 1000);
+  set->min_interval_ms = poll_cfg_get(root, "poll_min_interval_ms", 1000);
+  set->max_interval_ms = poll_cfg_get(root, "poll_max_interval_ms",
+      30000);
+  if (set->max_interval_ms < set->min_interval_ms) {
+    set->max_interval_ms = set->min_interval_ms;
+  }
+  set->tokens = set->budget;
+  set->refilled_usec = w_metric_now_usec();
+  return set;
+}
+
+void w_poll_set_free(struct w_poll_set *set)
+{
+  w_ht_free(set->dirs);
+  free(set->heap);
+  pthread_mutex_destroy(&set->lock);
+  pthread_cond_destroy(&set->cond);
+  free(set);
+}
+
+/* Schedules dir_name for checks, if it isn't already.  cost estimates
+ * the stat calls that a check will take, until one has been made.
+ * crawled is when the dir was last crawled; changes made after that
+ * are assumed to have been missed */
+bool w_poll_set_add(struct w_poll_set *set, w_string_t *dir_name,
+    uint32_t cost, time_t crawled)
+{
+  struct poll_dir *pdir;
+  bool res = true;
+
+  pthread_mutex_lock(&set->lock);
+  pdir = lookup_dir(set, dir_name);
+  if (!pdir) {
+    pdir = calloc(1, sizeof(*pdir));
+    if (!pdir) {
+      res = false;
+      goto out;
+    }
+    pdir->path = dir_name;
+    w_string_addref(pdir->path);
+    pdir->interval_ms = set->min_interval_ms;
+    pdir->due_usec = w_metric_now_usec() +
+      ((uint64_t)pdir->interval_ms * 1000);
+    if (!heap_push(set, pdir)) {
+      del_poll_dir(w_ht_ptr_val(pdir));
+      res = false;
+      goto out;
+    }
+    w_ht_set(set->dirs, w_ht_ptr_val(pdir->path), w_ht_ptr_val(pdir));
+    pthread_cond_signal(&set->cond);
+  }
+  pdir->crawled = crawled;
+  if (!pdir->have_sig) {
+    pdir->cost = cost;
+  }
+out:
+  pthread_mutex_unlock(&set->lock);
+  return res;
+}
+
+// Stops checking dir_name.  Returns false if it wasn't in the set
+bool w_poll_set_remove(struct w_poll_set *set, w_string_t *dir_name)
+{
+  struct poll_dir *pdir;
+
+  pthread_mutex_lock(&set->lock);
+  pdir = lookup_dir(set, dir_name);
+  if (pdir) {
+    forget_dir(set, pdir);
+  }
+  pthread_mutex_unlock(&set->lock);
+  return pdir != NULL;
+}
+
+bool w_poll_set_contains(struct w_poll_set *set, w_string_t *dir_name)
+{
+  bool res;
+
+  pthread_mutex_lock(&set->lock);
+  res = lookup_dir(set, dir_name) != NULL;
+  pthread_mutex_unlock(&set->lock);
+  return res;
+}
+
+uint32_t w_poll_set_size(struct w_poll_set *set)
+{
+  uint32_t size;
+
+  pthread_mutex_lock(&set->lock);
+  size = set->heap_size;
+  pthread_mutex_unlock(&set->lock);
+  return size;
+}
+
+/* Returns 0 if a dir can be checked now, otherwise the number of
+ * milliseconds until one can be, or -1 if the set is empty */
+int w_poll_set_next_ms(struct w_poll_set *set)
+{
+  int ms;
+
+  pthread_mutex_lock(&set->lock);
+  ms = next_check_ms(set, w_metric_now_usec());
+  pthread_mutex_unlock(&set->lock);
+  return ms;
+}
+
+/* Checks the dir described by snapshot, a copy of its schedule entry,
+ * updates that entry and adds the dir to coll if it changed or is gone.
+ * Consumes the reference to snapshot->path */
+static void check_snapshot(struct w_poll_set *set,
+    struct poll_dir *snapshot, struct watchman_pending_collection *coll,
+    w_string_t **hot_dir)
+{
+  struct poll_dir *pdir;
+  struct poll_check check;
+  struct timeval now;
+  uint64_t now_usec;
+
+  check_dir(snapshot, &check);
+  w_metric_inc(&poll_checks);
+
+  now_usec = w_metric_now_usec();
+  pthread_mutex_lock(&set->lock);
+  if (!snapshot->forced) {
+    // Settle up for the estimate we paid in advance
+    set->tokens -= (double)check.cost - snapshot->cost;
+  }
+  pdir = lookup_dir(set, snapshot->path);
+  if (pdir && check.gone) {
+    forget_dir(set, pdir);
+  } else if (pdir) {
+    if (check.have_stat) {
+      pdir->mtime = check.mtime;
+      pdir->ctime = check.ctime;
+      pdir->have_stat = true;
+    }
+    pdir->sig = check.sig;
+    pdir->have_sig = true;
+    pdir->cost = check.cost;
+    if (check.changed) {
+      pdir->interval_ms = set->min_interval_ms;
+      pdir->streak++;
+    } else {
+      pdir->interval_ms = MIN(pdir->interval_ms * 2, set->max_interval_ms);
+      pdir->streak = 0;
+    }
+    pdir->due_usec = now_usec + ((uint64_t)pdir->interval_ms * 1000);
+    heap_fix(set, pdir);
+    if (hot_dir && pdir->streak >= POLL_HOT_STREAK) {
+      *hot_dir = pdir->path;
+      w_string_addref(*hot_dir);
+      pdir->streak = 0;
+    }
+  }
+  if (pdir) {
+    expedite_subdirs(set, snapshot->path, &check, now_usec);
+  }
+  pthread_mutex_unlock(&set->lock);
+
+  gettimeofday(&now, NULL);
+  if (check.gone) {
+    // Processing the path will find it gone and stop watching it
+    w_pending_coll_add(coll, snapshot->path, now, 0);
+  } else if (check.changed) {
+    w_metric_inc(&poll_changes);
+    w_log(W_LOG_DBG, "poll: %s changed\n", snapshot->path->buf);
+    w_pending_coll_add(coll, snapshot->path, now,
+        W_PENDING_CRAWL_ONLY|W_PENDING_RESCAN);
+  }
+
+  free_check(&check);
+  w_string_delref(snapshot->path);
+}
+
+/* Checks the next dir, if one is due, and adds it to coll if it changed
+ * or is gone.  A dir that has changed at each of its last few checks
+ * is reported via hot_dir, if that is non-NULL, for a watcher that can
+ * watch it more cheaply some other way; the caller owns the reference.
+ * Returns false if no dir was due */
+bool w_poll_set_check_next(struct w_poll_set *set,
+    struct watchman_pending_collection *coll, w_string_t **hot_dir)
+{
+  struct poll_dir *pdir, snapshot;
+  uint64_t now_usec = w_metric_now_usec();
+
+  pthread_mutex_lock(&set->lock);
+  if (next_check_ms(set, now_usec) != 0) {
+    pthread_mutex_unlock(&set->lock);
+    return false;
+  }
+  pdir = set->heap[0];
+  if (!pdir->forced) {
+    set->tokens -= pdir->cost;
+  }
+  snapshot = *pdir;
+  w_string_addref(snapshot.path);
+  // Until the check is done, leave it where it won't be picked again
+  pdir->forced = false;
+  pdir->due_usec = now_usec + ((uint64_t)pdir->interval_ms * 1000);
+  heap_fix(set, pdir);
+  pthread_mutex_unlock(&set->lock);
+
+  check_snapshot(set, &snapshot, coll, hot_dir);
+  return true;
+}
+
+/* Decides whether a sync may check pdir ahead of its schedule.
+ * Recently active dirs are checked for free, and the others as far as
+ * the budget allows, paying for them now.
+ * Must be called with set->lock held */
+static bool sync_can_check(struct w_poll_set *set, struct poll_dir *pdir)
+{
+  if (pdir->interval_ms == set->min_interval_ms) {
+    return true;
+  }
+  // As in next_check_ms, a dir bigger than the budget needs a full bucket
+  if (set->tokens < MIN(pdir->cost, set->budget)) {
+    return false;
+  }
+  set->tokens -= pdir->cost;
+  return true;
+}
+
+/* Checks every dir in the set now, rather than on its schedule, adding
+ * those that changed or are gone to coll.  This is for syncs of a
+ * watcher that sees the cookie some other way, and must have seen these
+ * changes by the time that it does.  Returns false if the budget didn't
+ * stretch to all of the dirs */
+bool w_poll_set_check_all(struct w_poll_set *set,
+    struct watchman_pending_collection *coll)
+{
+  struct poll_dir *snapshots;
+  uint32_t i, num = 0;
+  bool complete = true;
+
+  pthread_mutex_lock(&set->lock);
+  snapshots = malloc(MAX(set->heap_size, 1) * sizeof(*snapshots));
+  if (!snapshots) {
+    pthread_mutex_unlock(&set->lock);
+    return false;
+  }
+  refill_tokens(set, w_metric_now_usec());
+  for (i = 0; i < set->heap_size; i++) {
+    struct poll_dir *pdir = set->heap[i];
+
+    if (!sync_can_check(set, pdir)) {
+      complete = false;
+      continue;
+    }
+    snapshots[num] = *pdir;
+    // Already paid for
+    snapshots[num].forced = true;
+    w_string_addref(snapshots[num].path);
+    num++;
+  }
+  pthread_mutex_unlock(&set->lock);
+
+  for (i = 0; i < num; i++) {
+    check_snapshot(set, &snapshots[i], coll, NULL);
+  }
+  free(snapshots);
+  return complete;
+}
+
+/* Waits up to timeoutms for a dir to become due, or for
+ * w_poll_set_wake.  Returns true if a dir is due */
+bool w_poll_set_wait(struct w_poll_set *set, int timeoutms)
+{
+  uint64_t deadline = w_metric_now_usec() + ((uint64_t)timeoutms * 1000);
+  bool ready = false;
+
+  pthread_mutex_lock(&set->lock);
+  for (;;) {
+    uint64_t now = w_metric_now_usec();
+    int ms;
+    struct timespec ts;
+
+    if (set->signalled) {
+      set->signalled = false;
+      break;
+    }
+    ms = next_check_ms(set, now);
+    if (ms == 0) {
+      ready = true;
+      break;
+    }
+    if (now >= deadline) {
+      break;
+    }
+    if (ms == -1 || (uint64_t)ms * 1000 > deadline - now) {
+      ms = (int)((deadline - now + 999) / 1000);
+    }
+    w_timeoutms_to_abs_timespec(ms, &ts);
+    pthread_cond_timedwait(&set->cond, &set->lock, &ts);
+  }
+  pthread_mutex_unlock(&set->lock);
+  return ready;
+}
+
+void w_poll_set_wake(struct w_poll_set *set)
+{
+  pthread_mutex_lock(&set->lock);
+  set->signalled = true;
+  pthread_cond_broadcast(&set->cond);
+  pthread_mutex_unlock(&set->lock);
+}
+
+/* Brings forward the checks of the dirs, as far as sync_can_check
+ * allows, and then of cookie_dir, if it is in the set, so that a cookie
+ * isn't seen before changes that preceded it in those dirs.  Returns
+ * false if the budget didn't stretch to all of the dirs */
+bool w_poll_set_sync(struct w_poll_set *set, w_string_t *cookie_dir)
+{
+  struct poll_dir *pdir, *cookie;
+  bool complete = true;
+  uint32_t i;
+
+  pthread_mutex_lock(&set->lock);
+  refill_tokens(set, w_metric_now_usec());
+  cookie = lookup_dir(set, cookie_dir);
+  for (i = 0; i < set->heap_size; i++) {
+    pdir = set->heap[i];
+    if (pdir == cookie || pdir->forced) {
+      continue;
+    }
+    if (!sync_can_check(set, pdir)) {
+      complete = false;
+      continue;
+    }
+    // Ahead of everything that wasn't forced, including dirs that are
+    // already due but waiting for the budget
+    pdir->forced = true;
+    pdir->due_usec = 0;
+  }
+  // Due times only moved earlier, so sifting each entry up in turn
+  // restores the order
+  for (i = 0; i < set->heap_size; i++) {
+    heap_sift_up(set, i);
+  }
+
+  if (cookie) {
+    cookie->forced = true;
+    cookie->due_usec = 1;
+    heap_fix(set, cookie);
+  }
+  pthread_cond_signal(&set->cond);
+  pthread_mutex_unlock(&set->lock);
+  return complete;
+}
+
+static watchman_global_watcher_t poll_global_init(void) {
+  return NULL;
+}
+
+static void poll_global_dtor(watchman_global_watcher_t watcher) {
+  unused_parameter(watcher);
+}
+
+static bool poll_root_init(watchman_global_watcher_t watcher, w_root_t *root,
+    char **errmsg) {
+  unused_parameter(watcher);
+
+  root->watch = w_poll_set_new(root);
+  if (!root->watch) {
+    *errmsg = strdup("out of memory");
+    return false;
+  }
+  return true;
+}
+
+static bool poll_root_start(watchman_global_watcher_t watcher,
+    w_root_t *root) {
+  unused_parameter(watcher);
+  unused_parameter(root);
+  return true;
+}
+
+static void poll_root_dtor(watchman_global_watcher_t watcher,
+    w_root_t *root) {
+  unused_parameter(watcher);
+
+  if (root->watch) {
+    w_poll_set_free(root->watch);
+    root->watch = NULL;
+  }
+}
+
+static bool poll_root_start_watch_file(watchman_global_watcher_t watcher,
+      w_root_t *root, struct watchman_file *file) {
+  unused_parameter(watcher);
+  unused_parameter(root);
+  unused_parameter(file);
+  return true;
+}
+
+static void poll_root_stop_watch_file(watchman_global_watcher_t watcher,
+      w_root_t *root, struct watchman_file *file) {
+  unused_parameter(watcher);
+  unused_parameter(root);
+  unused_parameter(file);
+}
+
+static struct watchman_dir_handle *poll_root_start_watch_dir(
+    watchman_global_watcher_t watcher,
+    w_root_t *root, struct watchman_dir *dir, struct timeval now,
+    const char *path) {
+  struct watchman_dir_handle *osdir;
+  unused_parameter(watcher);
+
+  osdir = w_dir_open(path);
+  if (!osdir) {
+    handle_open_errno(root, dir, now, "opendir", errno, NULL);
+    return NULL;
+  }
+  if (!w_poll_set_add(root->watch, dir->path,
+        1 + (dir->files ? w_ht_size(dir->files) : 0), now.tv_sec)) {
+    w_log(W_LOG_ERR, "poll: OOM while scheduling %s\n", path);
+  }
+  return osdir;
+}
+
+static void poll_root_stop_watch_dir(watchman_global_watcher_t watcher,
+    w_root_t *root, struct watchman_dir *dir) {
+  unused_parameter(watcher);
+
+  w_poll_set_remove(root->watch, dir->path);
+}
+
+static void poll_root_signal_threads(watchman_global_watcher_t watcher,
+    w_root_t *root) {
+  unused_parameter(watcher);
+
+  if (root->watch) {
+    w_poll_set_wake(root->watch);
+  }
+}
+
+static bool poll_root_consume_notify(watchman_global_watcher_t watcher,
+    w_root_t *root, struct watchman_pending_collection *coll) {
+  unused_parameter(watcher);
+
+  return w_poll_set_check_next(root->watch, coll, NULL);
+}
+
+static bool poll_root_wait_notify(watchman_global_watcher_t watcher,
+    w_root_t *root, int timeoutms) {
+  unused_parameter(watcher);
+
+  return w_poll_set_wait(root->watch, timeoutms);
+}
+
+static void poll_file_free(watchman_global_watcher_t watcher,
+    struct watchman_file *file) {
+  unused_parameter(watcher);
+  unused_parameter(file);
+}
+
+// Called with the root locked.  The cookie dir is polled too, and is
+// checked after the others, so the checks needn't be made here
+static bool poll_root_sync(watchman_global_watcher_t watcher,
+    w_root_t *root, struct watchman_pending_collection *coll) {
+  unused_parameter(watcher);
+  unused_parameter(coll);
+
+  if (root->watch) {
+    return w_poll_set_sync(root->watch, root->query_cookie_dir);
+  }
+  return true;
+}
+
+struct watchman_ops poll_watcher = {
+  "poll",
+  WATCHER_TREE_EVICTABLE,
+  poll_global_init,
+  poll_global_dtor,
+  poll_root_init,
+  poll_root_start,
+  poll_root_dtor,
+  poll_root_start_watch_file,
+  poll_root_stop_watch_file,
+  poll_root_start_watch_dir,
+  poll_root_stop_watch_dir,
+  poll_root_signal_threads,
+  poll_root_consume_notify,
+  poll_root_wait_notify,
+  poll_file_free,
+  NULL, // root_notify_fd
+  poll_root_sync,
+  NULL, // root_timer_ms
+};
+
+#endif // _WIN32
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -339,7 +339,10 @@ struct watchman_ops portfs_watcher = {
   portfs_root_signal_threads,
   portfs_root_consume_notify,
   portfs_root_wait_notify,
-  portfs_file_free
+  portfs_file_free,
+  NULL, // root_notify_fd
+  NULL, // root_sync
+  NULL, // root_timer_ms
 };
 
 #endif // HAVE_INOTIFY_INIT
@@ -451,7 +451,10 @@ struct watchman_ops win32_watcher = {
   winwatch_root_signal_threads,
   winwatch_root_consume_notify,
   winwatch_root_wait_notify,
-  winwatch_file_free
+  winwatch_file_free,
+  NULL, // root_notify_fd
+  NULL, // root_sync
+  NULL, // root_timer_ms
 };
 
 #endif // _WIN32
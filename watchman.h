@@ -238,6 +238,11 @@ struct watchman_pending_fs;
 struct watchman_trigger_command;
 typedef struct watchman_root w_root_t;
 
+#include "watchman_metrics.h"
+#include "watchman_trace.h"
+#include "watchman_lockprof.h"
+#include "watchman_pool.h"
+
 // Process global state for the selected watcher
 typedef void *watchman_global_watcher_t;
 // Per-watch state for the selected watcher
@@ -252,6 +257,10 @@ typedef struct watchman_clock w_clock_t;
 #define W_PENDING_RECURSIVE   1
 #define W_PENDING_VIA_NOTIFY 2
 #define W_PENDING_CRAWL_ONLY  4
+// The watcher saw that something in the dir changed, but not what, so
+// the crawl must stat every entry, though it needn't descend into the
+// subdirs that it already knows about
+#define W_PENDING_RESCAN 8
 struct watchman_pending_fs {
   struct watchman_pending_fs *next;
   w_string_t *path;
@@ -263,14 +272,19 @@ struct watchman_pending_collection {
   struct watchman_pending_fs *pending;
   w_ht_t *pending_uniq;
   pthread_mutex_t lock;
+  struct w_lock_hold lock_hold;
   pthread_cond_t cond;
   bool pinged;
+  // if set, this job is kicked whenever the collection is pinged
+  struct w_pool_job *job;
 };
 
 bool w_pending_coll_init(struct watchman_pending_collection *coll);
 void w_pending_coll_destroy(struct watchman_pending_collection *coll);
 void w_pending_coll_drain(struct watchman_pending_collection *coll);
-void w_pending_coll_lock(struct watchman_pending_collection *coll);
+void w_pending_coll_lock_at(struct watchman_pending_collection *coll,
+    const char *site);
+#define w_pending_coll_lock(coll) w_pending_coll_lock_at(coll, W_LOCK_SITE)
 void w_pending_coll_unlock(struct watchman_pending_collection *coll);
 bool w_pending_coll_add(struct watchman_pending_collection *coll,
     w_string_t *path, struct timeval now, int flags);
@@ -281,15 +295,52 @@ void w_pending_coll_append(struct watchman_pending_collection *target,
     struct watchman_pending_collection *src);
 struct watchman_pending_fs *w_pending_coll_pop(
     struct watchman_pending_collection *coll);
-bool w_pending_coll_lock_and_wait(struct watchman_pending_collection *coll,
-    int timeoutms);
+bool w_pending_coll_lock_and_wait_at(struct watchman_pending_collection *coll,
+    int timeoutms, const char *site);
+#define w_pending_coll_lock_and_wait(coll, timeoutms) \
+  w_pending_coll_lock_and_wait_at(coll, timeoutms, W_LOCK_SITE)
 void w_pending_coll_ping(struct watchman_pending_collection *coll);
 uint32_t w_pending_coll_size(struct watchman_pending_collection *coll);
 void w_pending_fs_free(struct watchman_pending_fs *p);
 
+/* Totals for the files below a dir, kept up to date as files change
+ * so that a subtree can be judged without walking it */
+struct watchman_dir_summary {
+  /* the latest otime.ticks of any file below the dir, including the
+   * deleted ones; it never goes down */
+  uint32_t max_ticks;
+  /* the files (other than dirs) and dirs below the dir that exist */
+  uint32_t num_files;
+  uint32_t num_dirs;
+  /* the sum of the sizes of those files */
+  uint64_t num_bytes;
+};
+
+/* Bloom filters over the names and suffixes of the files below a dir,
+ * so that a walk can skip subtrees that can't hold a match; see bloom.c */
+struct w_bloom;
+struct w_bloom_key {
+  uint32_t h1, h2;
+};
+
+/* a file is filed under its name and the suffixes after up to this
+ * many of its last dots, less one */
+#define W_BLOOM_MAX_NAME_KEYS 8
+
+void w_bloom_key_name(struct w_bloom_key *key, const char *buf,
+    uint32_t len);
+void w_bloom_key_suffix(struct w_bloom_key *key, const char *buf,
+    uint32_t len);
+void w_bloom_free(struct w_bloom *bloom);
+
 struct watchman_dir {
   /* full path */
   w_string_t *path;
+  /* the containing dir, or NULL for the root */
+  struct watchman_dir *parent;
+  struct watchman_dir_summary summary;
+  /* filter over the files below the dir; NULL until a query needs it */
+  struct w_bloom *bloom;
   /* files contained in this dir (keyed by file->name) */
   w_ht_t *files;
   /* files contained in this dir (keyed by lc(file->name)) */
@@ -308,6 +359,10 @@ struct watchman_ops {
   // if renames do not reliably report the individual
   // files renamed in the hierarchy
 #define WATCHER_COALESCED_RENAME 2
+  // if the watcher keeps no state in the file and dir nodes, so that
+  // the tree can be evicted to disk, or restored from the journal,
+  // without disturbing the watches
+#define WATCHER_TREE_EVICTABLE 4
   unsigned flags;
 
   // Perform any global initialization needed for the watcher mechanism
@@ -366,6 +421,25 @@ struct watchman_ops {
   // Called when freeing a file node
   void (*file_free)(watchman_global_watcher_t watcher,
       struct watchman_file *file);
+
+  // Return a descriptor that becomes readable when notifications are
+  // available, so that they can be consumed from the shared pool.
+  // Optional; if NULL or -1, a dedicated notify thread is used
+  int (*root_notify_fd)(watchman_global_watcher_t watcher, w_root_t *root);
+
+  // Called with the root locked once a sync cookie has been created, so
+  // that watchers which don't see changes as they happen can look for
+  // it promptly.  Paths that the watcher adds to coll are processed
+  // before the root is unlocked, and so before the cookie can be seen.
+  // Returns false if changes made before the cookie may still be
+  // missed when it is seen.  Optional
+  bool (*root_sync)(watchman_global_watcher_t watcher, w_root_t *root,
+      struct watchman_pending_collection *coll);
+
+  // Return how many ms until notifications should be consumed even if
+  // the root_notify_fd descriptor isn't readable, or -1 for no limit.
+  // Optional
+  int (*root_timer_ms)(watchman_global_watcher_t watcher, w_root_t *root);
 };
 
 struct watchman_stat {
@@ -402,8 +476,8 @@ struct watchman_file {
   /* linkage to files ordered by changed time */
   struct watchman_file *prev, *next;
 
-  /* linkage to files ordered by common suffix */
-  struct watchman_file *suffix_prev, *suffix_next;
+  /* our positions in the suffix index; see suffix_index.c */
+  uint32_t suffix_slot, compound_slot;
 
   /* the time we last observed a change to this file */
   w_clock_t otime;
@@ -416,6 +490,8 @@ struct watchman_file {
   bool exists;
   /* whether we think this file might not exist */
   bool maybe_deleted;
+  /* whether the file is included in the summaries of its dirs */
+  bool counted;
 
   /* cache stat results so we can tell if an entry
    * changed */
@@ -428,6 +504,17 @@ struct watchman_query_cookie {
   bool seen;
 };
 
+// A sync cookie that has been issued by w_root_sync_begin
+struct watchman_sync {
+  struct watchman_query_cookie cookie;
+  w_string_t *path;
+  // the watcher couldn't promise to have seen everything by the time
+  // that it sees the cookie
+  bool partial;
+  uint64_t start;
+  uint64_t span;
+};
+
 #define WATCHMAN_IO_BUF_SIZE 1048576
 #define WATCHMAN_BATCH_LIMIT (16*1024)
 #define DEFAULT_SETTLE_PERIOD 20
@@ -439,6 +526,79 @@ struct watchman_query_cookie {
 /* Idle out watches that haven't had activity in several days */
 #define DEFAULT_REAP_AGE (86400*5)
 
+// Compiled ignore_dirs and ignore_vcs rules; see ignore.c
+struct watchman_ignore_node;
+struct watchman_ignore {
+  struct watchman_ignore_node *tree;
+};
+
+enum w_ignore_result {
+  W_IGNORE_NONE,
+  // the path is tracked, but nothing below it is
+  W_IGNORE_CONTENTS,
+  W_IGNORE_SELF
+};
+
+bool w_ignore_init(struct watchman_ignore *ign);
+void w_ignore_destroy(struct watchman_ignore *ign);
+bool w_ignore_add(struct watchman_ignore *ign, const char *rel, bool vcs);
+bool w_ignore_is_glob(const char *rel);
+enum w_ignore_result w_ignore_check(const struct watchman_ignore *ign,
+    w_string_t *root_path, const char *path, uint32_t len);
+
+/* The files with a given suffix; see suffix_index.c */
+struct w_suffix_bucket {
+  // NULL entries are the tombstones of files that have gone
+  struct watchman_file **files;
+  uint32_t len, alloc, dead;
+  // whether this is the bucket of a multi-part suffix
+  bool compound;
+};
+
+/* An ordered multimap from int64 keys to pointers; see skiplist.c */
+struct w_skiplist;
+typedef struct w_skiplist w_skiplist_t;
+struct w_skiplist_node;
+
+w_skiplist_t *w_skiplist_new(void);
+void w_skiplist_free(w_skiplist_t *list);
+uint32_t w_skiplist_size(w_skiplist_t *list);
+bool w_skiplist_insert(w_skiplist_t *list, int64_t key, void *val);
+bool w_skiplist_remove(w_skiplist_t *list, int64_t key, void *val);
+struct w_skiplist_node *w_skiplist_seek(w_skiplist_t *list, int64_t key);
+struct w_skiplist_node *w_skiplist_next(struct w_skiplist_node *node);
+int64_t w_skiplist_key(struct w_skiplist_node *node);
+void *w_skiplist_val(struct w_skiplist_node *node);
+
+/* The fields that a root can keep ordered indexes of its file nodes
+ * on, if the ordered_indexes option asks for them; see index.c */
+enum w_index_field {
+  W_INDEX_SIZE,
+  W_INDEX_MTIME,
+  W_INDEX_CCLOCK,
+  W_INDEX_MAX
+};
+#define W_INDEX_BIT(field) (1u << (field))
+#define W_INDEX_ALL ((1u << W_INDEX_MAX) - 1)
+
+/* Options that are consulted on hot paths, compiled from the root,
+ * argument and global configuration so that reading one is just a
+ * field access.  They are compiled when the root is created and again
+ * whenever its .watchmanconfig changes, and are replaced as a whole
+ * under the root lock */
+struct watchman_root_config {
+  int trigger_settle;
+  int gc_interval;
+  int gc_age;
+  int idle_reap_age;
+  uint32_t hint_num_files_per_dir;
+  // 0 if dirs don't keep Bloom filters
+  uint32_t bloom_bits_per_file;
+  // W_INDEX_BIT of each of the ordered_indexes
+  unsigned index_fields;
+  bool iothrottle;
+};
+
 struct watchman_root {
   long refcnt;
 
@@ -448,8 +608,22 @@ struct watchman_root {
 
   /* our locking granularity is per-root */
   pthread_mutex_t lock;
+  struct w_lock_hold lock_hold;
+  // the watcher used for this root, and its global context
+  struct watchman_ops *watcher_ops;
+  watchman_global_watcher_t watcher;
+
+  // only used if the watcher does not provide root_notify_fd
   pthread_t notify_thread;
-  pthread_t io_thread;
+
+  // Jobs run by the shared pool; see root_start
+  struct w_pool_job *notify_job;
+  struct w_pool_job *io_job;
+  struct watchman_pending_collection notify_pending;
+  struct watchman_pending_collection io_pending;
+  bool notify_started;
+  // current settle/backoff delay of the io job
+  int io_timeoutms;
 
   /* map of rule id => struct watchman_trigger_command */
   w_ht_t *commands;
@@ -459,15 +633,11 @@ struct watchman_root {
   w_string_t *query_cookie_prefix;
   w_ht_t *query_cookies;
 
-  /* map of dir name => dirname
-   * if the map has an entry for a given dir, we're ignoring it */
-  w_ht_t *ignore_vcs;
-  w_ht_t *ignore_dirs;
+  /* the ignore_dirs and ignore_vcs rules */
+  struct watchman_ignore ignore;
 
-  int trigger_settle;
-  int gc_interval;
-  int gc_age;
-  int idle_reap_age;
+  /* compiled hot-path options */
+  struct watchman_root_config config;
 
   /* config options loaded via json file */
   json_t *config_file;
@@ -485,6 +655,10 @@ struct watchman_root {
   /* queue of items that we need to stat/process */
   struct watchman_pending_collection pending;
 
+  /* changes observed while the tree is evicted; these are processed
+   * when it is rehydrated */
+  struct watchman_pending_collection evicted_pending;
+
   /* --- everything below this point will be reset on w_root_init --- */
   bool _init_sentinel_;
 
@@ -499,11 +673,27 @@ struct watchman_root {
 
   /* the most recently changed file */
   struct watchman_file *latest_file;
+  /* the ordered indexes, each built when a query first wants it */
+  w_skiplist_t *indexes[W_INDEX_MAX];
+  /* number of file nodes in the tree */
+  uint32_t num_files;
+
+  /* if true, the tree has been spilled to snapshot_path to stay within
+   * the memory budget and must be rehydrated before it is used */
+  bool evicted;
+  w_string_t *snapshot_path;
+
+  /* on-disk tree and change journal, if persistent_journal is set */
+  struct w_journal *journal;
 
   /* current tick */
   uint32_t ticks;
 
   bool done_initial;
+  /* the initial crawl, or a recrawl, runs in slices on the io job;
+   * this is set once the current one has begun */
+  bool crawl_started;
+  uint64_t crawl_start_usec;
   /* if true, we've decided that we should re-crawl the root
    * for the sake of ensuring consistency */
   bool should_recrawl;
@@ -512,9 +702,11 @@ struct watchman_root {
   /* map of cursor name => last observed tick value */
   w_ht_t *cursors;
 
-  /* map of filename suffix => watchman_file at the head
-   * of the suffix index.  Linkage via suffix_next */
+  /* map of filename suffix => struct w_suffix_bucket */
   w_ht_t *suffixes;
+  /* the multi-part suffixes that are indexed as well, longest first */
+  w_string_t **compound_suffixes;
+  uint32_t num_compound_suffixes;
 
   uint32_t next_cmd_id;
   uint32_t last_trigger_tick;
@@ -564,6 +756,10 @@ json_t *bunser(const char *buf, const char *end,
 struct watchman_client_response {
   struct watchman_client_response *next;
   json_t *json;
+  // a named cursor to move to cursor_ticks once json has been sent
+  w_root_t *cursor_root;
+  w_string_t *cursor;
+  uint32_t cursor_ticks;
 };
 
 struct watchman_client_subscription;
@@ -582,6 +778,10 @@ struct watchman_client {
 };
 extern pthread_mutex_t w_client_lock;
 extern w_ht_t *clients;
+// Acquire and release w_client_lock
+void w_clients_lock_at(const char *site);
+#define w_clients_lock() w_clients_lock_at(W_LOCK_SITE)
+void w_clients_unlock(void);
 
 void w_mark_dead(pid_t pid);
 bool w_reap_children(bool block);
@@ -623,6 +823,7 @@ w_string_t *w_string_dup_lower(w_string_t *str);
 w_string_t *w_string_suffix(w_string_t *str);
 bool w_string_suffix_match(w_string_t *str, w_string_t *suffix);
 w_string_t *w_string_slice(w_string_t *str, uint32_t start, uint32_t len);
+void w_string_init_borrowed(w_string_t *str, const char *buf, uint32_t len);
 char *w_string_dup_buf(const w_string_t *str);
 void w_string_addref(w_string_t *str);
 void w_string_delref(w_string_t *str);
@@ -679,12 +880,82 @@ bool w_root_process_pending(w_root_t *root,
 
 void w_root_mark_file_changed(w_root_t *root, struct watchman_file *file,
     struct timeval now);
+void w_root_make_latest_file(w_root_t *root, struct watchman_file *file);
+void w_root_set_file_stat(w_root_t *root, struct watchman_file *file,
+    const struct watchman_stat *st);
+void w_root_summarize_file(struct watchman_file *file);
+void w_root_init_suffix_index(w_root_t *root);
+void w_root_free_suffix_index(w_root_t *root);
+void w_root_rebuild_suffix_index(w_root_t *root);
+void w_root_index_suffix(w_root_t *root, struct watchman_file *file);
+void w_root_unindex_suffix(w_root_t *root, struct watchman_file *file);
+struct w_suffix_bucket *w_root_suffix_bucket(w_root_t *root,
+    w_string_t *suffix);
+void w_root_index_file(w_root_t *root, struct watchman_file *file,
+    unsigned fields);
+void w_root_unindex_file(w_root_t *root, struct watchman_file *file,
+    unsigned fields);
+void w_root_free_indexes(w_root_t *root, unsigned fields);
+unsigned w_root_parse_index_fields(w_root_t *root);
+w_skiplist_t *w_root_get_index(w_root_t *root, enum w_index_field field);
+void w_bloom_note_file(struct watchman_file *file);
+void w_bloom_forget_file(struct watchman_file *file);
+bool w_bloom_dir_may_contain(w_root_t *root, struct watchman_dir *dir,
+    const struct w_bloom_key *keys, uint32_t num_keys);
+void w_bloom_dir_walked(struct watchman_dir *dir,
+    const struct w_bloom_key *keys, uint32_t num_keys);
 
 bool w_root_sync_to_now(w_root_t *root, int timeoutms);
+bool w_root_sync_begin(w_root_t *root, struct watchman_sync *sync);
+bool w_root_sync_wait(w_root_t *root, struct watchman_sync *sync,
+    const struct timespec *deadline);
 
-void w_root_lock(w_root_t *root);
+void w_root_lock_at(w_root_t *root, const char *site);
+#define w_root_lock(root) w_root_lock_at(root, W_LOCK_SITE)
 void w_root_unlock(w_root_t *root);
 
+void w_root_reset_tree(w_root_t *root);
+void w_root_count_nodes(uint64_t *files, uint64_t *dirs);
+const struct watchman_ops *w_root_watcher_ops(w_root_t *root);
+w_root_t **w_root_list_watched(uint32_t *num_roots);
+bool w_root_has_subscriptions(w_root_t *root);
+
+// Tree snapshots; see snapshot.c
+struct w_snapshot_info {
+  uint32_t root_number;
+  uint32_t ticks;
+  uint32_t num_dirs;
+  uint32_t num_files;
+};
+bool w_root_snapshot_write(w_root_t *root, const char *path, char **errmsg);
+bool w_root_snapshot_load(w_root_t *root, const char *path,
+    struct w_snapshot_info *info, char **errmsg);
+bool w_snapshot_write_file(w_root_t *root, FILE *f,
+    struct watchman_file *file);
+struct watchman_file *w_snapshot_read_file(w_root_t *root, FILE *f);
+
+// Persistent change journal; see journal.c
+bool w_journal_restore(w_root_t *root);
+void w_journal_checkpoint(w_root_t *root);
+void w_journal_flush(w_root_t *root);
+void w_journal_reserve_ticks(w_root_t *root);
+void w_journal_record_cursor(w_root_t *root, w_string_t *cursor,
+    uint32_t ticks);
+bool w_journal_owns_clock(w_root_t *root, uint64_t start_time, int pid,
+    uint32_t root_number);
+void w_journal_close(w_root_t *root);
+void w_journal_discard(w_root_t *root);
+
+// Memory budget and tree eviction; see evict.c
+uint64_t w_evict_estimate_total(void);
+uint64_t w_root_estimate_bytes(w_root_t *root);
+bool w_root_evict(w_root_t *root, char **errmsg);
+bool w_root_rehydrate(w_root_t *root, char **errmsg);
+void w_root_discard_snapshot(w_root_t *root);
+bool w_root_defer_pending(w_root_t *root,
+    struct watchman_pending_collection *coll);
+void w_evict_check(void);
+
 /* Bob Jenkins' lookup3.c hash function */
 uint32_t w_hash_bytes(const void *key, size_t length, uint32_t initval);
 
@@ -822,6 +1093,7 @@ extern const char *watchman_tmp_dir;
 extern char *watchman_state_file;
 extern int dont_save_state;
 bool w_state_save(void);
+bool w_state_flush(void);
 bool w_state_load(void);
 bool w_root_save_state(json_t *state);
 bool w_root_load_state(json_t *state);
@@ -891,7 +1163,14 @@ struct w_clockspec *w_clockspec_parse(json_t *value);
 void w_clockspec_eval(w_root_t *root,
     const struct w_clockspec *spec,
     struct w_query_since *since);
+void w_clockspec_eval_cursor(w_root_t *root,
+    const struct w_clockspec *spec,
+    struct w_query_since *since,
+    bool advance_cursor);
+struct w_clockspec *w_clockspec_copy(const struct w_clockspec *spec);
 void w_clockspec_free(struct w_clockspec *spec);
+void w_root_advance_cursor(w_root_t *root, w_string_t *cursor,
+    uint32_t ticks);
 
 const char *get_sock_name(void);
 
@@ -905,6 +1184,7 @@ void cfg_shutdown(void);
 void cfg_set_arg(const char *name, json_t *val);
 void cfg_load_global_config_file(void);
 json_t *cfg_get_json(w_root_t *root, const char *name);
+json_t *cfg_swap_root_config(w_root_t *root, json_t *config);
 const char *cfg_get_string(w_root_t *root, const char *name,
     const char *defval);
 json_int_t cfg_get_int(w_root_t *root, const char *name,
@@ -921,6 +1201,10 @@ struct watchman_client_subscription {
   w_string_t *name;
   w_query *query;
   bool vcs_defer;
+  // the named cursor that the subscription started from, if any; it
+  // follows the results that we deliver.  The cursor is the root's
+  // named cursor, shared with queries and other subscriptions
+  w_string_t *cursor;
   uint32_t last_sub_tick;
   struct w_query_field_list field_list;
 };
@@ -972,6 +1256,25 @@ uint32_t u32_strlen(const char *str);
 extern struct watchman_ops fsevents_watcher;
 extern struct watchman_ops kqueue_watcher;
 extern struct watchman_ops inotify_watcher;
+extern struct watchman_ops poll_watcher;
+
+// A schedule of periodic checks of dirs for changes; see watcher/poll.c
+struct w_poll_set;
+struct w_poll_set *w_poll_set_new(w_root_t *root);
+void w_poll_set_free(struct w_poll_set *set);
+bool w_poll_set_add(struct w_poll_set *set, w_string_t *dir_name,
+    uint32_t cost, time_t crawled);
+bool w_poll_set_remove(struct w_poll_set *set, w_string_t *dir_name);
+bool w_poll_set_contains(struct w_poll_set *set, w_string_t *dir_name);
+uint32_t w_poll_set_size(struct w_poll_set *set);
+int w_poll_set_next_ms(struct w_poll_set *set);
+bool w_poll_set_check_next(struct w_poll_set *set,
+    struct watchman_pending_collection *coll, w_string_t **hot_dir);
+bool w_poll_set_wait(struct w_poll_set *set, int timeoutms);
+void w_poll_set_wake(struct w_poll_set *set);
+bool w_poll_set_sync(struct w_poll_set *set, w_string_t *cookie_dir);
+bool w_poll_set_check_all(struct w_poll_set *set,
+    struct watchman_pending_collection *coll);
 extern struct watchman_ops portfs_watcher;
 extern struct watchman_ops win32_watcher;
 
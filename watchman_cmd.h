@@ -67,6 +67,8 @@ void send_and_dispose_response(struct watchman_client *client,
     json_t *response);
 bool enqueue_response(struct watchman_client *client,
     json_t *json, bool ping);
+bool enqueue_cursor_response(struct watchman_client *client,
+    json_t *json, w_root_t *root, w_string_t *cursor, uint32_t ticks);
 
 w_root_t *resolve_root_or_err(
     struct watchman_client *client,
@@ -80,6 +82,7 @@ void add_root_warnings_to_response(json_t *response, w_root_t *root);
 
 bool clock_id_string(uint32_t root_number, uint32_t ticks, char *buf,
     size_t bufsize);
+void w_clock_get_identity(uint64_t *start_time, int *pid);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,97 @@
+/* Copyright 2015-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#ifndef WATCHMAN_LOCKPROF_H
+#define WATCHMAN_LOCKPROF_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Lock contention profiling for the main serialization points.
+ *
+ * Each profiled lock belongs to a class that owns a pair of histograms
+ * (time spent waiting to acquire and time spent holding the lock), and
+ * each acquisition is tagged with its call site so that the heaviest
+ * holders can be reported by debug-lock-profile.
+ *
+ * Profiling is toggled at runtime; while it is off the wrappers cost a
+ * flag check and a depth counter update. */
+
+struct w_lock_class {
+  const char *name;
+  struct watchman_metric *wait;
+  struct watchman_metric *hold;
+};
+
+/* Tracks the current holder of a lock.  All fields are protected by
+ * the lock that this is associated with.  The locks are recursive, so
+ * only the outermost acquisition is measured */
+struct w_lock_hold {
+  uint32_t depth;
+  // 0 if the current hold is not being measured
+  uint64_t acquired;
+  const char *site;
+};
+
+extern bool w_lockprof_enabled;
+extern struct w_lock_class w_lock_class_root;
+extern struct w_lock_class w_lock_class_clients;
+extern struct w_lock_class w_lock_class_pending;
+
+#define w_lock_stringify2(x) #x
+#define w_lock_stringify(x) w_lock_stringify2(x)
+// The call site tag recorded for an acquisition
+#define W_LOCK_SITE __FILE__ ":" w_lock_stringify(__LINE__)
+
+void w_lockprof_acquired(struct w_lock_class *cls, struct w_lock_hold *hold,
+    const char *site, uint64_t wait_start);
+void w_lockprof_released(struct w_lock_class *cls, struct w_lock_hold *hold);
+
+// Call before blocking on the lock; returns 0 if profiling is off
+static inline uint64_t w_lockprof_begin(void) {
+  if (!w_lockprof_enabled) {
+    return 0;
+  }
+  return w_metric_now_usec();
+}
+
+// Call after acquiring the lock, passing the result of w_lockprof_begin
+static inline void w_lock_hold_enter(struct w_lock_class *cls,
+    struct w_lock_hold *hold, const char *site, uint64_t wait_start) {
+  if (hold->depth++ == 0 && wait_start) {
+    w_lockprof_acquired(cls, hold, site, wait_start);
+  }
+}
+
+// Call before releasing the lock
+static inline void w_lock_hold_exit(struct w_lock_class *cls,
+    struct w_lock_hold *hold) {
+  if (--hold->depth == 0 && hold->acquired) {
+    w_lockprof_released(cls, hold);
+  }
+}
+
+/* Call when a condition wait returns with the lock re-acquired.  The
+ * time spent in the wait is neither a hold nor contention, so the wait
+ * histogram is not updated */
+static inline void w_lock_hold_resume(struct w_lock_class *cls,
+    struct w_lock_hold *hold, const char *site) {
+  if (hold->depth++ == 0 && w_lockprof_enabled) {
+    w_lockprof_acquired(cls, hold, site, 0);
+  }
+}
+
+// Resets the collected data and enables profiling
+void w_lockprof_start(void);
+void w_lockprof_stop(void);
+json_t *w_lockprof_to_json(uint32_t max_sites);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vim:ts=2:sw=2:et:
+ */
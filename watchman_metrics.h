@@ -0,0 +1,120 @@
+/* Copyright 2015-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#ifndef WATCHMAN_METRICS_H
+#define WATCHMAN_METRICS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A daemon-wide registry of counters, gauges and histograms.
+ *
+ * Metrics are statically allocated at their point of use and link
+ * themselves into the registry from a constructor, so there is no
+ * lookup on the hot path; updates are plain atomic operations.
+ *
+ *   W_METRIC_COUNTER(queries, "query_total", "Number of queries run");
+ *   ...
+ *   w_metric_inc(&queries);
+ */
+
+enum w_metric_type {
+  W_METRIC_COUNTER,
+  W_METRIC_GAUGE,
+  W_METRIC_HISTOGRAM,
+};
+
+/* Histogram buckets are log-linear: values below W_METRIC_HIST_LINEAR
+ * get their own bucket, and every power of two above that is split into
+ * W_METRIC_HIST_SUB sub-buckets, giving a relative error of at most 25%
+ * across the full 64-bit range */
+#define W_METRIC_HIST_LINEAR 16
+#define W_METRIC_HIST_SUB 4
+#define W_METRIC_HIST_BUCKETS \
+  (W_METRIC_HIST_LINEAR + (64 - 4) * W_METRIC_HIST_SUB)
+
+struct watchman_metric {
+  const char *name;
+  const char *help;
+  enum w_metric_type type;
+  // for histograms, the units of the observed values
+  const char *unit;
+
+  // counter and gauge value; sum of observations for histograms
+  int64_t value;
+
+  // histogram state
+  uint64_t count;
+  uint64_t max;
+  uint64_t *buckets;
+
+  struct watchman_metric *next;
+};
+
+void w_metric_register(struct watchman_metric *metric);
+
+#define W_METRIC_DEFINE_1(symbol, sym, mtype, mname, mhelp, munit, mbuckets) \
+  static struct watchman_metric sym = {                                     \
+    mname, mhelp, mtype, munit, 0, 0, 0, mbuckets, NULL };                  \
+  static w_ctor_fn_type(symbol) {                                           \
+    w_metric_register(&sym);                                                \
+  }                                                                         \
+  w_ctor_fn_reg(symbol)
+
+#define W_METRIC_COUNTER(sym, name, help) \
+  W_METRIC_DEFINE_1(w_gen_symbol(w_metric_reg_), sym, W_METRIC_COUNTER, \
+      name, help, NULL, NULL)
+
+#define W_METRIC_GAUGE(sym, name, help) \
+  W_METRIC_DEFINE_1(w_gen_symbol(w_metric_reg_), sym, W_METRIC_GAUGE, \
+      name, help, NULL, NULL)
+
+#define W_METRIC_HISTOGRAM(sym, name, help, unit) \
+  static uint64_t w_paste1(sym, _buckets)[W_METRIC_HIST_BUCKETS];       \
+  W_METRIC_DEFINE_1(w_gen_symbol(w_metric_reg_), sym, W_METRIC_HISTOGRAM, \
+      name, help, unit, w_paste1(sym, _buckets))
+
+static inline void w_metric_add(struct watchman_metric *metric, int64_t n) {
+  __sync_fetch_and_add(&metric->value, n);
+}
+
+static inline void w_metric_inc(struct watchman_metric *metric) {
+  w_metric_add(metric, 1);
+}
+
+static inline void w_metric_dec(struct watchman_metric *metric) {
+  w_metric_add(metric, -1);
+}
+
+static inline void w_metric_set(struct watchman_metric *metric, int64_t v) {
+  __sync_lock_test_and_set(&metric->value, v);
+}
+
+void w_metric_observe(struct watchman_metric *metric, uint64_t value);
+
+// Monotonic time for measuring durations to feed into histograms
+uint64_t w_metric_now_usec(void);
+
+// Observe the time elapsed since start, which came from w_metric_now_usec
+static inline void w_metric_observe_since(struct watchman_metric *metric,
+    uint64_t start) {
+  w_metric_observe(metric, w_metric_now_usec() - start);
+}
+
+// Clears a metric; not atomic with respect to concurrent updates
+void w_metric_reset(struct watchman_metric *metric);
+json_t *w_metric_to_json(struct watchman_metric *metric);
+
+json_t *w_metrics_to_json(void);
+w_string_t *w_metrics_to_prometheus(void);
+bool w_metrics_start_exporter(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vim:ts=2:sw=2:et:
+ */
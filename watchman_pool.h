@@ -0,0 +1,60 @@
+/* Copyright 2015-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#ifndef WATCHMAN_POOL_H
+#define WATCHMAN_POOL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A process-wide pool of worker threads that runs jobs on behalf of
+ * the watched roots, in place of dedicated per-root threads.
+ *
+ * A job is a function that is run serially: it never runs on two
+ * workers at once, and kicking it while it runs causes it to be run
+ * again once it returns.  A job may also ask to be run after a delay,
+ * and may ask to be kicked when a descriptor becomes readable; the
+ * descriptors of all jobs are multiplexed onto a single poller thread.
+ *
+ * The pool is sized by the global thread_pool_size option. */
+
+struct w_pool_job;
+
+/* Runs the job.  kicked is false if the run was triggered only by the
+ * delay requested via w_pool_job_run_after.  Return false to retire the
+ * job; it will not run again and release will be called */
+typedef bool (*w_pool_job_func)(void *arg, bool kicked);
+typedef void (*w_pool_job_release)(void *arg);
+
+struct w_pool_job *w_pool_job_new(const char *name, w_pool_job_func func,
+    w_pool_job_release release, void *arg);
+
+/* Frees a job that has retired, or that was never kicked */
+void w_pool_job_free(struct w_pool_job *job);
+
+// Schedule the job to run as soon as possible
+void w_pool_job_kick(struct w_pool_job *job);
+
+/* Schedule the job to run once timeoutms have elapsed, unless it is
+ * kicked sooner.  Replaces any previously requested delay; the delay is
+ * discarded whenever the job runs */
+void w_pool_job_run_after(struct w_pool_job *job, int timeoutms);
+
+/* Kick the job once when fd becomes readable.  Must be called again to
+ * re-arm after the job runs.  Returns false if descriptors cannot be
+ * multiplexed on this system, in which case the caller must wait for
+ * the descriptor by some other means */
+bool w_pool_job_arm_fd(struct w_pool_job *job, int fd);
+
+// Stop watching the descriptor previously passed to w_pool_job_arm_fd
+void w_pool_job_disarm_fd(struct w_pool_job *job);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -14,6 +14,23 @@ typedef struct w_query w_query;
 struct w_query_expr;
 typedef struct w_query_expr w_query_expr;
 
+// Candidate files are evaluated this many at a time
+#define W_QUERY_BLOCK_SIZE  256
+#define W_QUERY_BLOCK_WORDS (W_QUERY_BLOCK_SIZE / 64)
+
+// A block of candidate files, along with copies of the stat fields that
+// the simple terms test, one array per field, so that those terms can
+// decide a whole block in one tight loop.  Which of the files are
+// selected is given by a bitmask of W_QUERY_BLOCK_WORDS words
+struct w_query_block {
+  uint32_t num;
+  struct watchman_file *files[W_QUERY_BLOCK_SIZE];
+  uint8_t exists[W_QUERY_BLOCK_SIZE];
+  // stat.mode & S_IFMT
+  uint32_t fmt[W_QUERY_BLOCK_SIZE];
+  int64_t size[W_QUERY_BLOCK_SIZE];
+};
+
 // Holds state for the execution of a query
 struct w_query_ctx {
   struct w_query *query;
@@ -22,11 +39,27 @@ struct w_query_ctx {
   w_string_t *wholename;
   struct w_query_since since;
 
+  // The candidates that the generators produced and that have yet to
+  // be evaluated
+  struct w_query_block *block;
+
+  // Set by the generators when they produce files most recently changed
+  // first, so that a query for the latest few can stop early
+  bool otime_order;
+
   struct watchman_rule_match *results;
   uint32_t num_results;
   uint32_t num_allocd;
 };
 
+enum w_query_order {
+  W_QUERY_ORDER_NONE,
+  W_QUERY_ORDER_OTIME,
+  W_QUERY_ORDER_MTIME,
+  W_QUERY_ORDER_SIZE,
+  W_QUERY_ORDER_NAME,
+};
+
 struct w_query_path {
   w_string_t *name;
   int depth;
@@ -37,16 +70,28 @@ typedef bool (*w_query_expr_eval_func)(
     struct watchman_file *file,
     void *data
 );
+// Sets in out those of the files selected by in that match
+typedef void (*w_query_expr_block_func)(
+    struct w_query_ctx *ctx,
+    struct w_query_block *block,
+    const uint64_t *in,
+    uint64_t *out,
+    void *data
+);
 typedef void (*w_query_expr_dispose_func)(
     void *data
 );
 struct w_query_expr {
   long refcnt;
   w_query_expr_eval_func    evaluate;
+  // Optional; terms without one are evaluated a file at a time
+  w_query_expr_block_func   evaluate_block;
   w_query_expr_dispose_func dispose;
   void *data;
 };
 
+/* Anything that a query owns must also be copied or addref'd by
+ * w_query_clone_with_since */
 struct w_query {
   long refcnt;
 
@@ -71,9 +116,35 @@ struct w_query {
   // to evaluate named cursors and determine fresh
   // instance at the time we execute
   struct w_clockspec *since_spec;
+  // If set, a named cursor in since_spec is only read; the caller moves
+  // it once the results have been delivered
+  bool hold_cursor;
 
   w_query_expr *expr;
 
+  // If use_bloom, the expression can only match files whose name or
+  // one of whose suffixes is among bloom_keys, so walks can skip the
+  // subtrees whose Bloom filters hold none of them
+  bool use_bloom;
+  struct w_bloom_key *bloom_keys;
+  uint32_t num_bloom_keys;
+
+  // If use_index, the expression can only match files whose value of
+  // index_field lies in [index_min, index_max] and, if index_since is
+  // set, that were created after it; so the files can be generated
+  // from the root's ordered index on that field
+  bool use_index;
+  enum w_index_field index_field;
+  int64_t index_min, index_max;
+  struct w_clockspec *index_since;
+
+  // If order_by is set, the results are sorted on it, in descending
+  // order if order_desc; if limit is nonzero, only that many of them
+  // are kept
+  enum w_query_order order_by;
+  bool order_desc;
+  uint32_t limit;
+
   // Error message placeholder while parsing
   char *errmsg;
 };
@@ -88,6 +159,10 @@ bool w_query_register_expression_parser(
     w_query_expr_parser parser);
 
 w_query *w_query_parse(w_root_t *root, json_t *query, char **errmsg);
+w_query *w_query_clone_with_since(w_query *tmpl, json_t *query,
+    char **errmsg);
+// Like w_query_parse, but reuses queries of the same shape; see cache.c
+w_query *w_query_parse_cached(w_root_t *root, json_t *query, char **errmsg);
 void w_query_delref(w_query *query);
 
 w_query_expr *w_query_expr_parse(w_query *query, json_t *term);
@@ -99,6 +174,13 @@ w_query_expr *w_query_expr_new(
     w_query_expr_dispose_func dispose,
     void *data
 );
+// For terms that can also decide a whole block of files at once
+w_query_expr *w_query_expr_new_with_block(
+    w_query_expr_eval_func evaluate,
+    w_query_expr_block_func evaluate_block,
+    w_query_expr_dispose_func dispose,
+    void *data
+);
 
 bool w_query_file_matches_relative_root(
     struct w_query_ctx *ctx,
@@ -111,6 +193,14 @@ bool w_query_process_file(
     struct w_query_ctx *ctx,
     struct watchman_file *file);
 
+// Processes the files below the relative root whose otime is at or
+// after min_ticks, skipping the dirs in which nothing has changed since
+bool w_query_process_relative_root_changes(
+    w_query *query,
+    w_root_t *root,
+    struct w_query_ctx *ctx,
+    uint32_t min_ticks);
+
 // Generator callback, used to plug in an alternate
 // generator when used in triggers or subscriptions
 typedef bool (*w_query_generator)(
@@ -122,6 +212,8 @@ typedef bool (*w_query_generator)(
 
 struct w_query_result {
   bool is_fresh_instance;
+  // the sync couldn't promise that every change was seen
+  bool partial_sync;
   uint32_t num_results;
   struct watchman_rule_match *results;
   uint32_t root_number;
@@ -152,11 +244,24 @@ bool w_query_expr_evaluate(
     w_query_expr *expr,
     struct w_query_ctx *ctx,
     struct watchman_file *file);
+void w_query_expr_evaluate_block(
+    w_query_expr *expr,
+    struct w_query_ctx *ctx,
+    struct w_query_block *block,
+    const uint64_t *in,
+    uint64_t *out);
+
+// Sets out to in, less the files of block whose entry in sel is zero
+void w_query_block_select(const struct w_query_block *block,
+    const uint8_t *sel, const uint64_t *in, uint64_t *out);
 
 struct w_query_field_renderer;
 struct w_query_field_list {
   unsigned int num_fields;
   struct w_query_field_renderer *fields[32];
+  // If true, results are rendered as one array per field
+  // rather than one object per file
+  bool columns;
 };
 
 // parse the old style since and find queries
@@ -186,10 +291,15 @@ struct w_query_int_compare {
 bool parse_int_compare(json_t *term, struct w_query_int_compare *comp,
     char **errmsg);
 bool eval_int_compare(json_int_t ival, struct w_query_int_compare *comp);
+void eval_int_compare_block(const int64_t *ivals, uint32_t num,
+    struct w_query_int_compare *comp, uint8_t *sel);
 
 bool parse_field_list(json_t *field_list,
     struct w_query_field_list *selected,
     char **errmsg);
+bool parse_result_format(json_t *query_spec,
+    struct w_query_field_list *selected,
+    char **errmsg);
 
 #define W_TERM_PARSER1(symbol, name, func) \
   static w_ctor_fn_type(symbol) {                   \
@@ -0,0 +1,63 @@
+/* Copyright 2015-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#ifndef WATCHMAN_TRACE_H
+#define WATCHMAN_TRACE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Span tracing in the Chrome trace-event format.
+ *
+ * Tracing is off by default and is toggled at runtime by the debug-trace
+ * command.  While it is off, a span costs one load of w_trace_enabled.
+ * While it is on, each thread appends completed spans to its own ring
+ * buffer, so the only lock taken is the uncontended per-thread one.
+ *
+ *   uint64_t span = w_trace_begin();
+ *   ...
+ *   w_trace_end("query", "generate", span, NULL);
+ */
+
+// Number of spans retained per thread; the oldest are overwritten
+#define W_TRACE_EVENTS_PER_THREAD 16384
+
+extern bool w_trace_enabled;
+
+// Returns the start time of a span, or 0 if tracing is disabled
+static inline uint64_t w_trace_begin(void) {
+  if (!w_trace_enabled) {
+    return 0;
+  }
+  return w_metric_now_usec();
+}
+
+void w_trace_record(const char *cat, const char *name, uint64_t start,
+    const char *detail);
+
+/* Completes a span started by w_trace_begin.  cat and name must be
+ * string literals; detail is optional and is copied */
+static inline void w_trace_end(const char *cat, const char *name,
+    uint64_t start, const char *detail) {
+  if (start) {
+    w_trace_record(cat, name, start, detail);
+  }
+}
+
+// Discards previously recorded spans and enables tracing
+void w_trace_start(void);
+void w_trace_stop(void);
+
+/* Returns the recorded spans in the Chrome trace-event JSON object
+ * format, suitable for loading into chrome://tracing or Perfetto */
+json_t *w_trace_to_json(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* vim:ts=2:sw=2:et:
+ */